@@ -8,7 +8,10 @@
 #ifndef MPOLOLU_H
 #define MPOLOLU_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/time.h>
+#include "mpololu_error.h"
 
 
 #ifdef __cplusplus
@@ -30,6 +33,22 @@ extern "C" {
 #define POLOLU_ERR_CALLSTACK (0x80)  /** Serial call stack error */
 
 #define POLOLU_ERR_COUNTER (0x100)  /** Serial program counter error */
+
+
+	/**************************************************************************/
+	/*                                 CONSTANTS                              */
+	/**************************************************************************/
+
+#define MAESTRO_COMPACT (-1) /** Device number selecting Compact protocol where device is int32_t */
+#define MAESTRO_PLAN_MAX_CHANNELS 64 /** Maximal number of channels for maestro_batch_*_set_targets() */
+
+#define MAESTRO_CAP_SINGLE_TARGET 0x01 /** No Set Multiple Targets (Micro Maestro 6), targets are planned as single set target */
+
+#define MAESTRO_LINK_RAW 0x01         /** Raw 8N1 mode without flow control and translations */
+#define MAESTRO_LINK_BAUD 0x02        /** Baud rate */
+#define MAESTRO_LINK_VMIN_VTIME 0x04  /** VMIN/VTIME read policy */
+#define MAESTRO_LINK_LOW_LATENCY 0x08 /** ASYNC_LOW_LATENCY of serial driver */
+#define MAESTRO_LINK_FLUSH 0x10       /** Unread input discarded */
 	
 
 	/**************************************************************************/
@@ -45,16 +64,71 @@ extern "C" {
 	 *
 	 * @param device -- name of COM-port device file
 	 *
-	 * @retval File desriptor of opened interface or -1 if error occured
+	 * @retval File desriptor of opened interface or negative MAESTRO_ERR_* code if error occured
 	 */
 	int32_t maestro_open(const char* device);
 
+	/**
+	 * @brief Serial link profile
+	 */
+	struct maestro_link_profile {
+		uint32_t baud;        /** baud rate, 0 -- keep current, default 0 */
+		uint8_t raw;          /** raw 8N1 mode (cfmakeraw), default 1 */
+		uint8_t vmin;         /** VMIN, default 1 */
+		uint8_t vtime;        /** VTIME in 0.1 s units, default 0 */
+		uint8_t low_latency;  /** request ASYNC_LOW_LATENCY (FTDI latency timer 1 ms), default 1 */
+		uint8_t flush;        /** discard unread input, default 1 */
+	};
+
+	/**
+	 * @brief What was applied to serial link
+	 *
+	 * @details Settings which driver does not support (e.g. low latency on
+	 * CDC ACM or pseudo-terminal) are reported as failed but do not fail open.
+	 */
+	struct maestro_link_report {
+		uint32_t applied;     /** MAESTRO_LINK_* flags applied */
+		uint32_t failed;      /** MAESTRO_LINK_* flags requested but not supported */
+		uint32_t baud;        /** baud rate read back from port, 0 -- unknown */
+	};
+
+	/**
+	 * @brief Fill link profile with default values
+	 *
+	 * @param profile -- link profile
+	 */
+	void maestro_link_profile_default(struct maestro_link_profile* profile);
+
+	/**
+	 * @brief Configure opened serial interface
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param profile -- link profile, NULL -- default profile
+	 * @param report -- what was applied, may be NULL
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- port attributes can't be set, MAESTRO_ERR_ARG -- unsupported baud rate
+	 */
+	int32_t maestro_link_configure(int32_t fd, const struct maestro_link_profile* profile, struct maestro_link_report* report);
+
+	/**
+	 * @brief Open serial interface with link profile
+	 *
+	 * @details maestro_open() is the same with default profile.
+	 *
+	 * @param device -- name of COM-port device file
+	 * @param profile -- link profile, NULL -- default profile
+	 * @param report -- what was applied, may be NULL
+	 *
+	 * @retval File desriptor of opened interface or negative MAESTRO_ERR_* code if error occured
+	 */
+	int32_t maestro_open_link(const char* device, const struct maestro_link_profile* profile, struct maestro_link_report* report);
+
 	/**
 	 * @brief Close serial interface
 	 *
 	 * @param fd -- file dsecriptor of opened COM-port
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 */
 	int32_t maestro_close(int32_t fd);
 
@@ -72,7 +146,7 @@ extern "C" {
 	 * @param channel -- device channel number
 	 * @param target -- absolute angle of rotation in 0.25 us units
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 */
 	int32_t maestro_pololu_set_target(int32_t fd, uint8_t device, uint8_t channel, uint16_t target);
 
@@ -85,7 +159,7 @@ extern "C" {
 	 * @param channel -- device channel number
 	 * @param target -- absolute angle of rotation in 0.25 us units
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 */
 	int32_t maestro_compact_set_target(int32_t fd, uint8_t channel, uint16_t target);
 
@@ -103,7 +177,7 @@ extern "C" {
 	 * @param target -- 8-bit target value. Value is interprets relative to range of servo
 	 * and Maestro Pololu min/max settings.
 	 *
-	 * @retval 0 -- success, -1 -- failed	 
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 */
 	int32_t maestro_minissc_set_target(int32_t fd, uint8_t channel, uint8_t target);
 
@@ -121,7 +195,7 @@ extern "C" {
 	 * @param firs_channel -- number of first channel to set
 	 * @param targets_p -- pointer to array of targets
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 * 
 	 */
 	int32_t maestro_pololu_set_multiple_target(int32_t fd, uint8_t device, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p);
@@ -136,7 +210,7 @@ extern "C" {
 	 * @param firs_channel -- number of first channel to set
 	 * @param targets_p -- pointer to array of targets
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 * 	 
 	 */
 	int32_t maestro_compact_set_multiple_target(int32_t fd, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p);
@@ -154,7 +228,7 @@ extern "C" {
 	 * @param channel -- device channel number
 	 * @param speed -- in 0.025 us/ms units), 0 -- unlimited speed
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 *
 	 */
 	int32_t maestro_pololu_set_speed(int32_t fd, uint8_t device, uint8_t channel, uint16_t speed);
@@ -170,7 +244,7 @@ extern "C" {
 	 * @param channel -- device channel number
 	 * @param acceleration -- acceleration limit in 0.025/80 us/(ms * ms) units, 0 -- unlimited acceleration
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 *
 	 */
 	int32_t maestro_pololu_set_acceleration(int32_t fd, uint8_t device, uint8_t channel, uint16_t acceleration);
@@ -186,7 +260,7 @@ extern "C" {
 	 * @param on_time -- on time part of period (in 1/48 us units), default 0
 	 * @param period -- value of period (in 1/48 us units), default 0
 	 *
-	 * @retval 0 -- success, -1 -- failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
 	 *
 	 */
 	int32_t maestro_pololu_set_pwm(int32_t fd, uint8_t device, uint16_t on_time, uint16_t period);
@@ -195,29 +269,55 @@ extern "C" {
 	/**
 	 * @brief Get position
 	 *
-	 * @details Implemented through select()
+	 * @details Implemented through ppoll() with CLOCK_MONOTONIC deadline,
+	 * caller's timeout value is not modified.
 	 *
 	 * @param fd -- file descriptor of opened COM-port
 	 * @param device -- device number
 	 * @param channel -- device channel number
 	 * @param timeout -- pointer to timeout value, if NULL -- infinite timeout
 	 *  
-	 * @retval 16 bit position value in 0.25 us units, -1 -- if error occured
+	 * @retval 16 bit position value in 0.25 us units, MAESTRO_ERR_* -- if error occured
 	 *
 	 */
 	int32_t maestro_pololu_get_position(int32_t fd, uint8_t device, uint8_t channel, struct timeval* timeout);
 	int32_t maestro_compact_get_position(int32_t fd, uint8_t channel, struct timeval* timeout);
 
+	/**
+	 * @brief Get positions of channels range
+	 *
+	 * @details All GET_POSITION requests are written back-to-back and replies are
+	 * collected in order, so the whole range costs about one round trip.
+	 * Implemented through ppoll() with CLOCK_MONOTONIC deadline,
+	 * caller's timeout value is not modified.
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param device -- device number
+	 * @param channels_num -- number of channels
+	 * @param first_channel -- number of first channel to read
+	 * @param positions_p -- pointer to array of channels_num positions in 0.25 us units
+	 * @param status_p -- pointer to array of channels_num statuses: 0 -- position read,
+	 * MAESTRO_ERR_TIMEOUT -- no answer for channel, MAESTRO_ERR_SHORT_READ -- answer incomplete; may be NULL
+	 * @param timeout -- pointer to timeout value for whole range, if NULL -- infinite timeout
+	 *
+	 * @retval number of read positions, MAESTRO_ERR_ARG -- range passes channel 255,
+	 * MAESTRO_ERR_* -- if failed to send requests or stream is misaligned
+	 *
+	 */
+	int32_t maestro_pololu_get_positions(int32_t fd, uint8_t device, uint8_t channels_num, uint8_t first_channel, uint16_t* positions_p, int32_t* status_p, struct timeval* timeout);
+	int32_t maestro_compact_get_positions(int32_t fd, uint8_t channels_num, uint8_t first_channel, uint16_t* positions_p, int32_t* status_p, struct timeval* timeout);
+
 	/**
 	 * @brief Get moving state
 	 *
-	 * @details Implemented through select()
+	 * @details Implemented through ppoll() with CLOCK_MONOTONIC deadline,
+	 * caller's timeout value is not modified.
 	 *
 	 * @param fd -- file descriptor of opened COM-port
 	 * @param device -- device number   
 	 * @param timeout -- pointer to timeout value, if NULL -- infinite timeout
 	 *
-	 * @retval 0 - if no servos are moving, 1 - otherwise, -1 -- if error
+	 * @retval 0 - if no servos are moving, 1 - otherwise, MAESTRO_ERR_* -- if error
 	 */
 	int32_t maestro_pololu_is_moving(int32_t fd, uint8_t device, struct timeval* timeout);
 	int32_t maestro_compact_is_moving(int32_t fd, struct timeval* timeout);
@@ -225,13 +325,14 @@ extern "C" {
 	/**
 	 * @brief Get errors
 	 * 
-	 * @details Implemented through select()
+	 * @details Implemented through ppoll() with CLOCK_MONOTONIC deadline,
+	 * caller's timeout value is not modified.
 	 *
 	 * @param fd -- file descriptor of opened COM-port
 	 * @param device -- device number   
 	 * @param timeout -- pointer to timeout value, if NULL -- infinite timeout
 	 *
-	 * @retval 16 bit error value, -1 -- if failed, see POLOLU_ERR_* macro for error explanation
+	 * @retval 16 bit error value, MAESTRO_ERR_* -- if failed, see POLOLU_ERR_* macro for error explanation
 	 *
 	 */
 	int32_t maestro_pololu_get_errors(int32_t fd, uint8_t device, struct timeval* timeout);
@@ -243,7 +344,7 @@ extern "C" {
 	 * @param fd -- file descriptor of opened COM-port
 	 * @param device -- device number   
 	 *
-	 * @retval 0 -- success, -1 -- if failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- if failed
 	 */
 	int32_t maestro_pololu_go_home(int32_t fd, uint8_t device);
 	int32_t maestro_compact_go_home(int32_t fd);
@@ -257,7 +358,7 @@ extern "C" {
 	 * @param fd -- file descriptor of opened COM-port
 	 * @param device -- device number   
 	 *
-	 * @retval 0 -- success, -1 -- if failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- if failed
 	 *
 	 */
 	int32_t maestro_pololu_stop_script(int32_t fd, uint8_t device);
@@ -270,7 +371,7 @@ extern "C" {
 	 * @param device -- device number   
 	 * @param subroutine_number -- number of subroutine where script must be restarted
 	 *
-	 * @retval 0 -- success, -1 -- if failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- if failed
 	 *
 	 */
 	int32_t maestro_pololu_restart_script(int32_t fd, uint8_t device, uint8_t subroutine_number);
@@ -284,7 +385,7 @@ extern "C" {
 	 * @param subroutine_number -- number of subroutine where script must be restarted
 	 * @param parameter -- parameter to subroutine, the parameter must be between 0 and 16383
 	 *
-	 * @retval 0 -- success, -1 -- if failed
+	 * @retval 0 -- success, MAESTRO_ERR_* -- if failed
 	 *
 	 */
 	int32_t maestro_pololu_restart_script_par(int32_t fd, uint8_t device, uint8_t subroutine_number, uint16_t parameter);
@@ -302,6 +403,126 @@ extern "C" {
 	int32_t maestro_pololu_is_stopped(int32_t fd, uint8_t device, struct timeval* timeout);
 	int32_t maestro_compact_is_stopped(int32_t fd, struct timeval* timeout);
 
+
+
+	/** Batch API */
+
+	/**
+	 * @brief Batch of commands
+	 *
+	 * @details Commands are encoded into caller-owned buffer and sent to device
+	 * with single write() by maestro_batch_flush(). Fields are read-only for caller.
+	 */
+	struct maestro_batch {
+		uint8_t* buf; /** caller-owned buffer */
+		size_t size;  /** buffer size */
+		size_t len;   /** number of queued bytes */
+		uint32_t caps; /** MAESTRO_CAP_* limits of device for targets planner */
+	};
+
+	/**
+	 * @brief Initialize batch
+	 *
+	 * @param batch -- batch to initialize
+	 * @param buf -- caller-owned buffer for encoded commands
+	 * @param size -- buffer size
+	 */
+	void maestro_batch_init(struct maestro_batch* batch, uint8_t* buf, size_t size);
+
+	/**
+	 * @brief Drop all queued commands
+	 *
+	 * @param batch -- batch
+	 */
+	void maestro_batch_reset(struct maestro_batch* batch);
+
+	/**
+	 * @brief Limit commands used by targets planner
+	 *
+	 * @details Initialized batch has no limits. With MAESTRO_CAP_SINGLE_TARGET
+	 * maestro_batch_*_set_targets() never emit set multiple target, which
+	 * Micro Maestro 6 does not support.
+	 *
+	 * @param batch -- batch
+	 * @param caps -- MAESTRO_CAP_* flags
+	 */
+	void maestro_batch_set_caps(struct maestro_batch* batch, uint32_t caps);
+
+	/**
+	 * @brief Append command to batch
+	 *
+	 * @details Same commands and parameters as fd based functions above, 
+	 * but command is only encoded into batch buffer.
+	 *
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- buffer is too small for command
+	 */
+	int32_t maestro_batch_pololu_set_target(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t target);
+	int32_t maestro_batch_compact_set_target(struct maestro_batch* batch, uint8_t channel, uint16_t target);
+	int32_t maestro_batch_minissc_set_target(struct maestro_batch* batch, uint8_t channel, uint8_t target);
+
+	int32_t maestro_batch_pololu_set_multiple_target(struct maestro_batch* batch, uint8_t device, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p);
+	int32_t maestro_batch_compact_set_multiple_target(struct maestro_batch* batch, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p);
+
+	int32_t maestro_batch_pololu_set_speed(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t speed);
+	int32_t maestro_batch_compact_set_speed(struct maestro_batch* batch, uint8_t channel, uint16_t speed);
+
+	int32_t maestro_batch_pololu_set_acceleration(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t acceleration);
+	int32_t maestro_batch_compact_set_acceleration(struct maestro_batch* batch, uint8_t channel, uint16_t acceleration);
+
+	int32_t maestro_batch_pololu_set_pwm(struct maestro_batch* batch, uint8_t device, uint16_t on_time, uint16_t period);
+	int32_t maestro_batch_compact_set_pwm(struct maestro_batch* batch, uint16_t on_time, uint16_t period);
+
+	int32_t maestro_batch_pololu_go_home(struct maestro_batch* batch, uint8_t device);
+	int32_t maestro_batch_compact_go_home(struct maestro_batch* batch);
+
+	int32_t maestro_batch_pololu_stop_script(struct maestro_batch* batch, uint8_t device);
+	int32_t maestro_batch_compact_stop_script(struct maestro_batch* batch);
+
+	int32_t maestro_batch_pololu_restart_script(struct maestro_batch* batch, uint8_t device, uint8_t subroutine_number);
+	int32_t maestro_batch_compact_restart_script(struct maestro_batch* batch, uint8_t subroutine_number);
+
+	int32_t maestro_batch_pololu_restart_script_par(struct maestro_batch* batch, uint8_t device, uint8_t subroutine_number, uint16_t parameter);
+	int32_t maestro_batch_compact_restart_script_par(struct maestro_batch* batch, uint8_t subroutine_number, uint16_t parameter);
+
+	/**
+	 * @brief Append changed targets with minimal number of bytes
+	 *
+	 * @details Changed channels are split into single set target commands and
+	 * set multiple target runs so that total encoded size is minimal. Run may bridge
+	 * gap of unchanged channels if they are marked as known: their targets from
+	 * targets_p are sent again, so they must be current targets of the device.
+	 * Pass 0 as known to never resend unchanged channels. Only single set target
+	 * commands are used if batch has MAESTRO_CAP_SINGLE_TARGET (see maestro_batch_set_caps()).
+	 *
+	 * @param batch -- batch
+	 * @param device -- device number (Pololu protocol)
+	 * @param channels_num -- size of targets_p, up to MAESTRO_PLAN_MAX_CHANNELS
+	 * @param targets_p -- targets of channels 0..channels_num-1 in 0.25 us units
+	 * @param changed -- bitmask of channels to send
+	 * @param known -- bitmask of unchanged channels which may be sent again
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad parameters, MAESTRO_ERR_FULL -- buffer is too small for commands
+	 */
+	int32_t maestro_batch_pololu_set_targets(struct maestro_batch* batch, uint8_t device, uint8_t channels_num,
+	                                         const uint16_t* targets_p, uint64_t changed, uint64_t known);
+	int32_t maestro_batch_compact_set_targets(struct maestro_batch* batch, uint8_t channels_num,
+	                                          const uint16_t* targets_p, uint64_t changed, uint64_t known);
+
+	/**
+	 * @brief Send all queued commands
+	 *
+	 * @details Whole batch is sent with single write() (retried only on partial write),
+	 * batch is empty after success. On failure unsent commands stay queued.
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_batch_flush(int32_t fd, struct maestro_batch* batch);
+
 #ifdef __cplusplus
 }
 #endif
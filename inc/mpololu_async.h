@@ -0,0 +1,211 @@
+/**
+ * @file   mpololu_async.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Non-blocking API for communicating with Maestro Pololu from event loop.
+ *
+ * @details Requests are queued and return immediately. Caller polls descriptor
+ * returned by maestro_async_fd() for events from maestro_async_events() (epoll, poll
+ * or select), and calls maestro_async_process() when it is ready. Answers are decoded
+ * and delivered to completion callbacks in submission order. Request deadlines
+ * are kept in CLOCK_MONOTONIC time and may be waited on with timerfd
+ * (see maestro_async_timer_fd()).
+ *
+ * When request times out, all outstanding requests fail and their unsent
+ * commands are dropped. Late answers are then drained (until they came or line
+ * is quiet) before new queries go out.
+ *
+ */
+#ifndef MPOLOLU_ASYNC_H
+#define MPOLOLU_ASYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_ASYNC_IN (0x001)  /** Readiness for reading, same as EPOLLIN/POLLIN */
+#define MAESTRO_ASYNC_OUT (0x004) /** Readiness for writing, same as EPOLLOUT/POLLOUT */
+
+#define MAESTRO_ASYNC_TX_SIZE 4096 /** Size of queue for unsent bytes */
+
+	/**
+	 * @brief Completion callback
+	 *
+	 * @param arg -- user argument passed on submission
+	 * @param status -- 0 -- answer received, MAESTRO_ERR_TIMEOUT -- request or one before it timed out,
+	 * MAESTRO_ERR_STATE -- context destroyed
+	 * @param value -- decoded answer (as returned by blocking API), -1 if failed
+	 */
+	typedef void (*maestro_async_cb)(void* arg, int32_t status, int32_t value);
+
+	struct maestro_async;
+
+	/**
+	 * @brief Create asynchronous context on opened COM-port
+	 *
+	 * @details Descriptor is switched to non-blocking mode and must not be used
+	 * for blocking calls while context exists.
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param max_requests -- maximal number of requests waiting for answer
+	 *
+	 * @retval context or NULL if error occured
+	 */
+	struct maestro_async* maestro_async_create(int32_t fd, uint32_t max_requests);
+
+	/**
+	 * @brief Destroy context
+	 *
+	 * @details Callbacks of outstanding requests are called with MAESTRO_ERR_STATE status,
+	 * they can't submit new requests. Descriptor is not closed.
+	 *
+	 * @param async -- context
+	 */
+	void maestro_async_destroy(struct maestro_async* async);
+
+	/**
+	 * @brief Descriptor to wait on
+	 *
+	 * @param async -- context
+	 *
+	 * @retval file descriptor
+	 */
+	int32_t maestro_async_fd(const struct maestro_async* async);
+
+	/**
+	 * @brief Events to wait for
+	 *
+	 * @param async -- context
+	 *
+	 * @retval MAESTRO_ASYNC_IN, plus MAESTRO_ASYNC_OUT while unsent bytes are queued
+	 */
+	uint32_t maestro_async_events(const struct maestro_async* async);
+
+	/**
+	 * @brief Time until nearest request deadline
+	 *
+	 * @param async -- context
+	 *
+	 * @retval timeout in ms for epoll_wait()/poll(), -1 -- no deadline
+	 */
+	int32_t maestro_async_timeout(const struct maestro_async* async);
+
+	/**
+	 * @brief Deadline timer descriptor
+	 *
+	 * @details Alternative to maestro_async_timeout(): timerfd created on first call
+	 * is kept armed at nearest request deadline (absolute CLOCK_MONOTONIC time),
+	 * so event loop may wait on it instead of recomputing timeout each iteration
+	 * and wakes up with ns precision. It becomes readable when deadline passes,
+	 * maestro_async_process() must be called then (events 0 is fine).
+	 * Descriptor is closed by maestro_async_destroy().
+	 *
+	 * @param async -- context
+	 *
+	 * @retval timer descriptor, MAESTRO_ERR_IO -- failed to create timer
+	 */
+	int32_t maestro_async_timer_fd(struct maestro_async* async);
+
+	/**
+	 * @brief Process readiness
+	 *
+	 * @details Sends queued bytes, reads and decodes answers, calls completion callbacks
+	 * and expires requests. Never blocks. Must be called on readiness and on timeout.
+	 *
+	 * @param async -- context
+	 * @param events -- ready events (MAESTRO_ASYNC_IN, MAESTRO_ASYNC_OUT), 0 -- check all
+	 *
+	 * @retval number of completed requests, MAESTRO_ERR_IO -- I/O error
+	 */
+	int32_t maestro_async_process(struct maestro_async* async, uint32_t events);
+
+	/**
+	 * @brief Number of requests waiting for answer
+	 *
+	 * @param async -- context
+	 *
+	 * @retval number of requests
+	 */
+	uint32_t maestro_async_pending(const struct maestro_async* async);
+
+	/**
+	 * @brief Queue raw command
+	 *
+	 * @details Command bytes are sent in submission order and never split by other commands.
+	 * If request fails before any of its bytes are sent, only its queries are dropped,
+	 * commands without answer are still sent. Bytes library can't decode (Mini SSC)
+	 * are dropped with the rest of the submission.
+	 *
+	 * @param async -- context
+	 * @param cmd -- encoded command(s)
+	 * @param len -- command length
+	 * @param ans_len -- answer length (up to 4 bytes), 0 -- command without answer
+	 * @param timeout_ms -- timeout in ms since submission, -1 -- infinite timeout
+	 * @param cb -- completion callback, required if ans_len is not 0
+	 * @param arg -- callback argument
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- queue is full, MAESTRO_ERR_ARG -- bad arguments,
+	 * MAESTRO_ERR_STATE -- context is being destroyed, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_async_submit(struct maestro_async* async, const uint8_t* cmd, size_t len, size_t ans_len,
+	                             int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+	/**
+	 * @brief Hold submitted bytes until uncorked
+	 *
+	 * @details While context is corked, submissions are only queued, so commands
+	 * submitted from many sources in one event loop iteration go out with one
+	 * write() when context is uncorked. Queued bytes are still sent by
+	 * maestro_async_process() on MAESTRO_ASYNC_OUT readiness.
+	 *
+	 * @param async -- context
+	 * @param cork -- 1 -- cork, 0 -- uncork and send queued bytes
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_async_cork(struct maestro_async* async, int32_t cork);
+
+	/**
+	 * @brief Queue all commands of batch and reset batch
+	 *
+	 * @param async -- context
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- queue is full, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_async_submit_batch(struct maestro_async* async, struct maestro_batch* batch);
+
+	/**
+	 * @brief Queue query
+	 *
+	 * @details Same queries as blocking API, answer is passed to callback.
+	 *
+	 * @param async -- context
+	 * @param timeout_ms -- timeout in ms since submission, -1 -- infinite timeout
+	 * @param cb -- completion callback
+	 * @param arg -- callback argument
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- queue is full, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_async_pololu_get_position(struct maestro_async* async, uint8_t device, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_async_compact_get_position(struct maestro_async* async, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+	int32_t maestro_async_pololu_is_moving(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_async_compact_is_moving(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+	int32_t maestro_async_pololu_get_errors(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_async_compact_get_errors(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+	int32_t maestro_async_pololu_is_stopped(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_async_compact_is_stopped(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_ASYNC_H */
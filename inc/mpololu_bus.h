@@ -0,0 +1,189 @@
+/**
+ * @file   mpololu_bus.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Arbiter of daisy-chained Pololu protocol devices on one serial line.
+ *
+ * @details All devices receive every byte written to the line and answer
+ * on shared RX path, so answers of two devices may collide and answers carry
+ * no device number. Arbiter keeps queries of each device in own queue and
+ * lets only one device have outstanding queries at a time: queries to the
+ * same device are pipelined, next device gets the line when all answers
+ * came back (or, after timeout, when late answers were drained). Devices
+ * waiting for the line are served round-robin.
+ *
+ * Targets are latest-value-wins: changed channels of all devices are packed
+ * into one write with minimal number of bytes (see maestro_batch_pololu_set_targets()).
+ * Pending targets are always written before queries submitted after them.
+ *
+ * Arbiter is non-blocking and is driven from event loop like mpololu_async.h:
+ * wait on maestro_bus_fd() for maestro_bus_events() up to maestro_bus_timeout()
+ * and call maestro_bus_process().
+ *
+ */
+#ifndef MPOLOLU_BUS_H
+#define MPOLOLU_BUS_H
+
+#include <stdint.h>
+#include "mpololu.h"
+#include "mpololu_async.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_BUS_MAX_DEVICES 16 /** Maximal number of devices on bus */
+
+	/**
+	 * @brief Bus statistics
+	 */
+	struct maestro_bus_stats {
+		uint64_t writes;    /** target writes, all devices packed in each */
+		uint64_t targets;   /** targets written */
+		uint64_t queries;   /** queries sent */
+		uint64_t answers;   /** queries answered */
+		uint64_t failures;  /** queries failed or timed out */
+		uint64_t switches;  /** line handed over to another device */
+	};
+
+	struct maestro_bus;
+
+	/**
+	 * @brief Create arbiter on opened COM-port
+	 *
+	 * @details Descriptor is switched to non-blocking mode and must not be used
+	 * for blocking calls while arbiter exists.
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param max_queries -- maximal number of queued queries of each device
+	 *
+	 * @retval arbiter or NULL if error occured
+	 */
+	struct maestro_bus* maestro_bus_create(int32_t fd, uint32_t max_queries);
+
+	/**
+	 * @brief Destroy arbiter
+	 *
+	 * @details Callbacks of queued and outstanding queries are called with MAESTRO_ERR_STATE status.
+	 * Unwritten targets are dropped. Descriptor is not closed.
+	 *
+	 * @param bus -- arbiter
+	 */
+	void maestro_bus_destroy(struct maestro_bus* bus);
+
+	/**
+	 * @brief Add device to bus
+	 *
+	 * @param bus -- arbiter
+	 * @param device -- device number
+	 * @param channels -- number of device channels, up to MAESTRO_PLAN_MAX_CHANNELS
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- too many devices, MAESTRO_ERR_STATE -- device exists,
+	 * MAESTRO_ERR_ARG -- bad channels number
+	 */
+	int32_t maestro_bus_add_device(struct maestro_bus* bus, uint8_t device, uint8_t channels);
+
+	/**
+	 * @brief Set limits of device
+	 *
+	 * @details With MAESTRO_CAP_SINGLE_TARGET (Micro Maestro 6) targets of device
+	 * are flushed as single set target commands. Added device has no limits.
+	 *
+	 * @param bus -- arbiter
+	 * @param device -- device number
+	 * @param caps -- MAESTRO_CAP_* flags
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- unknown device
+	 */
+	int32_t maestro_bus_set_device_caps(struct maestro_bus* bus, uint8_t device, uint32_t caps);
+
+	/**
+	 * @brief Event loop interface, same as in mpololu_async.h
+	 *
+	 * @param bus -- arbiter
+	 * @param events -- ready events (MAESTRO_ASYNC_IN, MAESTRO_ASYNC_OUT), 0 -- check all
+	 *
+	 * @retval descriptor, events to wait for, timeout in ms (-1 -- no deadline),
+	 * number of completed queries (MAESTRO_ERR_IO -- I/O error)
+	 */
+	int32_t maestro_bus_fd(const struct maestro_bus* bus);
+	uint32_t maestro_bus_events(const struct maestro_bus* bus);
+	int32_t maestro_bus_timeout(const struct maestro_bus* bus);
+	int32_t maestro_bus_process(struct maestro_bus* bus, uint32_t events);
+
+	/**
+	 * @brief Number of queued and outstanding queries
+	 *
+	 * @param bus -- arbiter
+	 *
+	 * @retval number of queries
+	 */
+	uint32_t maestro_bus_pending(const struct maestro_bus* bus);
+
+	/**
+	 * @brief Process bus until all queries are completed and targets written
+	 *
+	 * @param bus -- arbiter
+	 * @param timeout_ms -- timeout, -1 -- infinite
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- I/O error, MAESTRO_ERR_TIMEOUT -- timeout
+	 */
+	int32_t maestro_bus_run(struct maestro_bus* bus, int32_t timeout_ms);
+
+	/**
+	 * @brief Set target of device channel
+	 *
+	 * @details Target is written by next maestro_bus_flush() or maestro_bus_process(),
+	 * newer target of the same channel replaces unwritten one.
+	 *
+	 * @param bus -- arbiter
+	 * @param device -- device number
+	 * @param channel -- device channel number
+	 * @param target -- target in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- unknown device or bad channel
+	 */
+	int32_t maestro_bus_set_target(struct maestro_bus* bus, uint8_t device, uint8_t channel, uint16_t target);
+
+	/**
+	 * @brief Write pending targets of all devices with single write
+	 *
+	 * @param bus -- arbiter
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- I/O error
+	 */
+	int32_t maestro_bus_flush(struct maestro_bus* bus);
+
+	/**
+	 * @brief Queue query
+	 *
+	 * @details Same queries as blocking API, answer is passed to callback.
+	 * Timeout is counted from the moment query is sent to the line.
+	 *
+	 * @param bus -- arbiter
+	 * @param device -- device number
+	 * @param timeout_ms -- timeout in ms, -1 -- infinite timeout
+	 * @param cb -- completion callback
+	 * @param arg -- callback argument
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- unknown device or bad channel, MAESTRO_ERR_FULL -- queue is full
+	 */
+	int32_t maestro_bus_get_position(struct maestro_bus* bus, uint8_t device, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_bus_is_moving(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_bus_get_errors(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+	int32_t maestro_bus_is_stopped(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param bus -- arbiter
+	 * @param stats -- statistics
+	 */
+	void maestro_bus_get_stats(const struct maestro_bus* bus, struct maestro_bus_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_BUS_H */
@@ -0,0 +1,100 @@
+/**
+ * @file   mpololu_capture.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Binary capture of bytes written to and read from controllers.
+ *
+ * @details When capture is started, every buffer written to or read from
+ * a COM-port by the library (blocking, handle, async, I/O thread, coalescer,
+ * group and bus APIs) is appended to capture file with CLOCK_MONOTONIC
+ * timestamp and descriptor number. When capture is stopped, the cost is
+ * one relaxed atomic load per read or write.
+ *
+ * File is capture header followed by records: record header and len data
+ * bytes. All fields are in host byte order. Capture is process-wide,
+ * records of all threads are buffered and written under one lock.
+ *
+ * mpololu_replay plays device side of capture back through pseudo-terminal.
+ *
+ */
+#ifndef MPOLOLU_CAPTURE_H
+#define MPOLOLU_CAPTURE_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_CAPTURE_MAGIC "MPOLCAP"  /** First 8 bytes of file, terminating zero included */
+#define MAESTRO_CAPTURE_VERSION 1
+
+#define MAESTRO_CAPTURE_TX 0 /** Bytes written to controller */
+#define MAESTRO_CAPTURE_RX 1 /** Bytes read from controller */
+
+	/**
+	 * @brief Capture file header
+	 */
+	struct maestro_capture_header {
+		char magic[8];          /** MAESTRO_CAPTURE_MAGIC */
+		uint32_t version;       /** MAESTRO_CAPTURE_VERSION */
+		uint32_t record_size;   /** sizeof(struct maestro_capture_record) */
+		uint64_t start_ns;      /** CLOCK_MONOTONIC time capture started */
+	};
+
+	/**
+	 * @brief Capture record header, followed by len data bytes
+	 */
+	struct maestro_capture_record {
+		uint64_t ts_ns;   /** CLOCK_MONOTONIC time write or read returned */
+		int32_t fd;       /** descriptor */
+		uint16_t len;     /** number of data bytes */
+		uint8_t dir;      /** MAESTRO_CAPTURE_TX or MAESTRO_CAPTURE_RX */
+		uint8_t flags;    /** reserved, 0 */
+	};
+
+	/**
+	 * @brief Capture statistics
+	 */
+	struct maestro_capture_stats {
+		uint64_t records;  /** records written */
+		uint64_t bytes;    /** data bytes captured */
+		uint64_t errors;   /** failed file writes, records buffered then are lost */
+	};
+
+	/**
+	 * @brief Start capture
+	 *
+	 * @param path -- capture file, created or truncated
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- failed to create file, MAESTRO_ERR_STATE -- capture is already running
+	 */
+	int32_t maestro_capture_start(const char* path);
+
+	/**
+	 * @brief Stop capture, write buffered records and close file
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_STATE -- capture is not running, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_capture_stop(void);
+
+	/**
+	 * @brief Write buffered records to file
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- write failed
+	 */
+	int32_t maestro_capture_flush(void);
+
+	/**
+	 * @brief Get statistics of current or last capture
+	 *
+	 * @param stats -- statistics
+	 */
+	void maestro_capture_get_stats(struct maestro_capture_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_CAPTURE_H */
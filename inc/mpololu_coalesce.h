@@ -0,0 +1,122 @@
+/**
+ * @file   mpololu_coalesce.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Latest-value-wins target coalescer with fixed-rate flush.
+ *
+ * @details Producers store targets at any rate, coalescer keeps only the newest
+ * target of each channel and marks it dirty. Flush sends dirty channels only,
+ * so command latency is bounded by one flush period regardless of producer rate.
+ *
+ */
+#ifndef MPOLOLU_COALESCE_H
+#define MPOLOLU_COALESCE_H
+
+#include <stdint.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_COALESCE_MAX_CHANNELS 64 /** Maximal number of coalesced channels */
+
+	/**
+	 * @brief Coalescer statistics
+	 */
+	struct maestro_coalesce_stats {
+		uint64_t updates;     /** targets stored by producers */
+		uint64_t overwritten; /** targets replaced by newer ones before flush */
+		uint64_t flushes;     /** flushes which sent something */
+		uint64_t sent;        /** channel targets sent */
+		uint64_t errors;      /** failed flushes */
+	};
+
+	struct maestro_coalesce;
+
+	/**
+	 * @brief Create coalescer
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param device -- device number, MAESTRO_COMPACT -- use Compact protocol
+	 * @param channels -- number of channels, up to MAESTRO_COALESCE_MAX_CHANNELS
+	 *
+	 * @retval coalescer or NULL if error occured
+	 */
+	struct maestro_coalesce* maestro_coalesce_create(int32_t fd, int32_t device, uint8_t channels);
+
+	/**
+	 * @brief Stop flush thread (if started) and free coalescer
+	 *
+	 * @param co -- coalescer
+	 */
+	void maestro_coalesce_destroy(struct maestro_coalesce* co);
+
+	/**
+	 * @brief Store newest target of channel
+	 *
+	 * @details Lock-free, never blocks and never writes to port.
+	 *
+	 * @param co -- coalescer
+	 * @param channel -- device channel number
+	 * @param target -- absolute angle of rotation in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_coalesce_set_target(struct maestro_coalesce* co, uint8_t channel, uint16_t target);
+
+	/**
+	 * @brief Set limits of device
+	 *
+	 * @details With MAESTRO_CAP_SINGLE_TARGET (Micro Maestro 6) flushes send
+	 * single set target commands only. Coalescer has no limits after create.
+	 *
+	 * @param co -- coalescer
+	 * @param caps -- MAESTRO_CAP_* flags
+	 */
+	void maestro_coalesce_set_caps(struct maestro_coalesce* co, uint32_t caps);
+
+	/**
+	 * @brief Send targets of channels changed since previous flush
+	 *
+	 * @details All changed channels are sent with single write().
+	 *
+	 * @param co -- coalescer
+	 *
+	 * @retval number of sent channels, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_coalesce_flush(struct maestro_coalesce* co);
+
+	/**
+	 * @brief Start thread calling maestro_coalesce_flush() at fixed rate
+	 *
+	 * @param co -- coalescer
+	 * @param rate_hz -- flush rate
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_coalesce_start(struct maestro_coalesce* co, uint32_t rate_hz);
+
+	/**
+	 * @brief Stop flush thread, pending targets are flushed
+	 *
+	 * @param co -- coalescer
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_coalesce_stop(struct maestro_coalesce* co);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param co -- coalescer
+	 * @param stats -- statistics
+	 */
+	void maestro_coalesce_get_stats(struct maestro_coalesce* co, struct maestro_coalesce_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_COALESCE_H */
@@ -0,0 +1,163 @@
+/**
+ * @file   mpololu_daemon.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Port multiplexing daemon protocol and client API.
+ *
+ * @details mpololu_daemon owns COM-ports and serves many local clients on
+ * Unix domain socket of SOCK_SEQPACKET type, so several processes share
+ * controllers without reopening the tty and without interleaving frames.
+ * Each packet is one request header followed by len command bytes, as encoded
+ * by batch API, replies are single reply packets. Commands of all clients read
+ * in one event loop iteration are sent to port with one write(), answers are
+ * returned to client which sent the query. All fields are in host byte order.
+ *
+ * Commands without answer get no reply unless MAESTRO_DAEMON_ACK is set.
+ * Client functions below are blocking, socket must not be shared between
+ * threads without locking.
+ *
+ */
+#ifndef MPOLOLU_DAEMON_H
+#define MPOLOLU_DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_DAEMON_SOCKET "/tmp/mpololu.sock" /** Default socket path */
+#define MAESTRO_DAEMON_MAX_PORTS 8                /** Maximal number of ports of one daemon */
+#define MAESTRO_DAEMON_MAX_CMD 1024               /** Maximal number of command bytes in request */
+#define MAESTRO_DAEMON_GRACE_MS 100               /** Client waits that long after query timeout for daemon reply */
+
+#define MAESTRO_DAEMON_ACK 0x01 /** Reply to command without answer once it is queued */
+
+	/**
+	 * @brief Request header, followed by len command bytes
+	 */
+	struct maestro_daemon_request {
+		uint32_t tag;          /** copied to reply */
+		uint16_t len;          /** number of command bytes */
+		uint8_t port;          /** port index in order of daemon --dev options */
+		uint8_t ans_len;       /** answer length (up to 4 bytes), 0 -- command without answer */
+		int32_t timeout_ms;    /** answer timeout since daemon received request, -1 -- infinite */
+		uint8_t flags;         /** MAESTRO_DAEMON_* */
+		uint8_t reserved[3];   /** 0 */
+	};
+
+	/**
+	 * @brief Reply
+	 */
+	struct maestro_daemon_reply {
+		uint32_t tag;          /** tag of request */
+		int32_t status;        /** 0 -- success, MAESTRO_ERR_* -- failed */
+		int32_t value;         /** decoded answer, -1 if failed or command without answer */
+	};
+
+	/**
+	 * @brief Check command bytes of request
+	 *
+	 * @details Commands are decoded one by one. Request may hold at most one
+	 * query, it must be the last command and its answer must be ans_len bytes
+	 * long, otherwise answers of port would be returned to wrong clients.
+	 * Daemon rejects other requests, client functions check them before sending.
+	 *
+	 * @param cmd -- encoded command(s)
+	 * @param len -- command length
+	 * @param ans_len -- answer length, 0 -- command without answer
+	 *
+	 * @retval 0 -- valid, MAESTRO_ERR_ARG -- unknown or truncated command, or answer does not match ans_len
+	 */
+	int32_t maestro_daemon_check(const uint8_t* cmd, size_t len, size_t ans_len);
+
+	/**
+	 * @brief Connect to daemon
+	 *
+	 * @param path -- socket path, NULL -- MAESTRO_DAEMON_SOCKET
+	 *
+	 * @retval socket descriptor, MAESTRO_ERR_ARG -- path is too long, MAESTRO_ERR_IO -- failed to connect
+	 */
+	int32_t maestro_daemon_connect(const char* path);
+
+	/**
+	 * @brief Close connection
+	 *
+	 * @param sock -- socket descriptor
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- failed
+	 */
+	int32_t maestro_daemon_close(int32_t sock);
+
+	/**
+	 * @brief Send command without answer
+	 *
+	 * @details Returns once request is handed to socket, daemon sends command
+	 * with commands of other clients.
+	 *
+	 * @param sock -- socket descriptor
+	 * @param port -- port index
+	 * @param cmd -- encoded command(s)
+	 * @param len -- command length, up to MAESTRO_DAEMON_MAX_CMD
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- command is too long, MAESTRO_ERR_IO -- send failed
+	 */
+	int32_t maestro_daemon_send(int32_t sock, uint8_t port, const uint8_t* cmd, size_t len);
+
+	/**
+	 * @brief Send all commands of batch and reset batch
+	 *
+	 * @param sock -- socket descriptor
+	 * @param port -- port index
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed, batch is kept
+	 */
+	int32_t maestro_daemon_send_batch(int32_t sock, uint8_t port, struct maestro_batch* batch);
+
+	/**
+	 * @brief Send raw command and wait for daemon reply
+	 *
+	 * @details Replies of earlier timed-out queries are dropped.
+	 *
+	 * @param sock -- socket descriptor
+	 * @param port -- port index
+	 * @param cmd -- encoded command
+	 * @param len -- command length, up to MAESTRO_DAEMON_MAX_CMD
+	 * @param ans_len -- answer length (up to 4 bytes), 0 -- wait until command is queued
+	 * @param timeout_ms -- answer timeout, -1 -- infinite timeout
+	 *
+	 * @retval decoded answer, 0 for command without answer, MAESTRO_ERR_* -- failed
+	 * (status of daemon reply or MAESTRO_ERR_TIMEOUT if daemon did not reply)
+	 */
+	int32_t maestro_daemon_query(int32_t sock, uint8_t port, const uint8_t* cmd, size_t len, size_t ans_len, int32_t timeout_ms);
+
+	/**
+	 * @brief Queries of blocking API through daemon
+	 *
+	 * @param sock -- socket descriptor
+	 * @param port -- port index
+	 * @param timeout_ms -- answer timeout, -1 -- infinite timeout
+	 *
+	 * @retval same as maestro_daemon_query()
+	 */
+	int32_t maestro_daemon_pololu_get_position(int32_t sock, uint8_t port, uint8_t device, uint8_t channel, int32_t timeout_ms);
+	int32_t maestro_daemon_compact_get_position(int32_t sock, uint8_t port, uint8_t channel, int32_t timeout_ms);
+
+	int32_t maestro_daemon_pololu_is_moving(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms);
+	int32_t maestro_daemon_compact_is_moving(int32_t sock, uint8_t port, int32_t timeout_ms);
+
+	int32_t maestro_daemon_pololu_get_errors(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms);
+	int32_t maestro_daemon_compact_get_errors(int32_t sock, uint8_t port, int32_t timeout_ms);
+
+	int32_t maestro_daemon_pololu_is_stopped(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms);
+	int32_t maestro_daemon_compact_is_stopped(int32_t sock, uint8_t port, int32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_DAEMON_H */
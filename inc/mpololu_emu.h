@@ -0,0 +1,156 @@
+/**
+ * @file   mpololu_emu.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Software Maestro Pololu emulator on Linux pseudo-terminal.
+ *
+ * @details Emulator decodes Compact, Pololu and MiniSSC commands written to the
+ * slave side of a pty, keeps per-channel target/speed/acceleration state and answers
+ * status queries. Slave device name can be passed to maestro_open() as is.
+ *
+ */
+#ifndef MPOLOLU_EMU_H
+#define MPOLOLU_EMU_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_EMU_MAX_CHANNELS 24 /** Maximal number of channels of single device */
+#define MAESTRO_EMU_MAX_DEVICES 16 /** Maximal number of daisy-chained devices */
+
+	/**
+	 * @brief Emulator configuration
+	 */
+	struct maestro_emu_config {
+		uint8_t channels;  /** number of channels of each device, default 24 */
+		uint8_t device;    /** Pololu protocol device number of first device, default 12 */
+		uint8_t devices;   /** number of daisy-chained devices with consecutive numbers, default 1 */
+		uint32_t baud;     /** simulated baud rate, 0 -- no throttling, default 0 */
+	};
+
+	/**
+	 * @brief Emulated channel state
+	 */
+	struct maestro_emu_channel {
+		uint16_t target;       /** target in 0.25 us units, 0 -- channel is off */
+		uint16_t speed;        /** speed limit in 0.025 us/ms units */
+		uint16_t acceleration; /** acceleration limit in 0.025/80 us/(ms * ms) units */
+		uint16_t position;     /** current position in 0.25 us units */
+	};
+
+	/**
+	 * @brief Emulator traffic counters
+	 */
+	struct maestro_emu_counters {
+		uint64_t rx_bytes;     /** bytes received from host */
+		uint64_t tx_bytes;     /** bytes answered to host */
+		uint64_t commands;     /** decoded commands */
+		uint64_t proto_errors; /** malformed commands */
+	};
+
+	struct maestro_emu;
+
+	/**
+	 * @brief Fill configuration with default values
+	 *
+	 * @param cfg -- configuration
+	 */
+	void maestro_emu_config_default(struct maestro_emu_config* cfg);
+
+	/**
+	 * @brief Create emulator on new pseudo-terminal
+	 *
+	 * @param cfg -- configuration, if NULL -- default configuration
+	 *
+	 * @retval emulator or NULL if error occured
+	 */
+	struct maestro_emu* maestro_emu_create(const struct maestro_emu_config* cfg);
+
+	/**
+	 * @brief Stop emulator thread (if started), close pty and free emulator
+	 *
+	 * @param emu -- emulator
+	 */
+	void maestro_emu_destroy(struct maestro_emu* emu);
+
+	/**
+	 * @brief Name of pty slave device for maestro_open()
+	 *
+	 * @param emu -- emulator
+	 *
+	 * @retval device file name
+	 */
+	const char* maestro_emu_device_name(const struct maestro_emu* emu);
+
+	/**
+	 * @brief File descriptor of pty master side, readable when host sent data
+	 *
+	 * @param emu -- emulator
+	 *
+	 * @retval file descriptor
+	 */
+	int32_t maestro_emu_fd(const struct maestro_emu* emu);
+
+	/**
+	 * @brief Process all pending host data without blocking
+	 *
+	 * @param emu -- emulator
+	 *
+	 * @retval number of processed bytes, -1 -- if failed
+	 */
+	int32_t maestro_emu_process(struct maestro_emu* emu);
+
+	/**
+	 * @brief Process host data until maestro_emu_stop() is called
+	 *
+	 * @param emu -- emulator
+	 *
+	 * @retval 0 -- stopped, -1 -- if failed
+	 */
+	int32_t maestro_emu_run(struct maestro_emu* emu);
+
+	/**
+	 * @brief Run maestro_emu_run() in background thread
+	 *
+	 * @param emu -- emulator
+	 *
+	 * @retval 0 -- success, -1 -- failed
+	 */
+	int32_t maestro_emu_start(struct maestro_emu* emu);
+
+	/**
+	 * @brief Request maestro_emu_run() to return, async-signal-safe
+	 *
+	 * @param emu -- emulator
+	 */
+	void maestro_emu_stop(struct maestro_emu* emu);
+
+	/**
+	 * @brief Get emulated channel state
+	 *
+	 * @param emu -- emulator
+	 * @param device -- device number
+	 * @param channel -- device channel number
+	 * @param state -- channel state
+	 *
+	 * @retval 0 -- success, -1 -- no such device or channel
+	 */
+	int32_t maestro_emu_get_channel(struct maestro_emu* emu, uint8_t device, uint8_t channel, struct maestro_emu_channel* state);
+
+	/**
+	 * @brief Get traffic counters
+	 *
+	 * @param emu -- emulator
+	 * @param counters -- counters
+	 */
+	void maestro_emu_get_counters(struct maestro_emu* emu, struct maestro_emu_counters* counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_EMU_H */
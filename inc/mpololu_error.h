@@ -0,0 +1,92 @@
+/**
+ * @file   mpololu_error.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Error codes, thread-local last error and log callback.
+ *
+ * @details Failed functions return negative MAESTRO_ERR_* code (or NULL) and
+ * record details in last error of calling thread. Library writes nothing to
+ * stdout or stderr: errors are passed to log callback if one is installed,
+ * otherwise only recorded.
+ *
+ */
+#ifndef MPOLOLU_ERROR_H
+#define MPOLOLU_ERROR_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_ERR_IO (-1)          /** System call failed, see sys_errno */
+#define MAESTRO_ERR_WRITE_SHORT (-2) /** Command written partially */
+#define MAESTRO_ERR_TIMEOUT (-3)     /** No answer byte before deadline */
+#define MAESTRO_ERR_SHORT_READ (-4)  /** Part of answer received before deadline */
+#define MAESTRO_ERR_PROTOCOL (-5)    /** Received bytes do not match request */
+#define MAESTRO_ERR_ARG (-6)         /** Bad argument */
+#define MAESTRO_ERR_NOMEM (-7)       /** Out of memory */
+#define MAESTRO_ERR_FULL (-8)        /** Queue, buffer or table is full */
+#define MAESTRO_ERR_STATE (-9)       /** Not allowed in current state */
+
+	/**
+	 * @brief Error details
+	 */
+	struct maestro_error {
+		int32_t code;        /** MAESTRO_ERR_*, 0 -- no error */
+		int32_t sys_errno;   /** errno of failed system call, 0 -- none */
+		const char* what;    /** static description of failed operation */
+	};
+
+	/**
+	 * @brief Log callback
+	 *
+	 * @details Called by thread where error occured, before failed function returns.
+	 * Callback is on real-time path and should not block.
+	 *
+	 * @param arg -- user argument
+	 * @param err -- error details, valid during call
+	 */
+	typedef void (*maestro_log_cb)(void* arg, const struct maestro_error* err);
+
+	/**
+	 * @brief Last error of calling thread
+	 *
+	 * @retval error details, code 0 if no error since start or maestro_clear_error()
+	 */
+	const struct maestro_error* maestro_last_error(void);
+
+	/**
+	 * @brief Reset last error of calling thread
+	 */
+	void maestro_clear_error(void);
+
+	/**
+	 * @brief Description of error code
+	 *
+	 * @param code -- MAESTRO_ERR_* code
+	 *
+	 * @retval static string
+	 */
+	const char* maestro_strerror(int32_t code);
+
+	/**
+	 * @brief Install log callback
+	 *
+	 * @details Callback and argument are published together, so it may be
+	 * replaced while other threads use library: each error goes to either old
+	 * or new pair. Replaced pair is not freed, thread may be calling it.
+	 *
+	 * @param cb -- callback, NULL -- errors are only recorded (default)
+	 * @param arg -- callback argument
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_NOMEM -- callback is not changed
+	 */
+	int32_t maestro_set_log_cb(maestro_log_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_ERROR_H */
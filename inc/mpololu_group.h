@@ -0,0 +1,114 @@
+/**
+ * @file   mpololu_group.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Logical channel group spanning many controllers and serial ports.
+ *
+ * @details Group maps flat logical channel space onto (handle, channel) pairs.
+ * Handles sharing descriptor (daisy-chained devices) form one port. Whole frame
+ * of logical targets is split by port, each port share is encoded into one
+ * buffer through shadow cache and planner of its handles, then all ports are
+ * written at once by per-port writer threads released together, so transmission
+ * on every port starts within microseconds.
+ *
+ * Handles must not be used by caller while frame is being sent.
+ *
+ */
+#ifndef MPOLOLU_GROUP_H
+#define MPOLOLU_GROUP_H
+
+#include <stdint.h>
+#include "mpololu_handle.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_GROUP_MAX_HANDLES 32 /** Maximal number of handles in group */
+#define MAESTRO_GROUP_MAX_PORTS 16   /** Maximal number of distinct descriptors in group */
+
+	/**
+	 * @brief Group statistics
+	 *
+	 * @details Skew is difference between first and last port write start
+	 * of one frame.
+	 */
+	struct maestro_group_stats {
+		uint64_t frames;       /** frames sent */
+		uint64_t writes;       /** port writes */
+		uint64_t errors;       /** failed port writes */
+		uint64_t skew_last_ns; /** start skew of last frame written to more than one port */
+		uint64_t skew_max_ns;  /** maximal start skew */
+	};
+
+	struct maestro_group;
+
+	/**
+	 * @brief Create group
+	 *
+	 * @param channels -- number of logical channels
+	 *
+	 * @retval group or NULL if error occured
+	 */
+	struct maestro_group* maestro_group_create(uint16_t channels);
+
+	/**
+	 * @brief Stop writer threads and free group, handles are not closed
+	 *
+	 * @param g -- group
+	 */
+	void maestro_group_destroy(struct maestro_group* g);
+
+	/**
+	 * @brief Map logical channel to device channel
+	 *
+	 * @details Handle is added to group on first mapping, writer thread
+	 * is started for each new descriptor.
+	 *
+	 * @param g -- group
+	 * @param logical -- logical channel
+	 * @param m -- controller handle
+	 * @param channel -- device channel number, less than 64
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channel, MAESTRO_ERR_FULL -- too many handles or ports
+	 */
+	int32_t maestro_group_map(struct maestro_group* g, uint16_t logical, struct maestro* m, uint8_t channel);
+
+	/**
+	 * @brief Send whole frame
+	 *
+	 * @details Only changed targets are sent (see shadow cache in mpololu_handle.h).
+	 * Unmapped logical channels are ignored. Returns when all ports are written.
+	 *
+	 * @param g -- group
+	 * @param targets_p -- targets of all logical channels in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* of failed port -- write to any port failed
+	 */
+	int32_t maestro_group_set_frame(struct maestro_group* g, const uint16_t* targets_p);
+
+	/**
+	 * @brief Set target of single logical channel
+	 *
+	 * @param g -- group
+	 * @param logical -- logical channel
+	 * @param target -- target in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- channel is not mapped, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_group_set_target(struct maestro_group* g, uint16_t logical, uint16_t target);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param g -- group
+	 * @param stats -- statistics
+	 */
+	void maestro_group_get_stats(struct maestro_group* g, struct maestro_group_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_GROUP_H */
@@ -0,0 +1,441 @@
+/**
+ * @file   mpololu_handle.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Persistent controller handle.
+ *
+ * @details Handle keeps descriptor, protocol, device number, channel count
+ * and preallocated TX/RX buffers. Memory is allocated only by open/attach,
+ * functions taking handle never call malloc(). Handle is not thread-safe,
+ * use it from one thread or serialize calls.
+ *
+ * Handle keeps shadow copy of last target, speed and acceleration written to
+ * each channel and skips writes which would not change device state.
+ * The same values drive motion model predicting position of each channel
+ * without querying device.
+ *
+ * Round trip time of every query is measured. With adaptive timeout enabled,
+ * queries called with NULL timeout wait for time derived from observed RTT
+ * percentiles and answer size instead of forever.
+ *
+ * Answers are framed per handle: partial reads are accumulated, and late
+ * answer of timed-out query is dropped before next query instead of being
+ * taken for its answer.
+ *
+ * Timeouts are converted to absolute CLOCK_MONOTONIC deadlines and waited
+ * with ppoll(), so caller's timeval is never modified and descriptor number
+ * is not limited by FD_SETSIZE.
+ *
+ */
+#ifndef MPOLOLU_HANDLE_H
+#define MPOLOLU_HANDLE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_SHADOW_TARGET 0x01       /** Cached target */
+#define MAESTRO_SHADOW_SPEED 0x02        /** Cached speed */
+#define MAESTRO_SHADOW_ACCELERATION 0x04 /** Cached acceleration */
+#define MAESTRO_SHADOW_ALL 0x07          /** All cached values */
+
+	/**
+	 * @brief Shadow cache statistics
+	 */
+	struct maestro_shadow_stats {
+		uint64_t written;    /** values written to device */
+		uint64_t suppressed; /** writes skipped because device already has value */
+	};
+
+	/**
+	 * @brief Predicted state of channel
+	 */
+	struct maestro_model_state {
+		uint16_t position;    /** 0.25 us units */
+		uint16_t target;      /** 0.25 us units */
+		int32_t velocity;     /** 0.25 us per second units */
+		uint32_t arrival_us;  /** time left until target is reached, 0 -- not moving */
+	};
+
+	/**
+	 * @brief Motion model statistics
+	 */
+	struct maestro_model_stats {
+		uint64_t resyncs;     /** resyncs done */
+		uint32_t max_error;   /** maximal prediction error seen by resync, 0.25 us units */
+		uint32_t last_error;  /** prediction error of last resynced channel */
+	};
+
+	/**
+	 * @brief Round trip time statistics
+	 *
+	 * @details Percentiles are taken over last MAESTRO_RTT_WINDOW (64) answers.
+	 */
+	struct maestro_rtt_stats {
+		uint32_t samples;     /** answers in window */
+		uint32_t min_us;
+		uint32_t p50_us;
+		uint32_t p99_us;
+		uint32_t max_us;
+		uint32_t byte_ns;     /** estimated cost of each answer byte */
+		uint32_t timeout_us;  /** current adaptive timeout of 2 byte answer */
+		uint64_t timeouts;    /** queries failed with adaptive timeout */
+	};
+
+	/**
+	 * @brief RX framer statistics
+	 */
+	struct maestro_framer_stats {
+		uint64_t short_reads; /** answers received in more than one read */
+		uint64_t timeouts;    /** answers not completed in time */
+		uint64_t discarded;   /** late or unexpected bytes dropped */
+		uint64_t resyncs;     /** stream resynchronizations */
+	};
+
+	struct maestro;
+
+	/**
+	 * @brief Open serial interface and create handle
+	 *
+	 * @param path -- serial device name
+	 * @param device -- device number, MAESTRO_COMPACT -- use Compact protocol
+	 * @param channels -- number of device channels
+	 *
+	 * @retval handle or NULL if error occured
+	 */
+	struct maestro* maestro_handle_open(const char* path, int32_t device, uint8_t channels);
+
+	/**
+	 * @brief Create handle for already opened descriptor
+	 *
+	 * @details Descriptor is not closed by maestro_handle_close().
+	 *
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param device -- device number, MAESTRO_COMPACT -- use Compact protocol
+	 * @param channels -- number of device channels
+	 *
+	 * @retval handle or NULL if error occured
+	 */
+	struct maestro* maestro_handle_attach(int32_t fd, int32_t device, uint8_t channels);
+
+	/**
+	 * @brief Free handle, close descriptor if handle opened it
+	 *
+	 * @param m -- handle
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_handle_close(struct maestro* m);
+
+	/**
+	 * @brief Handle properties
+	 *
+	 * @param m -- handle
+	 *
+	 * @retval file descriptor, device number (MAESTRO_COMPACT for Compact protocol)
+	 * and number of channels
+	 */
+	int32_t maestro_handle_fd(const struct maestro* m);
+	int32_t maestro_handle_device(const struct maestro* m);
+	uint8_t maestro_handle_channels(const struct maestro* m);
+
+	/**
+	 * @brief Set limits of device
+	 *
+	 * @details With MAESTRO_CAP_SINGLE_TARGET (Micro Maestro 6) targets of set
+	 * multiple target, changed targets and group frames are sent as single set
+	 * target commands. Handle has no limits after open.
+	 *
+	 * @param m -- handle
+	 * @param caps -- MAESTRO_CAP_* flags
+	 */
+	void maestro_handle_set_caps(struct maestro* m, uint32_t caps);
+
+	/**
+	 * @brief Send all commands of batch through handle and reset batch
+	 *
+	 * @details Unlike maestro_batch_flush() on handle descriptor, write is counted
+	 * in handle metrics and targets, speeds and accelerations of batch are recorded
+	 * in shadow cache and motion model (go home and restart script invalidate them
+	 * as handle commands do). Commands are sent as is, shadow cache does not skip any.
+	 *
+	 * @param m -- handle
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed, batch is kept
+	 */
+	int32_t maestro_handle_send_batch(struct maestro* m, struct maestro_batch* batch);
+
+
+	/**
+	 * @brief Commands
+	 *
+	 * @details Same commands and parameters as fd based functions in mpololu.h,
+	 * protocol and device number are taken from handle. Channel numbers are
+	 * checked against number of channels of handle.
+	 *
+	 * Set target, speed and acceleration are skipped (and succeed) when shadow
+	 * cache holds the same value, target -- within deadband of channel.
+	 * Set multiple target sends only changed channels in the cheapest encoding.
+	 * Go home invalidates cached targets, restart script -- all cached values.
+	 *
+	 * @param m -- handle
+	 *
+	 * @retval same as fd based functions, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_set_target(struct maestro* m, uint8_t channel, uint16_t target);
+	int32_t maestro_set_multiple_target(struct maestro* m, uint8_t targets_num, uint8_t first_channel, const uint16_t* targets_p);
+	int32_t maestro_set_speed(struct maestro* m, uint8_t channel, uint16_t speed);
+	int32_t maestro_set_acceleration(struct maestro* m, uint8_t channel, uint16_t acceleration);
+	int32_t maestro_set_pwm(struct maestro* m, uint16_t on_time, uint16_t period);
+	int32_t maestro_go_home(struct maestro* m);
+	int32_t maestro_stop_script(struct maestro* m);
+	int32_t maestro_restart_script(struct maestro* m, uint8_t subroutine_number);
+	int32_t maestro_restart_script_par(struct maestro* m, uint8_t subroutine_number, uint16_t parameter);
+
+	int32_t maestro_get_position(struct maestro* m, uint8_t channel, struct timeval* timeout);
+	int32_t maestro_get_positions(struct maestro* m, uint8_t channels_num, uint8_t first_channel,
+	                              uint16_t* positions_p, int32_t* status_p, struct timeval* timeout);
+	int32_t maestro_is_moving(struct maestro* m, struct timeval* timeout);
+	int32_t maestro_get_errors(struct maestro* m, struct timeval* timeout);
+	int32_t maestro_is_stopped(struct maestro* m, struct timeval* timeout);
+
+	/**
+	 * @brief Send changed targets with minimal number of bytes
+	 *
+	 * @details See maestro_batch_pololu_set_targets().
+	 *
+	 * @param m -- handle
+	 * @param targets_p -- targets of all channels of handle in 0.25 us units
+	 * @param changed -- bitmask of channels to send
+	 * @param known -- bitmask of unchanged channels which may be sent again
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_set_targets(struct maestro* m, const uint16_t* targets_p, uint64_t changed, uint64_t known);
+
+
+	/** Shadow cache */
+
+	/**
+	 * @brief Enable or disable shadow cache (enabled by default)
+	 *
+	 * @details Cached values are dropped in both cases.
+	 *
+	 * @param m -- handle
+	 * @param enable -- 0 -- disable, otherwise enable
+	 */
+	void maestro_shadow_enable(struct maestro* m, int32_t enable);
+
+	/**
+	 * @brief Set target deadband of channel
+	 *
+	 * @details Set target is skipped while new target differs from last written
+	 * one by no more than deadband. Default deadband is 0.
+	 *
+	 * @param m -- handle
+	 * @param channel -- device channel number
+	 * @param deadband -- deadband in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_shadow_set_deadband(struct maestro* m, uint8_t channel, uint16_t deadband);
+
+	/**
+	 * @brief Forget cached values, next writes are sent unconditionally
+	 *
+	 * @details Call it when device was reset or its state was changed
+	 * bypassing handle (other process, script, fd based functions).
+	 *
+	 * @param m -- handle
+	 * @param what -- MAESTRO_SHADOW_* flags
+	 */
+	void maestro_shadow_invalidate(struct maestro* m, uint8_t what);
+
+	/**
+	 * @brief Forget cached values of one channel
+	 *
+	 * @param m -- handle
+	 * @param channel -- device channel number
+	 * @param what -- MAESTRO_SHADOW_* flags
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_shadow_invalidate_channel(struct maestro* m, uint8_t channel, uint8_t what);
+
+	/**
+	 * @brief Get last target written to channel
+	 *
+	 * @param m -- handle
+	 * @param channel -- device channel number
+	 *
+	 * @retval target in 0.25 us units, MAESTRO_ERR_STATE -- unknown, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_shadow_get_target(const struct maestro* m, uint8_t channel);
+
+	/**
+	 * @brief Get shadow cache statistics
+	 *
+	 * @param m -- handle
+	 * @param stats -- statistics
+	 */
+	void maestro_shadow_get_stats(const struct maestro* m, struct maestro_shadow_stats* stats);
+
+
+	/** Motion model */
+
+	/**
+	 * @brief Predict state of channel now
+	 *
+	 * @details Prediction needs target, speed and acceleration of channel to be
+	 * set through handle (after open, go home or restart script). Speed and
+	 * acceleration units are documented in mpololu.h, zero means no limit.
+	 * No serial traffic.
+	 *
+	 * @param m -- handle
+	 * @param channel -- device channel number
+	 * @param state -- predicted state
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_STATE -- channel state is unknown, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_model_predict(const struct maestro* m, uint8_t channel, struct maestro_model_state* state);
+
+	/**
+	 * @brief Predict whether any channel with known state is moving
+	 *
+	 * @param m -- handle
+	 *
+	 * @retval 1 -- moving, 0 -- all channels reached targets
+	 */
+	int32_t maestro_model_is_moving(const struct maestro* m);
+
+	/**
+	 * @brief Correct model by positions read from device
+	 *
+	 * @param m -- handle
+	 * @param channels_num -- number of channels to read
+	 * @param first_channel -- first channel
+	 * @param timeout -- timeout for all answers
+	 *
+	 * @retval number of corrected channels, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_model_resync(struct maestro* m, uint8_t channels_num, uint8_t first_channel, struct timeval* timeout);
+
+	/**
+	 * @brief Set period of automatic resync done by maestro_model_poll()
+	 *
+	 * @param m -- handle
+	 * @param period_ms -- resync period, 0 -- never (default)
+	 */
+	void maestro_model_set_resync_period(struct maestro* m, uint32_t period_ms);
+
+	/**
+	 * @brief Resync all channels if resync period elapsed
+	 *
+	 * @details Call it from control loop, it blocks only when resync is due.
+	 *
+	 * @param m -- handle
+	 * @param timeout -- timeout for all answers
+	 *
+	 * @retval 1 -- resynced, 0 -- resync is not due, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_model_poll(struct maestro* m, struct timeval* timeout);
+
+	/**
+	 * @brief Get motion model statistics
+	 *
+	 * @param m -- handle
+	 * @param stats -- statistics
+	 */
+	void maestro_model_get_stats(const struct maestro* m, struct maestro_model_stats* stats);
+
+
+	/** Round trip time */
+
+	/**
+	 * @brief Measure round trip time of link
+	 *
+	 * @details Sends count GET_MOVING_STATE queries (1 byte answer) and count
+	 * get positions queries of all channels, answer size difference gives cost
+	 * of answer byte. Queries have no side effects on device.
+	 *
+	 * @param m -- handle
+	 * @param count -- number of queries of each kind
+	 * @param timeout -- timeout of each query, NULL -- adaptive or infinite
+	 *
+	 * @retval number of answered queries, MAESTRO_ERR_* of last query -- none answered
+	 */
+	int32_t maestro_rtt_probe(struct maestro* m, uint32_t count, struct timeval* timeout);
+
+	/**
+	 * @brief Enable adaptive timeout of queries called with NULL timeout
+	 *
+	 * @details Timeout is 2 * p99 of RTT (without answer bytes) plus cost of
+	 * answer bytes, bounded by min_us and max_us. It is max_us until first
+	 * answer and doubles after each timeout until next answer.
+	 *
+	 * @param m -- handle
+	 * @param min_us -- lower bound of timeout
+	 * @param max_us -- upper bound of timeout, 0 -- disable (default)
+	 */
+	void maestro_rtt_set_adaptive(struct maestro* m, uint32_t min_us, uint32_t max_us);
+
+	/**
+	 * @brief Get adaptive timeout for answer size
+	 *
+	 * @details Use it with fd based functions or other handles on the same link.
+	 *
+	 * @param m -- handle
+	 * @param answer_bytes -- answer size
+	 * @param tv -- timeout
+	 */
+	void maestro_rtt_timeout(const struct maestro* m, uint32_t answer_bytes, struct timeval* tv);
+
+	/**
+	 * @brief Get round trip time statistics
+	 *
+	 * @param m -- handle
+	 * @param stats -- statistics
+	 */
+	void maestro_rtt_get_stats(const struct maestro* m, struct maestro_rtt_stats* stats);
+
+	/**
+	 * @brief Set deadline shared by following queries
+	 *
+	 * @details Deadline is absolute CLOCK_MONOTONIC time, so whole batch of queries
+	 * completes or fails within timeout regardless of how long each query took.
+	 * Each query waits until the earlier of its own timeout and batch deadline,
+	 * queries called after deadline fail without being sent.
+	 *
+	 * @param m -- handle
+	 * @param timeout -- timeout from now, NULL -- clear deadline
+	 */
+	void maestro_deadline_set(struct maestro* m, const struct timeval* timeout);
+
+	/**
+	 * @brief Time left until batch deadline
+	 *
+	 * @param m -- handle
+	 *
+	 * @retval time in ms, 0 -- deadline passed, -1 -- no deadline
+	 */
+	int32_t maestro_deadline_left_ms(const struct maestro* m);
+
+	/**
+	 * @brief Get RX framer statistics
+	 *
+	 * @param m -- handle
+	 * @param stats -- statistics
+	 */
+	void maestro_framer_get_stats(const struct maestro* m, struct maestro_framer_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_HANDLE_H */
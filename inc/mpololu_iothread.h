@@ -0,0 +1,110 @@
+/**
+ * @file   mpololu_iothread.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Dedicated serial I/O thread fed by lock-free command ring.
+ *
+ * @details Any number of threads submit pre-encoded commands into bounded
+ * lock-free ring, single owner thread drains the ring and writes commands with
+ * as few write() calls as possible. Each submitted frame is written contiguously,
+ * frames of one producer are written in submission order.
+ *
+ */
+#ifndef MPOLOLU_IOTHREAD_H
+#define MPOLOLU_IOTHREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_IOTHREAD_FRAME_MAX 112 /** Maximal size of single submitted frame */
+
+	/**
+	 * @brief I/O thread statistics
+	 */
+	struct maestro_iothread_stats {
+		uint64_t frames;   /** frames written */
+		uint64_t bytes;    /** bytes written */
+		uint64_t writes;   /** write() calls */
+		uint64_t full;     /** submissions rejected because ring was full */
+		uint64_t errors;   /** failed write() calls */
+	};
+
+	struct maestro_iothread;
+
+	/**
+	 * @brief Start I/O thread
+	 *
+	 * @param fd -- file descriptor of opened COM-port, owned by thread until stop
+	 * @param slots -- ring capacity in frames, rounded up to power of 2
+	 *
+	 * @retval I/O thread or NULL if error occured
+	 */
+	struct maestro_iothread* maestro_iothread_start(int32_t fd, uint32_t slots);
+
+	/**
+	 * @brief Write all submitted frames, stop thread and free it
+	 *
+	 * @details Descriptor is not closed.
+	 *
+	 * @param iot -- I/O thread
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- some frames were not written
+	 */
+	int32_t maestro_iothread_stop(struct maestro_iothread* iot);
+
+	/**
+	 * @brief Submit encoded frame
+	 *
+	 * @details Lock-free and never blocks, safe to call from any thread.
+	 *
+	 * @param iot -- I/O thread
+	 * @param frame -- one or more encoded commands
+	 * @param len -- frame length, up to MAESTRO_IOTHREAD_FRAME_MAX
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- ring is full, MAESTRO_ERR_ARG -- frame is too long
+	 */
+	int32_t maestro_iothread_submit(struct maestro_iothread* iot, const uint8_t* frame, size_t len);
+
+	/**
+	 * @brief Submit all commands of batch as single frame and reset batch
+	 *
+	 * @param iot -- I/O thread
+	 * @param batch -- batch
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- ring is full, MAESTRO_ERR_ARG -- batch is too long
+	 */
+	int32_t maestro_iothread_submit_batch(struct maestro_iothread* iot, struct maestro_batch* batch);
+
+	/**
+	 * @brief Wait until all frames submitted so far are written
+	 *
+	 * @details Caller sleeps on condition variable, I/O thread signals it
+	 * only while somebody waits. Failed write is reported once, to the first
+	 * flush after it.
+	 *
+	 * @param iot -- I/O thread
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- write failed since previous flush, its
+	 * frames are lost, MAESTRO_ERR_STATE -- thread has stopped, frames are not written
+	 */
+	int32_t maestro_iothread_flush(struct maestro_iothread* iot);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param iot -- I/O thread
+	 * @param stats -- statistics
+	 */
+	void maestro_iothread_get_stats(struct maestro_iothread* iot, struct maestro_iothread_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_IOTHREAD_H */
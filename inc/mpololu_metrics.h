@@ -0,0 +1,109 @@
+/**
+ * @file   mpololu_metrics.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Per-handle command counters and query latency histograms.
+ *
+ * @details Every handle counts commands written through it by command byte,
+ * bytes sent and received, write errors and, for each query type, number of
+ * queries, timeouts, errors and latency histogram with power-of-two buckets.
+ *
+ * Counters are updated by thread using the handle without locks or locked
+ * instructions and may be read at any time from any thread with
+ * maestro_metrics_get(). Snapshot is not atomic as a whole, each counter is.
+ *
+ * Targets written by group (mpololu_group.h) bypass handle functions and are
+ * not counted.
+ *
+ */
+#ifndef MPOLOLU_METRICS_H
+#define MPOLOLU_METRICS_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_METRICS_BUCKETS 24  /** Latency buckets: 0 -- below 1 us, i -- [2^(i-1), 2^i) us, last one is open */
+#define MAESTRO_METRICS_OPCODES 128 /** Command counters indexed by Pololu protocol command byte (Compact byte & 0x7F) */
+
+#define MAESTRO_QUERY_GET_POSITION 0  /** maestro_get_position() */
+#define MAESTRO_QUERY_GET_POSITIONS 1 /** maestro_get_positions(), one query per call */
+#define MAESTRO_QUERY_IS_MOVING 2     /** maestro_is_moving() */
+#define MAESTRO_QUERY_GET_ERRORS 3    /** maestro_get_errors() */
+#define MAESTRO_QUERY_IS_STOPPED 4    /** maestro_is_stopped() */
+#define MAESTRO_QUERY_TYPES 5
+
+	/**
+	 * @brief Metrics of one query type
+	 */
+	struct maestro_query_metrics {
+		uint64_t count;       /** queries sent */
+		uint64_t timeouts;    /** answer incomplete when timeout expired */
+		uint64_t errors;      /** I/O errors */
+		uint64_t latency_us;  /** sum of latency of answered queries */
+		uint64_t hist[MAESTRO_METRICS_BUCKETS]; /** latency of answered queries */
+	};
+
+	/**
+	 * @brief Snapshot of handle metrics
+	 */
+	struct maestro_metrics_snapshot {
+		uint64_t commands[MAESTRO_METRICS_OPCODES]; /** commands written, by command byte */
+		uint64_t unknown;      /** writes with bytes not recognized as commands */
+		uint64_t writes;       /** write calls, queries included */
+		uint64_t write_errors; /** failed write calls */
+		uint64_t tx_bytes;     /** bytes written */
+		uint64_t rx_bytes;     /** bytes received, late and junk bytes included */
+		uint64_t short_reads;  /** reads returning part of answer */
+		uint64_t discarded;    /** late and junk bytes dropped by resync */
+		uint64_t resyncs;      /** RX stream resynchronizations */
+		struct maestro_query_metrics queries[MAESTRO_QUERY_TYPES];
+	};
+
+	struct maestro;
+
+	/**
+	 * @brief Read metrics of handle
+	 *
+	 * @details Safe to call from any thread while handle is used.
+	 *
+	 * @param m -- handle
+	 * @param snap -- snapshot
+	 */
+	void maestro_metrics_get(const struct maestro* m, struct maestro_metrics_snapshot* snap);
+
+	/**
+	 * @brief Reset metrics of handle
+	 *
+	 * @details Must be called by thread using the handle.
+	 *
+	 * @param m -- handle
+	 */
+	void maestro_metrics_reset(struct maestro* m);
+
+	/**
+	 * @brief Latency percentile of query type
+	 *
+	 * @param q -- metrics of query type
+	 * @param pct -- percentile, 0 - 100
+	 *
+	 * @retval upper bound of bucket containing percentile in us, 0 -- no answered queries
+	 */
+	uint32_t maestro_metrics_percentile(const struct maestro_query_metrics* q, uint32_t pct);
+
+	/**
+	 * @brief Names for printing
+	 *
+	 * @retval name of query type or command byte, NULL -- unknown
+	 */
+	const char* maestro_metrics_query_name(uint32_t type);
+	const char* maestro_metrics_command_name(uint8_t command);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_METRICS_H */
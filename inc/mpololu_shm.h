@@ -0,0 +1,201 @@
+/**
+ * @file   mpololu_shm.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Shared-memory target table with fixed-rate flush.
+ *
+ * @details Owner of COM-port creates named POSIX shared memory segment
+ * (shm_open() + mmap()) holding target and sequence counter of every channel.
+ * Producer processes attach to segment and store targets with plain atomic
+ * operations, no system call and no lock. Flusher picks up channels whose
+ * sequence counter changed since previous flush and sends them with minimal
+ * set target / set multiple target commands in single write().
+ *
+ * Targets published with maestro_shm_set_targets() form a pose: flush does not
+ * send part of pose, it rereads table or is postponed by one flush instead.
+ * Flush is postponed at most once for each pose, so producer which died
+ * inside pose does not slow flushes down.
+ *
+ */
+#ifndef MPOLOLU_SHM_H
+#define MPOLOLU_SHM_H
+
+#include <stdint.h>
+#include "mpololu.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_SHM_NAME "/mpololu"     /** Default segment name */
+#define MAESTRO_SHM_MAX_CHANNELS 64     /** Maximal number of channels in table */
+
+	/**
+	 * @brief Flusher statistics
+	 */
+	struct maestro_shm_stats {
+		uint64_t flushes;     /** flushes which sent something */
+		uint64_t sent;        /** channel targets sent */
+		uint64_t deferred;    /** flushes postponed because pose was being written */
+		uint64_t errors;      /** failed flushes */
+	};
+
+	/** Flusher, owns segment */
+	struct maestro_shm;
+
+	/** Mapped target table, shared by processes */
+	struct maestro_shm_table;
+
+	/**
+	 * @brief Create segment and flusher
+	 *
+	 * @details Existing segment of the same name is replaced. Segment is created
+	 * with 0660 permissions, so producers of the same group may attach.
+	 *
+	 * @param name -- segment name ("/name"), NULL -- MAESTRO_SHM_NAME
+	 * @param fd -- file descriptor of opened COM-port
+	 * @param device -- device number, MAESTRO_COMPACT -- use Compact protocol
+	 * @param channels -- number of channels, up to MAESTRO_SHM_MAX_CHANNELS
+	 *
+	 * @retval flusher or NULL if error occured
+	 */
+	struct maestro_shm* maestro_shm_create(const char* name, int32_t fd, int32_t device, uint8_t channels);
+
+	/**
+	 * @brief Stop flush thread (if started), unmap and remove segment
+	 *
+	 * @details Producers keep their mappings, but nothing reads them any more.
+	 *
+	 * @param shm -- flusher
+	 */
+	void maestro_shm_destroy(struct maestro_shm* shm);
+
+	/**
+	 * @brief Table of flusher, for producers in owner process
+	 *
+	 * @param shm -- flusher
+	 *
+	 * @retval mapped table, valid until maestro_shm_destroy()
+	 */
+	struct maestro_shm_table* maestro_shm_get_table(struct maestro_shm* shm);
+
+	/**
+	 * @brief Set limits of device
+	 *
+	 * @details With MAESTRO_CAP_SINGLE_TARGET (Micro Maestro 6) flushes send
+	 * single set target commands only. Flusher has no limits after create.
+	 *
+	 * @param shm -- flusher
+	 * @param caps -- MAESTRO_CAP_* flags
+	 */
+	void maestro_shm_set_caps(struct maestro_shm* shm, uint32_t caps);
+
+	/**
+	 * @brief Send targets of channels changed since previous flush
+	 *
+	 * @details All changed channels are sent with single write(). Failed channels
+	 * are retried on next flush.
+	 *
+	 * @param shm -- flusher
+	 *
+	 * @retval number of sent channels, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_shm_flush(struct maestro_shm* shm);
+
+	/**
+	 * @brief Start thread calling maestro_shm_flush() at fixed rate
+	 *
+	 * @param shm -- flusher
+	 * @param rate_hz -- flush rate
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_shm_start(struct maestro_shm* shm, uint32_t rate_hz);
+
+	/**
+	 * @brief Stop flush thread, pending targets are flushed
+	 *
+	 * @param shm -- flusher
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_* -- failed
+	 */
+	int32_t maestro_shm_stop(struct maestro_shm* shm);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param shm -- flusher
+	 * @param stats -- statistics
+	 */
+	void maestro_shm_get_stats(struct maestro_shm* shm, struct maestro_shm_stats* stats);
+
+	/**
+	 * @brief Attach to segment created by owner process
+	 *
+	 * @param name -- segment name, NULL -- MAESTRO_SHM_NAME
+	 *
+	 * @retval mapped table or NULL if error occured (MAESTRO_ERR_IO -- no segment,
+	 * MAESTRO_ERR_PROTOCOL -- segment of other library version)
+	 */
+	struct maestro_shm_table* maestro_shm_attach(const char* name);
+
+	/**
+	 * @brief Unmap table attached with maestro_shm_attach()
+	 *
+	 * @param table -- mapped table
+	 */
+	void maestro_shm_detach(struct maestro_shm_table* table);
+
+	/**
+	 * @brief Number of channels in table
+	 *
+	 * @param table -- mapped table
+	 *
+	 * @retval number of channels
+	 */
+	uint8_t maestro_shm_channels(const struct maestro_shm_table* table);
+
+	/**
+	 * @brief Publish target of channel
+	 *
+	 * @details Lock-free and without system calls, safe for many producers.
+	 *
+	 * @param table -- mapped table
+	 * @param channel -- device channel number
+	 * @param target -- absolute angle of rotation in 0.25 us units
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_shm_set_target(struct maestro_shm_table* table, uint8_t channel, uint16_t target);
+
+	/**
+	 * @brief Publish pose of channels range
+	 *
+	 * @details Flush sends either none or all targets of pose.
+	 *
+	 * @param table -- mapped table
+	 * @param first_channel -- number of first channel
+	 * @param channels_num -- number of channels
+	 * @param targets_p -- pointer to array of channels_num targets
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_ARG -- bad channels range
+	 */
+	int32_t maestro_shm_set_targets(struct maestro_shm_table* table, uint8_t first_channel, uint8_t channels_num,
+	                                const uint16_t* targets_p);
+
+	/**
+	 * @brief Last published target of channel
+	 *
+	 * @param table -- mapped table
+	 * @param channel -- device channel number
+	 *
+	 * @retval target, MAESTRO_ERR_STATE -- never published, MAESTRO_ERR_ARG -- bad channel
+	 */
+	int32_t maestro_shm_get_target(const struct maestro_shm_table* table, uint8_t channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_SHM_H */
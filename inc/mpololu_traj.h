@@ -0,0 +1,143 @@
+/**
+ * @file   mpololu_traj.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Real-time trajectory streaming engine.
+ *
+ * @details Caller queues timestamped multi-channel waypoints, engine thread
+ * sleeps until absolute CLOCK_MONOTONIC deadline of each waypoint and sends it
+ * with maestro_set_multiple_target(). Engine thread may run with SCHED_FIFO
+ * policy and be pinned to CPU. Lateness of every frame is recorded in histogram.
+ *
+ * For best results lock process memory with mlockall() before start.
+ *
+ */
+#ifndef MPOLOLU_TRAJ_H
+#define MPOLOLU_TRAJ_H
+
+#include <stdint.h>
+#include "mpololu_handle.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAESTRO_TRAJ_MAX_CHANNELS 24 /** Maximal number of channels of single waypoint */
+#define MAESTRO_TRAJ_HIST_BUCKETS 20 /** Lateness histogram buckets */
+
+	/**
+	 * @brief Engine configuration
+	 */
+	struct maestro_traj_config {
+		int32_t priority;      /** SCHED_FIFO priority, 0 -- default scheduling, default 0 */
+		int32_t cpu;           /** CPU to pin engine thread to, -1 -- any, default -1 */
+		uint32_t capacity;     /** queue capacity in waypoints, rounded up to power of 2, default 256 */
+		uint32_t skip_late_us; /** frame late more than this is skipped when next one is due too,
+		                           0 -- never skip, default 0 */
+	};
+
+	/**
+	 * @brief Waypoint
+	 */
+	struct maestro_waypoint {
+		uint64_t t_ns;          /** time since engine start */
+		uint8_t first_channel;
+		uint8_t channels_num;   /** up to MAESTRO_TRAJ_MAX_CHANNELS */
+		uint16_t targets[MAESTRO_TRAJ_MAX_CHANNELS]; /** 0.25 us units */
+	};
+
+	/**
+	 * @brief Engine statistics
+	 *
+	 * @details Bucket 0 of histogram counts frames late less than 1 us,
+	 * bucket i -- late [2^(i-1), 2^i) us, last bucket -- everything later.
+	 */
+	struct maestro_traj_stats {
+		uint64_t frames;       /** sent frames */
+		uint64_t skipped;      /** frames skipped as too late */
+		uint64_t errors;       /** failed writes */
+		uint64_t late_max_ns;  /** maximal lateness of wakeup */
+		uint64_t late_sum_ns;  /** sum of lateness, for average */
+		uint64_t write_max_ns; /** maximal duration of frame write */
+		uint64_t hist[MAESTRO_TRAJ_HIST_BUCKETS];
+	};
+
+	struct maestro_traj;
+
+	/**
+	 * @brief Fill configuration with default values
+	 *
+	 * @param cfg -- configuration
+	 */
+	void maestro_traj_config_default(struct maestro_traj_config* cfg);
+
+	/**
+	 * @brief Create engine
+	 *
+	 * @details Handle must not be used by caller while engine is running.
+	 *
+	 * @param m -- controller handle
+	 * @param cfg -- configuration, if NULL -- default configuration
+	 *
+	 * @retval engine or NULL if error occured
+	 */
+	struct maestro_traj* maestro_traj_create(struct maestro* m, const struct maestro_traj_config* cfg);
+
+	/**
+	 * @brief Stop engine (if started) and free it
+	 *
+	 * @param tr -- engine
+	 */
+	void maestro_traj_destroy(struct maestro_traj* tr);
+
+	/**
+	 * @brief Queue waypoint
+	 *
+	 * @details Lock-free, may be called from one thread at a time while engine
+	 * is running. Waypoints must be queued in time order.
+	 *
+	 * @param tr -- engine
+	 * @param wp -- waypoint
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_FULL -- queue is full, MAESTRO_ERR_ARG -- bad waypoint
+	 */
+	int32_t maestro_traj_push(struct maestro_traj* tr, const struct maestro_waypoint* wp);
+
+	/**
+	 * @brief Start engine thread
+	 *
+	 * @param tr -- engine
+	 * @param start_ns -- CLOCK_MONOTONIC time of waypoint time 0, 0 -- now
+	 *
+	 * @retval 0 -- success, MAESTRO_ERR_IO -- failed (e.g. EPERM, no permission for SCHED_FIFO)
+	 */
+	int32_t maestro_traj_start(struct maestro_traj* tr, uint64_t start_ns);
+
+	/**
+	 * @brief Wait until all queued waypoints are sent
+	 *
+	 * @param tr -- engine
+	 */
+	void maestro_traj_wait(struct maestro_traj* tr);
+
+	/**
+	 * @brief Stop engine thread, queued waypoints are dropped
+	 *
+	 * @param tr -- engine
+	 */
+	void maestro_traj_stop(struct maestro_traj* tr);
+
+	/**
+	 * @brief Get statistics
+	 *
+	 * @param tr -- engine
+	 * @param stats -- statistics
+	 */
+	void maestro_traj_get_stats(struct maestro_traj* tr, struct maestro_traj_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPOLOLU_TRAJ_H */
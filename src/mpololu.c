@@ -6,75 +6,196 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
-#include <stdio.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 #include <termios.h>
-#include <stdio.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <string.h>
+#include <errno.h>
 #include "mpololu.h"
+#include "mpololu_priv.h"
+
+
+/** Baud rates which have termios speed constant */
+static const struct {
+	uint32_t baud;
+	speed_t speed;
+} link_speeds[] = {
+	{1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600},
+	{19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200},
+	{230400, B230400},
+#ifdef B460800
+	{460800, B460800},
+#endif
+#ifdef B500000
+	{500000, B500000},
+#endif
+#ifdef B921600
+	{921600, B921600},
+#endif
+#ifdef B1000000
+	{1000000, B1000000},
+#endif
+};
+
+static int32_t link_speed(uint32_t baud, speed_t* speed)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(link_speeds) / sizeof(link_speeds[0]); i++) {
+		if (link_speeds[i].baud == baud) {
+			*speed = link_speeds[i].speed;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint32_t link_baud(speed_t speed)
+{
+	size_t i;
 
+	for (i = 0; i < sizeof(link_speeds) / sizeof(link_speeds[0]); i++) {
+		if (link_speeds[i].speed == speed)
+			return link_speeds[i].baud;
+	}
+	return 0;
+}
 
-#define ANSWER_GET_POSITION_SIZE 0x02
-#define ANSWER_GET_ERRORS_SIZE 0x02
-#define ANSWER_IS_MOVING_SIZE 0x01
-#define ANSWER_IS_STOPPED_SIZE 0x01
+/**
+ * @brief Request low latency mode from serial driver
+ */
+static int32_t link_low_latency(int32_t fd)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ser;
 
-#define POLOLU_PROTO_ON 0xAA
-#define MINISSC_PROTO_ON 0xFF
+	if (ioctl(fd, TIOCGSERIAL, &ser) < 0)
+		return -1;
 
-#define COMPACT_SET_TARGET 0x84
-#define POLOLU_SET_TARGET 0x04
+	ser.flags |= ASYNC_LOW_LATENCY;
 
-#define COMPACT_SET_MULTARGET 0x9F
-#define POLOLU_SET_MULTARGET 0x1F
+	if (ioctl(fd, TIOCSSERIAL, &ser) < 0)
+		return -1;
 
-#define COMPACT_SET_SPEED 0x87
-#define POLOLU_SET_SPEED 0x07
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-#define COMPACT_SET_ACCELERATION 0x89
-#define POLOLU_SET_ACCELERATION 0x09
+/**
+ * @brief Fill link profile with default values
+ */
+void maestro_link_profile_default(struct maestro_link_profile* profile)
+{
+	profile->baud = 0;
+	profile->raw = 1;
+	profile->vmin = 1;
+	profile->vtime = 0;
+	profile->low_latency = 1;
+	profile->flush = 1;
+}
 
-#define COMPACT_SET_PWM 0x8A
-#define POLOLU_SET_PWM 0x0A
+/**
+ * @brief Configure opened serial interface
+ */
+int32_t maestro_link_configure(int32_t fd, const struct maestro_link_profile* profile, struct maestro_link_report* report)
+{
+	struct maestro_link_profile def;
+	struct maestro_link_report rep;
+	struct termios options;
+	speed_t speed;
+
+	if (profile == NULL) {
+		maestro_link_profile_default(&def);
+		profile = &def;
+	}
 
-#define COMPACT_GET_POSITION 0x90
-#define POLOLU_GET_POSITION 0x10
+	memset(&rep, 0, sizeof(rep));
 
-#define COMPACT_GET_POSITION 0x90
-#define POLOLU_GET_POSITION 0x10
+	if (tcgetattr(fd, &options) < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "tcgetattr");
 
-#define COMPACT_GET_MOVING_STATE 0x93
-#define POLOLU_GET_MOVING_STATE 0x13
+	if (profile->raw) {
+		cfmakeraw(&options);
+		options.c_cflag &= ~(CSTOPB | CRTSCTS);
+		options.c_cflag |= CLOCAL | CREAD;
+		options.c_iflag &= ~(IXON | IXOFF | IXANY);
+		rep.applied |= MAESTRO_LINK_RAW;
+	} else {
+		options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		options.c_oflag &= ~(ONLCR | OCRNL);
+	}
 
-#define COMPACT_GET_ERRORS 0xA1
-#define POLOLU_GET_ERRORS 0x21
+	if (profile->baud) {
+		if (link_speed(profile->baud, &speed) < 0)
+			return maestro_fail(MAESTRO_ERR_ARG, "unsupported baud rate");
+		cfsetispeed(&options, speed);
+		cfsetospeed(&options, speed);
+		rep.applied |= MAESTRO_LINK_BAUD;
+	}
 
-#define COMPACT_GO_HOME 0xA2
-#define POLOLU_GO_HOME 0x22
+	options.c_cc[VMIN] = profile->vmin;
+	options.c_cc[VTIME] = profile->vtime;
+	rep.applied |= MAESTRO_LINK_VMIN_VTIME;
 
-#define COMPACT_STOP_SCRIPT 0xA4
-#define POLOLU_STOP_SCRIPT 0x24
+	if (tcsetattr(fd, TCSANOW, &options) < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "tcsetattr");
 
-#define COMPACT_RESTART_SCRIPT 0xA7
-#define POLOLU_RESTART_SCRIPT 0x27
+	if (profile->low_latency) {
+		if (link_low_latency(fd) == 0)
+			rep.applied |= MAESTRO_LINK_LOW_LATENCY;
+		else
+			rep.failed |= MAESTRO_LINK_LOW_LATENCY;
+	}
 
-#define COMPACT_RESTART_SCRIPT_PAR 0xA8
-#define POLOLU_RESTART_SCRIPT_PAR 0x28
+	if (profile->flush) {
+		if (tcflush(fd, TCIFLUSH) == 0)
+			rep.applied |= MAESTRO_LINK_FLUSH;
+		else
+			rep.failed |= MAESTRO_LINK_FLUSH;
+	}
 
-#define COMPACT_GET_SCRIPT_STATUS 0xAE
-#define POLOLU_GET_SCRIPT_STATUS 0x2E
+	/** Read back, driver may silently ignore some settings */
+	if (tcgetattr(fd, &options) == 0)
+		rep.baud = link_baud(cfgetospeed(&options));
 
+	if (report)
+		*report = rep;
 
+	return 0;
+}
 
-static void dump_cmd(uint8_t* cmd, int32_t len)
+/**
+ * @brief Open serial interface with link profile
+ */
+int32_t maestro_open_link(const char* device, const struct maestro_link_profile* profile, struct maestro_link_report* report)
 {
-	int i = 0;
-	printf("write command: \n");
-	for (i = 0; i < len; i++) {
-		printf("\t0x%X\n",cmd[i]);
+	int32_t res;
+	int fd;
+
+	if (device == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "no device name presented");
+
+	fd = open(device, O_RDWR | O_NOCTTY);
+
+	if (fd < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "open device");
+
+	res = maestro_link_configure(fd, profile, report);
+	if (res < 0) {
+		close(fd);
+		return res;
 	}
+
+	return fd;
 }
 
 /**
@@ -83,40 +204,162 @@ static void dump_cmd(uint8_t* cmd, int32_t len)
  */
 int32_t maestro_open(const char* device)
 {
-	struct termios options;	
-	int fd;
-	
-	if (device == NULL) {
-		fprintf(stderr, "No device name presented\n");
-		return -1;
+	return maestro_open_link(device, NULL, NULL);
+}
+
+
+/**
+ * @brief Close serial interface
+ */
+int32_t maestro_close(int32_t fd)
+{
+	if (close(fd))
+		return maestro_fail(MAESTRO_ERR_IO, "close");
+	return 0;
+}
+
+
+/** Command encoders */
+
+static size_t maestro_enc_header(uint8_t* cmd, int32_t device, uint8_t op)
+{
+	if (device < 0) {
+		cmd[0] = op;
+		return 1;
 	}
 
-	fd = open(device, O_RDWR | O_NOCTTY);
-	
-	if (fd == -1) {
-		perror(device);
-		return -1;
+	cmd[0] = POLOLU_PROTO_ON;
+	cmd[1] = (uint8_t) device;
+	cmd[2] = op & 0x7F;
+	return 3;
+}
+
+size_t maestro_enc_set_target(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t target)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_SET_TARGET);
+
+	cmd[len++] = channel;
+	cmd[len++] = target & 0x7F;
+	cmd[len++] = (target >> 7) & 0x7F;
+
+	return len;
+}
+
+size_t maestro_enc_minissc_set_target(uint8_t* cmd, uint8_t channel, uint8_t target)
+{
+	cmd[0] = MINISSC_PROTO_ON;
+	cmd[1] = channel;
+	cmd[2] = target;
+
+	return CMD_MINISSC_SIZE;
+}
+
+size_t maestro_enc_set_multiple_target(uint8_t* cmd, int32_t device, uint8_t targets_num, uint8_t first_channel, const uint16_t* targets_p)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_SET_MULTARGET);
+	int i;
+
+	cmd[len++] = targets_num;
+	cmd[len++] = first_channel;
+
+	for (i = 0; i < targets_num; i++) {
+		cmd[len++] = targets_p[i] & 0x7F;
+		cmd[len++] = (targets_p[i] >> 7) & 0x7F;
 	}
 
-	tcgetattr(fd, &options);
-	options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	options.c_oflag &= ~(ONLCR | OCRNL);
+	return len;
+}
+
+size_t maestro_enc_set_speed(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t speed)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_SET_SPEED);
+
+	cmd[len++] = channel;
+	cmd[len++] = speed & 0x7F;
+	cmd[len++] = (speed >> 7) & 0x7F;
 
-	tcsetattr(fd, TCSANOW, &options);
-	   
-	return fd;
+	return len;
+}
+
+size_t maestro_enc_set_acceleration(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t acceleration)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_SET_ACCELERATION);
+
+	cmd[len++] = channel;
+	cmd[len++] = acceleration & 0x7F;
+	cmd[len++] = (acceleration >> 7) & 0x7F;
+
+	return len;
+}
+
+size_t maestro_enc_set_pwm(uint8_t* cmd, int32_t device, uint16_t on_time, uint16_t period)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_SET_PWM);
+
+	cmd[len++] = on_time & 0x7F;
+	cmd[len++] = (on_time >> 7) & 0x7F;
+	cmd[len++] = period & 0x7F;
+	cmd[len++] = (period >> 7) & 0x7F;
+
+	return len;
+}
+
+size_t maestro_enc_get_position(uint8_t* cmd, int32_t device, uint8_t channel)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_GET_POSITION);
+
+	cmd[len++] = channel;
+
+	return len;
+}
+
+size_t maestro_enc_simple(uint8_t* cmd, int32_t device, uint8_t op)
+{
+	return maestro_enc_header(cmd, device, op);
+}
+
+size_t maestro_enc_restart_script(uint8_t* cmd, int32_t device, uint8_t subroutine_number)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_RESTART_SCRIPT);
+
+	cmd[len++] = subroutine_number;
+
+	return len;
+}
+
+size_t maestro_enc_restart_script_par(uint8_t* cmd, int32_t device, uint8_t subroutine_number, uint16_t parameter)
+{
+	size_t len = maestro_enc_header(cmd, device, COMPACT_RESTART_SCRIPT_PAR);
+
+	cmd[len++] = subroutine_number;
+	cmd[len++] = parameter & 0x7F;
+	cmd[len++] = (parameter >> 7) & 0x7F;
+
+	return len;
 }
 
 
 /**
- * @brief Close serial interface
+ *  @brief Write whole command
  */
-int32_t maestro_close(int32_t fd)
+int32_t maestro_write_cmd(int32_t fd, const uint8_t* cmd, size_t len)
 {
-	if (close(fd)) {
-		perror("error closing");
-		return -1;
+	size_t done = 0;
+	ssize_t wr;
+
+	/** Half of frame left on the line would garble next command, so rest is sent too */
+	while (done < len) {
+		wr = write(fd, &cmd[done], len - done);
+		maestro_capture(fd, MAESTRO_CAPTURE_TX, &cmd[done], wr);
+
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return maestro_fail(MAESTRO_ERR_IO, "write");
+		}
+		done += wr;
 	}
+
 	return 0;
 }
 
@@ -126,43 +369,21 @@ int32_t maestro_close(int32_t fd)
  */
 int32_t maestro_pololu_set_target(int32_t fd, uint8_t device, uint8_t channel, uint16_t target)
 {
-	uint8_t command[6];
-	int wr = 0;
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_SET_TARGET;
-	command[3] = channel;
-	command[4] = target & 0x7F;
-	command[5] = (target >> 7) & 0x7F;	
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	uint8_t command[CMD_SIZE(0, CMD_SET_TARGET_SIZE)];
+	size_t len = maestro_enc_set_target(command, device, channel, target);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
  * @brief Maestro set target (Compact protocol)
  */
 int32_t maestro_compact_set_target(int32_t fd, uint8_t channel, uint16_t target)
-{  
-	uint8_t command[4];
-	int wr = 0;
-			
-	command[0] = COMPACT_SET_TARGET;
-	command[1] = channel;
-	command[2] = target & 0x7F;
-	command[3] = (target >> 7) & 0x7F;   		
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+{
+	uint8_t command[CMD_SET_TARGET_SIZE];
+	size_t len = maestro_enc_set_target(command, MAESTRO_COMPACT, channel, target);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 
@@ -171,19 +392,10 @@ int32_t maestro_compact_set_target(int32_t fd, uint8_t channel, uint16_t target)
  */
 int32_t maestro_minissc_set_target(int32_t fd, uint8_t channel, uint8_t target)
 {
-	uint8_t command[3];
-	int wr = 0;
-	
-	command[0] = MINISSC_PROTO_ON;
-	command[1] = channel;
-	command[2] = target;	
+	uint8_t command[CMD_MINISSC_SIZE];
+	size_t len = maestro_enc_minissc_set_target(command, channel, target);
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -191,36 +403,15 @@ int32_t maestro_minissc_set_target(int32_t fd, uint8_t channel, uint8_t target)
  */
 int32_t maestro_pololu_set_multiple_target(int32_t fd, uint8_t device, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p)
 {
-	uint8_t *command;	
-	int wr = 0;
-	int i;
+	uint8_t command[CMD_MAX_SIZE];
+	size_t len;
 
-	size_t cmd_sz = 5 /* command header*/ + 2 * targets_num;
-	
-	if ((targets_p == NULL) & (targets_num != 0)) {
-		fprintf(stderr, "NULL pointer\n");
-		return -1;
-	}
+	if ((targets_p == NULL) & (targets_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
 
-	command = (uint8_t*) calloc(cmd_sz, sizeof(uint8_t));
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_SET_MULTARGET;
-	command[3] = targets_num;
-	command[4] = first_channel;
-	
-	for (i = 0; i < targets_num; i++) {
-		command[5 + 2 * i] = targets_p[i] & 0x7F;
-		command[6 + 2 * i] = (targets_p[i] >> 7) & 0x7F;
-	}
-	
+	len = maestro_enc_set_multiple_target(command, device, targets_num, first_channel, targets_p);
 
-	if ((wr = write(fd, command, cmd_sz)) != cmd_sz) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -228,35 +419,15 @@ int32_t maestro_pololu_set_multiple_target(int32_t fd, uint8_t device, uint8_t t
  */
 int32_t maestro_compact_set_multiple_target(int32_t fd, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p)
 {
-	uint8_t *command;	
-	int wr = 0;
-	int i;
-
-	size_t cmd_sz = 3 /* command header*/ + 2 * targets_num;
-	
-	if ((targets_p == NULL) & (targets_num != 0)) {
-		fprintf(stderr, "NULL pointer\n");
-		return -1;
-	}
+	uint8_t command[CMD_MAX_SIZE];
+	size_t len;
 
-	command = (uint8_t*) calloc(cmd_sz, sizeof(uint8_t));
-	
-	command[0] = COMPACT_SET_MULTARGET;
-	command[1] = targets_num;
-	command[2] = first_channel;
+	if ((targets_p == NULL) & (targets_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
 
-	for (i = 0; i < targets_num; i++) {
-		command[3 + 2 * i] = targets_p[i] & 0x7F;
-		command[4 + 2 * i] = (targets_p[i] >> 7) & 0x7F;
-	}
-	
+	len = maestro_enc_set_multiple_target(command, MAESTRO_COMPACT, targets_num, first_channel, targets_p);
 
-	if ((wr = write(fd, command, cmd_sz)) != cmd_sz) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, len);
 }
 
 
@@ -265,43 +436,21 @@ int32_t maestro_compact_set_multiple_target(int32_t fd, uint8_t targets_num, uin
  */
 int32_t maestro_pololu_set_speed(int32_t fd, uint8_t device, uint8_t channel, uint16_t speed)
 {
-	uint8_t command[6];
-	int wr = 0;
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_SET_SPEED;
-	command[3] = channel;
-	command[4] = speed & 0x7F;
-	command[5] = (speed >> 7) & 0x7F;   
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	uint8_t command[CMD_SIZE(0, CMD_SET_SPEED_SIZE)];
+	size_t len = maestro_enc_set_speed(command, device, channel, speed);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
  *  @brief Set speed (Compact protocol)
  */
 int32_t maestro_compact_set_speed(int32_t fd, uint8_t channel, uint16_t speed)
-{	
-	uint8_t command[4];
-	int wr = 0;
-	
-	command[0] = COMPACT_SET_SPEED;
-	command[1] = channel;
-	command[2] = speed & 0x7F;
-	command[3] = (speed >> 7) & 0x7F;	
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+{
+	uint8_t command[CMD_SET_SPEED_SIZE];
+	size_t len = maestro_enc_set_speed(command, MAESTRO_COMPACT, channel, speed);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -309,22 +458,10 @@ int32_t maestro_compact_set_speed(int32_t fd, uint8_t channel, uint16_t speed)
  */
 int32_t maestro_pololu_set_acceleration(int32_t fd, uint8_t device, uint8_t channel, uint16_t acceleration)
 {
-	uint8_t command[6];
-	int wr = 0;
-		
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_SET_ACCELERATION;
-	command[3] = channel;
-	command[4] = acceleration & 0x7F;
-	command[5] = (acceleration >> 7) & 0x7F;   
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	uint8_t command[CMD_SIZE(0, CMD_SET_ACCELERATION_SIZE)];
+	size_t len = maestro_enc_set_acceleration(command, device, channel, acceleration);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -332,20 +469,10 @@ int32_t maestro_pololu_set_acceleration(int32_t fd, uint8_t device, uint8_t chan
  */
 int32_t maestro_compact_set_acceleration(int32_t fd, uint8_t channel, uint16_t acceleration)
 {
-	uint8_t command[4];
-	int wr = 0;
-	
-	command[0] = COMPACT_SET_ACCELERATION;
-	command[1] = channel;
-	command[2] = acceleration & 0x7F;
-	command[3] = (acceleration >> 7) & 0x7F;
+	uint8_t command[CMD_SET_ACCELERATION_SIZE];
+	size_t len = maestro_enc_set_acceleration(command, MAESTRO_COMPACT, channel, acceleration);
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -353,23 +480,10 @@ int32_t maestro_compact_set_acceleration(int32_t fd, uint8_t channel, uint16_t a
  */
 int32_t maestro_pololu_set_pwm(int32_t fd, uint8_t device, uint16_t on_time, uint16_t period)
 {
-	uint8_t command[7];
-	int wr = 0;
-		
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_SET_PWM;
-	command[3] = on_time & 0x7F;
-	command[4] = (on_time >> 7) & 0x7F;
-	command[5] = period & 0x7F;
-	command[6] = (period >> 7) & 0x7F;   
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	uint8_t command[CMD_SIZE(0, CMD_SET_PWM_SIZE)];
+	size_t len = maestro_enc_set_pwm(command, device, on_time, period);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -377,165 +491,350 @@ int32_t maestro_pololu_set_pwm(int32_t fd, uint8_t device, uint16_t on_time, uin
  */
 int32_t maestro_compact_set_pwm(int32_t fd, uint16_t on_time, uint16_t period)
 {
-	uint8_t command[5];	
-	int wr = 0;
-	
-	command[0] = COMPACT_SET_PWM;
-	command[1] = on_time & 0x7F;
-	command[2] = (on_time >> 7) & 0x7F;
-	command[3] = period & 0x7F;
-	command[4] = (period >> 7) & 0x7F;
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	uint8_t command[CMD_SET_PWM_SIZE];
+	size_t len = maestro_enc_set_pwm(command, MAESTRO_COMPACT, on_time, period);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 
-static int32_t maestro_get_small_answer(int32_t fd, 
-                                        uint8_t* cmd, 
-                                        size_t len, 
-                                        struct timeval* timeout,
-                                        size_t ans_len) 
+/**
+ * @brief Wait for descriptor readiness until deadline
+ *
+ * @details ppoll() has no FD_SETSIZE limit and remaining time is recomputed
+ * from monotonic deadline after each interruption.
+ *
+ * @retval 1 -- ready, 0 -- deadline passed, MAESTRO_ERR_IO -- error
+ */
+int32_t maestro_wait_fd(int32_t fd, short events, uint64_t deadline)
 {
-	fd_set set;
-	int wr = 0;
-	int rd = 0;   
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t now, left;
 	int rv;
-	int32_t res = 0;
-	int i = 0;
-	uint8_t* answer = (uint8_t*) calloc(1, ans_len);
-	
-	if (!answer) {
-		perror("calloc()");
-		return -1;
+
+	while (1) {
+		if (deadline) {
+			now = maestro_now_ns();
+			left = (deadline > now) ? deadline - now : 0;
+			ts.tv_sec = left / 1000000000ull;
+			ts.tv_nsec = left % 1000000000ull;
+		}
+
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+
+		rv = ppoll(&pfd, 1, deadline ? &ts : NULL, NULL);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return maestro_fail(MAESTRO_ERR_IO, "ppoll");
+		}
+
+		return rv ? 1 : 0;
 	}
+}
 
-	if (ans_len > sizeof (int32_t)) {
-		fprintf(stderr, "ans_len > sizeof int32_t\n"); 
-		free(answer);
-		return -1;
+/**
+ * @brief Drop late bytes of timed-out answers and flush input
+ */
+static void framer_resync(int32_t fd, struct maestro_framer* fr, uint32_t quiet_us)
+{
+	uint8_t junk[64];
+	ssize_t rd;
+
+	fr->discarded += fr->len;
+	fr->len = 0;
+
+	if (quiet_us < 2 * fr->wait_us)
+		quiet_us = 2 * fr->wait_us;
+	if (quiet_us > MAESTRO_QUIET_MAX_US)
+		quiet_us = MAESTRO_QUIET_MAX_US;
+
+	/** Until all late bytes came or line is quiet */
+	while (maestro_wait_fd(fd, POLLIN, maestro_now_ns() + (uint64_t) quiet_us * 1000ull) > 0) {
+		rd = read(fd, junk, sizeof(junk));
+		maestro_capture(fd, MAESTRO_CAPTURE_RX, junk, rd);
+		if ((rd < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+			continue;
+		if (rd <= 0)
+			break;
+
+		fr->rx_bytes += rd;
+		fr->discarded += rd;
+		if (fr->stale) {
+			fr->stale = ((size_t) rd < fr->stale) ? fr->stale - rd : 0;
+			if (!fr->stale)
+				break;
+		}
 	}
 
-	if ((wr = write(fd, cmd, len)) != len) {
-		perror("error writing");
-		free(answer);
-		return -1;
+	tcflush(fd, TCIFLUSH);
+	fr->stale = 0;
+	fr->resync = 0;
+	fr->wait_us = 0;
+	fr->resyncs++;
+}
+
+/**
+ * @brief Send query and receive answer through framer
+ *
+ * @details Partial reads are accumulated until answer is complete or
+ * deadline passes. Incomplete answer is recorded as MAESTRO_ERR_TIMEOUT or
+ * MAESTRO_ERR_SHORT_READ last error.
+ *
+ * @retval number of answer bytes received, MAESTRO_ERR_* -- I/O error or
+ * bytes following answer (stream is misaligned)
+ */
+int32_t maestro_framer_query(int32_t fd, struct maestro_framer* fr, const uint8_t* cmd, size_t len,
+                             uint8_t* answer, size_t ans_len, uint64_t deadline, uint32_t quiet_us)
+{
+	struct maestro_framer tmp;
+	uint64_t start;
+	size_t done = 0;
+	int32_t err = 0;
+	ssize_t rd;
+	int rv;
+
+	if (fr == NULL) {
+		fr = &tmp;
+		memset(fr, 0, sizeof(*fr));
+	}
+
+	if (fr->resync)
+		framer_resync(fd, fr, quiet_us);
+
+	/** Nothing is sent, so no late answer to absorb */
+	if (deadline && (maestro_now_ns() >= deadline)) {
+		maestro_fail(MAESTRO_ERR_TIMEOUT, "deadline expired before query");
+		return 0;
 	}
-	
-	FD_ZERO(&set); 
-	FD_SET(fd, &set); 
-	
-	rv = select(fd + 1, &set, NULL, NULL, timeout);
-	
-	if (rv == -1)
-		perror("select"); /* an error accured */
-	else if (rv == 0)
-		fprintf(stderr, "timeout get_postion()\n"); /* a timeout occured */
-	else {
-		if ((rd = read(fd, answer, ans_len)) != ans_len) {
-			fprintf(stderr, "incorrect answer size %d\n", rd);
-		} 				
-		
-		for (i = 0; i < ans_len; i++) {
-			res += answer[i] << (8 * i);
+
+	err = maestro_write_cmd(fd, cmd, len);
+	if (err)
+		return err;
+
+	start = maestro_now_ns();
+
+	while (done < ans_len) {
+		if (fr->len) {
+			size_t n = (fr->len < ans_len - done) ? fr->len : ans_len - done;
+
+			memcpy(&answer[done], fr->buf, n);
+			memmove(fr->buf, fr->buf + n, fr->len - n);
+			fr->len -= n;
+			done += n;
+			continue;
 		}
-	
-		free(answer);
-		return res;
+
+		rv = maestro_wait_fd(fd, POLLIN, deadline);
+
+		if (rv <= 0) {
+			err = rv;
+			break;
+		}
+
+		rd = read(fd, fr->buf, sizeof(fr->buf));
+		maestro_capture(fd, MAESTRO_CAPTURE_RX, fr->buf, rd);
+
+		if (rd <= 0) {
+			if ((rd < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+				continue;
+			err = maestro_fail(MAESTRO_ERR_IO, "read");
+			break;
+		}
+
+		fr->rx_bytes += rd;
+		if ((size_t) rd < ans_len - done)
+			fr->short_reads++;
+		fr->len = rd;
+	}
+
+	if (done < ans_len) {
+		fr->timeouts++;
+		fr->stale += ans_len - done;
+		fr->resync = 1;
+		fr->wait_us = (uint32_t)((maestro_now_ns() - start) / 1000);
+		if (!err)
+			maestro_fail(done ? MAESTRO_ERR_SHORT_READ : MAESTRO_ERR_TIMEOUT, "answer");
+	} else if (fr->len) {
+		/** Device never sends unsolicited bytes -- stream is misaligned */
+		fr->resync = 1;
+		err = maestro_fail(MAESTRO_ERR_PROTOCOL, "bytes after answer");
 	}
-	
-	free(answer);
-	return -1;
-}
 
+	if ((fr == &tmp) && fr->resync)
+		tcflush(fd, TCIFLUSH);
 
+	return err ? err : (int32_t) done;
+}
 
 /**
- *  @brief Get position (Pololu protocol)
+ * @brief Send query and decode answer of up to 4 bytes
  */
-int32_t maestro_pololu_get_position(int32_t fd, uint8_t device, uint8_t channel, struct timeval* timeout)
+int32_t maestro_get_small_answer(int32_t fd, struct maestro_framer* fr, const uint8_t* cmd, size_t len,
+                                 uint64_t deadline, size_t ans_len, uint32_t quiet_us)
 {
+	uint8_t answer[sizeof (int32_t)];
 	int32_t res = 0;
-	uint8_t command[4];
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_GET_POSITION;
-	command[3] = channel;
+	int32_t done;
+	size_t i;
 
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_GET_POSITION_SIZE);
+	if (ans_len > sizeof (int32_t))
+		return maestro_fail(MAESTRO_ERR_ARG, "ans_len > sizeof int32_t");
+
+	done = maestro_framer_query(fd, fr, cmd, len, answer, ans_len, deadline, quiet_us);
+	if (done < 0)
+		return done;
+	if (done != (int32_t) ans_len)
+		return done ? MAESTRO_ERR_SHORT_READ : MAESTRO_ERR_TIMEOUT;
+
+	for (i = 0; i < ans_len; i++) {
+		res += answer[i] << (8 * i);
+	}
 
 	return res;
 }
 
 
 /**
- *  @brief Get position (Compact protocol)
+ *  @brief Get position (Pololu protocol)
  */
-int32_t maestro_compact_get_position(int32_t fd, uint8_t channel, struct timeval* timeout)
+int32_t maestro_pololu_get_position(int32_t fd, uint8_t device, uint8_t channel, struct timeval* timeout)
 {
-	int32_t res = 0;
-	uint8_t command[2];
+	uint8_t command[CMD_SIZE(0, CMD_GET_POSITION_SIZE)];
+	size_t len = maestro_enc_get_position(command, device, channel);
 
-	command[0] = COMPACT_GET_POSITION;
-	command[1] = channel;
-
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_GET_POSITION_SIZE);
-	
-	return res;
+	return maestro_get_small_answer(fd, NULL, command, len, maestro_deadline(timeout), ANSWER_GET_POSITION_SIZE, 0);
 }
 
 
 /**
- *  @brief Get moving state (Pololu protocol)
+ *  @brief Get position (Compact protocol)
  */
-int32_t maestro_pololu_is_moving(int32_t fd, uint8_t device, struct timeval* timeout)
+int32_t maestro_compact_get_position(int32_t fd, uint8_t channel, struct timeval* timeout)
 {
-	int32_t res = 0;
-	uint8_t command[3]; 
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_GET_MOVING_STATE;
-
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_IS_MOVING_SIZE);
-	
-	return res;
+	uint8_t command[CMD_GET_POSITION_SIZE];
+	size_t len = maestro_enc_get_position(command, MAESTRO_COMPACT, channel);
+
+	return maestro_get_small_answer(fd, NULL, command, len, maestro_deadline(timeout), ANSWER_GET_POSITION_SIZE, 0);
 }
 
+
 /**
- *  @brief Get moving state (Compact protocol)
- *
+ *  @brief Query positions of channels range using caller-provided buffers
  */
-int32_t maestro_compact_is_moving(int32_t fd, struct timeval* timeout)
+int32_t maestro_get_positions_buf(int32_t fd, struct maestro_framer* fr, int32_t device, uint8_t channels_num,
+                                  uint8_t first_channel, uint16_t* positions_p, int32_t* status_p,
+                                  uint64_t deadline, uint32_t quiet_us, uint8_t* command, uint8_t* answer)
 {
+	size_t ans_len = ANSWER_GET_POSITION_SIZE * (size_t) channels_num;
+	size_t len = 0;
+	int32_t done;
 	int32_t res = 0;
-	uint8_t command[1] = {COMPACT_GET_MOVING_STATE};
+	int i;
+
+	if ((positions_p == NULL) && (channels_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	/** Channel numbers must not wrap around */
+	if ((uint32_t) first_channel + channels_num > 256)
+		return maestro_fail(MAESTRO_ERR_ARG, "channels range passes channel 255");
+
+	/** All requests are sent back-to-back, replies come in the same order */
+	for (i = 0; i < channels_num; i++) {
+		len += maestro_enc_get_position(&command[len], device, (uint8_t)(first_channel + i));
+	}
+
+	done = maestro_framer_query(fd, fr, command, len, answer, ans_len, deadline, quiet_us);
+	if (done < 0)
+		return done;
+
+	for (i = 0; i < channels_num; i++) {
+		size_t off = ANSWER_GET_POSITION_SIZE * i;
+
+		if (off + ANSWER_GET_POSITION_SIZE <= (size_t) done) {
+			positions_p[i] = answer[off] | (answer[off + 1] << 8);
+			res++;
+		}
+
+		if (status_p) {
+			if (off + ANSWER_GET_POSITION_SIZE <= (size_t) done)
+				status_p[i] = 0;
+			else
+				status_p[i] = (off < (size_t) done) ? MAESTRO_ERR_SHORT_READ : MAESTRO_ERR_TIMEOUT;
+		}
+	}
 
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_IS_MOVING_SIZE);
-	
 	return res;
 }
 
 /**
- *  @brief Get errors (Pololu protocol)
+ *  @brief Get positions of channels range (Pololu protocol)
  */
-int32_t maestro_pololu_get_errors(int32_t fd, uint8_t device, struct timeval* timeout)
+int32_t maestro_pololu_get_positions(int32_t fd, 
+                                     uint8_t device, 
+                                     uint8_t channels_num, 
+                                     uint8_t first_channel, 
+                                     uint16_t* positions_p, 
+                                     int32_t* status_p, 
+                                     struct timeval* timeout)
 {
-	int32_t res = 0;
-	uint8_t command[3];
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_GET_ERRORS;
-
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_GET_ERRORS_SIZE);
-	
-	return res;
+	uint8_t command[GET_POSITIONS_CMD_SIZE];
+	uint8_t answer[GET_POSITIONS_ANSWER_SIZE];
+
+	return maestro_get_positions_buf(fd, NULL, device, channels_num, first_channel, positions_p, status_p, maestro_deadline(timeout), 0, command, answer);
+}
+
+/**
+ *  @brief Get positions of channels range (Compact protocol)
+ */
+int32_t maestro_compact_get_positions(int32_t fd, 
+                                      uint8_t channels_num, 
+                                      uint8_t first_channel, 
+                                      uint16_t* positions_p, 
+                                      int32_t* status_p, 
+                                      struct timeval* timeout)
+{
+	uint8_t command[GET_POSITIONS_CMD_SIZE];
+	uint8_t answer[GET_POSITIONS_ANSWER_SIZE];
+
+	return maestro_get_positions_buf(fd, NULL, MAESTRO_COMPACT, channels_num, first_channel, positions_p, status_p, maestro_deadline(timeout), 0, command, answer);
+}
+
+
+/**
+ *  @brief Get moving state (Pololu protocol)
+ */
+int32_t maestro_pololu_is_moving(int32_t fd, uint8_t device, struct timeval* timeout)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_MOVING_STATE);
+
+	return maestro_get_small_answer(fd, NULL, command, len, maestro_deadline(timeout), ANSWER_IS_MOVING_SIZE, 0);
+}
+
+/**
+ *  @brief Get moving state (Compact protocol)
+ *
+ */
+int32_t maestro_compact_is_moving(int32_t fd, struct timeval* timeout)
+{
+	uint8_t command[1] = {COMPACT_GET_MOVING_STATE};
+
+	return maestro_get_small_answer(fd, NULL, command, sizeof command, maestro_deadline(timeout), ANSWER_IS_MOVING_SIZE, 0);
+}
+
+/**
+ *  @brief Get errors (Pololu protocol)
+ */
+int32_t maestro_pololu_get_errors(int32_t fd, uint8_t device, struct timeval* timeout)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_ERRORS);
+
+	return maestro_get_small_answer(fd, NULL, command, len, maestro_deadline(timeout), ANSWER_GET_ERRORS_SIZE, 0);
 }
 
 /**
@@ -543,32 +842,19 @@ int32_t maestro_pololu_get_errors(int32_t fd, uint8_t device, struct timeval* ti
  */
 int32_t maestro_compact_get_errors(int32_t fd, struct timeval* timeout)
 {
-	int32_t res = 0;
 	uint8_t command[1] = {COMPACT_GET_ERRORS};
-	dump_cmd(command, sizeof (command));
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_GET_ERRORS_SIZE);
-	
-	return res;
+	return maestro_get_small_answer(fd, NULL, command, sizeof command, maestro_deadline(timeout), ANSWER_GET_ERRORS_SIZE, 0);
 }
 
 /**
  *  @brief Go home (Pololu protocol)
  */
 int32_t maestro_pololu_go_home(int32_t fd, uint8_t device)
-{	
-	uint8_t command[3];	
-	int wr = 0;
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_GO_HOME;
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GO_HOME);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -576,15 +862,9 @@ int32_t maestro_pololu_go_home(int32_t fd, uint8_t device)
  */
 int32_t maestro_compact_go_home(int32_t fd)
 {
-	uint8_t command[1] = {COMPACT_GO_HOME};	
-	int wr = 0;
+	uint8_t command[1] = {COMPACT_GO_HOME};
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-  
-	return 0;
+	return maestro_write_cmd(fd, command, sizeof command);
 }
 
 /** Scripts API */
@@ -593,19 +873,10 @@ int32_t maestro_compact_go_home(int32_t fd)
  */
 int32_t maestro_pololu_stop_script(int32_t fd, uint8_t device)
 {
-	uint8_t command[3];		
-	int wr = 0;
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_STOP_SCRIPT;
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_STOP_SCRIPT);
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -613,15 +884,9 @@ int32_t maestro_pololu_stop_script(int32_t fd, uint8_t device)
  */
 int32_t maestro_compact_stop_script(int32_t fd)
 {
-	uint8_t command[] = {COMPACT_STOP_SCRIPT};	
-	int wr = 0;
+	uint8_t command[] = {COMPACT_STOP_SCRIPT};
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;
+	return maestro_write_cmd(fd, command, sizeof command);
 }
 
 /**
@@ -629,20 +894,10 @@ int32_t maestro_compact_stop_script(int32_t fd)
  */
 int32_t maestro_pololu_restart_script(int32_t fd, uint8_t device, uint8_t subroutine_number)
 {
-	uint8_t command[4];
-	int wr = 0;
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_RESTART_SCRIPT;
-	command[3] = subroutine_number;
+	uint8_t command[CMD_SIZE(0, CMD_RESTART_SCRIPT_SIZE)];
+	size_t len = maestro_enc_restart_script(command, device, subroutine_number);
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;	
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -650,19 +905,10 @@ int32_t maestro_pololu_restart_script(int32_t fd, uint8_t device, uint8_t subrou
  */
 int32_t maestro_compact_restart_script(int32_t fd, uint8_t subroutine_number)
 {
-	uint8_t command[2];
-	
-	int wr = 0;
-	
-	command[0] = COMPACT_RESTART_SCRIPT;
-	command[1] = subroutine_number;
+	uint8_t command[CMD_RESTART_SCRIPT_SIZE];
+	size_t len = maestro_enc_restart_script(command, MAESTRO_COMPACT, subroutine_number);
 
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;		
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -673,22 +919,10 @@ int32_t maestro_pololu_restart_script_par(int32_t fd,
                                           uint8_t subroutine_number, 
                                           uint16_t parameter)
 {
-	uint8_t command[6];
-	int wr = 0;
-		
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_RESTART_SCRIPT_PAR;
-	command[3] = subroutine_number;
-	command[4] = parameter & 0x7F;
-	command[5] = (parameter >> 7) & 0x7F;	
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;	
+	uint8_t command[CMD_SIZE(0, CMD_RESTART_SCRIPT_PAR_SIZE)];
+	size_t len = maestro_enc_restart_script_par(command, device, subroutine_number, parameter);
+
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -698,20 +932,10 @@ int32_t maestro_compact_restart_script_par(int32_t fd,
                                            uint8_t subroutine_number, 
                                            uint16_t parameter)
 {
-	uint8_t command[4];	
-	int wr = 0;
+	uint8_t command[CMD_RESTART_SCRIPT_PAR_SIZE];
+	size_t len = maestro_enc_restart_script_par(command, MAESTRO_COMPACT, subroutine_number, parameter);
 
-	command[0] = COMPACT_RESTART_SCRIPT_PAR;
-	command[1] = subroutine_number;
-	command[2] = parameter & 0x7F;
-	command[3] = (parameter >> 7) & 0x7F;
-
-	if ((wr = write(fd, command, sizeof(command))) != sizeof(command)) {
-		perror("error writing");
-		return -1;
-	}
-	
-	return 0;		
+	return maestro_write_cmd(fd, command, len);
 }
 
 /**
@@ -719,17 +943,10 @@ int32_t maestro_compact_restart_script_par(int32_t fd,
  */
 int32_t maestro_pololu_is_stopped(int32_t fd, uint8_t device, struct timeval* timeout)
 {
-	int32_t res = 0;
-	uint8_t command[3];
-	
-	command[0] = POLOLU_PROTO_ON;
-	command[1] = device;
-	command[2] = POLOLU_GET_SCRIPT_STATUS;
-
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_IS_STOPPED_SIZE);
-	
-	return res;
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_SCRIPT_STATUS);
 
+	return maestro_get_small_answer(fd, NULL, command, len, maestro_deadline(timeout), ANSWER_IS_STOPPED_SIZE, 0);
 }
 
 /**
@@ -737,10 +954,458 @@ int32_t maestro_pololu_is_stopped(int32_t fd, uint8_t device, struct timeval* ti
  */
 int32_t maestro_compact_is_stopped(int32_t fd, struct timeval* timeout)
 {
-	int32_t res = 0;
 	uint8_t command[1] = {COMPACT_GET_SCRIPT_STATUS};
 
-	res = maestro_get_small_answer(fd, &command[0], sizeof command, timeout, ANSWER_IS_STOPPED_SIZE);
-	
-	return res;   
+	return maestro_get_small_answer(fd, NULL, command, sizeof command, maestro_deadline(timeout), ANSWER_IS_STOPPED_SIZE, 0);
+}
+
+
+/** Batch API */
+
+/**
+ *  @brief Reserve room for command in batch buffer
+ */
+static uint8_t* maestro_batch_reserve(struct maestro_batch* batch, size_t len)
+{
+	if (batch == NULL) {
+		maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+		return NULL;
+	}
+
+	if (batch->len + len > batch->size) {
+		maestro_fail(MAESTRO_ERR_FULL, "batch buffer overflow");
+		return NULL;
+	}
+
+	return batch->buf + batch->len;
+}
+
+/**
+ *  @brief Initialize batch
+ */
+void maestro_batch_init(struct maestro_batch* batch, uint8_t* buf, size_t size)
+{
+	batch->buf = buf;
+	batch->size = size;
+	batch->len = 0;
+	batch->caps = 0;
+}
+
+/**
+ *  @brief Drop all queued commands
+ */
+void maestro_batch_reset(struct maestro_batch* batch)
+{
+	batch->len = 0;
+}
+
+/**
+ *  @brief Limit commands used by targets planner
+ */
+void maestro_batch_set_caps(struct maestro_batch* batch, uint32_t caps)
+{
+	batch->caps = caps;
+}
+
+/**
+ *  @brief Append set target (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_target(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t target)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SET_TARGET_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_target(cmd, device, channel, target);
+	return 0;
+}
+
+/**
+ *  @brief Append set target (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_target(struct maestro_batch* batch, uint8_t channel, uint16_t target)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SET_TARGET_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_target(cmd, MAESTRO_COMPACT, channel, target);
+	return 0;
+}
+
+/**
+ *  @brief Append set target (MiniSSC protocol)
+ */
+int32_t maestro_batch_minissc_set_target(struct maestro_batch* batch, uint8_t channel, uint8_t target)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_MINISSC_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_minissc_set_target(cmd, channel, target);
+	return 0;
+}
+
+/**
+ *  @brief Append set multiple target (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_multiple_target(struct maestro_batch* batch, uint8_t device, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p)
+{
+	uint8_t* cmd;
+
+	if ((targets_p == NULL) && (targets_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SET_MULTARGET_SIZE(targets_num)));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_multiple_target(cmd, device, targets_num, first_channel, targets_p);
+	return 0;
+}
+
+/**
+ *  @brief Append set multiple target (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_multiple_target(struct maestro_batch* batch, uint8_t targets_num, uint8_t first_channel, uint16_t* targets_p)
+{
+	uint8_t* cmd;
+
+	if ((targets_p == NULL) && (targets_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	cmd = maestro_batch_reserve(batch, CMD_SET_MULTARGET_SIZE(targets_num));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_multiple_target(cmd, MAESTRO_COMPACT, targets_num, first_channel, targets_p);
+	return 0;
+}
+
+/**
+ *  @brief Append set speed (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_speed(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t speed)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SET_SPEED_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_speed(cmd, device, channel, speed);
+	return 0;
+}
+
+/**
+ *  @brief Append set speed (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_speed(struct maestro_batch* batch, uint8_t channel, uint16_t speed)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SET_SPEED_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_speed(cmd, MAESTRO_COMPACT, channel, speed);
+	return 0;
+}
+
+/**
+ *  @brief Append set acceleration (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_acceleration(struct maestro_batch* batch, uint8_t device, uint8_t channel, uint16_t acceleration)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SET_ACCELERATION_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_acceleration(cmd, device, channel, acceleration);
+	return 0;
+}
+
+/**
+ *  @brief Append set acceleration (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_acceleration(struct maestro_batch* batch, uint8_t channel, uint16_t acceleration)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SET_ACCELERATION_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_acceleration(cmd, MAESTRO_COMPACT, channel, acceleration);
+	return 0;
+}
+
+/**
+ *  @brief Append set PWM (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_pwm(struct maestro_batch* batch, uint8_t device, uint16_t on_time, uint16_t period)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SET_PWM_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_pwm(cmd, device, on_time, period);
+	return 0;
+}
+
+/**
+ *  @brief Append set PWM (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_pwm(struct maestro_batch* batch, uint16_t on_time, uint16_t period)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SET_PWM_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_set_pwm(cmd, MAESTRO_COMPACT, on_time, period);
+	return 0;
+}
+
+/**
+ *  @brief Append go home (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_go_home(struct maestro_batch* batch, uint8_t device)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SIMPLE_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_simple(cmd, device, COMPACT_GO_HOME);
+	return 0;
+}
+
+/**
+ *  @brief Append go home (Compact protocol)
+ */
+int32_t maestro_batch_compact_go_home(struct maestro_batch* batch)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIMPLE_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_simple(cmd, MAESTRO_COMPACT, COMPACT_GO_HOME);
+	return 0;
+}
+
+/**
+ *  @brief Append stop script (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_stop_script(struct maestro_batch* batch, uint8_t device)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_SIMPLE_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_simple(cmd, device, COMPACT_STOP_SCRIPT);
+	return 0;
+}
+
+/**
+ *  @brief Append stop script (Compact protocol)
+ */
+int32_t maestro_batch_compact_stop_script(struct maestro_batch* batch)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIMPLE_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_simple(cmd, MAESTRO_COMPACT, COMPACT_STOP_SCRIPT);
+	return 0;
+}
+
+/**
+ *  @brief Append restart script at subroutine (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_restart_script(struct maestro_batch* batch, uint8_t device, uint8_t subroutine_number)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_RESTART_SCRIPT_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_restart_script(cmd, device, subroutine_number);
+	return 0;
+}
+
+/**
+ *  @brief Append restart script at subroutine (Compact protocol)
+ */
+int32_t maestro_batch_compact_restart_script(struct maestro_batch* batch, uint8_t subroutine_number)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_RESTART_SCRIPT_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_restart_script(cmd, MAESTRO_COMPACT, subroutine_number);
+	return 0;
+}
+
+/**
+ *  @brief Append restart script at subroutine with parameter (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_restart_script_par(struct maestro_batch* batch, uint8_t device, uint8_t subroutine_number, uint16_t parameter)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_SIZE(device, CMD_RESTART_SCRIPT_PAR_SIZE));
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_restart_script_par(cmd, device, subroutine_number, parameter);
+	return 0;
+}
+
+/**
+ *  @brief Append restart script at subroutine with parameter (Compact protocol)
+ */
+int32_t maestro_batch_compact_restart_script_par(struct maestro_batch* batch, uint8_t subroutine_number, uint16_t parameter)
+{
+	uint8_t* cmd = maestro_batch_reserve(batch, CMD_RESTART_SCRIPT_PAR_SIZE);
+
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	batch->len += maestro_enc_restart_script_par(cmd, MAESTRO_COMPACT, subroutine_number, parameter);
+	return 0;
+}
+
+/** Mask of channels first..last */
+#define SPAN_MASK(first, last) ((~0ull >> (63 - (last))) & (~0ull << (first)))
+
+/**
+ *  @brief Append minimal-size encoding of changed targets
+ *
+ *  @details Dynamic programming over changed channels in ascending order:
+ *  best[j + 1] is the cheapest encoding of the first j + 1 changed channels, where
+ *  the last command covers changed channels i..j either as single set target (i == j)
+ *  or as set multiple target spanning all channels between them. Span may include
+ *  unchanged channels only when they are known, their targets are sent again.
+ *  Spans are not tried for device with MAESTRO_CAP_SINGLE_TARGET.
+ *  Bit i of masks and targets_p[i] refer to channel first_channel + i.
+ */
+int32_t maestro_batch_set_targets(struct maestro_batch* batch, int32_t device, uint32_t caps, uint8_t first_channel, uint8_t channels_num,
+                                  const uint16_t* targets_p, uint64_t changed, uint64_t known)
+{
+	uint8_t ch[MAESTRO_PLAN_MAX_CHANNELS];
+	size_t best[MAESTRO_PLAN_MAX_CHANNELS + 1];
+	uint8_t from[MAESTRO_PLAN_MAX_CHANNELS + 1];
+	uint8_t* cmd;
+	uint64_t sendable;
+	size_t cost;
+	int i, j, k = 0;
+
+	if ((targets_p == NULL) || (channels_num > MAESTRO_PLAN_MAX_CHANNELS))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad targets");
+
+	if (channels_num < MAESTRO_PLAN_MAX_CHANNELS)
+		changed &= (1ull << channels_num) - 1;
+	sendable = changed | known;
+
+	for (i = 0; i < channels_num; i++) {
+		if (changed & (1ull << i))
+			ch[k++] = i;
+	}
+
+	best[0] = 0;
+	for (j = 0; j < k; j++) {
+		best[j + 1] = best[j] + CMD_SIZE(device, CMD_SET_TARGET_SIZE);
+		from[j + 1] = j;
+
+		for (i = j - 1; (i >= 0) && !(caps & MAESTRO_CAP_SINGLE_TARGET); i--) {
+			if ((SPAN_MASK(ch[i], ch[j]) & ~sendable) != 0)
+				break;
+
+			cost = best[i] + CMD_SIZE(device, CMD_SET_MULTARGET_SIZE(ch[j] - ch[i] + 1));
+			if (cost < best[j + 1]) {
+				best[j + 1] = cost;
+				from[j + 1] = i;
+			}
+		}
+	}
+
+	/** Whole plan is appended or nothing */
+	cmd = maestro_batch_reserve(batch, best[k]);
+	if (cmd == NULL)
+		return maestro_last_error()->code;
+
+	/** Plan is restored backwards, commands are encoded from the end of reserved room */
+	cmd += best[k];
+	for (j = k; j > 0; j = i) {
+		i = from[j];
+
+		if (i == j - 1) {
+			cmd -= CMD_SIZE(device, CMD_SET_TARGET_SIZE);
+			maestro_enc_set_target(cmd, device, first_channel + ch[i], targets_p[ch[i]]);
+		} else {
+			cmd -= CMD_SIZE(device, CMD_SET_MULTARGET_SIZE(ch[j - 1] - ch[i] + 1));
+			maestro_enc_set_multiple_target(cmd, device, ch[j - 1] - ch[i] + 1, first_channel + ch[i], targets_p + ch[i]);
+		}
+	}
+
+	batch->len += best[k];
+	return 0;
+}
+
+/**
+ *  @brief Append changed targets with minimal number of bytes (Pololu protocol)
+ */
+int32_t maestro_batch_pololu_set_targets(struct maestro_batch* batch, uint8_t device, uint8_t channels_num,
+                                         const uint16_t* targets_p, uint64_t changed, uint64_t known)
+{
+	return maestro_batch_set_targets(batch, device, batch->caps, 0, channels_num, targets_p, changed, known);
+}
+
+/**
+ *  @brief Append changed targets with minimal number of bytes (Compact protocol)
+ */
+int32_t maestro_batch_compact_set_targets(struct maestro_batch* batch, uint8_t channels_num,
+                                          const uint16_t* targets_p, uint64_t changed, uint64_t known)
+{
+	return maestro_batch_set_targets(batch, MAESTRO_COMPACT, batch->caps, 0, channels_num, targets_p, changed, known);
+}
+
+/**
+ *  @brief Send all queued commands with single write()
+ */
+int32_t maestro_batch_flush(int32_t fd, struct maestro_batch* batch)
+{
+	size_t done = 0;
+	int32_t res;
+	ssize_t wr;
+
+	if (batch == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	while (done < batch->len) {
+		wr = write(fd, batch->buf + done, batch->len - done);
+		maestro_capture(fd, MAESTRO_CAPTURE_TX, batch->buf + done, wr);
+
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			/** keep unsent commands queued */
+			res = maestro_fail(MAESTRO_ERR_IO, "write");
+			memmove(batch->buf, batch->buf + done, batch->len - done);
+			batch->len -= done;
+			return res;
+		}
+		done += wr;
+	}
+
+	batch->len = 0;
+	return 0;
 }
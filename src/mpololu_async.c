@@ -0,0 +1,666 @@
+/**
+ * @file   mpololu_async.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Non-blocking API for communicating with Maestro Pololu from event loop.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "mpololu.h"
+#include "mpololu_async.h"
+#include "mpololu_priv.h"
+
+#define ASYNC_READ_CHUNK 256
+#define ASYNC_MAX_ANSWER 4
+
+struct async_request {
+	uint8_t ans_len;
+	uint64_t tx_start;  /** command bytes in TX stream, see tx_total */
+	uint64_t tx_end;
+	uint64_t submitted; /** CLOCK_MONOTONIC ns */
+	uint64_t deadline;  /** CLOCK_MONOTONIC ns, 0 -- infinite */
+	maestro_async_cb cb;
+	void* arg;
+};
+
+struct maestro_async {
+	int32_t fd;
+
+	/** Unsent bytes */
+	uint8_t tx[MAESTRO_ASYNC_TX_SIZE];
+	size_t tx_len;
+	uint64_t tx_total;    /** bytes ever queued, stream position of tx end */
+	uint8_t corked;       /** submissions are only queued */
+	uint8_t closing;      /** context is being destroyed, submissions are rejected */
+
+	/** Requests waiting for answer, ring */
+	struct async_request* req;
+	uint32_t req_size;
+	uint32_t req_head;
+	uint32_t req_count;
+
+	/** Partially received answer of head request */
+	uint8_t rx[ASYNC_MAX_ANSWER];
+	size_t rx_len;
+
+	/** Late answers of failed requests, see maestro_framer */
+	size_t stale;         /** bytes which may still arrive */
+	uint8_t resync;       /** answers are not matched, bytes after tx_hold are held */
+	uint64_t tx_hold;     /** stream position up to which bytes are sent during resync */
+	uint64_t quiet_ns;    /** quiet window */
+	uint64_t quiet_until; /** resync ends when line is quiet until then */
+
+	/** Deadline timer, armed at nearest request deadline */
+	int32_t timer_fd;     /** -1 -- not created */
+	uint64_t timer_armed; /** deadline timer is armed for, 0 -- disarmed */
+};
+
+
+/** Number of queued bytes allowed to go out now */
+static size_t async_sendable(const struct maestro_async* a)
+{
+	uint64_t sent = a->tx_total - a->tx_len;
+
+	/** New queries wait for resync, their answers would be taken for late ones */
+	if (!a->resync)
+		return a->tx_len;
+
+	return (sent < a->tx_hold) ? (size_t)(a->tx_hold - sent) : 0;
+}
+
+static int32_t async_flush(struct maestro_async* a)
+{
+	size_t len;
+	ssize_t wr;
+
+	while ((len = async_sendable(a)) != 0) {
+		wr = write(a->fd, a->tx, len);
+		maestro_capture(a->fd, MAESTRO_CAPTURE_TX, a->tx, wr);
+
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			return maestro_fail(MAESTRO_ERR_IO, "write");
+		}
+
+		memmove(a->tx, a->tx + wr, a->tx_len - wr);
+		a->tx_len -= wr;
+
+		/** Rest of partially sent query went out, its answer may follow */
+		if (a->resync)
+			a->quiet_until = maestro_now_ns() + a->quiet_ns;
+	}
+
+	return 0;
+}
+
+/** Nearest deadline of requests, 0 -- none */
+static uint64_t async_next_deadline(const struct maestro_async* a)
+{
+	uint64_t deadline = 0;
+	uint32_t i;
+
+	/** Requests expire in any order, since each has own timeout */
+	for (i = 0; i < a->req_count; i++) {
+		const struct async_request* r = &a->req[(a->req_head + i) % a->req_size];
+
+		deadline = maestro_deadline_min(deadline, r->deadline);
+	}
+
+	if (a->resync && !async_sendable(a))
+		deadline = maestro_deadline_min(deadline, a->quiet_until);
+
+	return deadline;
+}
+
+/** Rearm deadline timer if nearest deadline changed */
+static void async_arm_timer(struct maestro_async* a)
+{
+	struct itimerspec its;
+	uint64_t deadline;
+
+	if (a->timer_fd < 0)
+		return;
+
+	deadline = async_next_deadline(a);
+	if (deadline == a->timer_armed)
+		return;
+
+	/** Zero it_value disarms timer, deadline in the past fires at once */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000ull;
+	its.it_value.tv_nsec = deadline % 1000000000ull;
+
+	if (timerfd_settime(a->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "timerfd_settime");
+		return;
+	}
+	a->timer_armed = deadline;
+}
+
+static struct async_request* async_head(struct maestro_async* a)
+{
+	return a->req_count ? &a->req[a->req_head] : NULL;
+}
+
+static void async_pop(struct maestro_async* a, int32_t status, int32_t value)
+{
+	struct async_request r = a->req[a->req_head];
+
+	a->req_head = (a->req_head + 1) % a->req_size;
+	a->req_count--;
+	a->rx_len = 0;
+
+	/** Request is removed before callback, so callback may submit new ones */
+	if (r.cb)
+		r.cb(r.arg, status, value);
+}
+
+/** Remove bytes of stream range from tx */
+static void async_drop_tx(struct maestro_async* a, uint64_t start, uint64_t end)
+{
+	size_t off = (size_t)(start - (a->tx_total - a->tx_len));
+	size_t len = (size_t)(end - start);
+
+	memmove(a->tx + off, a->tx + off + len, a->tx_len - off - len);
+	a->tx_len -= len;
+	a->tx_total -= len;
+}
+
+/**
+ * @brief Remove queries of unsent request from tx
+ *
+ * @details Other commands submitted with them stay queued. Bytes walker can't
+ * decode (Mini SSC) can't be split, so the rest of range is dropped.
+ */
+static void async_drop_queries(struct maestro_async* a, uint64_t start, uint64_t end)
+{
+	uint64_t pos = start;
+	size_t off, size;
+	uint8_t command, answer;
+
+	while (pos < end) {
+		off = (size_t)(pos - (a->tx_total - a->tx_len));
+		size = maestro_cmd_size(a->tx + off, (size_t)(end - pos), &command, &answer);
+
+		if (size == 0) {
+			async_drop_tx(a, pos, end);
+			break;
+		}
+
+		if (answer) {
+			async_drop_tx(a, pos, pos + size);
+			end -= size;
+		} else {
+			pos += size;
+		}
+	}
+}
+
+/**
+ * @brief Fail all outstanding requests with status
+ *
+ * @details Answers come without any tag, after missing answer the rest of
+ * stream can't be matched to requests, so everything pending is failed.
+ * Unsent queries of failed requests are dropped. Answers of sent ones may
+ * still arrive, so stream is resynchronized like maestro_framer does: bytes
+ * are dropped until all of them came or line is quiet for twice the wait of
+ * failed requests, new queries are held meanwhile. Requests submitted from
+ * callbacks are not failed.
+ */
+static int32_t async_fail_all(struct maestro_async* a, int32_t status)
+{
+	uint64_t now = maestro_now_ns();
+	uint64_t sent = a->tx_total - a->tx_len;
+	uint64_t wait_ns = 0;
+	uint32_t n = a->req_count;
+	uint32_t i;
+
+	/** Backwards, so stream positions of earlier requests stay valid */
+	for (i = n; i > 0; i--) {
+		const struct async_request* r = &a->req[(a->req_head + i - 1) % a->req_size];
+
+		if (r->tx_start >= sent) {
+			async_drop_queries(a, r->tx_start, r->tx_end);
+			continue;
+		}
+
+		/** Partially sent command is completed, so device is not left mid-frame */
+		a->stale += r->ans_len - ((i == 1) ? a->rx_len : 0);
+		if (now - r->submitted > wait_ns)
+			wait_ns = now - r->submitted;
+	}
+
+	if (a->stale) {
+		if (2 * wait_ns > a->quiet_ns)
+			a->quiet_ns = 2 * wait_ns;
+		if (a->quiet_ns > MAESTRO_QUIET_MAX_US * 1000ull)
+			a->quiet_ns = MAESTRO_QUIET_MAX_US * 1000ull;
+		a->quiet_until = now + a->quiet_ns;
+		a->tx_hold = a->tx_total;
+		a->resync = 1;
+	} else if (!a->resync) {
+		tcflush(a->fd, TCIFLUSH);
+	}
+
+	for (i = 0; i < n; i++) {
+		async_pop(a, status, -1);
+	}
+
+	return (int32_t) n;
+}
+
+/** End resync once late bytes came or line stayed quiet, held bytes are released */
+static int32_t async_resync_check(struct maestro_async* a, uint64_t now)
+{
+	if (!a->resync || async_sendable(a))
+		return 0;
+
+	if (a->stale && (now < a->quiet_until))
+		return 0;
+
+	tcflush(a->fd, TCIFLUSH);
+	a->stale = 0;
+	a->resync = 0;
+	a->quiet_ns = 0;
+
+	return async_flush(a);
+}
+
+static int32_t async_read(struct maestro_async* a)
+{
+	uint8_t buf[ASYNC_READ_CHUNK];
+	struct async_request* r;
+	int32_t done = 0;
+	ssize_t rd;
+	ssize_t i;
+
+	while (1) {
+		rd = read(a->fd, buf, sizeof(buf));
+		maestro_capture(a->fd, MAESTRO_CAPTURE_RX, buf, rd);
+
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			return maestro_fail(MAESTRO_ERR_IO, "read");
+		}
+		if (rd == 0)
+			break;
+
+		/** Late answers and junk until resync ends */
+		if (a->resync) {
+			a->stale = ((size_t) rd < a->stale) ? a->stale - rd : 0;
+			a->quiet_until = maestro_now_ns() + a->quiet_ns;
+			continue;
+		}
+
+		for (i = 0; i < rd; i++) {
+			r = async_head(a);
+
+			/** Nobody waits for this byte -- stale answer */
+			if (r == NULL)
+				continue;
+
+			a->rx[a->rx_len++] = buf[i];
+
+			if (a->rx_len == r->ans_len) {
+				int32_t res = 0;
+				size_t k;
+
+				for (k = 0; k < a->rx_len; k++) {
+					res += a->rx[k] << (8 * k);
+				}
+				async_pop(a, 0, res);
+				done++;
+			}
+		}
+	}
+
+	return done;
+}
+
+
+/**
+ * @brief Create asynchronous context on opened COM-port
+ */
+struct maestro_async* maestro_async_create(int32_t fd, uint32_t max_requests)
+{
+	struct maestro_async* a;
+	int flags;
+
+	if (max_requests == 0) {
+		maestro_fail(MAESTRO_ERR_ARG, "max_requests must be positive");
+		return NULL;
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		maestro_fail(MAESTRO_ERR_IO, "fcntl");
+		return NULL;
+	}
+
+	a = (struct maestro_async*) calloc(1, sizeof(*a));
+	if (a == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	a->req = (struct async_request*) calloc(max_requests, sizeof(*a->req));
+	if (a->req == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		free(a);
+		return NULL;
+	}
+
+	a->fd = fd;
+	a->req_size = max_requests;
+	a->timer_fd = -1;
+
+	return a;
+}
+
+/**
+ * @brief Destroy context
+ */
+void maestro_async_destroy(struct maestro_async* async)
+{
+	uint32_t n;
+
+	if (async == NULL)
+		return;
+
+	/** Callbacks may try to submit again */
+	async->closing = 1;
+	for (n = async->req_count; n > 0; n--) {
+		async_pop(async, MAESTRO_ERR_STATE, -1);
+	}
+
+	if (async->timer_fd >= 0)
+		close(async->timer_fd);
+
+	free(async->req);
+	free(async);
+}
+
+/**
+ * @brief Descriptor to wait on
+ */
+int32_t maestro_async_fd(const struct maestro_async* async)
+{
+	return async->fd;
+}
+
+/**
+ * @brief Deadline timer descriptor
+ */
+int32_t maestro_async_timer_fd(struct maestro_async* async)
+{
+	if (async->timer_fd < 0) {
+		async->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (async->timer_fd < 0)
+			return maestro_fail(MAESTRO_ERR_IO, "timerfd_create");
+		async->timer_armed = 0;
+		async_arm_timer(async);
+	}
+
+	return async->timer_fd;
+}
+
+/**
+ * @brief Events to wait for
+ */
+uint32_t maestro_async_events(const struct maestro_async* async)
+{
+	return MAESTRO_ASYNC_IN | (async_sendable(async) ? MAESTRO_ASYNC_OUT : 0);
+}
+
+/**
+ * @brief Time until nearest request deadline
+ */
+int32_t maestro_async_timeout(const struct maestro_async* async)
+{
+	uint64_t now;
+	uint64_t deadline = async_next_deadline(async);
+
+	if (!deadline)
+		return -1;
+
+	now = maestro_now_ns();
+	if (deadline <= now)
+		return 0;
+
+	/** Round up, so wakeup is never before deadline */
+	return (int32_t)((deadline - now + 999999) / 1000000);
+}
+
+/**
+ * @brief Process readiness
+ */
+int32_t maestro_async_process(struct maestro_async* async, uint32_t events)
+{
+	int32_t done = 0;
+	int32_t rv;
+	uint64_t now;
+	uint32_t i;
+
+	if (!events)
+		events = MAESTRO_ASYNC_IN | MAESTRO_ASYNC_OUT;
+
+	/** One-shot timer is disarmed once expiration is read */
+	if (async->timer_fd >= 0) {
+		uint64_t expirations;
+
+		if (read(async->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			async->timer_armed = 0;
+	}
+
+	if (events & MAESTRO_ASYNC_OUT) {
+		rv = async_flush(async);
+		if (rv < 0)
+			return rv;
+	}
+
+	if (events & MAESTRO_ASYNC_IN) {
+		rv = async_read(async);
+		if (rv < 0)
+			return rv;
+		done += rv;
+	}
+
+	now = maestro_now_ns();
+	rv = async_resync_check(async, now);
+	if (rv < 0)
+		return rv;
+
+	for (i = 0; i < async->req_count; i++) {
+		const struct async_request* r = &async->req[(async->req_head + i) % async->req_size];
+
+		if (r->deadline && (r->deadline <= now)) {
+			done += async_fail_all(async, MAESTRO_ERR_TIMEOUT);
+			break;
+		}
+	}
+
+	async_arm_timer(async);
+	return done;
+}
+
+/**
+ * @brief Late answers are being drained
+ */
+int32_t maestro_async_resyncing(const struct maestro_async* async)
+{
+	return async->resync;
+}
+
+/**
+ * @brief Number of requests waiting for answer
+ */
+uint32_t maestro_async_pending(const struct maestro_async* async)
+{
+	return async->req_count;
+}
+
+/**
+ * @brief Queue raw command
+ */
+int32_t maestro_async_submit(struct maestro_async* async, const uint8_t* cmd, size_t len, size_t ans_len,
+                             int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	struct async_request* r;
+
+	if (async->closing)
+		return maestro_fail(MAESTRO_ERR_STATE, "async context is being destroyed");
+
+	if ((ans_len > ASYNC_MAX_ANSWER) || (ans_len && (cb == NULL)))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad answer length or callback");
+
+	if (async->tx_len + len > sizeof(async->tx))
+		return maestro_fail(MAESTRO_ERR_FULL, "async tx queue is full");
+
+	if (ans_len && (async->req_count == async->req_size))
+		return maestro_fail(MAESTRO_ERR_FULL, "too many requests waiting for answer");
+
+	memcpy(async->tx + async->tx_len, cmd, len);
+	async->tx_len += len;
+	async->tx_total += len;
+
+	if (ans_len) {
+		r = &async->req[(async->req_head + async->req_count) % async->req_size];
+		r->ans_len = (uint8_t) ans_len;
+		r->tx_start = async->tx_total - len;
+		r->tx_end = async->tx_total;
+		r->submitted = maestro_now_ns();
+		r->deadline = (timeout_ms < 0) ? 0 : r->submitted + (uint64_t) timeout_ms * 1000000ull;
+		r->cb = cb;
+		r->arg = arg;
+		async->req_count++;
+		async_arm_timer(async);
+	}
+
+	if (async->corked)
+		return 0;
+
+	/** Try to send right away, rest goes out on MAESTRO_ASYNC_OUT readiness */
+	return async_flush(async);
+}
+
+/**
+ * @brief Hold submitted bytes until uncorked
+ */
+int32_t maestro_async_cork(struct maestro_async* async, int32_t cork)
+{
+	async->corked = cork ? 1 : 0;
+
+	return cork ? 0 : async_flush(async);
+}
+
+/**
+ * @brief Queue all commands of batch and reset batch
+ */
+int32_t maestro_async_submit_batch(struct maestro_async* async, struct maestro_batch* batch)
+{
+	int32_t res = maestro_async_submit(async, batch->buf, batch->len, 0, -1, NULL, NULL);
+
+	if (res < 0)
+		return res;
+
+	maestro_batch_reset(batch);
+	return 0;
+}
+
+/**
+ * @brief Queue get position query (Pololu protocol)
+ */
+int32_t maestro_async_pololu_get_position(struct maestro_async* async, uint8_t device, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_GET_POSITION_SIZE)];
+	size_t len = maestro_enc_get_position(command, device, channel);
+
+	return maestro_async_submit(async, command, len, ANSWER_GET_POSITION_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get position query (Compact protocol)
+ */
+int32_t maestro_async_compact_get_position(struct maestro_async* async, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_GET_POSITION_SIZE];
+	size_t len = maestro_enc_get_position(command, MAESTRO_COMPACT, channel);
+
+	return maestro_async_submit(async, command, len, ANSWER_GET_POSITION_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get moving state query (Pololu protocol)
+ */
+int32_t maestro_async_pololu_is_moving(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_MOVING_STATE);
+
+	return maestro_async_submit(async, command, len, ANSWER_IS_MOVING_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get moving state query (Compact protocol)
+ */
+int32_t maestro_async_compact_is_moving(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[1] = {COMPACT_GET_MOVING_STATE};
+
+	return maestro_async_submit(async, command, sizeof command, ANSWER_IS_MOVING_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get errors query (Pololu protocol)
+ */
+int32_t maestro_async_pololu_get_errors(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_ERRORS);
+
+	return maestro_async_submit(async, command, len, ANSWER_GET_ERRORS_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get errors query (Compact protocol)
+ */
+int32_t maestro_async_compact_get_errors(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[1] = {COMPACT_GET_ERRORS};
+
+	return maestro_async_submit(async, command, sizeof command, ANSWER_GET_ERRORS_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get script status query (Pololu protocol)
+ */
+int32_t maestro_async_pololu_is_stopped(struct maestro_async* async, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_SCRIPT_STATUS);
+
+	return maestro_async_submit(async, command, len, ANSWER_IS_STOPPED_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get script status query (Compact protocol)
+ */
+int32_t maestro_async_compact_is_stopped(struct maestro_async* async, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[1] = {COMPACT_GET_SCRIPT_STATUS};
+
+	return maestro_async_submit(async, command, sizeof command, ANSWER_IS_STOPPED_SIZE, timeout_ms, cb, arg);
+}
@@ -0,0 +1,782 @@
+/**
+ * @file   mpololu_bench.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Latency benchmark of library commands against built-in emulator.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include "mpololu.h" /* Maestro Pololu Lib */
+#include "mpololu_async.h" /* Maestro Pololu async API */
+#include "mpololu_iothread.h" /* Maestro Pololu I/O thread */
+#include "mpololu_coalesce.h" /* Maestro Pololu target coalescer */
+#include "mpololu_shm.h" /* Maestro Pololu shared-memory target table */
+#include "mpololu_handle.h" /* Maestro Pololu controller handle */
+#include "mpololu_traj.h" /* Maestro Pololu trajectory engine */
+#include "mpololu_group.h" /* Maestro Pololu channel group */
+#include "mpololu_emu.h" /* Maestro Pololu emulator */
+
+#define BENCH_DEVICE 12
+#define BENCH_CHANNELS 24
+#define BENCH_NAME_MAX 48
+#define BENCH_GROUP_PORTS 3
+
+struct bench_ctx {
+	int32_t fd;
+	uint8_t num;             /** channels number for multiple target benchmarks */
+	struct timeval tv;       /** timeout for queries */
+	uint16_t targets[BENCH_CHANNELS];
+	uint16_t positions[BENCH_CHANNELS];
+	uint8_t batch_buf[1024];
+	struct maestro_async* async;
+	int epfd;
+	uint32_t async_done;
+	struct maestro_iothread* iot;
+	struct maestro_coalesce* co;
+	struct maestro_shm* shm;
+	struct maestro* m;
+	struct maestro_traj* tr;
+	uint32_t traj_seq;       /** waypoints pushed, warm-up included */
+	struct maestro_group* group;
+	struct maestro_emu* group_emu[BENCH_GROUP_PORTS - 1]; /** extra ports, first one is bench emulator */
+	struct maestro* group_m[BENCH_GROUP_PORTS];
+	uint16_t frame[BENCH_GROUP_PORTS * BENCH_CHANNELS];
+};
+
+typedef int32_t (*bench_fn)(struct bench_ctx* ctx, uint32_t i);
+typedef void (*bench_hook)(struct bench_ctx* ctx);
+
+struct bench {
+	const char* name;
+	bench_fn fn;
+	uint8_t multi;       /** run for 1..BENCH_CHANNELS channels */
+	bench_hook setup;    /** called before benchmark, may be NULL */
+	bench_hook sync;     /** wait for completion of background work, may be NULL */
+	bench_hook teardown; /** called after benchmark, may be NULL */
+	uint8_t hot;         /** handle hot path, any allocation fails the run */
+};
+
+uint32_t iterations = 2000;
+uint32_t baud = 0;
+char *filter = NULL;
+
+
+/**
+ * Heap allocations of benchmark thread, counted by malloc() interposer.
+ * Thread-local, so emulator and background threads are not counted.
+ */
+static __thread uint64_t allocs;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+/** I/O thread allocates its ring aligned to cache line */
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	void* p;
+
+	if (!alignment || (alignment % sizeof(void*)) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	allocs++;
+	p = __libc_memalign(alignment, size);
+	if (p == NULL)
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	allocs++;
+	return __libc_memalign(alignment, size);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint16_t bench_target(uint32_t i)
+{
+	return (uint16_t)(4000 + (i % 4000));
+}
+
+/** Set target */
+static int32_t b_compact_set_target(struct bench_ctx* c, uint32_t i) { return maestro_compact_set_target(c->fd, i % BENCH_CHANNELS, bench_target(i)); }
+static int32_t b_pololu_set_target(struct bench_ctx* c, uint32_t i) { return maestro_pololu_set_target(c->fd, BENCH_DEVICE, i % BENCH_CHANNELS, bench_target(i)); }
+static int32_t b_minissc_set_target(struct bench_ctx* c, uint32_t i) { return maestro_minissc_set_target(c->fd, i % BENCH_CHANNELS, i % 255); }
+
+/** Set multiple target */
+static int32_t b_compact_set_multiple_target(struct bench_ctx* c, uint32_t i) { return maestro_compact_set_multiple_target(c->fd, c->num, 0, c->targets); }
+static int32_t b_pololu_set_multiple_target(struct bench_ctx* c, uint32_t i) { return maestro_pololu_set_multiple_target(c->fd, BENCH_DEVICE, c->num, 0, c->targets); }
+
+/** Other commands */
+static int32_t b_compact_set_speed(struct bench_ctx* c, uint32_t i) { return maestro_compact_set_speed(c->fd, i % BENCH_CHANNELS, 0); }
+static int32_t b_pololu_set_speed(struct bench_ctx* c, uint32_t i) { return maestro_pololu_set_speed(c->fd, BENCH_DEVICE, i % BENCH_CHANNELS, 0); }
+static int32_t b_compact_set_acceleration(struct bench_ctx* c, uint32_t i) { return maestro_compact_set_acceleration(c->fd, i % BENCH_CHANNELS, 0); }
+static int32_t b_pololu_set_acceleration(struct bench_ctx* c, uint32_t i) { return maestro_pololu_set_acceleration(c->fd, BENCH_DEVICE, i % BENCH_CHANNELS, 0); }
+static int32_t b_compact_set_pwm(struct bench_ctx* c, uint32_t i) { return maestro_compact_set_pwm(c->fd, 0, 0); }
+static int32_t b_pololu_set_pwm(struct bench_ctx* c, uint32_t i) { return maestro_pololu_set_pwm(c->fd, BENCH_DEVICE, 0, 0); }
+static int32_t b_compact_go_home(struct bench_ctx* c, uint32_t i) { return maestro_compact_go_home(c->fd); }
+static int32_t b_pololu_go_home(struct bench_ctx* c, uint32_t i) { return maestro_pololu_go_home(c->fd, BENCH_DEVICE); }
+
+/** Queries */
+static int32_t b_compact_get_position(struct bench_ctx* c, uint32_t i) { return maestro_compact_get_position(c->fd, i % BENCH_CHANNELS, &c->tv); }
+static int32_t b_pololu_get_position(struct bench_ctx* c, uint32_t i) { return maestro_pololu_get_position(c->fd, BENCH_DEVICE, i % BENCH_CHANNELS, &c->tv); }
+static int32_t b_compact_get_positions(struct bench_ctx* c, uint32_t i) { return maestro_compact_get_positions(c->fd, c->num, 0, c->positions, NULL, &c->tv) == c->num ? 0 : -1; }
+static int32_t b_pololu_get_positions(struct bench_ctx* c, uint32_t i) { return maestro_pololu_get_positions(c->fd, BENCH_DEVICE, c->num, 0, c->positions, NULL, &c->tv) == c->num ? 0 : -1; }
+static int32_t b_compact_is_moving(struct bench_ctx* c, uint32_t i) { return maestro_compact_is_moving(c->fd, &c->tv); }
+static int32_t b_pololu_is_moving(struct bench_ctx* c, uint32_t i) { return maestro_pololu_is_moving(c->fd, BENCH_DEVICE, &c->tv); }
+static int32_t b_compact_get_errors(struct bench_ctx* c, uint32_t i) { return maestro_compact_get_errors(c->fd, &c->tv); }
+static int32_t b_pololu_get_errors(struct bench_ctx* c, uint32_t i) { return maestro_pololu_get_errors(c->fd, BENCH_DEVICE, &c->tv); }
+static int32_t b_compact_is_stopped(struct bench_ctx* c, uint32_t i) { return maestro_compact_is_stopped(c->fd, &c->tv); }
+static int32_t b_pololu_is_stopped(struct bench_ctx* c, uint32_t i) { return maestro_pololu_is_stopped(c->fd, BENCH_DEVICE, &c->tv); }
+
+/** Scripts */
+static int32_t b_compact_stop_script(struct bench_ctx* c, uint32_t i) { return maestro_compact_stop_script(c->fd); }
+static int32_t b_pololu_stop_script(struct bench_ctx* c, uint32_t i) { return maestro_pololu_stop_script(c->fd, BENCH_DEVICE); }
+static int32_t b_compact_restart_script(struct bench_ctx* c, uint32_t i) { return maestro_compact_restart_script(c->fd, 0); }
+static int32_t b_pololu_restart_script(struct bench_ctx* c, uint32_t i) { return maestro_pololu_restart_script(c->fd, BENCH_DEVICE, 0); }
+static int32_t b_compact_restart_script_par(struct bench_ctx* c, uint32_t i) { return maestro_compact_restart_script_par(c->fd, 0, 1); }
+static int32_t b_pololu_restart_script_par(struct bench_ctx* c, uint32_t i) { return maestro_pololu_restart_script_par(c->fd, BENCH_DEVICE, 0, 1); }
+
+/** Controller handle */
+static int32_t b_handle_set_target(struct bench_ctx* c, uint32_t i) { return maestro_set_target(c->m, i % BENCH_CHANNELS, bench_target(i)); }
+static int32_t b_handle_set_multiple_target(struct bench_ctx* c, uint32_t i) { return maestro_set_multiple_target(c->m, c->num, 0, c->targets); }
+static int32_t b_handle_get_position(struct bench_ctx* c, uint32_t i) { return maestro_get_position(c->m, i % BENCH_CHANNELS, &c->tv); }
+static int32_t b_handle_get_positions(struct bench_ctx* c, uint32_t i) { return maestro_get_positions(c->m, c->num, 0, c->positions, NULL, &c->tv) == c->num ? 0 : -1; }
+
+/** Whole pose re-applied with only two joints changed, shadow cache sends the two */
+static int32_t b_handle_pose_two_changed(struct bench_ctx* c, uint32_t i)
+{
+	uint16_t pose[BENCH_CHANNELS];
+
+	memcpy(pose, c->targets, sizeof(pose));
+	pose[i % c->num] = bench_target(i);
+	pose[(i + c->num / 2) % c->num] = bench_target(i);
+	return maestro_set_multiple_target(c->m, c->num, 0, pose);
+}
+
+/** Position predicted by motion model instead of get_position round trip */
+static int32_t b_model_predict(struct bench_ctx* c, uint32_t i)
+{
+	struct maestro_model_state st;
+
+	return maestro_model_predict(c->m, i % BENCH_CHANNELS, &st);
+}
+
+static void handle_setup(struct bench_ctx* c)
+{
+	c->m = maestro_handle_attach(c->fd, MAESTRO_COMPACT, BENCH_CHANNELS);
+}
+
+static void model_setup(struct bench_ctx* c)
+{
+	int ch;
+
+	handle_setup(c);
+	for (ch = 0; ch < BENCH_CHANNELS; ch++) {
+		maestro_set_speed(c->m, ch, 10);
+		maestro_set_acceleration(c->m, ch, 5);
+		maestro_set_target(c->m, ch, c->targets[ch]);
+	}
+}
+
+static void handle_teardown(struct bench_ctx* c)
+{
+	maestro_handle_close(c->m);
+	c->m = NULL;
+}
+
+/** Producer side of trajectory engine, waypoints are due every millisecond */
+static int32_t b_traj_push(struct bench_ctx* c, uint32_t i)
+{
+	struct maestro_waypoint wp;
+	int ch;
+
+	wp.t_ns = (uint64_t)(c->traj_seq++ + 10) * 1000000ull;
+	wp.first_channel = 0;
+	wp.channels_num = BENCH_CHANNELS;
+	for (ch = 0; ch < BENCH_CHANNELS; ch++) {
+		wp.targets[ch] = bench_target(i + ch);
+	}
+
+	while (maestro_traj_push(c->tr, &wp) < 0) {
+		maestro_traj_wait(c->tr);
+	}
+	return 0;
+}
+
+static void traj_setup(struct bench_ctx* c)
+{
+	c->m = maestro_handle_attach(c->fd, MAESTRO_COMPACT, BENCH_CHANNELS);
+	c->tr = maestro_traj_create(c->m, NULL);
+	c->traj_seq = 0;
+	maestro_traj_start(c->tr, 0);
+}
+
+static void traj_sync(struct bench_ctx* c)
+{
+	maestro_traj_wait(c->tr);
+}
+
+static void traj_teardown(struct bench_ctx* c)
+{
+	struct maestro_traj_stats st;
+	int b;
+
+	maestro_traj_get_stats(c->tr, &st);
+	fprintf(stdout, "%-36s %llu frames, lateness avg %.1f us, max %.1f us\n", "  traj",
+	        (unsigned long long) st.frames, st.frames ? st.late_sum_ns / 1e3 / st.frames : 0.0,
+	        st.late_max_ns / 1e3);
+	for (b = 0; b < MAESTRO_TRAJ_HIST_BUCKETS; b++) {
+		if (st.hist[b])
+			fprintf(stdout, "    late < %7u us %10llu\n", 1u << b, (unsigned long long) st.hist[b]);
+	}
+
+	maestro_traj_destroy(c->tr);
+	maestro_handle_close(c->m);
+	c->tr = NULL;
+	c->m = NULL;
+}
+
+/** Whole frame with num channels changed on each of three ports, ports written in parallel */
+static int32_t b_group_set_frame(struct bench_ctx* c, uint32_t i)
+{
+	int p, ch;
+
+	for (p = 0; p < BENCH_GROUP_PORTS; p++) {
+		for (ch = 0; ch < c->num; ch++) {
+			c->frame[p * BENCH_CHANNELS + ch] = bench_target(i + ch);
+		}
+	}
+	return maestro_group_set_frame(c->group, c->frame);
+}
+
+static void group_setup(struct bench_ctx* c)
+{
+	struct maestro_emu_config cfg;
+	int p, ch;
+
+	maestro_emu_config_default(&cfg);
+	cfg.device = BENCH_DEVICE;
+	cfg.channels = BENCH_CHANNELS;
+	cfg.baud = baud;
+
+	c->group = maestro_group_create(BENCH_GROUP_PORTS * BENCH_CHANNELS);
+	c->group_m[0] = maestro_handle_attach(c->fd, MAESTRO_COMPACT, BENCH_CHANNELS);
+	for (p = 1; p < BENCH_GROUP_PORTS; p++) {
+		c->group_emu[p - 1] = maestro_emu_create(&cfg);
+		maestro_emu_start(c->group_emu[p - 1]);
+		c->group_m[p] = maestro_handle_open(maestro_emu_device_name(c->group_emu[p - 1]), MAESTRO_COMPACT, BENCH_CHANNELS);
+	}
+
+	for (p = 0; p < BENCH_GROUP_PORTS; p++) {
+		for (ch = 0; ch < BENCH_CHANNELS; ch++) {
+			maestro_group_map(c->group, p * BENCH_CHANNELS + ch, c->group_m[p], ch);
+			c->frame[p * BENCH_CHANNELS + ch] = c->targets[ch];
+		}
+	}
+	maestro_group_set_frame(c->group, c->frame);
+}
+
+static void group_teardown(struct bench_ctx* c)
+{
+	struct maestro_group_stats st;
+	int p;
+
+	maestro_group_get_stats(c->group, &st);
+	fprintf(stdout, "%-36s %llu frames in %llu writes, start skew last %.1f us, max %.1f us\n", "  group",
+	        (unsigned long long) st.frames, (unsigned long long) st.writes,
+	        st.skew_last_ns / 1e3, st.skew_max_ns / 1e3);
+
+	maestro_group_destroy(c->group);
+	for (p = 0; p < BENCH_GROUP_PORTS; p++) {
+		maestro_handle_close(c->group_m[p]);
+	}
+	for (p = 0; p < BENCH_GROUP_PORTS - 1; p++) {
+		maestro_emu_destroy(c->group_emu[p]);
+	}
+	c->group = NULL;
+}
+
+/** Batch of num single set target commands with one write() */
+static int32_t b_compact_batch_set_target(struct bench_ctx* c, uint32_t i)
+{
+	struct maestro_batch batch;
+	int ch;
+
+	maestro_batch_init(&batch, c->batch_buf, sizeof(c->batch_buf));
+	for (ch = 0; ch < c->num; ch++) {
+		maestro_batch_compact_set_target(&batch, ch, c->targets[ch]);
+	}
+	return maestro_batch_flush(c->fd, &batch);
+}
+
+static int32_t b_pololu_batch_set_target(struct bench_ctx* c, uint32_t i)
+{
+	struct maestro_batch batch;
+	int ch;
+
+	maestro_batch_init(&batch, c->batch_buf, sizeof(c->batch_buf));
+	for (ch = 0; ch < c->num; ch++) {
+		maestro_batch_pololu_set_target(&batch, BENCH_DEVICE, ch, c->targets[ch]);
+	}
+	return maestro_batch_flush(c->fd, &batch);
+}
+
+/** Every third of first num channels changed, the rest are known and may bridge gaps */
+static int32_t b_compact_batch_set_targets_sparse(struct bench_ctx* c, uint32_t i)
+{
+	struct maestro_batch batch;
+	uint64_t changed = 0;
+	int ch;
+
+	for (ch = 0; ch < c->num; ch += 3) {
+		changed |= 1ull << ch;
+	}
+
+	maestro_batch_init(&batch, c->batch_buf, sizeof(c->batch_buf));
+	maestro_batch_compact_set_targets(&batch, BENCH_CHANNELS, c->targets, changed, ~0ull);
+	return maestro_batch_flush(c->fd, &batch);
+}
+
+static void async_done(void* arg, int32_t status, int32_t value)
+{
+	struct bench_ctx* c = (struct bench_ctx*) arg;
+
+	c->positions[c->async_done++ % BENCH_CHANNELS] = (uint16_t) value;
+}
+
+/** num position queries submitted at once, answers collected from epoll loop */
+static int32_t b_async_get_position(struct bench_ctx* c, uint32_t i)
+{
+	struct epoll_event ev;
+	int ch;
+
+	c->async_done = 0;
+	for (ch = 0; ch < c->num; ch++) {
+		if (maestro_async_pololu_get_position(c->async, BENCH_DEVICE, ch, 1000, async_done, c) < 0)
+			return -1;
+	}
+
+	while (maestro_async_pending(c->async)) {
+		ev.events = maestro_async_events(c->async);
+		ev.data.ptr = c->async;
+		epoll_ctl(c->epfd, EPOLL_CTL_MOD, maestro_async_fd(c->async), &ev);
+
+		if (epoll_wait(c->epfd, &ev, 1, maestro_async_timeout(c->async)) < 0)
+			return -1;
+		if (maestro_async_process(c->async, ev.events) < 0)
+			return -1;
+	}
+
+	return (c->async_done == c->num) ? 0 : -1;
+}
+
+static void async_setup(struct bench_ctx* c)
+{
+	struct epoll_event ev;
+
+	c->async = maestro_async_create(c->fd, BENCH_CHANNELS);
+	c->epfd = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.ptr = c->async;
+	epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void async_teardown(struct bench_ctx* c)
+{
+	maestro_async_destroy(c->async);
+	close(c->epfd);
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+	c->async = NULL;
+}
+
+/** Caller side cost of set target through I/O thread */
+static int32_t b_iothread_set_target(struct bench_ctx* c, uint32_t i)
+{
+	uint8_t buf[8];
+	struct maestro_batch batch;
+	int32_t res;
+
+	maestro_batch_init(&batch, buf, sizeof(buf));
+	maestro_batch_compact_set_target(&batch, i % BENCH_CHANNELS, bench_target(i));
+
+	/** Ring full -- wait for I/O thread, like real producer would drop or retry */
+	while (maestro_iothread_submit_batch(c->iot, &batch) < 0) {
+		res = maestro_iothread_flush(c->iot);
+		if (res < 0)
+			return res;
+	}
+	return 0;
+}
+
+static void iothread_setup(struct bench_ctx* c)
+{
+	c->iot = maestro_iothread_start(c->fd, 1024);
+}
+
+static void iothread_sync(struct bench_ctx* c)
+{
+	maestro_iothread_flush(c->iot);
+}
+
+static void iothread_teardown(struct bench_ctx* c)
+{
+	struct maestro_iothread_stats st;
+
+	maestro_iothread_get_stats(c->iot, &st);
+	fprintf(stdout, "%-36s %llu frames in %llu writes\n", "  iothread",
+	        (unsigned long long) st.frames, (unsigned long long) st.writes);
+	maestro_iothread_stop(c->iot);
+	c->iot = NULL;
+}
+
+/** Producer side cost of set target through coalescer flushing at 100 Hz */
+static int32_t b_coalesce_set_target(struct bench_ctx* c, uint32_t i)
+{
+	return maestro_coalesce_set_target(c->co, i % BENCH_CHANNELS, bench_target(i));
+}
+
+static void coalesce_setup(struct bench_ctx* c)
+{
+	c->co = maestro_coalesce_create(c->fd, MAESTRO_COMPACT, BENCH_CHANNELS);
+	maestro_coalesce_start(c->co, 100);
+}
+
+static void coalesce_sync(struct bench_ctx* c)
+{
+	maestro_coalesce_flush(c->co);
+}
+
+static void coalesce_teardown(struct bench_ctx* c)
+{
+	struct maestro_coalesce_stats st;
+
+	maestro_coalesce_stop(c->co);
+	maestro_coalesce_get_stats(c->co, &st);
+	fprintf(stdout, "%-36s %llu updates, %llu sent in %llu flushes\n", "  coalesce",
+	        (unsigned long long) st.updates, (unsigned long long) st.sent,
+	        (unsigned long long) st.flushes);
+	maestro_coalesce_destroy(c->co);
+	c->co = NULL;
+}
+
+/** Producer side cost of publishing pose to shared table flushing at 100 Hz */
+static int32_t b_shm_set_targets(struct bench_ctx* c, uint32_t i)
+{
+	c->targets[0] = bench_target(i);
+	return maestro_shm_set_targets(maestro_shm_get_table(c->shm), 0, c->num, c->targets);
+}
+
+static void shm_setup(struct bench_ctx* c)
+{
+	c->shm = maestro_shm_create("/mpololu_bench", c->fd, MAESTRO_COMPACT, BENCH_CHANNELS);
+	maestro_shm_start(c->shm, 100);
+}
+
+static void shm_sync(struct bench_ctx* c)
+{
+	maestro_shm_flush(c->shm);
+}
+
+static void shm_teardown(struct bench_ctx* c)
+{
+	struct maestro_shm_stats st;
+
+	maestro_shm_stop(c->shm);
+	maestro_shm_get_stats(c->shm, &st);
+	fprintf(stdout, "%-36s %llu sent in %llu flushes, %llu deferred\n", "  shm",
+	        (unsigned long long) st.sent, (unsigned long long) st.flushes,
+	        (unsigned long long) st.deferred);
+	maestro_shm_destroy(c->shm);
+	c->shm = NULL;
+}
+
+static const struct bench benches[] = {
+	{"compact_set_target", b_compact_set_target, 0},
+	{"pololu_set_target", b_pololu_set_target, 0},
+	{"minissc_set_target", b_minissc_set_target, 0},
+	{"compact_set_multiple_target", b_compact_set_multiple_target, 1},
+	{"pololu_set_multiple_target", b_pololu_set_multiple_target, 1},
+	{"compact_batch_set_target", b_compact_batch_set_target, 1},
+	{"pololu_batch_set_target", b_pololu_batch_set_target, 1},
+	{"compact_batch_set_targets_sparse", b_compact_batch_set_targets_sparse, 1},
+	{"iothread_set_target", b_iothread_set_target, 0, iothread_setup, iothread_sync, iothread_teardown},
+	{"coalesce_set_target", b_coalesce_set_target, 0, coalesce_setup, coalesce_sync, coalesce_teardown},
+	{"shm_set_targets", b_shm_set_targets, 1, shm_setup, shm_sync, shm_teardown},
+	{"traj_push", b_traj_push, 0, traj_setup, traj_sync, traj_teardown},
+	{"group_set_frame", b_group_set_frame, 1, group_setup, NULL, group_teardown},
+	{"handle_set_target", b_handle_set_target, 0, handle_setup, NULL, handle_teardown, 1},
+	{"handle_set_multiple_target", b_handle_set_multiple_target, 1, handle_setup, NULL, handle_teardown, 1},
+	{"handle_pose_two_changed", b_handle_pose_two_changed, 1, handle_setup, NULL, handle_teardown, 1},
+	{"handle_get_position", b_handle_get_position, 0, handle_setup, NULL, handle_teardown, 1},
+	{"handle_get_positions", b_handle_get_positions, 1, handle_setup, NULL, handle_teardown, 1},
+	{"model_predict", b_model_predict, 0, model_setup, NULL, handle_teardown, 1},
+	{"compact_set_speed", b_compact_set_speed, 0},
+	{"pololu_set_speed", b_pololu_set_speed, 0},
+	{"compact_set_acceleration", b_compact_set_acceleration, 0},
+	{"pololu_set_acceleration", b_pololu_set_acceleration, 0},
+	{"compact_set_pwm", b_compact_set_pwm, 0},
+	{"pololu_set_pwm", b_pololu_set_pwm, 0},
+	{"compact_get_position", b_compact_get_position, 0},
+	{"pololu_get_position", b_pololu_get_position, 0},
+	{"compact_get_positions", b_compact_get_positions, 1},
+	{"pololu_get_positions", b_pololu_get_positions, 1},
+	{"async_get_position", b_async_get_position, 1, async_setup, NULL, async_teardown},
+	{"compact_is_moving", b_compact_is_moving, 0},
+	{"pololu_is_moving", b_pololu_is_moving, 0},
+	{"compact_get_errors", b_compact_get_errors, 0},
+	{"pololu_get_errors", b_pololu_get_errors, 0},
+	{"compact_go_home", b_compact_go_home, 0},
+	{"pololu_go_home", b_pololu_go_home, 0},
+	{"compact_stop_script", b_compact_stop_script, 0},
+	{"pololu_stop_script", b_pololu_stop_script, 0},
+	{"compact_restart_script", b_compact_restart_script, 0},
+	{"pololu_restart_script", b_pololu_restart_script, 0},
+	{"compact_restart_script_par", b_compact_restart_script_par, 0},
+	{"pololu_restart_script_par", b_pololu_restart_script_par, 0},
+	{"compact_is_stopped", b_compact_is_stopped, 0},
+	{"pololu_is_stopped", b_pololu_is_stopped, 0},
+};
+
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+/** Barrier query: Pololu GET_MOVING_STATE, 3 bytes request and 1 byte answer */
+#define BARRIER_BYTES 4
+
+/**
+ * @brief Wait until emulator consumed everything written so far
+ *
+ * @details Answer to barrier query comes only after all previous commands are decoded.
+ */
+static void emu_settle(struct bench_ctx* ctx, struct maestro_emu* emu, struct maestro_emu_counters* cnt)
+{
+	maestro_pololu_is_moving(ctx->fd, BENCH_DEVICE, &ctx->tv);
+	maestro_emu_get_counters(emu, cnt);
+}
+
+/**
+ * @brief Run benchmark and print its line
+ *
+ * @retval 0 -- passed, -1 -- calls failed or hot path allocated memory
+ */
+static int32_t run_bench(struct bench_ctx* ctx, struct maestro_emu* emu, const char* name, const struct bench* b, uint64_t* lat)
+{
+	struct maestro_emu_counters before, after;
+	uint64_t start, total;
+	uint32_t i;
+	uint32_t errors = 0;
+	uint64_t allocs_start;
+
+	for (i = 0; i < iterations / 10; i++) {
+		b->fn(ctx, i);
+	}
+	if (b->sync)
+		b->sync(ctx);
+	emu_settle(ctx, emu, &before);
+
+	allocs_start = allocs;
+	total = now_ns();
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		if (b->fn(ctx, i) < 0)
+			errors++;
+		lat[i] = now_ns() - start;
+	}
+	total = now_ns() - total;
+	allocs_start = allocs - allocs_start;
+
+	if (b->sync)
+		b->sync(ctx);
+
+	emu_settle(ctx, emu, &after);
+
+	qsort(lat, iterations, sizeof(*lat), cmp_u64);
+
+	fprintf(stdout, "%-36s %10.0f %7.1f %9.2f %9.2f %9.2f %8.2f %6u\n",
+	        name,
+	        iterations * 1e9 / total,
+	        (double)(after.rx_bytes + after.tx_bytes - before.rx_bytes - before.tx_bytes - BARRIER_BYTES) / iterations,
+	        lat[iterations / 2] / 1e3,
+	        lat[(uint64_t) iterations * 99 / 100] / 1e3,
+	        lat[(uint64_t) iterations * 999 / 1000] / 1e3,
+	        (double) allocs_start / iterations,
+	        errors);
+	fflush(stdout);
+
+	return (errors || (b->hot && allocs_start)) ? -1 : 0;
+}
+
+static void pr_help (char* prog_name)
+{
+	printf("usage: %s [OPTIONS]\n", prog_name);
+	printf("Benchmark of libmpololu API against pty-backed Maestro emulator\n");
+	printf("List of options: \n");
+	printf("\t --iterations,n NUM\t\t number of calls per benchmark, default 2000\n");
+	printf("\t --baud,b VALUE\t\t\t simulated baud rate, default 0 -- no throttling\n");
+	printf("\t --filter,f STRING\t\t run only benchmarks with STRING in name\n");
+	printf("\t --help,h \t\t\t print this help and exit\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	struct maestro_emu_config cfg;
+	struct maestro_emu* emu;
+	struct bench_ctx ctx;
+	uint64_t* lat;
+	char name[BENCH_NAME_MAX];
+	uint32_t failed = 0;
+	int32_t c;
+	size_t b;
+	int n;
+
+	while (1) {
+		int32_t option_index = 0;
+		static struct option long_options[] = {
+			{"iterations", required_argument, 0,  'n' },
+			{"baud",       required_argument, 0,  'b' },
+			{"filter",     required_argument, 0,  'f' },
+			{"help",       no_argument,       0,  'h' },
+			{0,         0,                 0,  0 }
+		};
+
+		c = getopt_long(argc, argv, "n:b:f:h",
+		                long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			iterations = (uint32_t) atoi(optarg);
+			break;
+		case 'b':
+			baud = (uint32_t) atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'h':
+			pr_help(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			pr_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (iterations < 10)
+		iterations = 10;
+
+	maestro_emu_config_default(&cfg);
+	cfg.device = BENCH_DEVICE;
+	cfg.channels = BENCH_CHANNELS;
+	cfg.baud = baud;
+
+	emu = maestro_emu_create(&cfg);
+	if ((emu == NULL) || maestro_emu_start(emu)) {
+		fprintf(stderr, "Failed to start emulator\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fd = maestro_open(maestro_emu_device_name(emu));
+	if (ctx.fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", maestro_emu_device_name(emu));
+		exit(EXIT_FAILURE);
+	}
+	ctx.tv.tv_sec = 1;
+	for (n = 0; n < BENCH_CHANNELS; n++) {
+		ctx.targets[n] = 6000 + 10 * n;
+	}
+
+	lat = (uint64_t*) calloc(iterations, sizeof(*lat));
+	if (lat == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout, "emulator %s, baud %u, %u iterations\n", maestro_emu_device_name(emu), baud, iterations);
+	fprintf(stdout, "%-36s %10s %7s %9s %9s %9s %8s %6s\n",
+	        "benchmark", "ops/s", "B/op", "p50,us", "p99,us", "p999,us", "allocs/op", "errors");
+
+	for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+		if (filter && !strstr(benches[b].name, filter))
+			continue;
+
+		if (benches[b].setup)
+			benches[b].setup(&ctx);
+
+		if (!benches[b].multi) {
+			ctx.num = 1;
+			if (run_bench(&ctx, emu, benches[b].name, &benches[b], lat))
+				failed++;
+		} else {
+			for (n = 1; n <= BENCH_CHANNELS; n++) {
+				ctx.num = (uint8_t) n;
+				snprintf(name, sizeof(name), "%s/%d", benches[b].name, n);
+				if (run_bench(&ctx, emu, name, &benches[b], lat))
+					failed++;
+			}
+		}
+
+		if (benches[b].teardown)
+			benches[b].teardown(&ctx);
+	}
+
+	free(lat);
+	maestro_close(ctx.fd);
+	maestro_emu_destroy(emu);
+
+	if (failed) {
+		fprintf(stderr, "%u benchmarks failed: calls returned errors or hot path allocated memory\n", failed);
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
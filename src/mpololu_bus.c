@@ -0,0 +1,577 @@
+/**
+ * @file   mpololu_bus.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Arbiter of daisy-chained Pololu protocol devices on one serial line.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpololu.h"
+#include "mpololu_async.h"
+#include "mpololu_bus.h"
+#include "mpololu_priv.h"
+
+struct bus_query {
+	uint8_t cmd[CMD_SIZE(0, CMD_GET_POSITION_SIZE)];
+	uint8_t len;
+	uint8_t ans_len;
+	int32_t timeout_ms;
+	maestro_async_cb cb;
+	void* arg;
+};
+
+struct bus_device {
+	uint8_t number;
+	uint8_t channels;
+	uint32_t caps;    /** MAESTRO_CAP_* */
+	uint64_t dirty;   /** targets waiting for write */
+	uint64_t known;   /** targets already on device, may bridge gaps */
+	uint16_t targets[MAESTRO_PLAN_MAX_CHANNELS];
+
+	/** Queries waiting for line, ring */
+	struct bus_query* q;
+	uint32_t q_head;
+	uint32_t q_count;
+};
+
+struct bus_inflight {
+	maestro_async_cb cb;
+	void* arg;
+};
+
+struct maestro_bus {
+	struct maestro_async* async;
+	uint32_t max_queries;
+
+	struct bus_device dev[MAESTRO_BUS_MAX_DEVICES];
+	int devices_num;
+
+	/** Device owning RX path while its answers are outstanding, -1 -- none yet */
+	int owner;
+	int query_rr;  /** next device to get the line */
+	int write_rr;  /** device written first when not all fit into one write */
+
+	/** Outstanding queries of owner in send order, ring */
+	struct bus_inflight* inflight;
+	uint32_t inflight_head;
+	uint32_t inflight_count;
+
+	uint8_t tx[MAESTRO_ASYNC_TX_SIZE];
+
+	struct maestro_bus_stats stats;
+};
+
+
+static struct bus_device* bus_device(struct maestro_bus* bus, uint8_t number)
+{
+	int i;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		if (bus->dev[i].number == number)
+			return &bus->dev[i];
+	}
+
+	maestro_fail(MAESTRO_ERR_ARG, "unknown device");
+	return NULL;
+}
+
+static int bus_dirty(const struct maestro_bus* bus)
+{
+	int i;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		if (bus->dev[i].dirty)
+			return 1;
+	}
+
+	return 0;
+}
+
+/** Any device other than owner waits for the line */
+static int bus_others_waiting(const struct maestro_bus* bus)
+{
+	int i;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		if ((i != bus->owner) && bus->dev[i].q_count)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void bus_done(void* arg, int32_t status, int32_t value)
+{
+	struct maestro_bus* bus = (struct maestro_bus*) arg;
+	struct bus_inflight r = bus->inflight[bus->inflight_head];
+
+	bus->inflight_head = (bus->inflight_head + 1) % bus->max_queries;
+	bus->inflight_count--;
+
+	if (status)
+		bus->stats.failures++;
+	else
+		bus->stats.answers++;
+
+	r.cb(r.arg, status, value);
+}
+
+/**
+ * @brief Send queries allowed to go to the line now
+ *
+ * @details Owner keeps pipelining while nobody else waits, otherwise the line
+ * is handed to next waiting device once all answers of owner came back.
+ * After timeout answers of owner may still arrive, so the line is not handed
+ * over until they are drained or the line is quiet.
+ */
+static int32_t bus_schedule(struct maestro_bus* bus)
+{
+	while (1) {
+		struct bus_device* d;
+		struct bus_query q;
+		struct bus_inflight* r;
+		int32_t res;
+		int i, idx = -1;
+
+		if (bus->inflight_count) {
+			d = &bus->dev[bus->owner];
+			if (!d->q_count || bus_others_waiting(bus) || (bus->inflight_count == bus->max_queries))
+				return 0;
+			idx = bus->owner;
+		} else {
+			for (i = 0; i < bus->devices_num; i++) {
+				int k = (bus->query_rr + i) % bus->devices_num;
+
+				if (bus->dev[k].q_count) {
+					idx = k;
+					break;
+				}
+			}
+			if (idx < 0)
+				return 0;
+
+			if (maestro_async_resyncing(bus->async))
+				return 0;
+
+			if ((bus->owner >= 0) && (bus->owner != idx))
+				bus->stats.switches++;
+			bus->owner = idx;
+			bus->query_rr = (idx + 1) % bus->devices_num;
+		}
+
+		/** Targets set before query must reach device before it */
+		res = maestro_bus_flush(bus);
+		if (res < 0)
+			return res;
+
+		d = &bus->dev[idx];
+		q = d->q[d->q_head];
+		d->q_head = (d->q_head + 1) % bus->max_queries;
+		d->q_count--;
+
+		r = &bus->inflight[(bus->inflight_head + bus->inflight_count) % bus->max_queries];
+		r->cb = q.cb;
+		r->arg = q.arg;
+		bus->inflight_count++;
+		bus->stats.queries++;
+
+		/** Query is not queued -- put it back, if TX queue is full it goes out on next process */
+		res = maestro_async_submit(bus->async, q.cmd, q.len, q.ans_len, q.timeout_ms, bus_done, bus);
+		if ((res < 0) && (res != MAESTRO_ERR_IO)) {
+			d->q_head = (d->q_head + bus->max_queries - 1) % bus->max_queries;
+			d->q_count++;
+			bus->inflight_count--;
+			bus->stats.queries--;
+			return (res == MAESTRO_ERR_FULL) ? 0 : res;
+		}
+		/** Query is queued, write failed */
+		if (res < 0)
+			return res;
+	}
+}
+
+static int32_t bus_query(struct maestro_bus* bus, uint8_t device, const uint8_t* cmd, size_t len, size_t ans_len,
+                         int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	struct bus_device* d = bus_device(bus, device);
+	struct bus_query* q;
+
+	if (d == NULL)
+		return MAESTRO_ERR_ARG;
+
+	if (cb == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	if (d->q_count == bus->max_queries)
+		return maestro_fail(MAESTRO_ERR_FULL, "too many queries of device");
+
+	q = &d->q[(d->q_head + d->q_count) % bus->max_queries];
+	memcpy(q->cmd, cmd, len);
+	q->len = (uint8_t) len;
+	q->ans_len = (uint8_t) ans_len;
+	q->timeout_ms = timeout_ms;
+	q->cb = cb;
+	q->arg = arg;
+	d->q_count++;
+
+	return bus_schedule(bus);
+}
+
+
+/**
+ * @brief Create arbiter on opened COM-port
+ */
+struct maestro_bus* maestro_bus_create(int32_t fd, uint32_t max_queries)
+{
+	struct maestro_bus* bus;
+
+	if (max_queries == 0) {
+		maestro_fail(MAESTRO_ERR_ARG, "max_queries must be positive");
+		return NULL;
+	}
+
+	bus = (struct maestro_bus*) calloc(1, sizeof(*bus));
+	if (bus == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	bus->inflight = (struct bus_inflight*) calloc(max_queries, sizeof(*bus->inflight));
+	if (bus->inflight == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		free(bus);
+		return NULL;
+	}
+
+	bus->async = maestro_async_create(fd, max_queries);
+	if (bus->async == NULL) {
+		free(bus->inflight);
+		free(bus);
+		return NULL;
+	}
+
+	bus->max_queries = max_queries;
+	bus->owner = -1;
+
+	return bus;
+}
+
+/**
+ * @brief Destroy arbiter
+ */
+void maestro_bus_destroy(struct maestro_bus* bus)
+{
+	int i;
+
+	if (bus == NULL)
+		return;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		struct bus_device* d = &bus->dev[i];
+
+		while (d->q_count) {
+			struct bus_query q = d->q[d->q_head];
+
+			d->q_head = (d->q_head + 1) % bus->max_queries;
+			d->q_count--;
+			q.cb(q.arg, MAESTRO_ERR_STATE, -1);
+		}
+	}
+
+	/** Fails outstanding queries through bus_done() */
+	maestro_async_destroy(bus->async);
+
+	for (i = 0; i < bus->devices_num; i++) {
+		free(bus->dev[i].q);
+	}
+	free(bus->inflight);
+	free(bus);
+}
+
+/**
+ * @brief Add device to bus
+ */
+int32_t maestro_bus_add_device(struct maestro_bus* bus, uint8_t device, uint8_t channels)
+{
+	struct bus_device* d;
+	int i;
+
+	if ((channels == 0) || (channels > MAESTRO_PLAN_MAX_CHANNELS))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channels number");
+
+	for (i = 0; i < bus->devices_num; i++) {
+		if (bus->dev[i].number == device)
+			return maestro_fail(MAESTRO_ERR_STATE, "device is already on bus");
+	}
+
+	if (bus->devices_num == MAESTRO_BUS_MAX_DEVICES)
+		return maestro_fail(MAESTRO_ERR_FULL, "too many devices on bus");
+
+	d = &bus->dev[bus->devices_num];
+	d->q = (struct bus_query*) calloc(bus->max_queries, sizeof(*d->q));
+	if (d->q == NULL)
+		return maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+
+	d->number = device;
+	d->channels = channels;
+	d->caps = 0;
+	d->dirty = 0;
+	d->known = 0;
+	d->q_head = 0;
+	d->q_count = 0;
+
+	bus->devices_num++;
+	return 0;
+}
+
+/**
+ * @brief Set limits of device
+ */
+int32_t maestro_bus_set_device_caps(struct maestro_bus* bus, uint8_t device, uint32_t caps)
+{
+	struct bus_device* d = bus_device(bus, device);
+
+	if (d == NULL)
+		return MAESTRO_ERR_ARG;
+
+	d->caps = caps;
+	return 0;
+}
+
+/**
+ * @brief Descriptor to wait on
+ */
+int32_t maestro_bus_fd(const struct maestro_bus* bus)
+{
+	return maestro_async_fd(bus->async);
+}
+
+/**
+ * @brief Events to wait for
+ */
+uint32_t maestro_bus_events(const struct maestro_bus* bus)
+{
+	return maestro_async_events(bus->async) | (bus_dirty(bus) ? MAESTRO_ASYNC_OUT : 0);
+}
+
+/**
+ * @brief Time until nearest query deadline
+ */
+int32_t maestro_bus_timeout(const struct maestro_bus* bus)
+{
+	return maestro_async_timeout(bus->async);
+}
+
+/**
+ * @brief Process readiness
+ */
+int32_t maestro_bus_process(struct maestro_bus* bus, uint32_t events)
+{
+	int32_t done, res;
+
+	done = maestro_async_process(bus->async, events);
+	if (done < 0)
+		return done;
+
+	res = maestro_bus_flush(bus);
+	if (res < 0)
+		return res;
+
+	res = bus_schedule(bus);
+	if (res < 0)
+		return res;
+
+	return done;
+}
+
+/**
+ * @brief Number of queued and outstanding queries
+ */
+uint32_t maestro_bus_pending(const struct maestro_bus* bus)
+{
+	uint32_t n = bus->inflight_count;
+	int i;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		n += bus->dev[i].q_count;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Process bus until all queries are completed and targets written
+ */
+int32_t maestro_bus_run(struct maestro_bus* bus, int32_t timeout_ms)
+{
+	uint64_t deadline = (timeout_ms < 0) ? 0 : maestro_now_ns() + (uint64_t) timeout_ms * 1000000ull;
+	struct pollfd pfd;
+	int32_t res;
+
+	while (maestro_bus_pending(bus) || (maestro_bus_events(bus) & MAESTRO_ASYNC_OUT)) {
+		int32_t wait = maestro_bus_timeout(bus);
+		uint32_t events = maestro_bus_events(bus);
+		int rv;
+
+		if (deadline) {
+			uint64_t now = maestro_now_ns();
+			int32_t left;
+
+			if (now >= deadline)
+				return maestro_fail(MAESTRO_ERR_TIMEOUT, "bus run");
+			left = (int32_t)((deadline - now + 999999) / 1000000);
+			if ((wait < 0) || (left < wait))
+				wait = left;
+		}
+
+		pfd.fd = maestro_bus_fd(bus);
+		pfd.events = ((events & MAESTRO_ASYNC_IN) ? POLLIN : 0) | ((events & MAESTRO_ASYNC_OUT) ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		rv = poll(&pfd, 1, wait);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return maestro_fail(MAESTRO_ERR_IO, "poll");
+		}
+
+		events = ((pfd.revents & POLLIN) ? MAESTRO_ASYNC_IN : 0) | ((pfd.revents & POLLOUT) ? MAESTRO_ASYNC_OUT : 0);
+		if (pfd.revents & (POLLERR | POLLHUP))
+			events = 0;
+
+		/** Timeout of poll -- process expires requests */
+		res = maestro_bus_process(bus, rv ? events : MAESTRO_ASYNC_IN);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set target of device channel
+ */
+int32_t maestro_bus_set_target(struct maestro_bus* bus, uint8_t device, uint8_t channel, uint16_t target)
+{
+	struct bus_device* d = bus_device(bus, device);
+
+	if (d == NULL)
+		return MAESTRO_ERR_ARG;
+
+	if (channel >= d->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	if ((d->known & (1ull << channel)) && (d->targets[channel] == target) && !(d->dirty & (1ull << channel)))
+		return 0;
+
+	d->targets[channel] = target;
+	d->dirty |= 1ull << channel;
+	return 0;
+}
+
+/**
+ * @brief Write pending targets of all devices with single write
+ */
+int32_t maestro_bus_flush(struct maestro_bus* bus)
+{
+	struct maestro_batch batch;
+	uint32_t encoded = 0;
+	int32_t res;
+	int i, next = bus->write_rr;
+
+	maestro_batch_init(&batch, bus->tx, sizeof(bus->tx));
+
+	for (i = 0; i < bus->devices_num; i++) {
+		int k = (bus->write_rr + i) % bus->devices_num;
+		struct bus_device* d = &bus->dev[k];
+
+		if (!d->dirty)
+			continue;
+
+		/** Does not fit -- rest goes with next write, starting from this device */
+		if (maestro_batch_set_targets(&batch, d->number, d->caps, 0, d->channels, d->targets, d->dirty, d->known))
+			break;
+
+		encoded |= 1u << k;
+		next = (k + 1) % bus->devices_num;
+	}
+
+	if (!encoded)
+		return 0;
+
+	/** Async queue is full -- keep targets dirty, they go out on next flush */
+	res = maestro_async_submit_batch(bus->async, &batch);
+	if (res < 0)
+		return (res == MAESTRO_ERR_FULL) ? 0 : res;
+
+	for (i = 0; i < bus->devices_num; i++) {
+		struct bus_device* d = &bus->dev[i];
+
+		if (!(encoded & (1u << i)))
+			continue;
+
+		bus->stats.targets += __builtin_popcountll(d->dirty);
+		d->known |= d->dirty;
+		d->dirty = 0;
+	}
+
+	bus->write_rr = next;
+	bus->stats.writes++;
+	return 0;
+}
+
+/**
+ * @brief Queue get position query
+ */
+int32_t maestro_bus_get_position(struct maestro_bus* bus, uint8_t device, uint8_t channel, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_GET_POSITION_SIZE)];
+	size_t len = maestro_enc_get_position(command, device, channel);
+
+	return bus_query(bus, device, command, len, ANSWER_GET_POSITION_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get moving state query
+ */
+int32_t maestro_bus_is_moving(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_MOVING_STATE);
+
+	return bus_query(bus, device, command, len, ANSWER_IS_MOVING_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get errors query
+ */
+int32_t maestro_bus_get_errors(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_ERRORS);
+
+	return bus_query(bus, device, command, len, ANSWER_GET_ERRORS_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Queue get script status query
+ */
+int32_t maestro_bus_is_stopped(struct maestro_bus* bus, uint8_t device, int32_t timeout_ms, maestro_async_cb cb, void* arg)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_SCRIPT_STATUS);
+
+	return bus_query(bus, device, command, len, ANSWER_IS_STOPPED_SIZE, timeout_ms, cb, arg);
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_bus_get_stats(const struct maestro_bus* bus, struct maestro_bus_stats* stats)
+{
+	*stats = bus->stats;
+}
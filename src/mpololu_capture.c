@@ -0,0 +1,196 @@
+/**
+ * @file   mpololu_capture.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Binary capture of bytes written to and read from controllers.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include "mpololu.h"
+#include "mpololu_capture.h"
+#include "mpololu_priv.h"
+
+#define CAPTURE_BUF_SIZE 65536
+
+/** Checked on every read and write, set only while file is open */
+atomic_int maestro_capture_enabled;
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	size_t len;
+	struct maestro_capture_stats stats;
+	uint8_t buf[CAPTURE_BUF_SIZE];
+} capture = {PTHREAD_MUTEX_INITIALIZER, -1, 0, {0, 0, 0}, {0}};
+
+
+static int32_t capture_write_all(const uint8_t* buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t wr;
+
+	while (done < len) {
+		wr = write(capture.fd, buf + done, len - done);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return maestro_fail(MAESTRO_ERR_IO, "capture write");
+		}
+		done += wr;
+	}
+
+	return 0;
+}
+
+/** Called with lock held */
+static int32_t capture_flush_locked(void)
+{
+	int32_t res = 0;
+
+	if ((capture.fd >= 0) && capture.len)
+		res = capture_write_all(capture.buf, capture.len);
+
+	capture.len = 0;
+	return res;
+}
+
+/**
+ * @brief Append record, data longer than record limit is split
+ */
+void maestro_capture_record(int32_t fd, uint8_t dir, const uint8_t* data, size_t len)
+{
+	struct maestro_capture_record rec;
+	uint64_t now = maestro_now_ns();
+
+	pthread_mutex_lock(&capture.lock);
+
+	while ((capture.fd >= 0) && len) {
+		size_t n = (len > UINT16_MAX) ? UINT16_MAX : len;
+
+		rec.ts_ns = now;
+		rec.fd = fd;
+		rec.len = (uint16_t) n;
+		rec.dir = dir;
+		rec.flags = 0;
+
+		if ((capture.len + sizeof(rec) + n > sizeof(capture.buf)) && capture_flush_locked())
+			capture.stats.errors++;
+
+		if (sizeof(rec) + n > sizeof(capture.buf)) {
+			/** Too big for buffer, goes straight to file */
+			if (capture_write_all((const uint8_t*) &rec, sizeof(rec)) || capture_write_all(data, n))
+				capture.stats.errors++;
+		} else {
+			memcpy(capture.buf + capture.len, &rec, sizeof(rec));
+			memcpy(capture.buf + capture.len + sizeof(rec), data, n);
+			capture.len += sizeof(rec) + n;
+		}
+
+		capture.stats.records++;
+		capture.stats.bytes += n;
+		data += n;
+		len -= n;
+	}
+
+	pthread_mutex_unlock(&capture.lock);
+}
+
+
+/**
+ * @brief Start capture
+ */
+int32_t maestro_capture_start(const char* path)
+{
+	struct maestro_capture_header hdr;
+	int32_t res;
+
+	pthread_mutex_lock(&capture.lock);
+
+	if (capture.fd >= 0) {
+		res = maestro_fail(MAESTRO_ERR_STATE, "capture is already running");
+		goto out;
+	}
+
+	capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture.fd < 0) {
+		res = maestro_fail(MAESTRO_ERR_IO, "open capture file");
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAESTRO_CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = MAESTRO_CAPTURE_VERSION;
+	hdr.record_size = sizeof(struct maestro_capture_record);
+	hdr.start_ns = maestro_now_ns();
+
+	res = capture_write_all((const uint8_t*) &hdr, sizeof(hdr));
+	if (res) {
+		close(capture.fd);
+		capture.fd = -1;
+		goto out;
+	}
+
+	capture.len = 0;
+	memset(&capture.stats, 0, sizeof(capture.stats));
+	atomic_store(&maestro_capture_enabled, 1);
+	res = 0;
+
+out:
+	pthread_mutex_unlock(&capture.lock);
+	return res;
+}
+
+/**
+ * @brief Stop capture, write buffered records and close file
+ */
+int32_t maestro_capture_stop(void)
+{
+	int32_t res;
+
+	atomic_store(&maestro_capture_enabled, 0);
+
+	pthread_mutex_lock(&capture.lock);
+
+	if (capture.fd < 0) {
+		pthread_mutex_unlock(&capture.lock);
+		return maestro_fail(MAESTRO_ERR_STATE, "capture is not running");
+	}
+
+	res = capture_flush_locked();
+	if (close(capture.fd) && !res)
+		res = maestro_fail(MAESTRO_ERR_IO, "close capture file");
+	capture.fd = -1;
+
+	pthread_mutex_unlock(&capture.lock);
+	return res;
+}
+
+/**
+ * @brief Write buffered records to file
+ */
+int32_t maestro_capture_flush(void)
+{
+	int32_t res;
+
+	pthread_mutex_lock(&capture.lock);
+	res = capture_flush_locked();
+	pthread_mutex_unlock(&capture.lock);
+
+	return res;
+}
+
+/**
+ * @brief Get statistics of current or last capture
+ */
+void maestro_capture_get_stats(struct maestro_capture_stats* stats)
+{
+	pthread_mutex_lock(&capture.lock);
+	*stats = capture.stats;
+	pthread_mutex_unlock(&capture.lock);
+}
@@ -1,11 +1,17 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <time.h>
 #include "mpololu.h" /* Maestro Pololu Lib */
+#include "mpololu_capture.h"
+#include "mpololu_handle.h"
+#include "mpololu_metrics.h"
 
 #define LINE_MAX (255)
+#define CMD_CHANNELS (24) /** Channels of the largest Maestro */
 
 int32_t device = -1;
 int32_t channel = -1;
@@ -39,6 +45,11 @@ int mult_first = -1;
 char *file = NULL;
 
 char *device_file = "/dev/ttyACM0";
+uint32_t baud = 0;
+
+int stats = 0;
+char *capture_file = NULL;
+char *script_file = NULL;
 
 struct timeval tv;
 
@@ -83,50 +94,299 @@ static void pr_errors (uint16_t err_code)
 
 }
 
-static int32_t get_targets_list(char* file_name, uint16_t **targets_p)
+/**
+ * Motion file: "motion 1" header line followed by frame lines, parsed one
+ * line at a time, so memory does not depend on number of frames.
+ *
+ *     [@MS | +MS] [dNUM] [cNUM] TARGET...
+ *
+ * @MS -- frame time since start of playback, +MS -- delay after previous
+ * frame (default "period MS" line, initially 0), dNUM -- Pololu protocol
+ * device (default --device), cNUM -- first channel (default --mult-first or 0).
+ * Frames of the same time are sent with single write.
+ */
+#define MOTION_LINE_MAX (2048)
+#define MOTION_BATCH_SIZE (4096)
+#define MOTION_MAX_TARGETS (255)
+#define MOTION_LATE_US (1000) /** Frame sent later than that is counted as late */
+
+struct motion {
+	struct maestro* m;
+	struct maestro_batch batch;
+	uint8_t buf[MOTION_BATCH_SIZE];
+	uint64_t start_ns;      /** CLOCK_MONOTONIC time of playback start */
+	int64_t due_ms;         /** time of frames in batch */
+	int64_t last_ms;        /** time of previous frame */
+	int32_t period_ms;      /** delay of frames without time */
+	int32_t line;
+	uint64_t frames;
+	uint64_t writes;
+	uint64_t late;
+	uint64_t late_max_us;
+};
+
+static uint64_t motion_now_ns (void)
 {
-	FILE* fp;
-	char line[LINE_MAX];   
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Parse integer argument within [min, max] */
+static int motion_arg (const struct motion* mo, const char* arg, const char* name, long long min, long long max, long long* value)
+{
+	char* end;
+	long long v;
+
+	v = strtoll(arg, &end, 0);
+	if ((end == arg) || (*end != '\0') || (v < min) || (v > max)) {
+		fprintf(stderr, "line %d: bad %s '%s'\n", mo->line, name, arg);
+		return -1;
+	}
+
+	*value = v;
+	return 0;
+}
+
+/** Send frames collected in batch at their time */
+static int32_t motion_send (struct motion* mo)
+{
+	struct timespec ts;
+	uint64_t due, now;
+
+	if (!mo->batch.len)
+		return 0;
+
+	due = mo->start_ns + (uint64_t) mo->due_ms * 1000000ull;
+	ts.tv_sec = due / 1000000000ull;
+	ts.tv_nsec = due % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+
+	now = motion_now_ns();
+	if (now > due + MOTION_LATE_US * 1000ull)
+		mo->late++;
+	if ((now > due) && ((now - due) / 1000 > mo->late_max_us))
+		mo->late_max_us = (now - due) / 1000;
+
+	mo->writes++;
+	if (maestro_handle_send_batch(mo->m, &mo->batch) < 0) {
+		fprintf(stderr, "line %d: failed to set targets\n", mo->line);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Parse frame line and queue it
+ *
+ * @retval 0 -- success, -1 -- failed
+ */
+static int32_t motion_frame (struct motion* mo, char* line)
+{
+	uint16_t targets[MOTION_MAX_TARGETS];
+	int32_t dev = device;
+	long long first = (mult_first == -1) ? 0 : mult_first;
+	int64_t t = mo->last_ms + mo->period_ms;
+	int32_t num = 0;
+	size_t size;
+	char* save = NULL;
+	char* tok;
+	long long v;
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (tok[0] == '#')
+			break;
+
+		if (tok[0] == '@') {
+			if (motion_arg(mo, tok + 1, "time", 0, INT32_MAX, &v))
+				return -1;
+			t = v;
+		} else if (tok[0] == '+') {
+			if (motion_arg(mo, tok + 1, "delay", 0, INT32_MAX, &v))
+				return -1;
+			t = mo->last_ms + v;
+		} else if (tok[0] == 'd') {
+			if (motion_arg(mo, tok + 1, "device", 0, 0x7F, &v))
+				return -1;
+			dev = (int32_t) v;
+		} else if (tok[0] == 'c') {
+			if (motion_arg(mo, tok + 1, "first channel", 0, 0xFF, &first))
+				return -1;
+		} else {
+			if (num == MOTION_MAX_TARGETS) {
+				fprintf(stderr, "line %d: more than %d targets\n", mo->line, MOTION_MAX_TARGETS);
+				return -1;
+			}
+			if (motion_arg(mo, tok, "target", 0, 0xFFFF, &v))
+				return -1;
+			targets[num++] = (uint16_t) v;
+		}
+	}
+
+	/** Line with time only is a pause */
+	mo->last_ms = t;
+	if (!num)
+		return 0;
+
+	if (first + num > 0x100) {
+		fprintf(stderr, "line %d: channels beyond 255\n", mo->line);
+		return -1;
+	}
+
+	/** Set multiple target is 3 bytes plus 2 per target, Pololu protocol adds 2 */
+	size = 3 + 2 * (size_t) num + ((dev < 0) ? 0 : 2);
+	if (mo->batch.len && ((t != mo->due_ms) || (mo->batch.len + size > mo->batch.size))) {
+		if (motion_send(mo) < 0)
+			return -1;
+	}
+
+	if (dev < 0)
+		maestro_batch_compact_set_multiple_target(&mo->batch, (uint8_t) num, (uint8_t) first, targets);
+	else
+		maestro_batch_pololu_set_multiple_target(&mo->batch, (uint8_t) dev, (uint8_t) num, (uint8_t) first, targets);
+
+	mo->due_ms = t;
+	mo->frames++;
+	return 0;
+}
+
+/**
+ * @brief Play motion file, header line is already read
+ *
+ * @retval 0 -- success, -1 -- failed at some line
+ */
+static int32_t exec_motion (struct maestro* m, FILE* fp)
+{
+	struct motion* mo;
+	char line[MOTION_LINE_MAX];
+	int32_t res = 0;
+	size_t len;
+
+	mo = (struct motion*) calloc(1, sizeof(*mo));
+	if (mo == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	mo->m = m;
+	mo->line = 1;
+	maestro_batch_init(&mo->batch, mo->buf, sizeof(mo->buf));
+	mo->start_ns = motion_now_ns();
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char* p = line + strspn(line, " \t");
+
+		mo->line++;
+
+		len = strlen(line);
+		if (len && (line[len - 1] != '\n') && !feof(fp)) {
+			fprintf(stderr, "line %d: longer than %d characters\n", mo->line, MOTION_LINE_MAX - 2);
+			res = -1;
+			break;
+		}
+
+		if (!strncmp(p, "period", 6)) {
+			long long v;
+
+			p = strtok(p + 6, " \t\r\n");
+			if ((p == NULL) || motion_arg(mo, p, "period", 0, INT32_MAX, &v)) {
+				res = -1;
+				break;
+			}
+			mo->period_ms = (int32_t) v;
+			continue;
+		}
+
+		res = motion_frame(mo, p);
+		if (res)
+			break;
+	}
+
+	if (!res)
+		res = motion_send(mo);
+
+	fprintf(stdout, "MOTION: %llu frames in %llu writes, %llu late, max lateness %.1f ms\n",
+	        (unsigned long long) mo->frames, (unsigned long long) mo->writes,
+	        (unsigned long long) mo->late, (double) mo->late_max_us / 1000.0);
+
+	free(mo);
+	return res;
+}
+
+/**
+ * @brief Set targets from --file: motion file or list of --mult-num targets
+ *
+ * @retval 0 -- success, -1 -- failed
+ */
+static int32_t exec_file (struct maestro* m)
+{
+	uint16_t targets[MOTION_MAX_TARGETS];
+	char line[LINE_MAX];
+	int32_t res = -1;
 	int32_t sz = 0;
+	FILE* fp;
 
-	fprintf(stdout, "Processing file %s...\n", file);
-		
 	fp = fopen(file, "r");
-		
 	if (fp == NULL) {
-		perror("failed to open file");
-		return -1;			
+		perror(file);
+		return -1;
+	}
+
+	if ((fgets(line, sizeof(line), fp) != NULL) && !strncmp(line, "motion", 6)) {
+		if (strtol(line + 6, NULL, 10) != 1)
+			fprintf(stderr, "%s: unsupported motion file version\n", file);
+		else
+			res = exec_motion(m, fp);
+		fclose(fp);
+		return res;
 	}
-		
-	while (fgets(line, LINE_MAX, fp) != NULL) {
-		int target = atoi(line);
-		
-		fprintf(stdout, "Target %u...\n", (uint16_t) target);
-		
-		sz++;
-		
-		*targets_p = (uint16_t *) realloc(*targets_p, sz * sizeof(uint16_t));
 
-		(*targets_p)[sz - 1] = (uint16_t) target;
-	}		
+	if ((mult_num < 1) || (mult_num > MOTION_MAX_TARGETS)) {
+		fprintf(stderr, "Use --mult-num for specifying number of targets in %s\n", file);
+	} else if (mult_first == -1) {
+		fprintf(stderr, "Use --mult-first for specifying first channel\n");
+	} else {
+		/** One target per line, only --mult-num of them are needed */
+		rewind(fp);
+		while ((sz < mult_num) && (fgets(line, sizeof(line), fp) != NULL)) {
+			targets[sz++] = (uint16_t) atoi(line);
+		}
+
+		if (sz < mult_num) {
+			fprintf(stderr, "Number of targets in %s less then specified mult-num value %d\n", file, mult_num);
+		} else if (maestro_set_multiple_target(m, (uint8_t) mult_num, (uint8_t) mult_first, targets) < 0) {
+			fprintf(stderr, "Failed to set number of targets and first channel num\n");
+		} else {
+			res = 0;
+		}
+	}
 
-	return sz;
+	fclose(fp);
+	return res;
 }
 
-static void exec_cmds_compact (int32_t fd) 
-{	
+/**
+ * @brief Execute options over handle
+ *
+ * @retval 0 -- success, -1 -- failed
+ */
+static int32_t exec_cmds_handle (struct maestro* m)
+{
 	/** Options */
 	if (speed != -1) {
-		if (maestro_compact_set_speed(fd, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)speed) < 0) {
+		if (maestro_set_speed(m, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)speed) < 0) {
 			fprintf(stderr, "Failed to set speed");
-			return;
+			return -1;
 		}
 	}
 
 	if (acceleration != -1) {
-		if (maestro_compact_set_acceleration(fd, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)acceleration) < 0) {
+		if (maestro_set_acceleration(m, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)acceleration) < 0) {
 			fprintf(stderr, "Failed to set acceleration");
-			return;
+			return -1;
 		}
 	}
 	
@@ -134,93 +394,64 @@ static void exec_cmds_compact (int32_t fd)
 	    (pwm_ontime != -1)) {
 		if (pwm_ontime == -1) pwm_ontime = 0;
 		if (pwm_period == -1) pwm_period = 0;
-		if (maestro_compact_set_pwm(fd, (uint16_t)pwm_ontime, (uint16_t)pwm_period) < 0) {
+		if (maestro_set_pwm(m, (uint16_t)pwm_ontime, (uint16_t)pwm_period) < 0) {
 			fprintf(stderr, "Failed to set PWM");
-			return;
+			return -1;
 		}
 	}
 	
 	/** Script cmds */
 	if (stop) {
-		if (maestro_compact_stop_script(fd) < 0){
+		if (maestro_stop_script(m) < 0){
 			fprintf(stderr, "Failed to stop script");
-			return;
+			return -1;
 		}
 	}
 
 	if (restart != -1) {
 		if (parameter != -1) {
-			if (maestro_compact_restart_script_par(fd, (uint8_t)restart, (uint16_t) parameter) < 0){
+			if (maestro_restart_script_par(m, (uint8_t)restart, (uint16_t) parameter) < 0){
 				fprintf(stderr, "Failed to restart script at subroutine %d with par %d\n", restart, parameter);
-				return;
+				return -1;
 			}
 		} else {			
-			if (maestro_compact_restart_script(fd, (uint8_t)restart) < 0){
+			if (maestro_restart_script(m, (uint8_t)restart) < 0){
 				fprintf(stderr, "Failed to restart script at subroutine %d\n", restart);
-				return;
+				return -1;
 			}					
 		}
 	}
 
-	
-	
 	/** Set targets */
-	if (mult_num != -1) {
-		if (mult_first != -1) {
-			if (file) {
-				uint16_t *targets_p = NULL;
-				int32_t sz = get_targets_list(file, &targets_p);
-				if (sz > 0) {
-					if (sz < mult_num) {
-						fprintf(stderr, "Number of targets in %s less then specified mult-num value %d\n", file, mult_num);
-						free(targets_p);
-						return;
-					}
-					
-					if (maestro_compact_set_multiple_target(fd, 			                                        
-					                                       (uint8_t) mult_num, 
-					                                       (uint8_t) mult_first, 
-					                                       targets_p) < 0) {
-						fprintf(stderr, "Failed to set number of targets and first channel num\n");
-						free(targets_p);
-						return;
-					}
-					free(targets_p);
-				}
-			} else {
-				fprintf(stderr, "Use --file for specifying file name with targets list\n");			
-				return;				
-			}
-		} else {
-			fprintf(stderr, "Use --mult-first for specifying first channel\n");			
-			return;				
-		}
+	if (file) {
+		if (exec_file(m) < 0)
+			return -1;
+	} else if (mult_num != -1) {
+		fprintf(stderr, "Use --file for specifying file name with targets list\n");
+		return -1;
 	}
 	
 	if (target != -1) {
-
 		if (ssc) {
-			if (maestro_minissc_set_target(fd, (channel == -1) ? 0: (uint8_t) channel, (uint8_t) target) < 0) {
+			if (maestro_minissc_set_target(maestro_handle_fd(m), (channel == -1) ? 0: (uint8_t) channel, (uint8_t) target) < 0) {
 				fprintf(stderr, "Failed to set target\n");
-				return;
+				return -1;
 			}
 		} else {
-			if (maestro_compact_set_target(fd, (channel == -1) ? 0: (uint8_t) channel, (uint16_t) target) < 0) {
+			if (maestro_set_target(m, (channel == -1) ? 0: (uint8_t) channel, (uint16_t) target) < 0) {
 				fprintf(stderr, "Failed to set target\n");
-				return;
+				return -1;
 			}				
 		}
 	}
 
-	
 	/** Status cmds */
-	
 	if (is_stop) {
-		int res = maestro_compact_is_stopped(fd, (timeout != -1) ? &tv : NULL);
+		int res = maestro_is_stopped(m, (timeout != -1) ? &tv : NULL);
 		
-		if (res == -1) {
+		if (res < 0) {
 			fprintf(stderr, "Failed to check script status\n");
-			return;
+			return -1;
 		}
 
 		if (res == 1) {
@@ -231,11 +462,11 @@ static void exec_cmds_compact (int32_t fd)
 	}
 
 	if (is_moving) {
-		int res = maestro_compact_is_moving(fd, (timeout != -1) ? &tv : NULL);
+		int res = maestro_is_moving(m, (timeout != -1) ? &tv : NULL);
 		
-		if (res == -1) {
+		if (res < 0) {
 			fprintf(stderr, "Failed to check moving status\n");
-			return;
+			return -1;
 		}
 
 		if (res == 1) {
@@ -246,212 +477,375 @@ static void exec_cmds_compact (int32_t fd)
 	}
 
 	if (get_position) {
-		int res = maestro_compact_get_position(fd, (channel == -1) ? 0 : (uint8_t)channel, (timeout != -1) ? &tv : NULL);
+		int res = maestro_get_position(m, (channel == -1) ? 0 : (uint8_t)channel, (timeout != -1) ? &tv : NULL);
 		
-		if (res == -1) {
+		if (res < 0) {
 			fprintf(stderr, "Failed to get position\n");
-			return;
+			return -1;
 		}		
 		fprintf(stdout, "POSITION: %u\n", (uint16_t)(res & 0xFFFF));				
 	}
 
 	if (get_errors) {
-		int res = maestro_compact_get_errors(fd, (timeout != -1) ? &tv : NULL);
+		int res = maestro_get_errors(m, (timeout != -1) ? &tv : NULL);
 		
-		if (res == -1) {
-			fprintf(stderr, "Failed to check moving status\n");
-			return;
+		if (res < 0) {
+			fprintf(stderr, "Failed to get errors\n");
+			return -1;
 		}		
 		fprintf(stdout, "ERRORS: 0x%X\n", (uint16_t)(res & 0xFFFF));				
 		pr_errors((uint16_t)(res & 0xFFFF));
 	}	
 	
 	if (go_home) {
-		if (maestro_compact_go_home(fd) < 0){
+		if (maestro_go_home(m) < 0){
 			fprintf(stderr, "Failed to set default home position");
-			return;
+			return -1;
 		}
 	}
 
+	return 0;
 }
 
-static void exec_cmds_pololu (int32_t fd)
+/**
+ * Script mode: one command per line, all executed over one open port.
+ * Consecutive target lines are collected and sent with single write
+ * before any other command.
+ */
+struct script {
+	struct maestro* m;
+	uint16_t targets[CMD_CHANNELS];
+	uint64_t changed;       /** channels with collected targets */
+	struct timeval tv;      /** query timeout */
+	int has_timeout;
+	int32_t line;
+};
+
+#define SCRIPT_WAIT_POLL_MS (5) /** Period of moving state polling by wait */
+
+static void script_sleep_ms (int32_t ms)
 {
-	/** Options */
-	if (speed != -1) {
-		if (maestro_pololu_set_speed(fd, (uint8_t)device, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)speed) < 0) {
-			fprintf(stderr, "Failed to set speed");
-			return;
-		}
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+	while (nanosleep(&ts, &ts) && (errno == EINTR))
+		;
+}
+
+static uint64_t script_now_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Send collected targets */
+static int32_t script_flush (struct script* s)
+{
+	int32_t res;
+
+	if (!s->changed)
+		return 0;
+
+	res = maestro_set_targets(s->m, s->targets, s->changed, 0);
+	s->changed = 0;
+	return res;
+}
+
+/** Parse integer argument within [min, max] */
+static int script_arg (const struct script* s, char* arg, const char* name, long min, long max, int32_t* value)
+{
+	char* end;
+	long v;
+
+	if (arg == NULL) {
+		fprintf(stderr, "line %d: missing %s\n", s->line, name);
+		return -1;
 	}
-	
-	if (acceleration != -1) {
-		if (maestro_pololu_set_acceleration(fd, (uint8_t)device, (channel == -1) ? 0 : (uint8_t)channel, (uint16_t)acceleration) < 0) {
-			fprintf(stderr, "Failed to set acceleration");
-			return;			
-		}
+
+	v = strtol(arg, &end, 0);
+	if ((*end != '\0') || (v < min) || (v > max)) {
+		fprintf(stderr, "line %d: bad %s '%s'\n", s->line, name, arg);
+		return -1;
 	}
 
-	if ((pwm_period != -1) ||
-	    (pwm_ontime != -1)) {
-		if (pwm_ontime == -1) pwm_ontime = 0;
-		if (pwm_period == -1) pwm_period = 0;
-		if (maestro_pololu_set_pwm(fd, (uint8_t)device, (uint16_t)pwm_ontime, (uint16_t)pwm_period) < 0) {
-			fprintf(stderr, "Failed to set PWM");
-			return;
+	*value = (int32_t) v;
+	return 0;
+}
+
+/** Wait until all servos reached their targets */
+static int32_t script_wait (struct script* s, int32_t timeout_ms)
+{
+	uint64_t deadline = (timeout_ms < 0) ? 0 : script_now_ms() + timeout_ms;
+	int32_t res;
+
+	while (1) {
+		res = maestro_is_moving(s->m, s->has_timeout ? &s->tv : NULL);
+		if (res <= 0)
+			return res;
+
+		if (deadline && (script_now_ms() >= deadline)) {
+			fprintf(stderr, "line %d: servos still moving after %d ms\n", s->line, timeout_ms);
+			return -1;
 		}
+
+		script_sleep_ms(SCRIPT_WAIT_POLL_MS);
 	}
-	
-	/** Script cmds */
-	if (stop) {
-		if (maestro_pololu_stop_script(fd, (uint8_t) device) < 0){
-			fprintf(stderr, "Failed to stop script");
-			return;
-		}
+}
+
+/**
+ * @brief Execute one script line
+ *
+ * @retval 0 -- success, -1 -- failed
+ */
+static int32_t script_exec_line (struct script* s, char* line)
+{
+	char* save = NULL;
+	char* cmd = strtok_r(line, " \t\r\n", &save);
+	char* arg1 = strtok_r(NULL, " \t\r\n", &save);
+	char* arg2 = strtok_r(NULL, " \t\r\n", &save);
+	int32_t ch, v, par;
+	int32_t res;
+
+	if ((cmd == NULL) || (cmd[0] == '#'))
+		return 0;
+
+	if (!strcmp(cmd, "target")) {
+		if (script_arg(s, arg1, "channel", 0, CMD_CHANNELS - 1, &ch) || script_arg(s, arg2, "target", 0, 0xFFFF, &v))
+			return -1;
+		s->targets[ch] = (uint16_t) v;
+		s->changed |= 1ull << ch;
+		return 0;
 	}
 
-	if (restart != -1) {
-		if (parameter != -1) {
-			if (maestro_pololu_restart_script_par(fd, (uint8_t)device, (uint8_t)restart, (uint16_t) parameter) < 0){
-				fprintf(stderr, "Failed to restart script at subroutine %d with par %d\n", restart, parameter);
-				return;
-			}
-		} else {			
-			if (maestro_pololu_restart_script(fd, (uint8_t)device, (uint8_t)restart) < 0){
-				fprintf(stderr, "Failed to restart script at subroutine %d\n", restart);
-				return;
-			}					
-		}
+	/** Targets set earlier must reach device before anything else */
+	if (script_flush(s) < 0) {
+		fprintf(stderr, "line %d: failed to set targets\n", s->line);
+		return -1;
 	}
-	
-	/** Set targets */
-	if (mult_num != -1) {
-		if (mult_first != -1) {
-			if (file) {
-				uint16_t *targets_p = NULL;
-				int32_t sz = get_targets_list(file, &targets_p);
-				if (sz > 0) {
-					if (sz < mult_num) {
-						fprintf(stderr, "Number of targets in %s less then specified mult-num value %d\n", file, mult_num);
-						free(targets_p);
-						return;
-					}
-					
-					if (maestro_pololu_set_multiple_target(fd, 
-					                                       (uint8_t) device, 
-					                                       (uint8_t) mult_num, 
-					                                       (uint8_t) mult_first, 
-					                                       targets_p) < 0) {
-						fprintf(stderr, "Failed to set number of targets and first channel num\n");
-						free(targets_p);
-						return;
-					}
-					free(targets_p);
-				}
-			} else {
-				fprintf(stderr, "Use --file for specifying file name with targets list\n");			
-				return;				
-			}
+
+	if (!strcmp(cmd, "flush")) {
+		res = 0;
+	} else if (!strcmp(cmd, "speed") || !strcmp(cmd, "accel")) {
+		if (script_arg(s, arg1, "channel", 0, CMD_CHANNELS - 1, &ch) || script_arg(s, arg2, cmd, 0, 0xFFFF, &v))
+			return -1;
+		if (cmd[0] == 's')
+			res = maestro_set_speed(s->m, (uint8_t) ch, (uint16_t) v);
+		else
+			res = maestro_set_acceleration(s->m, (uint8_t) ch, (uint16_t) v);
+	} else if (!strcmp(cmd, "pwm")) {
+		if (script_arg(s, arg1, "on time", 0, 0xFFFF, &v) || script_arg(s, arg2, "period", 0, 0xFFFF, &par))
+			return -1;
+		res = maestro_set_pwm(s->m, (uint16_t) v, (uint16_t) par);
+	} else if (!strcmp(cmd, "home")) {
+		res = maestro_go_home(s->m);
+	} else if (!strcmp(cmd, "stop")) {
+		res = maestro_stop_script(s->m);
+	} else if (!strcmp(cmd, "restart")) {
+		if (script_arg(s, arg1, "subroutine", 0, 0xFF, &v))
+			return -1;
+		if (arg2) {
+			if (script_arg(s, arg2, "parameter", 0, 0xFFFF, &par))
+				return -1;
+			res = maestro_restart_script_par(s->m, (uint8_t) v, (uint16_t) par);
 		} else {
-			fprintf(stderr, "Use --mult-first for specifying first channel\n");			
-			return;				
+			res = maestro_restart_script(s->m, (uint8_t) v);
+		}
+	} else if (!strcmp(cmd, "position")) {
+		if (script_arg(s, arg1, "channel", 0, CMD_CHANNELS - 1, &ch))
+			return -1;
+		res = maestro_get_position(s->m, (uint8_t) ch, s->has_timeout ? &s->tv : NULL);
+		if (res >= 0)
+			fprintf(stdout, "POSITION %d: %u\n", ch, (uint16_t)(res & 0xFFFF));
+	} else if (!strcmp(cmd, "errors")) {
+		res = maestro_get_errors(s->m, s->has_timeout ? &s->tv : NULL);
+		if (res >= 0) {
+			fprintf(stdout, "ERRORS: 0x%X\n", (uint16_t)(res & 0xFFFF));
+			pr_errors((uint16_t)(res & 0xFFFF));
 		}
+	} else if (!strcmp(cmd, "moving")) {
+		res = maestro_is_moving(s->m, s->has_timeout ? &s->tv : NULL);
+		if (res >= 0)
+			fprintf(stdout, "MOVING: %d\n", res);
+	} else if (!strcmp(cmd, "stopped")) {
+		res = maestro_is_stopped(s->m, s->has_timeout ? &s->tv : NULL);
+		if (res >= 0)
+			fprintf(stdout, "SCRIPT STOPPED: %d\n", res);
+	} else if (!strcmp(cmd, "timeout")) {
+		if (script_arg(s, arg1, "timeout", -1, INT32_MAX, &v))
+			return -1;
+		s->has_timeout = (v >= 0);
+		s->tv.tv_sec = v / 1000;
+		s->tv.tv_usec = (v % 1000) * 1000;
+		res = 0;
+	} else if (!strcmp(cmd, "sleep")) {
+		if (script_arg(s, arg1, "time", 0, INT32_MAX, &v))
+			return -1;
+		script_sleep_ms(v);
+		res = 0;
+	} else if (!strcmp(cmd, "wait")) {
+		v = -1;
+		if (arg1 && script_arg(s, arg1, "timeout", 0, INT32_MAX, &v))
+			return -1;
+		res = script_wait(s, v);
+	} else {
+		fprintf(stderr, "line %d: unknown command '%s'\n", s->line, cmd);
+		return -1;
 	}
-		
 
-	if (target != -1) {
-		if (ssc) {
-			if (maestro_minissc_set_target(fd, (channel == -1) ? 0: (uint8_t) channel, (uint8_t) target) < 0) {
-				fprintf(stderr, "Failed to set target\n");
-				return;
-			}
-		} else {
-			if (maestro_pololu_set_target(fd, (uint8_t) device, (channel == -1) ? 0: (uint8_t) channel, (uint16_t) target) < 0) {
-				fprintf(stderr, "Failed to set target\n");
-				return;
-			}				
-		}
+	if (res < 0) {
+		fprintf(stderr, "line %d: %s failed\n", s->line, cmd);
+		return -1;
 	}
-	
-	/** Status cmds */
-	if (is_stop) {
-		int res = maestro_pololu_is_stopped(fd, (uint8_t) device, (timeout != -1) ? &tv : NULL);
-		
-		if (res == -1) {
-			fprintf(stderr, "Failed to check script status\n");
-			return;
-		}
 
-		if (res == 1) {
-			fprintf(stdout, "Script is stopped\n");
-		} else if (res == 0) {
-			fprintf(stdout, "Script is running\n");
-		}		
+	return 0;
+}
+
+/**
+ * @brief Execute script from file, "-" -- stdin
+ *
+ * @retval 0 -- success, -1 -- failed at some line
+ */
+static int32_t exec_script (struct maestro* m, const char* path)
+{
+	struct script s;
+	char line[LINE_MAX];
+	int32_t res = 0;
+	FILE* fp;
+
+	fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (fp == NULL) {
+		perror(path);
+		return -1;
 	}
 
-	if (is_moving) {
-		int res = maestro_pololu_is_moving(fd, (uint8_t) device, (timeout != -1) ? &tv : NULL);
-		
-		if (res == -1) {
-			fprintf(stderr, "Failed to check moving status\n");
-			return;
+	memset(&s, 0, sizeof(s));
+	s.m = m;
+	s.has_timeout = (timeout != -1);
+	s.tv = tv;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+
+		s.line++;
+
+		/** Rest of long line must not run as another command */
+		if (len && (line[len - 1] != '\n') && !feof(fp)) {
+			fprintf(stderr, "line %d: longer than %d characters\n", s.line, LINE_MAX - 2);
+			res = -1;
+			break;
 		}
 
-		if (res == 1) {
-			fprintf(stdout, "Some servo is moving\n");
-		} else if (res == 0) {
-			fprintf(stdout, "No one servo is moving\n");
-		}		
+		res = script_exec_line(&s, line);
+		if (res)
+			break;
 	}
 
-	if (get_position) {
-		int res = maestro_pololu_get_position(fd, (uint8_t) device, (channel == -1) ? 0 : (uint8_t)channel, (timeout != -1) ? &tv : NULL);
-		
-		if (res == -1) {
-			fprintf(stderr, "Failed to check moving status\n");
-			return;
-		}		
-		fprintf(stdout, "POSITION: %u\n", (uint16_t)(res & 0xFFFF));				
+	if (!res && (script_flush(&s) < 0)) {
+		fprintf(stderr, "line %d: failed to set targets\n", s.line);
+		res = -1;
 	}
-	
-	if (get_errors) {
-		int res = maestro_pololu_get_errors(fd, (uint8_t) device, (timeout != -1) ? &tv : NULL);
-		
-		if (res == -1) {
-			fprintf(stderr, "Failed to check moving status\n");
-			return;
-		}		
-		fprintf(stdout, "ERRORS: 0x%X\n", (uint16_t)(res & 0xFFFF));				
-		pr_errors((uint16_t)(res & 0xFFFF));
-	}	
-	
-	if (go_home) {
-		if (maestro_pololu_go_home(fd, (uint8_t) device) < 0){
-			fprintf(stderr, "Failed to set default home position");
-			return;
-		}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return res;
+}
+
+static void log_error (void* arg, const struct maestro_error* err)
+{
+	if (err->sys_errno)
+		fprintf(stderr, "%s: %s (%s)\n", err->what, maestro_strerror(err->code), strerror(err->sys_errno));
+	else
+		fprintf(stderr, "%s: %s\n", err->what, maestro_strerror(err->code));
+}
+
+static void pr_stats (const struct maestro* m)
+{
+	struct maestro_metrics_snapshot snap;
+	uint32_t i;
+
+	maestro_metrics_get(m, &snap);
+
+	printf("STATS:\n");
+	printf("\twrites %llu (errors %llu), tx %llu bytes, rx %llu bytes\n",
+	       (unsigned long long) snap.writes, (unsigned long long) snap.write_errors,
+	       (unsigned long long) snap.tx_bytes, (unsigned long long) snap.rx_bytes);
+	printf("\tshort reads %llu, resyncs %llu, discarded %llu bytes\n",
+	       (unsigned long long) snap.short_reads, (unsigned long long) snap.resyncs,
+	       (unsigned long long) snap.discarded);
+
+	for (i = 0; i < MAESTRO_METRICS_OPCODES; i++) {
+		if (snap.commands[i])
+			printf("\tcommand %-20s %llu\n", maestro_metrics_command_name((uint8_t) i),
+			       (unsigned long long) snap.commands[i]);
 	}
 
+	for (i = 0; i < MAESTRO_QUERY_TYPES; i++) {
+		const struct maestro_query_metrics* q = &snap.queries[i];
+		uint64_t answered = q->count - q->timeouts - q->errors;
+
+		if (!q->count)
+			continue;
+
+		printf("\tquery %-14s %llu, timeouts %llu, errors %llu", maestro_metrics_query_name(i),
+		       (unsigned long long) q->count, (unsigned long long) q->timeouts, (unsigned long long) q->errors);
+		if (answered)
+			printf(", mean %llu us, p50 < %u us, p99 < %u us", (unsigned long long) (q->latency_us / answered),
+			       maestro_metrics_percentile(q, 50), maestro_metrics_percentile(q, 99));
+		printf("\n");
+	}
 }
 
-static void exec_cmds (void)
+static int32_t exec_cmds (void)
 {
+	struct maestro* m;
+	int32_t res = 0;
 	int32_t fd;
+	struct maestro_link_profile profile;
+	struct maestro_link_report report;
 	
-	fd = maestro_open(device_file);   
+	maestro_link_profile_default(&profile);
+	profile.baud = baud;
+
+	fd = maestro_open_link(device_file, &profile, &report);
 	
-	if (fd == -1) {
-		fprintf(stderr, "Failed to open %s", device_file);
-		return;
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", device_file);
+		return -1;
 	}
+
+	printf("\tLink: baud %u%s%s\n", report.baud,
+	       (report.applied & MAESTRO_LINK_RAW) ? ", raw 8N1" : "",
+	       (report.applied & MAESTRO_LINK_LOW_LATENCY) ? ", low latency" : ", low latency not supported");
 	
-	if (device != -1) { /** Work at Pololu protocol*/		
-		exec_cmds_pololu(fd);
-	} else { /** Work at Compact protocol*/
-		exec_cmds_compact(fd);
+	/** Device -1 selects Compact protocol */
+	m = maestro_handle_attach(fd, device, CMD_CHANNELS);
+	if (m == NULL) {
+		maestro_close(fd);
+		return -1;
 	}
 
+	if (capture_file && maestro_capture_start(capture_file))
+		fprintf(stderr, "Failed to start capture to %s\n", capture_file);
+
+	if (script_file)
+		res = exec_script(m, script_file);
+	else
+		res = exec_cmds_handle(m);
+
+	if (stats)
+		pr_stats(m);
+
+	if (capture_file)
+		maestro_capture_stop();
+
+	maestro_handle_close(m);
 	maestro_close(fd);
+	return res;
 }
 
 static void pr_help (char* prog_name)
@@ -474,7 +868,10 @@ static void pr_help (char* prog_name)
 	printf("\t --mult_num NUM\t\t\t set multiple targets num, default 0\n");
 	printf("\t --mult_first NUM\t\t set first channel for multiple targets command, default 0\n");
 	printf("\t ...and you must use file with targets list: \n");
-	printf("\t --file FILE \t\t\t set file source for list of targets\n\n");
+	printf("\t --file FILE \t\t\t set file source for list of targets, one per line\n");
+	printf("\t\t or motion file: \"motion 1\" line, then frames [@MS | +MS] [dDEVICE] [cFIRST] TARGET...\n");
+	printf("\t\t (@ -- time since start, + -- delay after previous frame, \"period MS\" line sets default delay),\n");
+	printf("\t\t played at their time, frames of the same time are sent with single write\n\n");
 
 	printf("\t Status commands: \n");
 	printf("\t --get-position \t\t print current postion of servo\n");
@@ -482,6 +879,15 @@ static void pr_help (char* prog_name)
 	printf("\t --get-errors \t\t\t print errors\n\n");
 	printf("\t --go-home \t\t\t go default position\n\n");
 	printf("\t --timeout \t\t\t set timeout for status commands (in ms)\n\n");
+	printf("\t --dev FILE \t\t\t set COM-port device file, default /dev/ttyACM0\n");
+	printf("\t --baud VALUE \t\t\t set baud rate of COM-port, default -- keep current\n");
+	printf("\t --stats \t\t\t print command counters and query latencies\n");
+	printf("\t --capture FILE \t\t record all bytes sent and received to FILE (see mpololu_replay)\n\n");
+
+	printf("\t --script FILE \t\t\t execute commands of FILE (- -- stdin) over one open port, one per line:\n");
+	printf("\t\t target CH VALUE, speed CH VALUE, accel CH VALUE, pwm ONTIME PERIOD, home, stop, restart SUB [PAR],\n");
+	printf("\t\t position CH, errors, moving, stopped, timeout MS, sleep MS, wait [MS], flush; # starts comment.\n");
+	printf("\t\t Consecutive targets are sent with single write, script stops at first failed line\n\n");
 
 	printf("\t --stop \t\t\t\t stop script\n");
 	printf("\t --restart NUM\t\t\t restart script at NUM subroutine\n");
@@ -525,6 +931,10 @@ int32_t main(int32_t argc, char *argv[])
 			{"is-stop",    no_argument, 0,  0 },
 			
 			{"dev",    required_argument, 0,  0 },
+			{"baud",    required_argument, 0,  0 },
+			{"stats",    no_argument, 0,  0 },
+			{"capture",    required_argument, 0,  0 },
+			{"script",    required_argument, 0,  0 },
 
 			{"help",    no_argument, 0,  'h' },
 			{0,         0,                 0,  0 }
@@ -609,6 +1019,16 @@ int32_t main(int32_t argc, char *argv[])
 			} else if (!strcmp(long_options[option_index].name, "dev")) {
 				device_file = optarg;
 				printf("\tDevice file %s\n", device_file);
+			} else if (!strcmp(long_options[option_index].name, "baud")) {
+				baud = (uint32_t) atoi(optarg);
+				printf("\tBaud rate %u\n", baud);
+			} else if (!strcmp(long_options[option_index].name, "stats")) {
+				stats = 1;
+			} else if (!strcmp(long_options[option_index].name, "capture")) {
+				capture_file = optarg;
+				printf("\tCapture file %s\n", capture_file);
+			} else if (!strcmp(long_options[option_index].name, "script")) {
+				script_file = optarg;
 			} 
 			break;			
 		case 'h':
@@ -624,7 +1044,9 @@ int32_t main(int32_t argc, char *argv[])
 	}
 		
 	if (argc > 1) {
-		exec_cmds();
+		maestro_set_log_cb(log_error, NULL);
+		if (exec_cmds())
+			exit(EXIT_FAILURE);
 	} else pr_help(argv[0]);
 	
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,186 @@
+/**
+ * @file   mpololu_coalesce.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Latest-value-wins target coalescer with fixed-rate flush.
+ *
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpololu.h"
+#include "mpololu_coalesce.h"
+#include "mpololu_priv.h"
+
+struct maestro_coalesce {
+	uint8_t channels;
+
+	/** Producer side */
+	atomic_uint_least16_t target[MAESTRO_COALESCE_MAX_CHANNELS];
+	atomic_uint_fast64_t dirty;
+	atomic_uint_fast64_t known;  /** channels set at least once, may be resent */
+
+	/** Flush side */
+	struct maestro_flusher fl;
+
+	atomic_uint_fast64_t updates;
+	atomic_uint_fast64_t overwritten;
+};
+
+
+static int32_t coalesce_flush(void* owner)
+{
+	return maestro_coalesce_flush((struct maestro_coalesce*) owner);
+}
+
+
+/**
+ * @brief Create coalescer
+ */
+struct maestro_coalesce* maestro_coalesce_create(int32_t fd, int32_t device, uint8_t channels)
+{
+	struct maestro_coalesce* co;
+	int i;
+
+	if ((channels == 0) || (channels > MAESTRO_COALESCE_MAX_CHANNELS)) {
+		maestro_fail(MAESTRO_ERR_ARG, "bad number of channels");
+		return NULL;
+	}
+
+	co = (struct maestro_coalesce*) calloc(1, sizeof(*co));
+	if (co == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	co->channels = channels;
+	maestro_flusher_init(&co->fl, fd, device, channels, coalesce_flush, co);
+
+	for (i = 0; i < MAESTRO_COALESCE_MAX_CHANNELS; i++) {
+		atomic_init(&co->target[i], 0);
+	}
+	atomic_init(&co->dirty, 0);
+	atomic_init(&co->known, 0);
+	atomic_init(&co->updates, 0);
+	atomic_init(&co->overwritten, 0);
+
+	return co;
+}
+
+/**
+ * @brief Stop flush thread (if started) and free coalescer
+ */
+void maestro_coalesce_destroy(struct maestro_coalesce* co)
+{
+	if (co == NULL)
+		return;
+
+	maestro_coalesce_stop(co);
+	maestro_flusher_destroy(&co->fl);
+	free(co);
+}
+
+/**
+ * @brief Store newest target of channel
+ */
+int32_t maestro_coalesce_set_target(struct maestro_coalesce* co, uint8_t channel, uint16_t target)
+{
+	uint64_t bit;
+
+	if (channel >= co->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	bit = 1ull << channel;
+
+	/** Target is stored before dirty bit, flush clears bit before reading target */
+	atomic_store_explicit(&co->target[channel], target, memory_order_relaxed);
+	if (!(atomic_load_explicit(&co->known, memory_order_relaxed) & bit))
+		atomic_fetch_or_explicit(&co->known, bit, memory_order_relaxed);
+	if (atomic_fetch_or_explicit(&co->dirty, bit, memory_order_release) & bit)
+		atomic_fetch_add_explicit(&co->overwritten, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&co->updates, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+/**
+ * @brief Set limits of device
+ */
+void maestro_coalesce_set_caps(struct maestro_coalesce* co, uint32_t caps)
+{
+	pthread_mutex_lock(&co->fl.lock);
+	co->fl.caps = caps;
+	pthread_mutex_unlock(&co->fl.lock);
+}
+
+/**
+ * @brief Send targets of channels changed since previous flush
+ */
+int32_t maestro_coalesce_flush(struct maestro_coalesce* co)
+{
+	uint64_t dirty;
+	uint64_t known;
+	int32_t res;
+	int32_t n = 0;
+	int ch;
+
+	pthread_mutex_lock(&co->fl.lock);
+
+	dirty = atomic_exchange_explicit(&co->dirty, 0, memory_order_acquire);
+	if (!dirty) {
+		pthread_mutex_unlock(&co->fl.lock);
+		return 0;
+	}
+
+	known = atomic_load_explicit(&co->known, memory_order_relaxed);
+	for (ch = 0; ch < co->channels; ch++) {
+		if ((dirty | known) & (1ull << ch))
+			co->fl.snapshot[ch] = atomic_load_explicit(&co->target[ch], memory_order_relaxed);
+		if (dirty & (1ull << ch))
+			n++;
+	}
+
+	res = maestro_flusher_send(&co->fl, dirty, known, n);
+	if (res < 0) {
+		/** Failed channels are retried on next flush unless overwritten */
+		atomic_fetch_or_explicit(&co->dirty, dirty, memory_order_relaxed);
+		pthread_mutex_unlock(&co->fl.lock);
+		return res;
+	}
+
+	pthread_mutex_unlock(&co->fl.lock);
+	return n;
+}
+
+/**
+ * @brief Start thread calling maestro_coalesce_flush() at fixed rate
+ */
+int32_t maestro_coalesce_start(struct maestro_coalesce* co, uint32_t rate_hz)
+{
+	return maestro_flusher_start(&co->fl, rate_hz);
+}
+
+/**
+ * @brief Stop flush thread, pending targets are flushed
+ */
+int32_t maestro_coalesce_stop(struct maestro_coalesce* co)
+{
+	return maestro_flusher_stop(&co->fl);
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_coalesce_get_stats(struct maestro_coalesce* co, struct maestro_coalesce_stats* stats)
+{
+	stats->updates = atomic_load_explicit(&co->updates, memory_order_relaxed);
+	stats->overwritten = atomic_load_explicit(&co->overwritten, memory_order_relaxed);
+
+	pthread_mutex_lock(&co->fl.lock);
+	stats->flushes = co->fl.flushes;
+	stats->sent = co->fl.sent;
+	stats->errors = co->fl.errors;
+	pthread_mutex_unlock(&co->fl.lock);
+}
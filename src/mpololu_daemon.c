@@ -0,0 +1,291 @@
+/**
+ * @file   mpololu_daemon.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Port multiplexing daemon protocol and client API.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "mpololu.h"
+#include "mpololu_daemon.h"
+#include "mpololu_priv.h"
+
+/** Tags are unique in process, so late reply is never taken for answer */
+static atomic_uint daemon_tag = 1;
+
+
+static int32_t daemon_send(int32_t sock, uint32_t tag, uint8_t port, const uint8_t* cmd, size_t len,
+                           size_t ans_len, int32_t timeout_ms, uint8_t flags)
+{
+	struct maestro_daemon_request req;
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t wr;
+
+	if ((len == 0) || (len > MAESTRO_DAEMON_MAX_CMD) || (ans_len > 4))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad command or answer length");
+
+	if (maestro_daemon_check(cmd, len, ans_len) < 0)
+		return MAESTRO_ERR_ARG;
+
+	memset(&req, 0, sizeof(req));
+	req.tag = tag;
+	req.len = (uint16_t) len;
+	req.port = port;
+	req.ans_len = (uint8_t) ans_len;
+	req.timeout_ms = timeout_ms;
+	req.flags = flags;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = (void*) cmd;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	/** Header and command go as one packet */
+	do {
+		wr = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while ((wr < 0) && (errno == EINTR));
+
+	if (wr < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "sendmsg");
+
+	return 0;
+}
+
+
+/**
+ * @brief Check command bytes of request
+ */
+int32_t maestro_daemon_check(const uint8_t* cmd, size_t len, size_t ans_len)
+{
+	uint8_t command, answer = 0;
+	size_t off = 0;
+	size_t size;
+
+	while (off < len) {
+		/** Daemon matches answers by length, answer of earlier query would shift the rest */
+		if (answer)
+			return maestro_fail(MAESTRO_ERR_ARG, "query is not the last command");
+
+		if (cmd[off] == MINISSC_PROTO_ON)
+			size = (len - off >= CMD_MINISSC_SIZE) ? CMD_MINISSC_SIZE : 0;
+		else
+			size = maestro_cmd_size(&cmd[off], len - off, &command, &answer);
+
+		if (!size)
+			return maestro_fail(MAESTRO_ERR_ARG, "unknown or truncated command");
+		off += size;
+	}
+
+	if (answer != ans_len)
+		return maestro_fail(MAESTRO_ERR_ARG, "answer length does not match query");
+
+	return 0;
+}
+
+/**
+ * @brief Connect to daemon
+ */
+int32_t maestro_daemon_connect(const char* path)
+{
+	struct sockaddr_un addr;
+	int32_t sock;
+
+	if (path == NULL)
+		path = MAESTRO_DAEMON_SOCKET;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return maestro_fail(MAESTRO_ERR_ARG, "socket path is too long");
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "socket");
+
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "connect to daemon");
+		close(sock);
+		return MAESTRO_ERR_IO;
+	}
+
+	return sock;
+}
+
+/**
+ * @brief Close connection
+ */
+int32_t maestro_daemon_close(int32_t sock)
+{
+	if (close(sock) < 0)
+		return maestro_fail(MAESTRO_ERR_IO, "close");
+
+	return 0;
+}
+
+/**
+ * @brief Send command without answer
+ */
+int32_t maestro_daemon_send(int32_t sock, uint8_t port, const uint8_t* cmd, size_t len)
+{
+	return daemon_send(sock, atomic_fetch_add(&daemon_tag, 1), port, cmd, len, 0, -1, 0);
+}
+
+/**
+ * @brief Send all commands of batch and reset batch
+ */
+int32_t maestro_daemon_send_batch(int32_t sock, uint8_t port, struct maestro_batch* batch)
+{
+	int32_t res = maestro_daemon_send(sock, port, batch->buf, batch->len);
+
+	if (res < 0)
+		return res;
+
+	maestro_batch_reset(batch);
+	return 0;
+}
+
+/**
+ * @brief Send raw command and wait for daemon reply
+ */
+int32_t maestro_daemon_query(int32_t sock, uint8_t port, const uint8_t* cmd, size_t len, size_t ans_len, int32_t timeout_ms)
+{
+	struct maestro_daemon_reply rep;
+	uint32_t tag = atomic_fetch_add(&daemon_tag, 1);
+	uint64_t deadline;
+	ssize_t rd;
+	int32_t res;
+
+	res = daemon_send(sock, tag, port, cmd, len, ans_len, timeout_ms, ans_len ? 0 : MAESTRO_DAEMON_ACK);
+	if (res < 0)
+		return res;
+
+	/** Daemon replies with timeout status itself, grace covers its scheduling */
+	deadline = (timeout_ms < 0) ? 0 : maestro_now_ns() + (uint64_t)(timeout_ms + MAESTRO_DAEMON_GRACE_MS) * 1000000ull;
+
+	while (1) {
+		res = maestro_wait_fd(sock, POLLIN, deadline);
+		if (res < 0)
+			return res;
+		if (res == 0)
+			return maestro_fail(MAESTRO_ERR_TIMEOUT, "no reply from daemon");
+
+		rd = recv(sock, &rep, sizeof(rep), MSG_DONTWAIT);
+		if (rd < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			return maestro_fail(MAESTRO_ERR_IO, "recv");
+		}
+		if (rd == 0)
+			return maestro_fail(MAESTRO_ERR_STATE, "daemon closed connection");
+		if (rd != sizeof(rep))
+			return maestro_fail(MAESTRO_ERR_PROTOCOL, "bad reply size");
+
+		/** Reply of earlier timed-out query */
+		if (rep.tag != tag)
+			continue;
+
+		if (rep.status < 0)
+			return maestro_fail(rep.status, "daemon request failed");
+
+		return ans_len ? rep.value : 0;
+	}
+}
+
+/**
+ * @brief Get position through daemon (Pololu protocol)
+ */
+int32_t maestro_daemon_pololu_get_position(int32_t sock, uint8_t port, uint8_t device, uint8_t channel, int32_t timeout_ms)
+{
+	uint8_t command[CMD_SIZE(0, CMD_GET_POSITION_SIZE)];
+	size_t len = maestro_enc_get_position(command, device, channel);
+
+	return maestro_daemon_query(sock, port, command, len, ANSWER_GET_POSITION_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get position through daemon (Compact protocol)
+ */
+int32_t maestro_daemon_compact_get_position(int32_t sock, uint8_t port, uint8_t channel, int32_t timeout_ms)
+{
+	uint8_t command[CMD_GET_POSITION_SIZE];
+	size_t len = maestro_enc_get_position(command, MAESTRO_COMPACT, channel);
+
+	return maestro_daemon_query(sock, port, command, len, ANSWER_GET_POSITION_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get moving state through daemon (Pololu protocol)
+ */
+int32_t maestro_daemon_pololu_is_moving(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_MOVING_STATE);
+
+	return maestro_daemon_query(sock, port, command, len, ANSWER_IS_MOVING_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get moving state through daemon (Compact protocol)
+ */
+int32_t maestro_daemon_compact_is_moving(int32_t sock, uint8_t port, int32_t timeout_ms)
+{
+	uint8_t command[1] = {COMPACT_GET_MOVING_STATE};
+
+	return maestro_daemon_query(sock, port, command, sizeof command, ANSWER_IS_MOVING_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get errors through daemon (Pololu protocol)
+ */
+int32_t maestro_daemon_pololu_get_errors(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_ERRORS);
+
+	return maestro_daemon_query(sock, port, command, len, ANSWER_GET_ERRORS_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get errors through daemon (Compact protocol)
+ */
+int32_t maestro_daemon_compact_get_errors(int32_t sock, uint8_t port, int32_t timeout_ms)
+{
+	uint8_t command[1] = {COMPACT_GET_ERRORS};
+
+	return maestro_daemon_query(sock, port, command, sizeof command, ANSWER_GET_ERRORS_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get script status through daemon (Pololu protocol)
+ */
+int32_t maestro_daemon_pololu_is_stopped(int32_t sock, uint8_t port, uint8_t device, int32_t timeout_ms)
+{
+	uint8_t command[CMD_SIZE(0, CMD_SIMPLE_SIZE)];
+	size_t len = maestro_enc_simple(command, device, COMPACT_GET_SCRIPT_STATUS);
+
+	return maestro_daemon_query(sock, port, command, len, ANSWER_IS_STOPPED_SIZE, timeout_ms);
+}
+
+/**
+ * @brief Get script status through daemon (Compact protocol)
+ */
+int32_t maestro_daemon_compact_is_stopped(int32_t sock, uint8_t port, int32_t timeout_ms)
+{
+	uint8_t command[1] = {COMPACT_GET_SCRIPT_STATUS};
+
+	return maestro_daemon_query(sock, port, command, sizeof command, ANSWER_IS_STOPPED_SIZE, timeout_ms);
+}
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mpololu.h" /* Maestro Pololu API */
+#include "mpololu_async.h" /* Non-blocking API */
+#include "mpololu_daemon.h" /* Daemon protocol */
+
+#define DAEMON_MAX_REQUESTS 64 /** Queries waiting for answer on one port */
+#define DAEMON_EVENTS 64
+
+/** What epoll event belongs to, index is in low 32 bits */
+#define SRC_LISTEN 0
+#define SRC_PORT 1
+#define SRC_TIMER 2
+#define SRC_CLIENT 3
+
+#define SRC(kind, index) (((uint64_t)(kind) << 32) | (uint32_t)(index))
+
+struct client {
+	int fd;              /** -1 -- free slot */
+	uint32_t gen;        /** incremented when slot is reused */
+};
+
+/** Query waiting for answer, replies go to client only if it is still the same one */
+struct pending {
+	uint32_t client;
+	uint32_t gen;
+	uint32_t tag;
+};
+
+struct port {
+	const char* dev;
+	int32_t fd;
+	struct maestro_async* async;
+	uint32_t events;     /** epoll events registered for fd */
+	int dirty;           /** commands submitted in this iteration */
+
+	/** Answers come in submission order, so pending queries are ring too */
+	struct pending pend[DAEMON_MAX_REQUESTS];
+	uint32_t head;
+	uint32_t count;
+
+	uint64_t commands;
+	uint64_t queries;
+	uint64_t flushes;
+	uint64_t failed;
+};
+
+char *socket_path = MAESTRO_DAEMON_SOCKET;
+uint32_t baud = 0;
+uint32_t max_clients = 32;
+
+static struct port ports[MAESTRO_DAEMON_MAX_PORTS];
+static uint32_t ports_num = 0;
+
+static struct client* clients = NULL;
+static int epfd = -1;
+
+static uint64_t accepted = 0, rejected = 0, dropped = 0;
+
+static volatile sig_atomic_t stopped = 0;
+
+
+static void on_signal(int sig)
+{
+	stopped = 1;
+}
+
+static void send_reply(uint32_t client, uint32_t gen, uint32_t tag, int32_t status, int32_t value)
+{
+	struct maestro_daemon_reply rep;
+
+	if ((clients[client].fd < 0) || (clients[client].gen != gen)) {
+		dropped++;
+		return;
+	}
+
+	rep.tag = tag;
+	rep.status = status;
+	rep.value = value;
+
+	/** Client which does not read its replies loses them, daemon never blocks */
+	if (send(clients[client].fd, &rep, sizeof(rep), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(rep))
+		dropped++;
+}
+
+static void on_answer(void* arg, int32_t status, int32_t value)
+{
+	struct port* p = (struct port*) arg;
+	struct pending pd = p->pend[p->head];
+
+	p->head = (p->head + 1) % DAEMON_MAX_REQUESTS;
+	p->count--;
+
+	if (status < 0)
+		p->failed++;
+
+	send_reply(pd.client, pd.gen, pd.tag, status, value);
+}
+
+static void close_client(uint32_t i)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, clients[i].fd, NULL);
+	close(clients[i].fd);
+	clients[i].fd = -1;
+	clients[i].gen++;
+}
+
+static void accept_clients(int lfd)
+{
+	struct epoll_event ev;
+	uint32_t i;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < max_clients; i++) {
+			if (clients[i].fd < 0)
+				break;
+		}
+
+		if (i == max_clients) {
+			close(fd);
+			rejected++;
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = SRC(SRC_CLIENT, i);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(fd);
+			continue;
+		}
+
+		clients[i].fd = fd;
+		accepted++;
+	}
+}
+
+static void handle_request(uint32_t client, const uint8_t* buf, ssize_t size)
+{
+	struct maestro_daemon_request req;
+	struct port* p;
+	int32_t res;
+
+	if ((size_t) size < sizeof(req)) {
+		dropped++;
+		return;
+	}
+	memcpy(&req, buf, sizeof(req));
+
+	if ((req.len == 0) || ((size_t) size != sizeof(req) + req.len) || (req.port >= ports_num) || (req.ans_len > 4)) {
+		send_reply(client, clients[client].gen, req.tag, MAESTRO_ERR_ARG, -1);
+		return;
+	}
+
+	/** Query in the middle or wrong ans_len would misroute answers of every later request */
+	if (maestro_daemon_check(buf + sizeof(req), req.len, req.ans_len) < 0) {
+		send_reply(client, clients[client].gen, req.tag, MAESTRO_ERR_ARG, -1);
+		return;
+	}
+
+	p = &ports[req.port];
+
+	res = maestro_async_submit(p->async, buf + sizeof(req), req.len, req.ans_len, req.timeout_ms,
+	                           req.ans_len ? on_answer : NULL, p);
+
+	/** Queue is full of this iteration's commands: send them and retry */
+	if ((res == MAESTRO_ERR_FULL) && (maestro_async_events(p->async) & MAESTRO_ASYNC_OUT)) {
+		maestro_async_cork(p->async, 0);
+		maestro_async_cork(p->async, 1);
+		p->flushes++;
+		res = maestro_async_submit(p->async, buf + sizeof(req), req.len, req.ans_len, req.timeout_ms,
+		                           req.ans_len ? on_answer : NULL, p);
+	}
+
+	if (res < 0) {
+		p->failed++;
+		send_reply(client, clients[client].gen, req.tag, res, -1);
+		return;
+	}
+
+	p->dirty = 1;
+
+	if (req.ans_len) {
+		struct pending* pd = &p->pend[(p->head + p->count) % DAEMON_MAX_REQUESTS];
+
+		pd->client = client;
+		pd->gen = clients[client].gen;
+		pd->tag = req.tag;
+		p->count++;
+		p->queries++;
+	} else {
+		p->commands++;
+		if (req.flags & MAESTRO_DAEMON_ACK)
+			send_reply(client, clients[client].gen, req.tag, 0, -1);
+	}
+}
+
+static void read_client(uint32_t client)
+{
+	uint8_t buf[sizeof(struct maestro_daemon_request) + MAESTRO_DAEMON_MAX_CMD];
+	ssize_t rd;
+
+	while (1) {
+		/** MSG_TRUNC returns real packet size, so oversized request is detected */
+		rd = recv(clients[client].fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				close_client(client);
+			return;
+		}
+		if (rd == 0) {
+			close_client(client);
+			return;
+		}
+
+		handle_request(client, buf, (rd > (ssize_t) sizeof(buf)) ? 0 : rd);
+	}
+}
+
+/** Register events port context waits for */
+static int32_t update_port_events(uint32_t i)
+{
+	struct epoll_event ev;
+	uint32_t events = maestro_async_events(ports[i].async);
+
+	if (events == ports[i].events)
+		return 0;
+
+	ev.events = events;
+	ev.data.u64 = SRC(SRC_PORT, i);
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, ports[i].fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	ports[i].events = events;
+	return 0;
+}
+
+static int32_t open_ports(void)
+{
+	struct maestro_link_profile profile;
+	struct epoll_event ev;
+	int32_t timer_fd;
+	uint32_t i;
+
+	maestro_link_profile_default(&profile);
+	profile.baud = baud;
+
+	for (i = 0; i < ports_num; i++) {
+		struct port* p = &ports[i];
+
+		p->fd = maestro_open_link(p->dev, &profile, NULL);
+		if (p->fd < 0)
+			return -1;
+
+		p->async = maestro_async_create(p->fd, DAEMON_MAX_REQUESTS);
+		if (p->async == NULL)
+			return -1;
+
+		/** Commands of all clients are held until end of loop iteration */
+		maestro_async_cork(p->async, 1);
+
+		p->events = maestro_async_events(p->async);
+		ev.events = p->events;
+		ev.data.u64 = SRC(SRC_PORT, i);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+
+		timer_fd = maestro_async_timer_fd(p->async);
+		if (timer_fd < 0)
+			return -1;
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = SRC(SRC_TIMER, i);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int open_socket(void)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	int lfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(socket_path);
+	if ((bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) || (listen(lfd, SOMAXCONN) < 0)) {
+		perror(socket_path);
+		close(lfd);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = SRC(SRC_LISTEN, 0);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+		perror("epoll_ctl");
+		close(lfd);
+		unlink(socket_path);
+		return -1;
+	}
+
+	return lfd;
+}
+
+static int32_t serve(int lfd)
+{
+	struct epoll_event events[DAEMON_EVENTS];
+	int32_t res = 0;
+	uint32_t i;
+	int n, k;
+
+	while (!stopped) {
+		n = epoll_wait(epfd, events, DAEMON_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (k = 0; k < n; k++) {
+			uint32_t kind = (uint32_t)(events[k].data.u64 >> 32);
+			uint32_t index = (uint32_t) events[k].data.u64;
+
+			switch (kind) {
+			case SRC_LISTEN:
+				accept_clients(lfd);
+				break;
+			case SRC_CLIENT:
+				if (clients[index].fd >= 0)
+					read_client(index);
+				break;
+			case SRC_PORT:
+			case SRC_TIMER:
+				/** Errors and hangup are found by reading, timer needs no events */
+				res = maestro_async_process(ports[index].async, (kind == SRC_PORT) ?
+				                            (events[k].events & (EPOLLIN | EPOLLOUT)) : 0);
+				if (res < 0) {
+					fprintf(stderr, "%s: %s\n", ports[index].dev, maestro_strerror(res));
+					return -1;
+				}
+				break;
+			}
+		}
+
+		/** One write per port for everything clients sent in this iteration */
+		for (i = 0; i < ports_num; i++) {
+			if (ports[i].dirty) {
+				ports[i].dirty = 0;
+				ports[i].flushes++;
+				res = maestro_async_cork(ports[i].async, 0);
+				maestro_async_cork(ports[i].async, 1);
+				if (res < 0) {
+					fprintf(stderr, "%s: %s\n", ports[i].dev, maestro_strerror(res));
+					return -1;
+				}
+			}
+
+			if (update_port_events(i) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void pr_help (char* prog_name)
+{
+	printf("usage: %s [OPTIONS]\n", prog_name);
+	printf("Owns Maestro COM-ports and serves local clients on Unix domain socket, see \"inc/mpololu_daemon.h\" for client API\n");
+	printf("List of options: \n");
+	printf("\t --dev,d FILE\t\t\t COM-port device file, repeat for more ports (port index is option order), default /dev/ttyACM0\n");
+	printf("\t --socket,s FILE\t\t socket path, default %s\n", MAESTRO_DAEMON_SOCKET);
+	printf("\t --baud,b VALUE\t\t\t baud rate of ports, default 0 -- keep current\n");
+	printf("\t --clients NUM\t\t\t maximal number of connected clients, default 32\n");
+	printf("\t --help,h \t\t\t print this help and exit\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	int32_t res = 0;
+	uint32_t i;
+	int32_t c;
+	int lfd;
+
+	while (1) {
+		int32_t option_index = 0;
+		static struct option long_options[] = {
+			{"dev",      required_argument, 0,  'd' },
+			{"socket",   required_argument, 0,  's' },
+			{"baud",     required_argument, 0,  'b' },
+			{"clients",  required_argument, 0,  0 },
+			{"help",     no_argument,       0,  'h' },
+			{0,         0,                 0,  0 }
+		};
+
+		c = getopt_long(argc, argv, "d:s:b:h",
+		                long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			if (ports_num == MAESTRO_DAEMON_MAX_PORTS) {
+				fprintf(stderr, "At most %d ports are supported\n", MAESTRO_DAEMON_MAX_PORTS);
+				exit(EXIT_FAILURE);
+			}
+			ports[ports_num++].dev = optarg;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'b':
+			baud = (uint32_t) atoi(optarg);
+			break;
+		case 0:
+			if (!strcmp(long_options[option_index].name, "clients")) {
+				max_clients = (uint32_t) atoi(optarg);
+			}
+			break;
+		case 'h':
+			pr_help(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			pr_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ports_num == 0)
+		ports[ports_num++].dev = "/dev/ttyACM0";
+
+	if (max_clients == 0) {
+		pr_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	clients = (struct client*) calloc(max_clients, sizeof(*clients));
+	if (clients == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < max_clients; i++) {
+		clients[i].fd = -1;
+	}
+	for (i = 0; i < MAESTRO_DAEMON_MAX_PORTS; i++) {
+		ports[i].fd = -1;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	if (open_ports() < 0) {
+		const struct maestro_error* err = maestro_last_error();
+
+		fprintf(stderr, "%s: %s (%s)\n", err->what ? err->what : "open ports", maestro_strerror(err->code),
+		        strerror(err->sys_errno));
+		res = -1;
+	}
+
+	lfd = res ? -1 : open_socket();
+	if (lfd >= 0) {
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		signal(SIGPIPE, SIG_IGN);
+
+		fprintf(stdout, "Serving %u port(s) on %s\n", ports_num, socket_path);
+		fflush(stdout);
+
+		res = serve(lfd);
+
+		close(lfd);
+		unlink(socket_path);
+	} else {
+		res = -1;
+	}
+
+	for (i = 0; i < ports_num; i++) {
+		/** Outstanding queries are answered with MAESTRO_ERR_STATE */
+		maestro_async_destroy(ports[i].async);
+		if (ports[i].fd >= 0)
+			maestro_close(ports[i].fd);
+
+		fprintf(stdout, "%s: %llu commands, %llu queries, %llu writes, %llu failed\n", ports[i].dev,
+		        (unsigned long long) ports[i].commands, (unsigned long long) ports[i].queries,
+		        (unsigned long long) ports[i].flushes, (unsigned long long) ports[i].failed);
+	}
+	fprintf(stdout, "Clients %llu accepted, %llu rejected, %llu replies dropped\n",
+	        (unsigned long long) accepted, (unsigned long long) rejected, (unsigned long long) dropped);
+
+	for (i = 0; i < max_clients; i++) {
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	}
+	free(clients);
+	close(epfd);
+
+	exit(res ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,621 @@
+/**
+ * @file   mpololu_emu.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Software Maestro Pololu emulator on Linux pseudo-terminal.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "mpololu.h"
+#include "mpololu_emu.h"
+#include "mpololu_priv.h"
+
+#define EMU_PATH_MAX 64
+#define EMU_READ_CHUNK 256
+
+/** MiniSSC 8-bit target range around neutral, in 0.25 us units */
+#define EMU_SSC_NEUTRAL 6000
+#define EMU_SSC_RANGE 2000
+
+struct emu_device {
+	uint8_t number;
+	uint16_t errors;
+	uint8_t script_stopped;
+	struct maestro_motion ch[MAESTRO_EMU_MAX_CHANNELS];
+};
+
+struct maestro_emu {
+	struct maestro_emu_config cfg;
+	int master;
+	int slave;
+	int stop_pipe[2];
+	char name[EMU_PATH_MAX];
+
+	pthread_t thread;
+	int thread_started;
+	pthread_mutex_t lock;
+
+	struct emu_device dev[MAESTRO_EMU_MAX_DEVICES];
+
+	/** Partially received command */
+	uint8_t frame[CMD_MAX_SIZE];
+	size_t frame_len;
+
+	/** Wire time simulation (CLOCK_MONOTONIC ns) */
+	uint64_t byte_ns;
+	uint64_t rx_wire;
+	uint64_t tx_wire;
+
+	struct maestro_emu_counters counters;
+};
+
+
+static void emu_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * @brief Move all channels to current time
+ *
+ * @details Motion is computed by the same model as library uses for prediction.
+ */
+static void emu_update(struct maestro_emu* emu)
+{
+	uint64_t now = maestro_now_ns();
+	int d, c;
+
+	for (d = 0; d < emu->cfg.devices; d++) {
+		for (c = 0; c < emu->cfg.channels; c++) {
+			maestro_motion_advance(&emu->dev[d].ch[c], now);
+		}
+	}
+}
+
+static void emu_set_target(struct maestro_motion* ch, uint16_t target)
+{
+	maestro_motion_set_target(ch, target, maestro_now_ns());
+}
+
+static int emu_answer(struct maestro_emu* emu, const uint8_t* ans, size_t len)
+{
+	if (emu->byte_ns) {
+		uint64_t now = maestro_now_ns();
+
+		if (emu->tx_wire < now)
+			emu->tx_wire = now;
+		emu->tx_wire += emu->byte_ns * len;
+		emu_sleep_until(emu->tx_wire);
+	}
+
+	if (write(emu->master, ans, len) != (ssize_t) len) {
+		perror("emulator answer");
+		return -1;
+	}
+
+	emu->counters.tx_bytes += len;
+	return 0;
+}
+
+static int emu_device_moving(const struct emu_device* dev, uint8_t channels)
+{
+	int c;
+
+	for (c = 0; c < channels; c++) {
+		if (dev->ch[c].position != dev->ch[c].target)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Execute command on device
+ *
+ * @param op -- Compact protocol opcode
+ * @param arg -- command arguments
+ * @param answer -- this device answers queries
+ */
+static void emu_exec(struct maestro_emu* emu, struct emu_device* dev, uint8_t op, const uint8_t* arg, int answer)
+{
+	uint8_t ans[2];
+	uint8_t channels = emu->cfg.channels;
+	uint16_t val;
+	int i;
+
+	switch (op) {
+	case COMPACT_SET_TARGET:
+	case COMPACT_SET_SPEED:
+	case COMPACT_SET_ACCELERATION:
+		if (arg[0] >= channels) {
+			dev->errors |= POLOLU_ERR_PROTO;
+			break;
+		}
+		val = arg[1] | (arg[2] << 7);
+		if (op == COMPACT_SET_TARGET)
+			emu_set_target(&dev->ch[arg[0]], val);
+		else if (op == COMPACT_SET_SPEED)
+			maestro_motion_set_speed(&dev->ch[arg[0]], val, maestro_now_ns());
+		else
+			maestro_motion_set_acceleration(&dev->ch[arg[0]], val, maestro_now_ns());
+		break;
+
+	case COMPACT_SET_MULTARGET:
+		for (i = 0; i < arg[0]; i++) {
+			if (arg[1] + i >= channels) {
+				dev->errors |= POLOLU_ERR_PROTO;
+				break;
+			}
+			emu_set_target(&dev->ch[arg[1] + i], arg[2 + 2 * i] | (arg[3 + 2 * i] << 7));
+		}
+		break;
+
+	case COMPACT_SET_PWM:
+		break;
+
+	case COMPACT_GET_POSITION:
+		if (!answer)
+			break;
+		val = (arg[0] < channels) ? (uint16_t)(dev->ch[arg[0]].position + 0.5) : 0;
+		ans[0] = val & 0xFF;
+		ans[1] = val >> 8;
+		emu_answer(emu, ans, ANSWER_GET_POSITION_SIZE);
+		break;
+
+	case COMPACT_GET_MOVING_STATE:
+		if (!answer)
+			break;
+		ans[0] = emu_device_moving(dev, channels);
+		emu_answer(emu, ans, ANSWER_IS_MOVING_SIZE);
+		break;
+
+	case COMPACT_GET_ERRORS:
+		if (!answer)
+			break;
+		ans[0] = dev->errors & 0xFF;
+		ans[1] = dev->errors >> 8;
+		dev->errors = 0;
+		emu_answer(emu, ans, ANSWER_GET_ERRORS_SIZE);
+		break;
+
+	case COMPACT_GO_HOME:
+		for (i = 0; i < channels; i++) {
+			emu_set_target(&dev->ch[i], 0);
+		}
+		break;
+
+	case COMPACT_STOP_SCRIPT:
+		dev->script_stopped = 1;
+		break;
+
+	case COMPACT_RESTART_SCRIPT:
+	case COMPACT_RESTART_SCRIPT_PAR:
+		dev->script_stopped = 0;
+		break;
+
+	case COMPACT_GET_SCRIPT_STATUS:
+		if (!answer)
+			break;
+		ans[0] = dev->script_stopped;
+		emu_answer(emu, ans, ANSWER_IS_STOPPED_SIZE);
+		break;
+	}
+}
+
+/**
+ * @brief Length of Compact protocol command
+ *
+ * @param cmd -- command starting with opcode
+ * @param len -- number of received bytes
+ *
+ * @retval full command length, 0 -- need more bytes, -1 -- unknown opcode
+ */
+static int emu_compact_len(const uint8_t* cmd, size_t len)
+{
+	switch (cmd[0]) {
+	case COMPACT_SET_TARGET:
+	case COMPACT_SET_SPEED:
+	case COMPACT_SET_ACCELERATION:
+		return CMD_SET_TARGET_SIZE;
+	case COMPACT_SET_MULTARGET:
+		return (len < 2) ? 0 : (int) CMD_SET_MULTARGET_SIZE(cmd[1]);
+	case COMPACT_SET_PWM:
+		return CMD_SET_PWM_SIZE;
+	case COMPACT_GET_POSITION:
+		return CMD_GET_POSITION_SIZE;
+	case COMPACT_RESTART_SCRIPT:
+		return CMD_RESTART_SCRIPT_SIZE;
+	case COMPACT_GET_MOVING_STATE:
+	case COMPACT_GET_ERRORS:
+	case COMPACT_GO_HOME:
+	case COMPACT_STOP_SCRIPT:
+	case COMPACT_GET_SCRIPT_STATUS:
+		return CMD_SIMPLE_SIZE;
+	case COMPACT_RESTART_SCRIPT_PAR:
+		return CMD_RESTART_SCRIPT_PAR_SIZE;
+	}
+	return -1;
+}
+
+static void emu_proto_error(struct maestro_emu* emu)
+{
+	int d;
+
+	for (d = 0; d < emu->cfg.devices; d++) {
+		emu->dev[d].errors |= POLOLU_ERR_PROTO;
+	}
+	emu->counters.proto_errors++;
+	emu->frame_len = 0;
+}
+
+/**
+ * @brief Execute complete command from frame buffer
+ */
+static void emu_dispatch(struct maestro_emu* emu)
+{
+	uint8_t* f = emu->frame;
+	int d;
+
+	emu->counters.commands++;
+	emu_update(emu);
+
+	if (f[0] == MINISSC_PROTO_ON) {
+		uint8_t idx = f[1] / emu->cfg.channels;
+		uint8_t ch = f[1] % emu->cfg.channels;
+
+		if ((f[2] <= 254) && (idx < emu->cfg.devices)) {
+			emu_set_target(&emu->dev[idx].ch[ch],
+			               EMU_SSC_NEUTRAL + ((int) f[2] - 127) * EMU_SSC_RANGE / 127);
+		}
+	} else if (f[0] == POLOLU_PROTO_ON) {
+		for (d = 0; d < emu->cfg.devices; d++) {
+			if (emu->dev[d].number == f[1]) {
+				emu_exec(emu, &emu->dev[d], f[2] | 0x80, &f[3], 1);
+			}
+		}
+	} else {
+		/** Compact protocol reaches every device on the line, first one answers */
+		for (d = 0; d < emu->cfg.devices; d++) {
+			emu_exec(emu, &emu->dev[d], f[0], &f[1], d == 0);
+		}
+	}
+
+	emu->frame_len = 0;
+}
+
+static void emu_feed(struct maestro_emu* emu, uint8_t byte)
+{
+	uint8_t* f = emu->frame;
+	int len;
+
+	if (emu->frame_len == 0) {
+		if (byte < 0x80) {
+			emu_proto_error(emu);
+			return;
+		}
+	} else if ((byte & 0x80) && (f[0] != MINISSC_PROTO_ON)) {
+		/** Data bytes have MSB cleared, new command interrupts current one */
+		emu_proto_error(emu);
+	}
+
+	f[emu->frame_len++] = byte;
+
+	if (f[0] == MINISSC_PROTO_ON) {
+		if (emu->frame_len == CMD_MINISSC_SIZE)
+			emu_dispatch(emu);
+		return;
+	}
+
+	if (f[0] == POLOLU_PROTO_ON) {
+		if (emu->frame_len < 3)
+			return;
+		/** Pololu opcode is Compact opcode with MSB cleared */
+		f[2] |= 0x80;
+		len = emu_compact_len(&f[2], emu->frame_len - 2);
+		f[2] &= 0x7F;
+		if (len > 0)
+			len += POLOLU_HEADER_EXTRA;
+	} else {
+		len = emu_compact_len(f, emu->frame_len);
+	}
+
+	if (len < 0) {
+		emu_proto_error(emu);
+	} else if ((len > 0) && (emu->frame_len == (size_t) len)) {
+		emu_dispatch(emu);
+	}
+}
+
+
+/**
+ * @brief Fill configuration with default values
+ */
+void maestro_emu_config_default(struct maestro_emu_config* cfg)
+{
+	cfg->channels = MAESTRO_EMU_MAX_CHANNELS;
+	cfg->device = 12;
+	cfg->devices = 1;
+	cfg->baud = 0;
+}
+
+/**
+ * @brief Create emulator on new pseudo-terminal
+ */
+struct maestro_emu* maestro_emu_create(const struct maestro_emu_config* cfg)
+{
+	struct maestro_emu* emu;
+	struct termios options;
+	int d;
+
+	emu = (struct maestro_emu*) calloc(1, sizeof(*emu));
+	if (emu == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+
+	if (cfg)
+		emu->cfg = *cfg;
+	else
+		maestro_emu_config_default(&emu->cfg);
+
+	if ((emu->cfg.channels == 0) || (emu->cfg.channels > MAESTRO_EMU_MAX_CHANNELS) ||
+	    (emu->cfg.devices == 0) || (emu->cfg.devices > MAESTRO_EMU_MAX_DEVICES)) {
+		fprintf(stderr, "Bad emulator configuration\n");
+		free(emu);
+		return NULL;
+	}
+
+	for (d = 0; d < emu->cfg.devices; d++) {
+		emu->dev[d].number = (uint8_t)(emu->cfg.device + d);
+		emu->dev[d].script_stopped = 1;
+	}
+
+	emu->master = emu->slave = -1;
+	emu->stop_pipe[0] = emu->stop_pipe[1] = -1;
+	pthread_mutex_init(&emu->lock, NULL);
+
+	if (emu->cfg.baud)
+		emu->byte_ns = 10ull * 1000000000ull / emu->cfg.baud; /** 8N1 -- 10 bits per byte */
+
+	emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((emu->master < 0) || grantpt(emu->master) || unlockpt(emu->master) ||
+	    ptsname_r(emu->master, emu->name, sizeof(emu->name))) {
+		perror("pty");
+		goto fail;
+	}
+
+	/** Keep slave opened, so master never sees hangup between clients */
+	emu->slave = open(emu->name, O_RDWR | O_NOCTTY);
+	if (emu->slave < 0) {
+		perror(emu->name);
+		goto fail;
+	}
+
+	tcgetattr(emu->slave, &options);
+	cfmakeraw(&options);
+	tcsetattr(emu->slave, TCSANOW, &options);
+
+	if ((fcntl(emu->master, F_SETFL, fcntl(emu->master, F_GETFL) | O_NONBLOCK) < 0) ||
+	    pipe(emu->stop_pipe)) {
+		perror("emulator");
+		goto fail;
+	}
+
+	return emu;
+
+fail:
+	maestro_emu_destroy(emu);
+	return NULL;
+}
+
+/**
+ * @brief Stop emulator thread (if started), close pty and free emulator
+ */
+void maestro_emu_destroy(struct maestro_emu* emu)
+{
+	if (emu == NULL)
+		return;
+
+	if (emu->thread_started) {
+		maestro_emu_stop(emu);
+		pthread_join(emu->thread, NULL);
+	}
+
+	if (emu->master >= 0)
+		close(emu->master);
+	if (emu->slave >= 0)
+		close(emu->slave);
+	if (emu->stop_pipe[0] >= 0)
+		close(emu->stop_pipe[0]);
+	if (emu->stop_pipe[1] >= 0)
+		close(emu->stop_pipe[1]);
+
+	pthread_mutex_destroy(&emu->lock);
+	free(emu);
+}
+
+/**
+ * @brief Name of pty slave device
+ */
+const char* maestro_emu_device_name(const struct maestro_emu* emu)
+{
+	return emu->name;
+}
+
+/**
+ * @brief File descriptor of pty master side
+ */
+int32_t maestro_emu_fd(const struct maestro_emu* emu)
+{
+	return emu->master;
+}
+
+/**
+ * @brief Process all pending host data without blocking
+ */
+int32_t maestro_emu_process(struct maestro_emu* emu)
+{
+	uint8_t buf[EMU_READ_CHUNK];
+	int32_t total = 0;
+	ssize_t rd;
+	ssize_t i;
+
+	while (1) {
+		rd = read(emu->master, buf, sizeof(buf));
+
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			perror("emulator read");
+			return -1;
+		}
+		if (rd == 0)
+			break;
+
+		pthread_mutex_lock(&emu->lock);
+
+		emu->counters.rx_bytes += rd;
+
+		if (emu->byte_ns) {
+			uint64_t now = maestro_now_ns();
+
+			if (emu->rx_wire < now)
+				emu->rx_wire = now;
+			emu->rx_wire += emu->byte_ns * rd;
+			emu_sleep_until(emu->rx_wire);
+		}
+
+		for (i = 0; i < rd; i++) {
+			emu_feed(emu, buf[i]);
+		}
+
+		pthread_mutex_unlock(&emu->lock);
+		total += rd;
+	}
+
+	return total;
+}
+
+/**
+ * @brief Process host data until maestro_emu_stop() is called
+ */
+int32_t maestro_emu_run(struct maestro_emu* emu)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = emu->master;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = emu->stop_pipe[0];
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("emulator poll");
+			return -1;
+		}
+
+		if (pfd[1].revents)
+			return 0;
+
+		if (pfd[0].revents & POLLIN) {
+			if (maestro_emu_process(emu) < 0)
+				return -1;
+		}
+	}
+}
+
+static void* emu_thread(void* arg)
+{
+	maestro_emu_run((struct maestro_emu*) arg);
+	return NULL;
+}
+
+/**
+ * @brief Run maestro_emu_run() in background thread
+ */
+int32_t maestro_emu_start(struct maestro_emu* emu)
+{
+	if (emu->thread_started)
+		return 0;
+
+	if (pthread_create(&emu->thread, NULL, emu_thread, emu)) {
+		fprintf(stderr, "Failed to start emulator thread\n");
+		return -1;
+	}
+
+	emu->thread_started = 1;
+	return 0;
+}
+
+/**
+ * @brief Request maestro_emu_run() to return
+ */
+void maestro_emu_stop(struct maestro_emu* emu)
+{
+	uint8_t b = 0;
+
+	if (write(emu->stop_pipe[1], &b, 1) < 0) {
+		/** pipe is full -- stop is already requested */
+	}
+}
+
+/**
+ * @brief Get emulated channel state
+ */
+int32_t maestro_emu_get_channel(struct maestro_emu* emu, uint8_t device, uint8_t channel, struct maestro_emu_channel* state)
+{
+	int d;
+
+	if (channel >= emu->cfg.channels)
+		return -1;
+
+	pthread_mutex_lock(&emu->lock);
+	emu_update(emu);
+
+	for (d = 0; d < emu->cfg.devices; d++) {
+		if (emu->dev[d].number == device) {
+			struct maestro_motion* ch = &emu->dev[d].ch[channel];
+
+			state->target = ch->target;
+			state->speed = ch->speed;
+			state->acceleration = ch->acceleration;
+			state->position = (uint16_t)(ch->position + 0.5);
+			pthread_mutex_unlock(&emu->lock);
+			return 0;
+		}
+	}
+
+	pthread_mutex_unlock(&emu->lock);
+	return -1;
+}
+
+/**
+ * @brief Get traffic counters
+ */
+void maestro_emu_get_counters(struct maestro_emu* emu, struct maestro_emu_counters* counters)
+{
+	pthread_mutex_lock(&emu->lock);
+	*counters = emu->counters;
+	pthread_mutex_unlock(&emu->lock);
+}
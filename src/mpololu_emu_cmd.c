@@ -0,0 +1,122 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "mpololu_emu.h" /* Maestro Pololu emulator */
+
+static struct maestro_emu* emu = NULL;
+
+char *link_name = NULL;
+
+
+static void on_signal(int sig)
+{
+	if (emu)
+		maestro_emu_stop(emu);
+}
+
+static void pr_help (char* prog_name)
+{
+	printf("usage: %s [OPTIONS]\n", prog_name);
+	printf("Software Maestro Pololu on pseudo-terminal, use printed device file with mpololu_cmd --dev\n");
+	printf("List of options: \n");
+	printf("\t --channels,c NUM\t\t number of channels of each device, default 24\n");
+	printf("\t --device,d NUM\t\t\t Pololu protocol device number of first device, default 12\n");
+	printf("\t --devices NUM\t\t\t number of daisy-chained devices, default 1\n");
+	printf("\t --baud,b VALUE\t\t\t simulate baud rate, default 0 -- no throttling\n");
+	printf("\t --link FILE\t\t\t create symbolic link FILE to pty device\n");
+	printf("\t --help,h \t\t\t print this help and exit\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	struct maestro_emu_config cfg;
+	struct maestro_emu_counters cnt;
+	int32_t c;
+
+	maestro_emu_config_default(&cfg);
+
+	while (1) {
+		int32_t option_index = 0;
+		static struct option long_options[] = {
+			{"channels", required_argument, 0,  'c' },
+			{"device",   required_argument, 0,  'd' },
+			{"devices",  required_argument, 0,  0 },
+			{"baud",     required_argument, 0,  'b' },
+			{"link",     required_argument, 0,  0 },
+			{"help",     no_argument,       0,  'h' },
+			{0,         0,                 0,  0 }
+		};
+
+		c = getopt_long(argc, argv, "c:d:b:h",
+		                long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			cfg.channels = (uint8_t) atoi(optarg);
+			break;
+		case 'd':
+			cfg.device = (uint8_t) atoi(optarg);
+			break;
+		case 'b':
+			cfg.baud = (uint32_t) atoi(optarg);
+			break;
+		case 0:
+			if (!strcmp(long_options[option_index].name, "devices")) {
+				cfg.devices = (uint8_t) atoi(optarg);
+			} else if (!strcmp(long_options[option_index].name, "link")) {
+				link_name = optarg;
+			}
+			break;
+		case 'h':
+			pr_help(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			pr_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	emu = maestro_emu_create(&cfg);
+
+	if (emu == NULL) {
+		fprintf(stderr, "Failed to create emulator\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (link_name) {
+		unlink(link_name);
+		if (symlink(maestro_emu_device_name(emu), link_name)) {
+			perror(link_name);
+			link_name = NULL;
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	fprintf(stdout, "Maestro emulator: %s, devices %u..%u, %u channels, baud %u\n",
+	        link_name ? link_name : maestro_emu_device_name(emu),
+	        cfg.device, cfg.device + cfg.devices - 1, cfg.channels, cfg.baud);
+	fflush(stdout);
+
+	maestro_emu_run(emu);
+
+	maestro_emu_get_counters(emu, &cnt);
+	fprintf(stdout, "RX %llu bytes, TX %llu bytes, %llu commands, %llu protocol errors\n",
+	        (unsigned long long) cnt.rx_bytes, (unsigned long long) cnt.tx_bytes,
+	        (unsigned long long) cnt.commands, (unsigned long long) cnt.proto_errors);
+
+	if (link_name)
+		unlink(link_name);
+
+	maestro_emu_destroy(emu);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file   mpololu_error.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Error codes, thread-local last error and log callback.
+ *
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "mpololu.h"
+#include "mpololu_error.h"
+#include "mpololu_priv.h"
+
+static _Thread_local struct maestro_error last_error;
+
+struct log_target {
+	maestro_log_cb cb;
+	void* arg;
+};
+
+static _Atomic(struct log_target*) log_target = NULL;
+
+
+/**
+ * @brief Record error of calling thread and pass it to log callback
+ */
+int32_t maestro_fail(int32_t code, const char* what)
+{
+	struct log_target* lt;
+
+	last_error.code = code;
+	last_error.sys_errno = (code == MAESTRO_ERR_IO) ? errno : 0;
+	last_error.what = what;
+
+	lt = atomic_load_explicit(&log_target, memory_order_acquire);
+	if (lt)
+		lt->cb(lt->arg, &last_error);
+
+	return code;
+}
+
+
+/**
+ * @brief Last error of calling thread
+ */
+const struct maestro_error* maestro_last_error(void)
+{
+	return &last_error;
+}
+
+/**
+ * @brief Reset last error of calling thread
+ */
+void maestro_clear_error(void)
+{
+	last_error.code = 0;
+	last_error.sys_errno = 0;
+	last_error.what = NULL;
+}
+
+/**
+ * @brief Description of error code
+ */
+const char* maestro_strerror(int32_t code)
+{
+	switch (code) {
+	case 0:
+		return "no error";
+	case MAESTRO_ERR_IO:
+		return "I/O error";
+	case MAESTRO_ERR_WRITE_SHORT:
+		return "command written partially";
+	case MAESTRO_ERR_TIMEOUT:
+		return "no answer before timeout";
+	case MAESTRO_ERR_SHORT_READ:
+		return "answer incomplete before timeout";
+	case MAESTRO_ERR_PROTOCOL:
+		return "unexpected bytes received";
+	case MAESTRO_ERR_ARG:
+		return "bad argument";
+	case MAESTRO_ERR_NOMEM:
+		return "out of memory";
+	case MAESTRO_ERR_FULL:
+		return "queue is full";
+	case MAESTRO_ERR_STATE:
+		return "not allowed in current state";
+	default:
+		return "unknown error";
+	}
+}
+
+/**
+ * @brief Install log callback
+ */
+int32_t maestro_set_log_cb(maestro_log_cb cb, void* arg)
+{
+	struct log_target* lt = NULL;
+
+	if (cb) {
+		lt = (struct log_target*) malloc(sizeof(*lt));
+		if (lt == NULL)
+			return maestro_fail(MAESTRO_ERR_NOMEM, "malloc()");
+		lt->cb = cb;
+		lt->arg = arg;
+	}
+
+	/** Old pair is leaked on purpose, failing thread may still read it */
+	atomic_store_explicit(&log_target, lt, memory_order_release);
+	return 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file   mpololu_flusher.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Fixed-rate flush thread and target snapshot sender of coalescer and shm table.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "mpololu.h"
+#include "mpololu_priv.h"
+
+
+static void* flusher_thread(void* arg)
+{
+	struct maestro_flusher* f = (struct maestro_flusher*) arg;
+	struct timespec next;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!atomic_load(&f->stop)) {
+		f->flush(f->owner);
+
+		/** Absolute deadlines, so flush time does not stretch period */
+		ns = next.tv_nsec + f->period_ns;
+		next.tv_sec += ns / 1000000000ull;
+		next.tv_nsec = ns % 1000000000ull;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief Initialize flusher of owner
+ */
+void maestro_flusher_init(struct maestro_flusher* f, int32_t fd, int32_t device, uint8_t channels,
+                          int32_t (*flush)(void* owner), void* owner)
+{
+	f->fd = fd;
+	f->device = device;
+	f->channels = channels;
+	f->caps = 0;
+	f->flush = flush;
+	f->owner = owner;
+	f->thread_started = 0;
+	atomic_init(&f->stop, 0);
+	pthread_mutex_init(&f->lock, NULL);
+	f->flushes = 0;
+	f->sent = 0;
+	f->errors = 0;
+}
+
+/**
+ * @brief Release flusher, thread must be stopped
+ */
+void maestro_flusher_destroy(struct maestro_flusher* f)
+{
+	pthread_mutex_destroy(&f->lock);
+}
+
+/**
+ * @brief Send changed channels of snapshot with single write()
+ *
+ * @details Called by owner flush with lock held. Failure is counted,
+ * owner decides whether channels are retried.
+ */
+int32_t maestro_flusher_send(struct maestro_flusher* f, uint64_t dirty, uint64_t known, int32_t n)
+{
+	struct maestro_batch batch;
+	int32_t res;
+
+	maestro_batch_init(&batch, f->tx, sizeof(f->tx));
+
+	/** Known neighbours may be resent to bridge gaps between changed channels */
+	res = maestro_batch_set_targets(&batch, f->device, f->caps, 0, f->channels, f->snapshot, dirty, known);
+	if (res == 0)
+		res = maestro_batch_flush(f->fd, &batch);
+
+	if (res < 0) {
+		f->errors++;
+		return res;
+	}
+
+	f->flushes++;
+	f->sent += n;
+	return 0;
+}
+
+/**
+ * @brief Start thread calling owner flush at fixed rate
+ */
+int32_t maestro_flusher_start(struct maestro_flusher* f, uint32_t rate_hz)
+{
+	int err;
+
+	if (f->thread_started)
+		return 0;
+
+	if (rate_hz == 0)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad flush rate");
+
+	f->period_ns = 1000000000ull / rate_hz;
+	atomic_store(&f->stop, 0);
+
+	err = pthread_create(&f->thread, NULL, flusher_thread, f);
+	if (err) {
+		errno = err;
+		return maestro_fail(MAESTRO_ERR_IO, "failed to start flush thread");
+	}
+
+	f->thread_started = 1;
+	return 0;
+}
+
+/**
+ * @brief Stop flush thread, pending targets are flushed
+ */
+int32_t maestro_flusher_stop(struct maestro_flusher* f)
+{
+	int32_t res;
+
+	if (f->thread_started) {
+		atomic_store(&f->stop, 1);
+		pthread_join(f->thread, NULL);
+		f->thread_started = 0;
+	}
+
+	res = f->flush(f->owner);
+	return (res < 0) ? res : 0;
+}
@@ -0,0 +1,437 @@
+/**
+ * @file   mpololu_group.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Logical channel group spanning many controllers and serial ports.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "mpololu.h"
+#include "mpololu_handle.h"
+#include "mpololu_group.h"
+#include "mpololu_priv.h"
+
+/** Longest spin of start barrier, writers late more than this do not delay others */
+#define GROUP_BARRIER_NS 1000000ull
+
+/** Largest encoding of one handle share: set target for every channel */
+#define GROUP_HANDLE_TX (CMD_SIZE(0, CMD_SET_TARGET_SIZE) * MAESTRO_PLAN_MAX_CHANNELS)
+
+struct group_handle {
+	struct maestro* m;
+	int port;
+	uint8_t channels;     /** channels covered by frame, up to MAESTRO_PLAN_MAX_CHANNELS */
+	uint64_t changed;
+	uint16_t targets[MAESTRO_PLAN_MAX_CHANNELS];
+	size_t tx_off;        /** share of handle in port batch */
+	size_t tx_len;
+};
+
+struct group_port {
+	struct maestro_group* g;
+	int32_t fd;
+	pthread_t thread;
+	int thread_started;
+	struct maestro_batch batch;
+	int assigned;         /** port is written by its thread in current frame */
+	int gen;              /** last frame generation seen by thread */
+	uint64_t start_ns;
+	int32_t res;
+	int32_t res_errno;    /** errno of failed write, error is recorded in writer thread */
+	uint8_t tx[GROUP_HANDLE_TX * MAESTRO_GROUP_MAX_HANDLES];
+};
+
+struct group_map {
+	int16_t handle;  /** -1 -- not mapped */
+	uint8_t channel;
+};
+
+struct maestro_group {
+	uint16_t channels;
+	struct group_map* map;
+
+	struct group_handle handles[MAESTRO_GROUP_MAX_HANDLES];
+	int handles_num;
+	struct group_port* ports[MAESTRO_GROUP_MAX_PORTS];
+	int ports_num;
+
+	/**
+	 * Writers wait on gen and are released by single futex wake, every writer
+	 * acknowledges frame through pending, caller waits for it to drop to 0
+	 */
+	atomic_int gen;
+	atomic_int pending;
+	atomic_int stop;
+
+	/**
+	 * Start barrier: woken writers and caller spin until all busy writers are awake,
+	 * used only when every writer may run on its own CPU
+	 */
+	long cpus;
+	int busy;
+	atomic_int ready;
+
+	uint64_t frames;
+	uint64_t writes;
+	uint64_t errors;
+	uint64_t skew_last_ns;
+	uint64_t skew_max_ns;
+};
+
+
+static void group_futex_wait(atomic_int* addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void group_futex_wake(atomic_int* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void group_barrier(struct maestro_group* g)
+{
+	uint64_t deadline = maestro_now_ns() + GROUP_BARRIER_NS;
+
+	while ((atomic_load_explicit(&g->ready, memory_order_acquire) < g->busy) &&
+	       (maestro_now_ns() < deadline))
+		;
+}
+
+static void group_port_write(struct group_port* p)
+{
+	p->start_ns = maestro_now_ns();
+	p->res = maestro_batch_flush(p->fd, &p->batch);
+	p->res_errno = (p->res < 0) ? maestro_last_error()->sys_errno : 0;
+}
+
+static void* group_thread(void* arg)
+{
+	struct group_port* p = (struct group_port*) arg;
+	struct maestro_group* g = p->g;
+	int gen = p->gen;
+
+	for (;;) {
+		int cur = atomic_load_explicit(&g->gen, memory_order_acquire);
+
+		if (atomic_load_explicit(&g->stop, memory_order_relaxed))
+			break;
+
+		if (cur == gen) {
+			group_futex_wait(&g->gen, cur);
+			continue;
+		}
+		gen = cur;
+
+		if (p->assigned) {
+			atomic_fetch_add_explicit(&g->ready, 1, memory_order_acq_rel);
+			group_barrier(g);
+			group_port_write(p);
+		}
+
+		if (atomic_fetch_sub_explicit(&g->pending, 1, memory_order_acq_rel) == 1)
+			group_futex_wake(&g->pending);
+	}
+
+	return NULL;
+}
+
+static int group_add_port(struct maestro_group* g, int32_t fd)
+{
+	struct group_port* p;
+	int i, err;
+
+	for (i = 0; i < g->ports_num; i++) {
+		if (g->ports[i]->fd == fd)
+			return i;
+	}
+
+	if (g->ports_num == MAESTRO_GROUP_MAX_PORTS)
+		return maestro_fail(MAESTRO_ERR_FULL, "too many ports in group");
+
+	p = (struct group_port*) calloc(1, sizeof(*p));
+	if (p == NULL)
+		return maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+
+	p->g = g;
+	p->fd = fd;
+	p->gen = atomic_load(&g->gen);
+	maestro_batch_init(&p->batch, p->tx, sizeof(p->tx));
+
+	err = pthread_create(&p->thread, NULL, group_thread, p);
+	if (err) {
+		free(p);
+		errno = err;
+		return maestro_fail(MAESTRO_ERR_IO, "failed to start group writer thread");
+	}
+	p->thread_started = 1;
+
+	g->ports[g->ports_num] = p;
+	return g->ports_num++;
+}
+
+static int group_add_handle(struct maestro_group* g, struct maestro* m)
+{
+	struct group_handle* h;
+	int i, port;
+
+	for (i = 0; i < g->handles_num; i++) {
+		if (g->handles[i].m == m)
+			return i;
+	}
+
+	if (g->handles_num == MAESTRO_GROUP_MAX_HANDLES)
+		return maestro_fail(MAESTRO_ERR_FULL, "too many handles in group");
+
+	port = group_add_port(g, maestro_handle_fd(m));
+	if (port < 0)
+		return port;
+
+	h = &g->handles[g->handles_num];
+	h->m = m;
+	h->port = port;
+	h->channels = 0;
+	h->changed = 0;
+
+	return g->handles_num++;
+}
+
+
+/**
+ * @brief Create group
+ */
+struct maestro_group* maestro_group_create(uint16_t channels)
+{
+	struct maestro_group* g;
+	int i;
+
+	g = (struct maestro_group*) calloc(1, sizeof(*g));
+	if (g == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	g->map = (struct group_map*) calloc(channels ? channels : 1, sizeof(*g->map));
+	if (g->map == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		free(g);
+		return NULL;
+	}
+
+	for (i = 0; i < channels; i++) {
+		g->map[i].handle = -1;
+	}
+
+	g->channels = channels;
+	g->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_init(&g->gen, 0);
+	atomic_init(&g->pending, 0);
+	atomic_init(&g->stop, 0);
+
+	return g;
+}
+
+/**
+ * @brief Stop writer threads and free group
+ */
+void maestro_group_destroy(struct maestro_group* g)
+{
+	int i;
+
+	if (g == NULL)
+		return;
+
+	atomic_store(&g->stop, 1);
+	atomic_fetch_add(&g->gen, 1);
+	group_futex_wake(&g->gen);
+
+	for (i = 0; i < g->ports_num; i++) {
+		if (g->ports[i]->thread_started)
+			pthread_join(g->ports[i]->thread, NULL);
+		free(g->ports[i]);
+	}
+
+	free(g->map);
+	free(g);
+}
+
+/**
+ * @brief Map logical channel to device channel
+ */
+int32_t maestro_group_map(struct maestro_group* g, uint16_t logical, struct maestro* m, uint8_t channel)
+{
+	int h;
+
+	if (m == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	if ((logical >= g->channels) || (channel >= maestro_handle_channels(m)) ||
+	    (channel >= MAESTRO_PLAN_MAX_CHANNELS))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	h = group_add_handle(g, m);
+	if (h < 0)
+		return h;
+
+	g->map[logical].handle = h;
+	g->map[logical].channel = channel;
+
+	if (g->handles[h].channels <= channel)
+		g->handles[h].channels = channel + 1;
+
+	return 0;
+}
+
+/**
+ * @brief Send whole frame
+ */
+int32_t maestro_group_set_frame(struct maestro_group* g, const uint16_t* targets_p)
+{
+	struct group_port* first = NULL;
+	uint64_t start_min = UINT64_MAX, start_max = 0;
+	int32_t res = 0;
+	int32_t rv;
+	int i, busy = 0;
+
+	for (i = 0; i < g->ports_num; i++) {
+		maestro_batch_reset(&g->ports[i]->batch);
+	}
+
+	for (i = 0; i < g->channels; i++) {
+		const struct group_map* mp = &g->map[i];
+
+		if (mp->handle >= 0) {
+			g->handles[mp->handle].targets[mp->channel] = targets_p[i];
+			g->handles[mp->handle].changed |= 1ull << mp->channel;
+		}
+	}
+
+	for (i = 0; i < g->handles_num; i++) {
+		struct group_handle* h = &g->handles[i];
+		struct maestro_batch* batch = &g->ports[h->port]->batch;
+
+		h->tx_off = batch->len;
+		rv = maestro_handle_encode_targets(h->m, batch, 0, h->channels, h->targets, &h->changed, 0);
+		h->tx_len = batch->len - h->tx_off;
+		if (rv < 0) {
+			h->changed = 0;
+			res = rv;
+		}
+	}
+
+	/**
+	 * Caller writes first port itself, other ports are written by their threads,
+	 * all writes start when every thread is awake
+	 */
+	for (i = 0; i < g->ports_num; i++) {
+		struct group_port* p = g->ports[i];
+
+		p->assigned = 0;
+		if (p->batch.len) {
+			if (first == NULL) {
+				first = p;
+			} else {
+				p->assigned = 1;
+				busy++;
+			}
+		}
+	}
+
+	if (busy) {
+		g->busy = (busy < g->cpus) ? busy : 0;
+		atomic_store_explicit(&g->ready, 0, memory_order_relaxed);
+		atomic_store_explicit(&g->pending, g->ports_num, memory_order_relaxed);
+		atomic_fetch_add_explicit(&g->gen, 1, memory_order_release);
+		group_futex_wake(&g->gen);
+		group_barrier(g);
+	}
+
+	if (first)
+		group_port_write(first);
+
+	for (;;) {
+		int left = atomic_load_explicit(&g->pending, memory_order_acquire);
+
+		if (left == 0)
+			break;
+		group_futex_wait(&g->pending, left);
+	}
+
+	for (i = 0; i < g->ports_num; i++) {
+		struct group_port* p = g->ports[i];
+
+		if (!p->assigned && (p != first))
+			continue;
+
+		g->writes++;
+		if (p->res) {
+			g->errors++;
+			res = p->res;
+			/** Record failure of writer thread in caller's last error */
+			if (p->assigned) {
+				errno = p->res_errno;
+				maestro_fail(p->res, "group port write");
+			}
+		}
+		if (p->start_ns < start_min)
+			start_min = p->start_ns;
+		if (p->start_ns > start_max)
+			start_max = p->start_ns;
+	}
+
+	if (busy) {
+		g->skew_last_ns = start_max - start_min;
+		if (g->skew_last_ns > g->skew_max_ns)
+			g->skew_max_ns = g->skew_last_ns;
+	}
+
+	for (i = 0; i < g->handles_num; i++) {
+		struct group_handle* h = &g->handles[i];
+
+		/** Flush keeps buffer of sent batch, failed write is counted without bytes */
+		if (h->changed)
+			maestro_handle_commit_targets(h->m, 0, h->channels, h->targets, h->changed,
+			                              g->ports[h->port]->tx + h->tx_off, h->tx_len, g->ports[h->port]->res);
+		h->changed = 0;
+	}
+
+	g->frames++;
+	return res;
+}
+
+/**
+ * @brief Set target of single logical channel
+ */
+int32_t maestro_group_set_target(struct maestro_group* g, uint16_t logical, uint16_t target)
+{
+	const struct group_map* mp;
+
+	if ((logical >= g->channels) || (g->map[logical].handle < 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	mp = &g->map[logical];
+	return maestro_set_target(g->handles[mp->handle].m, mp->channel, target);
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_group_get_stats(struct maestro_group* g, struct maestro_group_stats* stats)
+{
+	stats->frames = g->frames;
+	stats->writes = g->writes;
+	stats->errors = g->errors;
+	stats->skew_last_ns = g->skew_last_ns;
+	stats->skew_max_ns = g->skew_max_ns;
+}
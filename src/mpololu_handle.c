@@ -0,0 +1,1023 @@
+/**
+ * @file   mpololu_handle.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Persistent controller handle.
+ *
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include "mpololu.h"
+#include "mpololu_handle.h"
+#include "mpololu_metrics.h"
+#include "mpololu_priv.h"
+
+
+static int32_t maestro_check_channel(const struct maestro* m, uint32_t channel)
+{
+	if (channel >= m->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	return 0;
+}
+
+/** Target is within deadband of last written one */
+static int shadow_target_same(const struct maestro* m, uint8_t channel, uint16_t target)
+{
+	const struct maestro_shadow* sh = &m->shadow;
+	int32_t diff = (int32_t) target - sh->target[channel];
+
+	return sh->enabled && (sh->valid[channel] & MAESTRO_SHADOW_TARGET) &&
+	       (diff <= sh->deadband[channel]) && (-diff <= sh->deadband[channel]);
+}
+
+/** Feed written value to motion model */
+static void model_update(struct maestro* m, uint8_t flag, uint8_t channel, uint16_t value)
+{
+	struct maestro_motion* mo = &m->motion[channel];
+	uint64_t now = maestro_now_ns();
+
+	if (flag == MAESTRO_SHADOW_TARGET)
+		maestro_motion_set_target(mo, value, now);
+	else if (flag == MAESTRO_SHADOW_SPEED)
+		maestro_motion_set_speed(mo, value, now);
+	else
+		maestro_motion_set_acceleration(mo, value, now);
+
+	m->motion_known[channel] |= flag;
+}
+
+static void model_forget(struct maestro* m, uint8_t what)
+{
+	int i;
+
+	for (i = 0; i < m->channels; i++) {
+		m->motion_known[i] &= ~what;
+	}
+}
+
+static int model_valid(const struct maestro* m, uint8_t channel)
+{
+	return m->motion_known[channel] == MAESTRO_SHADOW_ALL;
+}
+
+/** Remember written value, forget it if write failed (device state is unknown) */
+static void shadow_update(struct maestro* m, uint16_t* values, uint8_t flag, uint8_t channel, uint16_t value, int32_t res)
+{
+	if (res) {
+		m->shadow.valid[channel] &= ~flag;
+		m->motion_known[channel] &= ~flag;
+		return;
+	}
+
+	values[channel] = value;
+	m->shadow.valid[channel] |= flag;
+	m->shadow.written++;
+
+	model_update(m, flag, channel, value);
+}
+
+
+/** Default timeout of maestro_rtt_timeout() before first answer when adaptive timeout is disabled */
+#define RTT_DEFAULT_US 1000000u
+
+/** Adaptive timeout is doubled at most this many times */
+#define RTT_MAX_BACKOFF 6
+
+/** RTT of sample without answer bytes */
+static uint32_t rtt_base_us(const struct maestro_rtt* r, uint32_t i)
+{
+	uint64_t cost = (uint64_t) r->bytes[i] * r->byte_ns / 1000;
+
+	return (r->us[i] > cost) ? (uint32_t)(r->us[i] - cost) : 0;
+}
+
+/** Percentile of RTT without answer bytes over window */
+static uint32_t rtt_percentile(const struct maestro_rtt* r, uint32_t pct)
+{
+	uint32_t v[MAESTRO_RTT_WINDOW];
+	uint32_t i, j;
+
+	if (!r->count)
+		return 0;
+
+	for (i = 0; i < r->count; i++) {
+		uint32_t x = rtt_base_us(r, i);
+
+		for (j = i; (j > 0) && (v[j - 1] > x); j--) {
+			v[j] = v[j - 1];
+		}
+		v[j] = x;
+	}
+
+	return v[(r->count - 1) * pct / 100];
+}
+
+static void rtt_record(struct maestro* m, uint32_t answer_bytes, uint64_t elapsed_ns, int32_t res, int adaptive)
+{
+	struct maestro_rtt* r = &m->rtt;
+
+	if (res < 0) {
+		if (adaptive) {
+			r->timeouts++;
+			if (r->backoff < RTT_MAX_BACKOFF)
+				r->backoff++;
+		}
+		return;
+	}
+
+	r->us[r->next] = (uint32_t)(elapsed_ns / 1000);
+	r->bytes[r->next] = (uint16_t) answer_bytes;
+	r->next = (r->next + 1) % MAESTRO_RTT_WINDOW;
+	if (r->count < MAESTRO_RTT_WINDOW)
+		r->count++;
+	r->backoff = 0;
+}
+
+/** Quiet window of resync, late bytes would have come by then */
+static uint32_t handle_quiet_us(const struct maestro* m)
+{
+	struct timeval tv;
+
+	if (!m->framer.resync)
+		return 0;
+
+	maestro_rtt_timeout(m, (uint32_t) m->framer.stale, &tv);
+	return (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/** Deadline of query: own timeout (adaptive if NULL) bounded by batch deadline */
+static uint64_t handle_deadline(const struct maestro* m, struct timeval* timeout, uint32_t answer_bytes, int adaptive)
+{
+	struct timeval tv;
+
+	if (adaptive) {
+		maestro_rtt_timeout(m, answer_bytes, &tv);
+		timeout = &tv;
+	}
+
+	return maestro_deadline_min(maestro_deadline(timeout), m->deadline);
+}
+
+/** Batch deadline passed, query would not be sent */
+static int handle_expired(const struct maestro* m)
+{
+	if (m->deadline && (maestro_now_ns() >= m->deadline)) {
+		maestro_fail(MAESTRO_ERR_TIMEOUT, "batch deadline expired");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write command in m->tx and count it
+ */
+static int32_t handle_write(struct maestro* m, size_t len)
+{
+	int32_t res = maestro_write_cmd(m->fd, m->tx, len);
+
+	maestro_metrics_tx(&m->metrics, m->tx, len, res);
+	return res;
+}
+
+/**
+ * @brief Record query in RTT window and metrics
+ *
+ * @details Query which got no complete answer within deadline is counted as
+ * timeout, other failures as errors.
+ */
+static void handle_query_done(struct maestro* m, uint32_t type, size_t len, uint32_t answer_bytes,
+                              uint64_t start_ns, int32_t res, int adaptive)
+{
+	uint64_t elapsed = maestro_now_ns() - start_ns;
+	int32_t status = 0;
+
+	if (res < 0)
+		status = ((res == MAESTRO_ERR_TIMEOUT) || (res == MAESTRO_ERR_SHORT_READ)) ? 1 : -1;
+
+	rtt_record(m, answer_bytes, elapsed, res, adaptive);
+	maestro_metrics_tx(&m->metrics, m->tx, len, (status < 0) ? -1 : 0);
+	maestro_metrics_query(&m->metrics, type, elapsed, status);
+	maestro_metrics_framer(&m->metrics, &m->framer);
+}
+
+/**
+ * @brief Send query in m->tx and read answer, measuring round trip time
+ */
+static int32_t handle_query(struct maestro* m, uint32_t type, size_t len, struct timeval* timeout, uint32_t answer_bytes)
+{
+	uint64_t start;
+	int32_t res;
+	int adaptive = (timeout == NULL) && m->rtt.max_us;
+
+	if (handle_expired(m))
+		return MAESTRO_ERR_TIMEOUT;
+
+	start = maestro_now_ns();
+	res = maestro_get_small_answer(m->fd, &m->framer, m->tx, len, handle_deadline(m, timeout, answer_bytes, adaptive),
+	                               answer_bytes, handle_quiet_us(m));
+	handle_query_done(m, type, len, answer_bytes, start, res, adaptive);
+	return res;
+}
+
+
+/**
+ * @brief Create handle for already opened descriptor
+ */
+struct maestro* maestro_handle_attach(int32_t fd, int32_t device, uint8_t channels)
+{
+	struct maestro* m;
+
+	if (fd < 0) {
+		maestro_fail(MAESTRO_ERR_ARG, "bad descriptor");
+		return NULL;
+	}
+
+	m = (struct maestro*) calloc(1, sizeof(*m));
+	if (m == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	m->fd = fd;
+	m->device = (device < 0) ? MAESTRO_COMPACT : device;
+	m->channels = channels;
+	m->shadow.enabled = 1;
+
+	return m;
+}
+
+/**
+ * @brief Open serial interface and create handle
+ */
+struct maestro* maestro_handle_open(const char* path, int32_t device, uint8_t channels)
+{
+	struct maestro* m;
+	int32_t fd = maestro_open(path);
+
+	if (fd < 0)
+		return NULL;
+
+	m = maestro_handle_attach(fd, device, channels);
+	if (m == NULL) {
+		maestro_close(fd);
+		return NULL;
+	}
+
+	m->owns_fd = 1;
+	return m;
+}
+
+/**
+ * @brief Free handle, close descriptor if handle opened it
+ */
+int32_t maestro_handle_close(struct maestro* m)
+{
+	int32_t res = 0;
+
+	if (m == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	if (m->owns_fd)
+		res = maestro_close(m->fd);
+
+	free(m);
+	return res;
+}
+
+/**
+ * @brief Handle properties
+ */
+int32_t maestro_handle_fd(const struct maestro* m)
+{
+	return m->fd;
+}
+
+int32_t maestro_handle_device(const struct maestro* m)
+{
+	return m->device;
+}
+
+uint8_t maestro_handle_channels(const struct maestro* m)
+{
+	return m->channels;
+}
+
+/**
+ * @brief Set limits of device
+ */
+void maestro_handle_set_caps(struct maestro* m, uint32_t caps)
+{
+	m->caps = caps;
+}
+
+/** Value of 14-bit command argument */
+#define CMD_VALUE(p) ((uint16_t)((p)[0] | ((p)[1] << 7)))
+
+/**
+ * @brief Update shadow and model after raw commands were written
+ *
+ * @details Commands which may change something not recorded drop the cache,
+ * like go home and restart script do.
+ */
+static void handle_track_cmds(struct maestro* m, const uint8_t* cmd, size_t len, int32_t res)
+{
+	size_t off = 0;
+
+	while (off < len) {
+		const uint8_t* c = &cmd[off];
+		uint8_t command, answer;
+		size_t size = maestro_cmd_size(c, len - off, &command, &answer);
+		uint8_t i;
+
+		if (!size) {
+			maestro_shadow_invalidate(m, MAESTRO_SHADOW_ALL);
+			model_forget(m, MAESTRO_SHADOW_ALL);
+			return;
+		}
+		off += size;
+
+		if (c[0] == POLOLU_PROTO_ON) {
+			/** Command of other device on the same line */
+			if ((m->device >= 0) && (c[1] != m->device))
+				continue;
+			c += POLOLU_HEADER_EXTRA;
+		}
+
+		switch (command) {
+		case POLOLU_SET_TARGET:
+			if (c[1] < m->channels)
+				shadow_update(m, m->shadow.target, MAESTRO_SHADOW_TARGET, c[1], CMD_VALUE(&c[2]), res);
+			break;
+		case POLOLU_SET_MULTARGET:
+			for (i = 0; (i < c[1]) && (c[2] + i < m->channels); i++) {
+				shadow_update(m, m->shadow.target, MAESTRO_SHADOW_TARGET, c[2] + i, CMD_VALUE(&c[3 + 2 * i]), res);
+			}
+			break;
+		case POLOLU_SET_SPEED:
+			if (c[1] < m->channels)
+				shadow_update(m, m->shadow.speed, MAESTRO_SHADOW_SPEED, c[1], CMD_VALUE(&c[2]), res);
+			break;
+		case POLOLU_SET_ACCELERATION:
+			if (c[1] < m->channels)
+				shadow_update(m, m->shadow.acceleration, MAESTRO_SHADOW_ACCELERATION, c[1], CMD_VALUE(&c[2]), res);
+			break;
+		case POLOLU_GO_HOME:
+			maestro_shadow_invalidate(m, MAESTRO_SHADOW_TARGET);
+			model_forget(m, MAESTRO_SHADOW_TARGET);
+			break;
+		case POLOLU_RESTART_SCRIPT:
+		case POLOLU_RESTART_SCRIPT_PAR:
+			maestro_shadow_invalidate(m, MAESTRO_SHADOW_ALL);
+			model_forget(m, MAESTRO_SHADOW_ALL);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Send all commands of batch through handle and reset batch
+ */
+int32_t maestro_handle_send_batch(struct maestro* m, struct maestro_batch* batch)
+{
+	int32_t res;
+
+	if (batch == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	if (!batch->len)
+		return 0;
+
+	res = maestro_write_cmd(m->fd, batch->buf, batch->len);
+	maestro_metrics_tx(&m->metrics, batch->buf, batch->len, res);
+	handle_track_cmds(m, batch->buf, batch->len, res);
+	if (res < 0)
+		return res;
+
+	maestro_batch_reset(batch);
+	return 0;
+}
+
+
+/**
+ * @brief Set target
+ */
+int32_t maestro_set_target(struct maestro* m, uint8_t channel, uint16_t target)
+{
+	int32_t res;
+
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	if (shadow_target_same(m, channel, target)) {
+		m->shadow.suppressed++;
+		return 0;
+	}
+
+	res = handle_write(m, maestro_enc_set_target(m->tx, m->device, channel, target));
+	shadow_update(m, m->shadow.target, MAESTRO_SHADOW_TARGET, channel, target, res);
+	return res;
+}
+
+/**
+ * @brief Append changed targets of channels range to batch
+ */
+int32_t maestro_handle_encode_targets(struct maestro* m, struct maestro_batch* batch, uint8_t first_channel, uint8_t targets_num,
+                                      const uint16_t* targets_p, uint64_t* changed, uint64_t known)
+{
+	int i;
+
+	for (i = 0; i < targets_num; i++) {
+		uint8_t ch = first_channel + i;
+
+		if (!(*changed & (1ull << i)))
+			continue;
+
+		if (shadow_target_same(m, ch, targets_p[i])) {
+			*changed &= ~(1ull << i);
+			if (targets_p[i] == m->shadow.target[ch])
+				known |= 1ull << i;
+			m->shadow.suppressed++;
+		}
+	}
+
+	if (!*changed)
+		return 0;
+
+	return maestro_batch_set_targets(batch, m->device, batch->caps | m->caps, first_channel, targets_num, targets_p, *changed, known);
+}
+
+/**
+ * @brief Count write of encoded targets and update shadow and model
+ */
+void maestro_handle_commit_targets(struct maestro* m, uint8_t first_channel, uint8_t targets_num,
+                                   const uint16_t* targets_p, uint64_t changed, const uint8_t* cmd, size_t len, int32_t res)
+{
+	int i;
+
+	if (len)
+		maestro_metrics_tx(&m->metrics, cmd, len, res);
+
+	for (i = 0; i < targets_num; i++) {
+		if (changed & (1ull << i))
+			shadow_update(m, m->shadow.target, MAESTRO_SHADOW_TARGET, first_channel + i, targets_p[i], res);
+	}
+}
+
+/**
+ * @brief Send changed targets of channels range and update shadow
+ *
+ * @details Channels within deadband are dropped, gaps between changed channels
+ * may be bridged by channels whose shadow equals new target exactly.
+ */
+static int32_t shadow_set_targets(struct maestro* m, uint8_t first_channel, uint8_t targets_num,
+                                  const uint16_t* targets_p, uint64_t changed, uint64_t known)
+{
+	struct maestro_batch batch;
+	int32_t res;
+
+	maestro_batch_init(&batch, m->tx, sizeof(m->tx));
+	res = maestro_handle_encode_targets(m, &batch, first_channel, targets_num, targets_p, &changed, known);
+	if (res < 0)
+		return res;
+
+	if (!changed)
+		return 0;
+
+	res = maestro_write_cmd(m->fd, batch.buf, batch.len);
+	maestro_handle_commit_targets(m, first_channel, targets_num, targets_p, changed, batch.buf, batch.len, res);
+	return res;
+}
+
+/**
+ * @brief Set multiple target
+ */
+int32_t maestro_set_multiple_target(struct maestro* m, uint8_t targets_num, uint8_t first_channel, const uint16_t* targets_p)
+{
+	int32_t res;
+	int i, n;
+
+	if ((targets_p == NULL) && (targets_num != 0))
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	if (targets_num && maestro_check_channel(m, (uint32_t) first_channel + targets_num - 1))
+		return MAESTRO_ERR_ARG;
+
+	/** Only changed channels are sent, in the cheapest encoding */
+	if (m->shadow.enabled && (targets_num <= MAESTRO_PLAN_MAX_CHANNELS))
+		return shadow_set_targets(m, first_channel, targets_num, targets_p,
+		                          (targets_num < 64) ? (1ull << targets_num) - 1 : ~0ull, 0);
+
+	/** Device without set multiple target gets planned single set targets, by planner-sized parts */
+	if (m->caps & MAESTRO_CAP_SINGLE_TARGET) {
+		for (i = 0; i < targets_num; i += n) {
+			n = targets_num - i;
+			if (n > MAESTRO_PLAN_MAX_CHANNELS)
+				n = MAESTRO_PLAN_MAX_CHANNELS;
+
+			res = shadow_set_targets(m, first_channel + i, n, targets_p + i, (n < 64) ? (1ull << n) - 1 : ~0ull, 0);
+			if (res < 0)
+				return res;
+		}
+		return 0;
+	}
+
+	res = handle_write(m, maestro_enc_set_multiple_target(m->tx, m->device, targets_num, first_channel, targets_p));
+
+	for (i = 0; i < targets_num; i++) {
+		shadow_update(m, m->shadow.target, MAESTRO_SHADOW_TARGET, first_channel + i, targets_p[i], res);
+	}
+
+	return res;
+}
+
+/**
+ * @brief Send changed targets with minimal number of bytes
+ */
+int32_t maestro_set_targets(struct maestro* m, const uint16_t* targets_p, uint64_t changed, uint64_t known)
+{
+	if ((targets_p == NULL) || (m->channels > MAESTRO_PLAN_MAX_CHANNELS))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad targets");
+
+	return shadow_set_targets(m, 0, m->channels, targets_p, changed, known);
+}
+
+/**
+ * @brief Set speed
+ */
+int32_t maestro_set_speed(struct maestro* m, uint8_t channel, uint16_t speed)
+{
+	int32_t res;
+
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	if (m->shadow.enabled && (m->shadow.valid[channel] & MAESTRO_SHADOW_SPEED) && (m->shadow.speed[channel] == speed)) {
+		m->shadow.suppressed++;
+		return 0;
+	}
+
+	res = handle_write(m, maestro_enc_set_speed(m->tx, m->device, channel, speed));
+	shadow_update(m, m->shadow.speed, MAESTRO_SHADOW_SPEED, channel, speed, res);
+	return res;
+}
+
+/**
+ * @brief Set acceleration
+ */
+int32_t maestro_set_acceleration(struct maestro* m, uint8_t channel, uint16_t acceleration)
+{
+	int32_t res;
+
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	if (m->shadow.enabled && (m->shadow.valid[channel] & MAESTRO_SHADOW_ACCELERATION) && (m->shadow.acceleration[channel] == acceleration)) {
+		m->shadow.suppressed++;
+		return 0;
+	}
+
+	res = handle_write(m, maestro_enc_set_acceleration(m->tx, m->device, channel, acceleration));
+	shadow_update(m, m->shadow.acceleration, MAESTRO_SHADOW_ACCELERATION, channel, acceleration, res);
+	return res;
+}
+
+/**
+ * @brief Set PWM
+ */
+int32_t maestro_set_pwm(struct maestro* m, uint16_t on_time, uint16_t period)
+{
+	return handle_write(m, maestro_enc_set_pwm(m->tx, m->device, on_time, period));
+}
+
+/**
+ * @brief Go home
+ */
+int32_t maestro_go_home(struct maestro* m)
+{
+	/** Targets are changed by device, speeds and accelerations are kept */
+	maestro_shadow_invalidate(m, MAESTRO_SHADOW_TARGET);
+	model_forget(m, MAESTRO_SHADOW_TARGET);
+	return handle_write(m, maestro_enc_simple(m->tx, m->device, COMPACT_GO_HOME));
+}
+
+/**
+ * @brief Stop script
+ */
+int32_t maestro_stop_script(struct maestro* m)
+{
+	return handle_write(m, maestro_enc_simple(m->tx, m->device, COMPACT_STOP_SCRIPT));
+}
+
+/**
+ * @brief Restart script at subroutine
+ */
+int32_t maestro_restart_script(struct maestro* m, uint8_t subroutine_number)
+{
+	/** Script may change anything */
+	maestro_shadow_invalidate(m, MAESTRO_SHADOW_ALL);
+	model_forget(m, MAESTRO_SHADOW_ALL);
+	return handle_write(m, maestro_enc_restart_script(m->tx, m->device, subroutine_number));
+}
+
+/**
+ * @brief Restart script at subroutine with parameter
+ */
+int32_t maestro_restart_script_par(struct maestro* m, uint8_t subroutine_number, uint16_t parameter)
+{
+	/** Script may change anything */
+	maestro_shadow_invalidate(m, MAESTRO_SHADOW_ALL);
+	model_forget(m, MAESTRO_SHADOW_ALL);
+	return handle_write(m, maestro_enc_restart_script_par(m->tx, m->device, subroutine_number, parameter));
+}
+
+
+/**
+ * @brief Get position
+ */
+int32_t maestro_get_position(struct maestro* m, uint8_t channel, struct timeval* timeout)
+{
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	return handle_query(m, MAESTRO_QUERY_GET_POSITION, maestro_enc_get_position(m->tx, m->device, channel), timeout, ANSWER_GET_POSITION_SIZE);
+}
+
+/**
+ * @brief Get positions of channels range
+ */
+int32_t maestro_get_positions(struct maestro* m, uint8_t channels_num, uint8_t first_channel,
+                              uint16_t* positions_p, int32_t* status_p, struct timeval* timeout)
+{
+	uint64_t start;
+	int32_t res;
+	int adaptive = (timeout == NULL) && m->rtt.max_us;
+
+	if (channels_num && maestro_check_channel(m, (uint32_t) first_channel + channels_num - 1))
+		return MAESTRO_ERR_ARG;
+
+	if (handle_expired(m))
+		return MAESTRO_ERR_TIMEOUT;
+
+	start = maestro_now_ns();
+	res = maestro_get_positions_buf(m->fd, &m->framer, m->device, channels_num, first_channel, positions_p, status_p,
+	                                handle_deadline(m, timeout, ANSWER_GET_POSITION_SIZE * channels_num, adaptive),
+	                                handle_quiet_us(m), m->tx, m->rx);
+	if (channels_num)
+		handle_query_done(m, MAESTRO_QUERY_GET_POSITIONS, CMD_SIZE(m->device, CMD_GET_POSITION_SIZE) * channels_num,
+		                  ANSWER_GET_POSITION_SIZE * channels_num, start,
+		                  (res < 0) ? res : (res == channels_num) ? 0 : res ? MAESTRO_ERR_SHORT_READ : MAESTRO_ERR_TIMEOUT,
+		                  adaptive);
+	return res;
+}
+
+/**
+ * @brief Get moving state
+ */
+int32_t maestro_is_moving(struct maestro* m, struct timeval* timeout)
+{
+	return handle_query(m, MAESTRO_QUERY_IS_MOVING, maestro_enc_simple(m->tx, m->device, COMPACT_GET_MOVING_STATE), timeout, ANSWER_IS_MOVING_SIZE);
+}
+
+/**
+ * @brief Get errors
+ */
+int32_t maestro_get_errors(struct maestro* m, struct timeval* timeout)
+{
+	return handle_query(m, MAESTRO_QUERY_GET_ERRORS, maestro_enc_simple(m->tx, m->device, COMPACT_GET_ERRORS), timeout, ANSWER_GET_ERRORS_SIZE);
+}
+
+/**
+ * @brief Get script status
+ */
+int32_t maestro_is_stopped(struct maestro* m, struct timeval* timeout)
+{
+	return handle_query(m, MAESTRO_QUERY_IS_STOPPED, maestro_enc_simple(m->tx, m->device, COMPACT_GET_SCRIPT_STATUS), timeout, ANSWER_IS_STOPPED_SIZE);
+}
+
+
+/**
+ * @brief Enable or disable shadow cache
+ */
+void maestro_shadow_enable(struct maestro* m, int32_t enable)
+{
+	m->shadow.enabled = enable ? 1 : 0;
+	maestro_shadow_invalidate(m, MAESTRO_SHADOW_ALL);
+}
+
+/**
+ * @brief Set target deadband of channel
+ */
+int32_t maestro_shadow_set_deadband(struct maestro* m, uint8_t channel, uint16_t deadband)
+{
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	m->shadow.deadband[channel] = deadband;
+	return 0;
+}
+
+/**
+ * @brief Forget cached values of all channels
+ */
+void maestro_shadow_invalidate(struct maestro* m, uint8_t what)
+{
+	int i;
+
+	for (i = 0; i < m->channels; i++) {
+		m->shadow.valid[i] &= ~what;
+	}
+}
+
+/**
+ * @brief Forget cached values of channel
+ */
+int32_t maestro_shadow_invalidate_channel(struct maestro* m, uint8_t channel, uint8_t what)
+{
+	if (maestro_check_channel(m, channel))
+		return MAESTRO_ERR_ARG;
+
+	m->shadow.valid[channel] &= ~what;
+	return 0;
+}
+
+/**
+ * @brief Get last target written to channel
+ */
+int32_t maestro_shadow_get_target(const struct maestro* m, uint8_t channel)
+{
+	if (channel >= m->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	/** Unknown target is not a failure, nothing is recorded */
+	if (!(m->shadow.valid[channel] & MAESTRO_SHADOW_TARGET))
+		return MAESTRO_ERR_STATE;
+
+	return m->shadow.target[channel];
+}
+
+/**
+ * @brief Get shadow cache statistics
+ */
+void maestro_shadow_get_stats(const struct maestro* m, struct maestro_shadow_stats* stats)
+{
+	stats->written = m->shadow.written;
+	stats->suppressed = m->shadow.suppressed;
+}
+
+
+/**
+ * @brief Predict state of channel now
+ */
+int32_t maestro_model_predict(const struct maestro* m, uint8_t channel, struct maestro_model_state* state)
+{
+	const struct maestro_motion* mo;
+	uint64_t now = maestro_now_ns();
+	uint64_t arrival;
+	double position, velocity;
+
+	if (channel >= m->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	if (!model_valid(m, channel))
+		return MAESTRO_ERR_STATE;
+
+	mo = &m->motion[channel];
+	maestro_motion_predict(mo, now, &position, &velocity);
+	arrival = maestro_motion_arrival(mo);
+
+	state->position = (uint16_t)(position + 0.5);
+	state->target = mo->target;
+	state->velocity = (int32_t)(velocity * 1000.0);
+	state->arrival_us = (arrival > now) ? (uint32_t)((arrival - now) / 1000) : 0;
+	return 0;
+}
+
+/**
+ * @brief Predict whether any channel is moving
+ */
+int32_t maestro_model_is_moving(const struct maestro* m)
+{
+	uint64_t now = maestro_now_ns();
+	int i;
+
+	for (i = 0; i < m->channels; i++) {
+		if (model_valid(m, i) && (maestro_motion_arrival(&m->motion[i]) > now))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Correct model by positions read from device
+ */
+int32_t maestro_model_resync(struct maestro* m, uint8_t channels_num, uint8_t first_channel, struct timeval* timeout)
+{
+	uint16_t positions[256];
+	int32_t status[256];
+	uint64_t now;
+	int32_t res;
+	int i;
+
+	res = maestro_get_positions(m, channels_num, first_channel, positions, status, timeout);
+	if (res < 0)
+		return res;
+
+	now = maestro_now_ns();
+	res = 0;
+
+	for (i = 0; i < channels_num; i++) {
+		struct maestro_motion* mo = &m->motion[first_channel + i];
+		double err;
+
+		if (status[i] || !model_valid(m, first_channel + i))
+			continue;
+
+		maestro_motion_advance(mo, now);
+		err = fabs(mo->position - positions[i]);
+
+		m->resync_last_error = (uint32_t)(err + 0.5);
+		if (m->resync_last_error > m->resync_max_error)
+			m->resync_max_error = m->resync_last_error;
+
+		mo->position = positions[i];
+		if (positions[i] == mo->target)
+			mo->velocity = 0.0;
+		res++;
+	}
+
+	m->resyncs++;
+	m->resync_last_ns = now;
+	return res;
+}
+
+/**
+ * @brief Set period of automatic resync done by maestro_model_poll()
+ */
+void maestro_model_set_resync_period(struct maestro* m, uint32_t period_ms)
+{
+	m->resync_period_ns = (uint64_t) period_ms * 1000000ull;
+}
+
+/**
+ * @brief Resync all channels if resync period elapsed
+ */
+int32_t maestro_model_poll(struct maestro* m, struct timeval* timeout)
+{
+	int32_t res;
+
+	if (!m->resync_period_ns || (maestro_now_ns() - m->resync_last_ns < m->resync_period_ns))
+		return 0;
+
+	res = maestro_model_resync(m, m->channels, 0, timeout);
+	return (res < 0) ? res : 1;
+}
+
+/**
+ * @brief Get motion model statistics
+ */
+void maestro_model_get_stats(const struct maestro* m, struct maestro_model_stats* stats)
+{
+	stats->resyncs = m->resyncs;
+	stats->max_error = m->resync_max_error;
+	stats->last_error = m->resync_last_error;
+}
+
+
+/**
+ * @brief Measure round trip time of link
+ */
+int32_t maestro_rtt_probe(struct maestro* m, uint32_t count, struct timeval* timeout)
+{
+	uint16_t positions[256];
+	uint32_t small_us = UINT32_MAX, big_us = UINT32_MAX;
+	int32_t answered = 0;
+	int32_t res = 0;
+	uint32_t i;
+
+	if (count == 0)
+		return maestro_fail(MAESTRO_ERR_ARG, "count must be positive");
+
+	for (i = 0; i < count; i++) {
+		res = maestro_is_moving(m, timeout);
+		if (res >= 0) {
+			uint32_t us = m->rtt.us[(m->rtt.next + MAESTRO_RTT_WINDOW - 1) % MAESTRO_RTT_WINDOW];
+
+			if (us < small_us)
+				small_us = us;
+			answered++;
+		}
+	}
+
+	for (i = 0; (m->channels > 1) && (i < count); i++) {
+		if (maestro_get_positions(m, m->channels, 0, positions, NULL, timeout) == m->channels) {
+			uint32_t us = m->rtt.us[(m->rtt.next + MAESTRO_RTT_WINDOW - 1) % MAESTRO_RTT_WINDOW];
+
+			if (us < big_us)
+				big_us = us;
+			answered++;
+		}
+	}
+
+	/** Fastest answers of both sizes have the least noise, their difference is cost of bytes */
+	if ((small_us != UINT32_MAX) && (big_us != UINT32_MAX)) {
+		uint32_t extra = ANSWER_GET_POSITION_SIZE * m->channels - ANSWER_IS_MOVING_SIZE;
+
+		m->rtt.byte_ns = (big_us > small_us) ? (uint32_t)((uint64_t)(big_us - small_us) * 1000 / extra) : 0;
+	}
+
+	return answered ? answered : res;
+}
+
+/**
+ * @brief Enable adaptive timeout of queries called with NULL timeout
+ */
+void maestro_rtt_set_adaptive(struct maestro* m, uint32_t min_us, uint32_t max_us)
+{
+	m->rtt.min_us = min_us;
+	m->rtt.max_us = max_us;
+	m->rtt.backoff = 0;
+}
+
+/**
+ * @brief Get adaptive timeout for answer size
+ */
+void maestro_rtt_timeout(const struct maestro* m, uint32_t answer_bytes, struct timeval* tv)
+{
+	const struct maestro_rtt* r = &m->rtt;
+	uint64_t us;
+
+	if (!r->count) {
+		us = r->max_us ? r->max_us : RTT_DEFAULT_US;
+	} else {
+		us = 2ull * rtt_percentile(r, 99) + (uint64_t) answer_bytes * r->byte_ns / 1000;
+		if (us < r->min_us)
+			us = r->min_us;
+		us <<= r->backoff;
+		if (r->max_us && (us > r->max_us))
+			us = r->max_us;
+	}
+
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+/**
+ * @brief Get round trip time statistics
+ */
+void maestro_rtt_get_stats(const struct maestro* m, struct maestro_rtt_stats* stats)
+{
+	const struct maestro_rtt* r = &m->rtt;
+	struct timeval tv;
+
+	stats->samples = r->count;
+	stats->min_us = rtt_percentile(r, 0);
+	stats->p50_us = rtt_percentile(r, 50);
+	stats->p99_us = rtt_percentile(r, 99);
+	stats->max_us = rtt_percentile(r, 100);
+	stats->byte_ns = r->byte_ns;
+	stats->timeouts = r->timeouts;
+
+	maestro_rtt_timeout(m, ANSWER_GET_POSITION_SIZE, &tv);
+	stats->timeout_us = (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+
+/**
+ * @brief Set deadline shared by following queries
+ */
+void maestro_deadline_set(struct maestro* m, const struct timeval* timeout)
+{
+	m->deadline = maestro_deadline(timeout);
+}
+
+/**
+ * @brief Time left until batch deadline
+ */
+int32_t maestro_deadline_left_ms(const struct maestro* m)
+{
+	uint64_t now;
+
+	if (!m->deadline)
+		return -1;
+
+	now = maestro_now_ns();
+	return (m->deadline > now) ? (int32_t)((m->deadline - now) / 1000000) : 0;
+}
+
+
+/**
+ * @brief Get RX framer statistics
+ */
+void maestro_framer_get_stats(const struct maestro* m, struct maestro_framer_stats* stats)
+{
+	stats->short_reads = m->framer.short_reads;
+	stats->timeouts = m->framer.timeouts;
+	stats->discarded = m->framer.discarded;
+	stats->resyncs = m->framer.resyncs;
+}
@@ -0,0 +1,387 @@
+/**
+ * @file   mpololu_iothread.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Dedicated serial I/O thread fed by lock-free command ring.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "mpololu.h"
+#include "mpololu_iothread.h"
+#include "mpololu_priv.h"
+
+#define IOT_TX_SIZE 4096
+#define IOT_CACHE_LINE 64
+
+/**
+ * Bounded MPSC ring (D. Vyukov's MPMC queue with single consumer).
+ * Slot sequence equals position when slot is free for producer of that position,
+ * and position + 1 when slot holds frame for consumer.
+ */
+struct iot_slot {
+	_Alignas(IOT_CACHE_LINE) atomic_size_t seq;
+	uint16_t len;
+	uint8_t data[MAESTRO_IOTHREAD_FRAME_MAX];
+};
+
+struct maestro_iothread {
+	int32_t fd;
+	int evfd;
+	pthread_t thread;
+
+	struct iot_slot* slots;
+	size_t mask;
+
+	_Alignas(IOT_CACHE_LINE) atomic_size_t enqueue_pos;
+	_Alignas(IOT_CACHE_LINE) atomic_size_t written_pos;  /** frames before it are written */
+	atomic_int sleeping;
+	atomic_int stop;
+	atomic_int exited;       /** thread is gone, nothing is written any more */
+
+	/** Flush waiters */
+	pthread_mutex_t lock;
+	pthread_cond_t written;
+	atomic_int waiters;
+	atomic_uint_fast64_t errors_reported;
+
+	/** Consumer only */
+	_Alignas(IOT_CACHE_LINE) size_t dequeue_pos;
+	uint8_t tx[IOT_TX_SIZE];
+
+	atomic_uint_fast64_t frames;
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t writes;
+	atomic_uint_fast64_t full;
+	atomic_uint_fast64_t errors;
+	atomic_int write_errno; /** errno of last failed write */
+};
+
+
+/** Wake flush waiters, lock orders it with their check of written_pos */
+static void iot_signal(struct maestro_iothread* iot)
+{
+	pthread_mutex_lock(&iot->lock);
+	pthread_cond_broadcast(&iot->written);
+	pthread_mutex_unlock(&iot->lock);
+}
+
+static void iot_write(struct maestro_iothread* iot, size_t len)
+{
+	size_t done = 0;
+	ssize_t wr;
+
+	atomic_fetch_add_explicit(&iot->writes, 1, memory_order_relaxed);
+
+	while (done < len) {
+		wr = write(iot->fd, iot->tx + done, len - done);
+		maestro_capture(iot->fd, MAESTRO_CAPTURE_TX, iot->tx + done, wr);
+
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			atomic_store_explicit(&iot->write_errno, errno, memory_order_relaxed);
+			atomic_fetch_add_explicit(&iot->errors, 1, memory_order_relaxed);
+			maestro_fail(MAESTRO_ERR_IO, "I/O thread write");
+			return;
+		}
+		done += wr;
+	}
+
+	atomic_fetch_add_explicit(&iot->bytes, len, memory_order_relaxed);
+}
+
+/**
+ * @brief Move ready frames into tx buffer
+ *
+ * @retval number of moved frames
+ */
+static size_t iot_drain(struct maestro_iothread* iot, size_t* len)
+{
+	size_t n = 0;
+
+	*len = 0;
+
+	while (1) {
+		struct iot_slot* slot = &iot->slots[iot->dequeue_pos & iot->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq != iot->dequeue_pos + 1)
+			break;
+
+		if (*len + slot->len > sizeof(iot->tx))
+			break;
+
+		memcpy(iot->tx + *len, slot->data, slot->len);
+		*len += slot->len;
+
+		atomic_store_explicit(&slot->seq, iot->dequeue_pos + iot->mask + 1, memory_order_release);
+		iot->dequeue_pos++;
+		n++;
+	}
+
+	return n;
+}
+
+static void* iot_thread(void* arg)
+{
+	struct maestro_iothread* iot = (struct maestro_iothread*) arg;
+	uint64_t cnt;
+	size_t len;
+	size_t n;
+
+	while (1) {
+		n = iot_drain(iot, &len);
+
+		if (n) {
+			iot_write(iot, len);
+			atomic_fetch_add_explicit(&iot->frames, n, memory_order_relaxed);
+			atomic_store_explicit(&iot->written_pos, iot->dequeue_pos, memory_order_release);
+
+			/** Pairs with waiter registration in maestro_iothread_flush() */
+			atomic_thread_fence(memory_order_seq_cst);
+			if (atomic_load_explicit(&iot->waiters, memory_order_relaxed))
+				iot_signal(iot);
+			continue;
+		}
+
+		if (atomic_load(&iot->stop))
+			break;
+
+		/** Announce sleep, then recheck ring to not miss frame submitted meanwhile */
+		atomic_store(&iot->sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (atomic_load_explicit(&iot->slots[iot->dequeue_pos & iot->mask].seq, memory_order_acquire) == iot->dequeue_pos + 1) {
+			atomic_store(&iot->sleeping, 0);
+			continue;
+		}
+
+		if ((read(iot->evfd, &cnt, sizeof(cnt)) < 0) && (errno != EINTR)) {
+			maestro_fail(MAESTRO_ERR_IO, "I/O thread eventfd");
+			break;
+		}
+		atomic_store(&iot->sleeping, 0);
+	}
+
+	atomic_store(&iot->exited, 1);
+	iot_signal(iot);
+	return NULL;
+}
+
+static void iot_wakeup(struct maestro_iothread* iot)
+{
+	uint64_t one = 1;
+
+	if (write(iot->evfd, &one, sizeof(one)) < 0) {
+		/** counter overflow -- thread is woken anyway */
+	}
+}
+
+
+/**
+ * @brief Start I/O thread
+ */
+struct maestro_iothread* maestro_iothread_start(int32_t fd, uint32_t slots)
+{
+	struct maestro_iothread* iot;
+	size_t size = 2;
+	size_t i;
+	int err;
+
+	while (size < slots) {
+		size <<= 1;
+	}
+
+	if (posix_memalign((void**) &iot, IOT_CACHE_LINE, sizeof(*iot))) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "posix_memalign()");
+		return NULL;
+	}
+	memset(iot, 0, sizeof(*iot));
+
+	if (posix_memalign((void**) &iot->slots, IOT_CACHE_LINE, size * sizeof(*iot->slots))) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "posix_memalign()");
+		free(iot);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		atomic_init(&iot->slots[i].seq, i);
+	}
+
+	iot->fd = fd;
+	iot->mask = size - 1;
+	atomic_init(&iot->enqueue_pos, 0);
+	atomic_init(&iot->written_pos, 0);
+	atomic_init(&iot->sleeping, 0);
+	atomic_init(&iot->stop, 0);
+	atomic_init(&iot->exited, 0);
+	atomic_init(&iot->waiters, 0);
+	atomic_init(&iot->errors_reported, 0);
+	atomic_init(&iot->write_errno, 0);
+	pthread_mutex_init(&iot->lock, NULL);
+	pthread_cond_init(&iot->written, NULL);
+
+	iot->evfd = eventfd(0, EFD_CLOEXEC);
+	if (iot->evfd < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "eventfd");
+		free(iot->slots);
+		free(iot);
+		return NULL;
+	}
+
+	err = pthread_create(&iot->thread, NULL, iot_thread, iot);
+	if (err) {
+		errno = err;
+		maestro_fail(MAESTRO_ERR_IO, "failed to start I/O thread");
+		pthread_cond_destroy(&iot->written);
+		pthread_mutex_destroy(&iot->lock);
+		close(iot->evfd);
+		free(iot->slots);
+		free(iot);
+		return NULL;
+	}
+
+	return iot;
+}
+
+/**
+ * @brief Write all submitted frames, stop thread and free it
+ */
+int32_t maestro_iothread_stop(struct maestro_iothread* iot)
+{
+	int32_t res;
+
+	if (iot == NULL)
+		return maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+
+	atomic_store(&iot->stop, 1);
+	iot_wakeup(iot);
+	pthread_join(iot->thread, NULL);
+
+	res = 0;
+	if (atomic_load(&iot->errors)) {
+		errno = atomic_load(&iot->write_errno);
+		res = maestro_fail(MAESTRO_ERR_IO, "I/O thread write");
+	}
+
+	pthread_cond_destroy(&iot->written);
+	pthread_mutex_destroy(&iot->lock);
+	close(iot->evfd);
+	free(iot->slots);
+	free(iot);
+
+	return res;
+}
+
+/**
+ * @brief Submit encoded frame
+ */
+int32_t maestro_iothread_submit(struct maestro_iothread* iot, const uint8_t* frame, size_t len)
+{
+	struct iot_slot* slot;
+	size_t pos;
+	size_t seq;
+	intptr_t diff;
+
+	if (len > MAESTRO_IOTHREAD_FRAME_MAX)
+		return maestro_fail(MAESTRO_ERR_ARG, "frame is too long");
+
+	pos = atomic_load_explicit(&iot->enqueue_pos, memory_order_relaxed);
+
+	while (1) {
+		slot = &iot->slots[pos & iot->mask];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (intptr_t) seq - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&iot->enqueue_pos, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&iot->full, 1, memory_order_relaxed);
+			return maestro_fail(MAESTRO_ERR_FULL, "I/O thread ring is full");
+		} else {
+			pos = atomic_load_explicit(&iot->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	memcpy(slot->data, frame, len);
+	slot->len = (uint16_t) len;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	/** Syscall only when thread went to sleep */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&iot->sleeping, memory_order_relaxed) &&
+	    atomic_exchange(&iot->sleeping, 0))
+		iot_wakeup(iot);
+
+	return 0;
+}
+
+/**
+ * @brief Submit all commands of batch as single frame and reset batch
+ */
+int32_t maestro_iothread_submit_batch(struct maestro_iothread* iot, struct maestro_batch* batch)
+{
+	int32_t res = maestro_iothread_submit(iot, batch->buf, batch->len);
+
+	if (res < 0)
+		return res;
+
+	maestro_batch_reset(batch);
+	return 0;
+}
+
+/**
+ * @brief Wait until all frames submitted so far are written
+ */
+int32_t maestro_iothread_flush(struct maestro_iothread* iot)
+{
+	size_t target = atomic_load(&iot->enqueue_pos);
+	uint64_t errors;
+	int exited = 0;
+
+	pthread_mutex_lock(&iot->lock);
+	atomic_fetch_add(&iot->waiters, 1);
+
+	while ((intptr_t)(atomic_load(&iot->written_pos) - target) < 0) {
+		exited = atomic_load(&iot->exited);
+		if (exited)
+			break;
+		pthread_cond_wait(&iot->written, &iot->lock);
+	}
+
+	atomic_fetch_sub(&iot->waiters, 1);
+	pthread_mutex_unlock(&iot->lock);
+
+	if (exited)
+		return maestro_fail(MAESTRO_ERR_STATE, "I/O thread has stopped");
+
+	/** Every failed write is reported once */
+	errors = atomic_load(&iot->errors);
+	if (atomic_exchange(&iot->errors_reported, errors) != errors) {
+		errno = atomic_load_explicit(&iot->write_errno, memory_order_relaxed);
+		return maestro_fail(MAESTRO_ERR_IO, "I/O thread write");
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_iothread_get_stats(struct maestro_iothread* iot, struct maestro_iothread_stats* stats)
+{
+	stats->frames = atomic_load_explicit(&iot->frames, memory_order_relaxed);
+	stats->bytes = atomic_load_explicit(&iot->bytes, memory_order_relaxed);
+	stats->writes = atomic_load_explicit(&iot->writes, memory_order_relaxed);
+	stats->full = atomic_load_explicit(&iot->full, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&iot->errors, memory_order_relaxed);
+}
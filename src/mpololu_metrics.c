@@ -0,0 +1,278 @@
+/**
+ * @file   mpololu_metrics.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Per-handle command counters and query latency histograms.
+ *
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mpololu.h"
+#include "mpololu_metrics.h"
+#include "mpololu_priv.h"
+
+/** Commands by Pololu protocol command byte, size is Compact size, 0 -- variable */
+static const struct {
+	uint8_t command;
+	uint8_t size;
+	uint8_t answer;
+	const char* name;
+} metrics_commands[] = {
+	{POLOLU_SET_TARGET, CMD_SET_TARGET_SIZE, 0, "set_target"},
+	{POLOLU_SET_MULTARGET, 0, 0, "set_multiple_target"},
+	{POLOLU_SET_SPEED, CMD_SET_SPEED_SIZE, 0, "set_speed"},
+	{POLOLU_SET_ACCELERATION, CMD_SET_ACCELERATION_SIZE, 0, "set_acceleration"},
+	{POLOLU_SET_PWM, CMD_SET_PWM_SIZE, 0, "set_pwm"},
+	{POLOLU_GET_POSITION, CMD_GET_POSITION_SIZE, ANSWER_GET_POSITION_SIZE, "get_position"},
+	{POLOLU_GET_MOVING_STATE, CMD_SIMPLE_SIZE, ANSWER_IS_MOVING_SIZE, "is_moving"},
+	{POLOLU_GET_ERRORS, CMD_SIMPLE_SIZE, ANSWER_GET_ERRORS_SIZE, "get_errors"},
+	{POLOLU_GO_HOME, CMD_SIMPLE_SIZE, 0, "go_home"},
+	{POLOLU_STOP_SCRIPT, CMD_SIMPLE_SIZE, 0, "stop_script"},
+	{POLOLU_RESTART_SCRIPT, CMD_RESTART_SCRIPT_SIZE, 0, "restart_script"},
+	{POLOLU_RESTART_SCRIPT_PAR, CMD_RESTART_SCRIPT_PAR_SIZE, 0, "restart_script_par"},
+	{POLOLU_GET_SCRIPT_STATUS, CMD_SIMPLE_SIZE, ANSWER_IS_STOPPED_SIZE, "is_stopped"},
+};
+
+static const char* metrics_queries[MAESTRO_QUERY_TYPES] = {
+	"get_position", "get_positions", "is_moving", "get_errors", "is_stopped",
+};
+
+
+/** Only thread using handle writes, so no locked instruction is needed */
+static inline void metric_add(atomic_uint_fast64_t* c, uint64_t v)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline uint64_t metric_get(const atomic_uint_fast64_t* c)
+{
+	return atomic_load_explicit((atomic_uint_fast64_t*) c, memory_order_relaxed);
+}
+
+/**
+ * @brief Size of first encoded command
+ *
+ * @retval command size with Pololu header, 0 -- unknown or truncated command
+ */
+size_t maestro_cmd_size(const uint8_t* cmd, size_t len, uint8_t* command, uint8_t* answer)
+{
+	size_t hdr = 0, size = 0;
+	size_t i;
+
+	if (cmd[0] == POLOLU_PROTO_ON) {
+		if (len < POLOLU_HEADER_EXTRA + 1)
+			return 0;
+		hdr = POLOLU_HEADER_EXTRA;
+	}
+
+	*command = cmd[hdr] & 0x7F;
+
+	for (i = 0; i < sizeof(metrics_commands) / sizeof(metrics_commands[0]); i++) {
+		if (metrics_commands[i].command == *command) {
+			size = metrics_commands[i].size;
+			*answer = metrics_commands[i].answer;
+			break;
+		}
+	}
+
+	if (i == sizeof(metrics_commands) / sizeof(metrics_commands[0]))
+		return 0;
+
+	if (!size) {
+		if (len < hdr + 2)
+			return 0;
+		size = CMD_SET_MULTARGET_SIZE(cmd[hdr + 1]);
+	}
+
+	return (hdr + size <= len) ? hdr + size : 0;
+}
+
+/**
+ * @brief Count written commands
+ */
+void maestro_metrics_tx(struct maestro_metrics* mt, const uint8_t* cmd, size_t len, int32_t res)
+{
+	size_t off = 0;
+
+	metric_add(&mt->writes, 1);
+	if (res < 0) {
+		metric_add(&mt->write_errors, 1);
+		return;
+	}
+	metric_add(&mt->tx_bytes, len);
+
+	while (off < len) {
+		uint8_t command, answer;
+		size_t size = maestro_cmd_size(&cmd[off], len - off, &command, &answer);
+
+		if (!size) {
+			metric_add(&mt->unknown, 1);
+			break;
+		}
+
+		metric_add(&mt->commands[command], 1);
+		off += size;
+	}
+}
+
+/**
+ * @brief Count query outcome and latency
+ */
+void maestro_metrics_query(struct maestro_metrics* mt, uint32_t type, uint64_t elapsed_ns, int32_t status)
+{
+	struct maestro_metrics_query* q = &mt->query[type];
+	uint64_t us = elapsed_ns / 1000;
+	uint32_t b = 0;
+
+	metric_add(&q->count, 1);
+
+	if (status < 0) {
+		metric_add(&q->errors, 1);
+		return;
+	} else if (status > 0) {
+		metric_add(&q->timeouts, 1);
+		return;
+	}
+
+	if (us)
+		b = 64 - __builtin_clzll(us);
+	if (b >= MAESTRO_METRICS_BUCKETS)
+		b = MAESTRO_METRICS_BUCKETS - 1;
+
+	metric_add(&q->latency_us, us);
+	metric_add(&q->hist[b], 1);
+}
+
+/**
+ * @brief Copy framer counters
+ */
+void maestro_metrics_framer(struct maestro_metrics* mt, const struct maestro_framer* fr)
+{
+	atomic_store_explicit(&mt->rx_bytes, fr->rx_bytes, memory_order_relaxed);
+	atomic_store_explicit(&mt->short_reads, fr->short_reads, memory_order_relaxed);
+	atomic_store_explicit(&mt->discarded, fr->discarded, memory_order_relaxed);
+	atomic_store_explicit(&mt->resyncs, fr->resyncs, memory_order_relaxed);
+}
+
+
+/**
+ * @brief Read metrics of handle
+ */
+void maestro_metrics_get(const struct maestro* m, struct maestro_metrics_snapshot* snap)
+{
+	const struct maestro_metrics* mt = &m->metrics;
+	int i, j;
+
+	for (i = 0; i < MAESTRO_METRICS_OPCODES; i++) {
+		snap->commands[i] = metric_get(&mt->commands[i]);
+	}
+
+	snap->unknown = metric_get(&mt->unknown);
+	snap->writes = metric_get(&mt->writes);
+	snap->write_errors = metric_get(&mt->write_errors);
+	snap->tx_bytes = metric_get(&mt->tx_bytes);
+	snap->rx_bytes = metric_get(&mt->rx_bytes);
+	snap->short_reads = metric_get(&mt->short_reads);
+	snap->discarded = metric_get(&mt->discarded);
+	snap->resyncs = metric_get(&mt->resyncs);
+
+	for (i = 0; i < MAESTRO_QUERY_TYPES; i++) {
+		const struct maestro_metrics_query* q = &mt->query[i];
+		struct maestro_query_metrics* s = &snap->queries[i];
+
+		s->count = metric_get(&q->count);
+		s->timeouts = metric_get(&q->timeouts);
+		s->errors = metric_get(&q->errors);
+		s->latency_us = metric_get(&q->latency_us);
+		for (j = 0; j < MAESTRO_METRICS_BUCKETS; j++) {
+			s->hist[j] = metric_get(&q->hist[j]);
+		}
+	}
+}
+
+/**
+ * @brief Reset metrics of handle
+ */
+void maestro_metrics_reset(struct maestro* m)
+{
+	struct maestro_metrics* mt = &m->metrics;
+	int i, j;
+
+	for (i = 0; i < MAESTRO_METRICS_OPCODES; i++) {
+		atomic_store_explicit(&mt->commands[i], 0, memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&mt->unknown, 0, memory_order_relaxed);
+	atomic_store_explicit(&mt->writes, 0, memory_order_relaxed);
+	atomic_store_explicit(&mt->write_errors, 0, memory_order_relaxed);
+	atomic_store_explicit(&mt->tx_bytes, 0, memory_order_relaxed);
+
+	/** Framer counters are copied, so they are reset at the source */
+	m->framer.rx_bytes = 0;
+	m->framer.short_reads = 0;
+	m->framer.discarded = 0;
+	m->framer.resyncs = 0;
+	maestro_metrics_framer(mt, &m->framer);
+
+	for (i = 0; i < MAESTRO_QUERY_TYPES; i++) {
+		struct maestro_metrics_query* q = &mt->query[i];
+
+		atomic_store_explicit(&q->count, 0, memory_order_relaxed);
+		atomic_store_explicit(&q->timeouts, 0, memory_order_relaxed);
+		atomic_store_explicit(&q->errors, 0, memory_order_relaxed);
+		atomic_store_explicit(&q->latency_us, 0, memory_order_relaxed);
+		for (j = 0; j < MAESTRO_METRICS_BUCKETS; j++) {
+			atomic_store_explicit(&q->hist[j], 0, memory_order_relaxed);
+		}
+	}
+}
+
+/**
+ * @brief Latency percentile of query type
+ */
+uint32_t maestro_metrics_percentile(const struct maestro_query_metrics* q, uint32_t pct)
+{
+	uint64_t total = 0, rank, seen = 0;
+	int b;
+
+	for (b = 0; b < MAESTRO_METRICS_BUCKETS; b++) {
+		total += q->hist[b];
+	}
+
+	if (!total)
+		return 0;
+
+	rank = (total * (pct > 100 ? 100 : pct) + 99) / 100;
+	if (!rank)
+		rank = 1;
+
+	for (b = 0; b < MAESTRO_METRICS_BUCKETS - 1; b++) {
+		seen += q->hist[b];
+		if (seen >= rank)
+			break;
+	}
+
+	return 1u << b;
+}
+
+/**
+ * @brief Names for printing
+ */
+const char* maestro_metrics_query_name(uint32_t type)
+{
+	return (type < MAESTRO_QUERY_TYPES) ? metrics_queries[type] : NULL;
+}
+
+const char* maestro_metrics_command_name(uint8_t command)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(metrics_commands) / sizeof(metrics_commands[0]); i++) {
+		if (metrics_commands[i].command == (command & 0x7F))
+			return metrics_commands[i].name;
+	}
+
+	return NULL;
+}
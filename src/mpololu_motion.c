@@ -0,0 +1,218 @@
+/**
+ * @file   mpololu_motion.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Closed-form model of Maestro servo motion.
+ *
+ * @details Servo accelerates towards target with acceleration limit,
+ * cruises at speed limit and decelerates to stop exactly at target.
+ * Zero limit means no limit, zero target or position means channel is off
+ * (first target after that is reached immediately).
+ *
+ */
+
+#include <math.h>
+#include "mpololu_priv.h"
+
+
+/**
+ * Motion towards target split into phases, all values are along the
+ * direction to target: 0 -- brake if moving away or faster than speed
+ * limit, 1 -- accelerate, 2 -- cruise, 3 -- decelerate to stop.
+ */
+struct motion_plan {
+	double dir;
+	double x[4];   /** distance covered during phase */
+	double t[4];   /** phase duration, ms */
+	double v[4];   /** velocity at phase start */
+	double a[4];   /** acceleration during phase */
+};
+
+static double motion_vmax(const struct maestro_motion* mo)
+{
+	return mo->speed ? mo->speed / 10.0 : INFINITY;
+}
+
+static double motion_acc(const struct maestro_motion* mo)
+{
+	return mo->acceleration ? mo->acceleration / 800.0 : INFINITY;
+}
+
+static int motion_instant(const struct maestro_motion* mo)
+{
+	return (mo->target == 0) || (mo->position == 0.0) ||
+	       ((mo->speed == 0) && (mo->acceleration == 0));
+}
+
+static void motion_plan(const struct maestro_motion* mo, struct motion_plan* p)
+{
+	double dist = mo->target - mo->position;
+	double vmax = motion_vmax(mo);
+	double a = motion_acc(mo);
+	double u, rem, vp;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p->x[i] = p->t[i] = p->v[i] = p->a[i] = 0.0;
+	}
+
+	p->dir = (dist >= 0.0) ? 1.0 : -1.0;
+	rem = dist * p->dir;
+	u = mo->velocity * p->dir;
+
+	if (isinf(a)) {
+		/** No acceleration limit -- constant speed */
+		p->v[2] = vmax;
+		p->x[2] = rem;
+		p->t[2] = rem / vmax;
+		return;
+	}
+
+	/** Phase 0: brake to zero if moving away, to speed limit if too fast */
+	if ((u < 0.0) || (u > vmax)) {
+		double v1 = (u < 0.0) ? 0.0 : vmax;
+
+		p->v[0] = u;
+		p->a[0] = (u < 0.0) ? a : -a;
+		p->t[0] = fabs(v1 - u) / a;
+		p->x[0] = (v1 * v1 - u * u) / (2.0 * p->a[0]);
+		rem -= p->x[0];
+		u = v1;
+	}
+
+	if (u * u / (2.0 * a) >= rem) {
+		/** Too fast to stop at target with a, braking is just harder */
+		if (rem <= 0.0 || u <= 0.0)
+			return;
+		p->v[3] = u;
+		p->a[3] = -u * u / (2.0 * rem);
+		p->t[3] = 2.0 * rem / u;
+		p->x[3] = rem;
+		return;
+	}
+
+	vp = sqrt(a * rem + u * u / 2.0);
+	if (vp > vmax)
+		vp = vmax;
+
+	p->v[1] = u;
+	p->a[1] = a;
+	p->t[1] = (vp - u) / a;
+	p->x[1] = (vp * vp - u * u) / (2.0 * a);
+
+	p->v[3] = vp;
+	p->a[3] = -a;
+	p->t[3] = vp / a;
+	p->x[3] = vp * vp / (2.0 * a);
+
+	p->v[2] = vp;
+	p->x[2] = rem - p->x[1] - p->x[3];
+	p->t[2] = (p->x[2] > 0.0) ? p->x[2] / vp : 0.0;
+	if (p->x[2] < 0.0)
+		p->x[2] = 0.0;
+}
+
+/**
+ * @brief Evaluate motion dt milliseconds after state time
+ */
+static void motion_eval(const struct maestro_motion* mo, double dt, double* position, double* velocity)
+{
+	struct motion_plan p;
+	double x = 0.0;
+	int i;
+
+	if (motion_instant(mo) || (mo->position == mo->target && mo->velocity == 0.0)) {
+		*position = mo->target;
+		*velocity = 0.0;
+		return;
+	}
+
+	motion_plan(mo, &p);
+
+	for (i = 0; i < 4; i++) {
+		if (dt < p.t[i]) {
+			x += p.v[i] * dt + p.a[i] * dt * dt / 2.0;
+			*position = mo->position + p.dir * x;
+			*velocity = p.dir * (p.v[i] + p.a[i] * dt);
+			return;
+		}
+		x += p.x[i];
+		dt -= p.t[i];
+	}
+
+	*position = mo->target;
+	*velocity = 0.0;
+}
+
+
+/**
+ * @brief Move model state to time now
+ */
+void maestro_motion_advance(struct maestro_motion* mo, uint64_t now)
+{
+	if (now > mo->t_ns)
+		motion_eval(mo, (now - mo->t_ns) / 1e6, &mo->position, &mo->velocity);
+	mo->t_ns = now;
+}
+
+/**
+ * @brief Set new target at time now
+ */
+void maestro_motion_set_target(struct maestro_motion* mo, uint16_t target, uint64_t now)
+{
+	maestro_motion_advance(mo, now);
+	mo->target = target;
+
+	if (target == 0) {
+		mo->position = 0.0;
+		mo->velocity = 0.0;
+	} else if (mo->position == 0.0) {
+		mo->position = target;
+	}
+}
+
+/**
+ * @brief Set new speed limit at time now
+ */
+void maestro_motion_set_speed(struct maestro_motion* mo, uint16_t speed, uint64_t now)
+{
+	maestro_motion_advance(mo, now);
+	mo->speed = speed;
+}
+
+/**
+ * @brief Set new acceleration limit at time now
+ */
+void maestro_motion_set_acceleration(struct maestro_motion* mo, uint16_t acceleration, uint64_t now)
+{
+	maestro_motion_advance(mo, now);
+	mo->acceleration = acceleration;
+}
+
+/**
+ * @brief Predict position and velocity at time at
+ */
+void maestro_motion_predict(const struct maestro_motion* mo, uint64_t at, double* position, double* velocity)
+{
+	motion_eval(mo, (at > mo->t_ns) ? (at - mo->t_ns) / 1e6 : 0.0, position, velocity);
+}
+
+/**
+ * @brief Time when target is reached
+ */
+uint64_t maestro_motion_arrival(const struct maestro_motion* mo)
+{
+	struct motion_plan p;
+	double t = 0.0;
+	int i;
+
+	if (motion_instant(mo) || (mo->position == mo->target && mo->velocity == 0.0))
+		return mo->t_ns;
+
+	motion_plan(mo, &p);
+	for (i = 0; i < 4; i++) {
+		t += p.t[i];
+	}
+
+	return mo->t_ns + (uint64_t)(t * 1e6);
+}
@@ -0,0 +1,392 @@
+/**
+ * @file   mpololu_priv.h
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Maestro Pololu protocol definitions shared by library sources.
+ *
+ */
+#ifndef MPOLOLU_PRIV_H
+#define MPOLOLU_PRIV_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "mpololu_capture.h"
+#include "mpololu_metrics.h"
+
+
+#define ANSWER_GET_POSITION_SIZE 0x02
+#define ANSWER_GET_ERRORS_SIZE 0x02
+#define ANSWER_IS_MOVING_SIZE 0x01
+#define ANSWER_IS_STOPPED_SIZE 0x01
+
+#define POLOLU_PROTO_ON 0xAA
+#define MINISSC_PROTO_ON 0xFF
+
+#define COMPACT_SET_TARGET 0x84
+#define POLOLU_SET_TARGET 0x04
+
+#define COMPACT_SET_MULTARGET 0x9F
+#define POLOLU_SET_MULTARGET 0x1F
+
+#define COMPACT_SET_SPEED 0x87
+#define POLOLU_SET_SPEED 0x07
+
+#define COMPACT_SET_ACCELERATION 0x89
+#define POLOLU_SET_ACCELERATION 0x09
+
+#define COMPACT_SET_PWM 0x8A
+#define POLOLU_SET_PWM 0x0A
+
+#define COMPACT_GET_POSITION 0x90
+#define POLOLU_GET_POSITION 0x10
+
+#define COMPACT_GET_MOVING_STATE 0x93
+#define POLOLU_GET_MOVING_STATE 0x13
+
+#define COMPACT_GET_ERRORS 0xA1
+#define POLOLU_GET_ERRORS 0x21
+
+#define COMPACT_GO_HOME 0xA2
+#define POLOLU_GO_HOME 0x22
+
+#define COMPACT_STOP_SCRIPT 0xA4
+#define POLOLU_STOP_SCRIPT 0x24
+
+#define COMPACT_RESTART_SCRIPT 0xA7
+#define POLOLU_RESTART_SCRIPT 0x27
+
+#define COMPACT_RESTART_SCRIPT_PAR 0xA8
+#define POLOLU_RESTART_SCRIPT_PAR 0x28
+
+#define COMPACT_GET_SCRIPT_STATUS 0xAE
+#define POLOLU_GET_SCRIPT_STATUS 0x2E
+
+
+/** Pololu protocol prepends POLOLU_PROTO_ON and device number to compact command */
+#define POLOLU_HEADER_EXTRA 2
+
+/** Command sizes in Compact protocol (add POLOLU_HEADER_EXTRA for Pololu protocol) */
+#define CMD_SET_TARGET_SIZE 4
+#define CMD_MINISSC_SIZE 3
+#define CMD_SET_MULTARGET_SIZE(num) (3 + 2 * (size_t)(num))
+#define CMD_SET_SPEED_SIZE 4
+#define CMD_SET_ACCELERATION_SIZE 4
+#define CMD_SET_PWM_SIZE 5
+#define CMD_GET_POSITION_SIZE 2
+#define CMD_SIMPLE_SIZE 1
+#define CMD_RESTART_SCRIPT_SIZE 2
+#define CMD_RESTART_SCRIPT_PAR_SIZE 4
+
+/** Biggest possible command: Pololu set multiple target for 255 channels */
+#define CMD_MAX_SIZE (CMD_SET_MULTARGET_SIZE(255) + POLOLU_HEADER_EXTRA)
+
+/** Buffers for querying positions of all 255 channels at once */
+#define GET_POSITIONS_CMD_SIZE (CMD_SIZE(0, CMD_GET_POSITION_SIZE) * 255)
+#define GET_POSITIONS_ANSWER_SIZE (ANSWER_GET_POSITION_SIZE * 255)
+
+/** Size of command for given device (MAESTRO_COMPACT -- Compact protocol) */
+#define CMD_SIZE(device, compact_size) ((compact_size) + (((device) < 0) ? 0 : POLOLU_HEADER_EXTRA))
+
+
+/**
+ * Command encoders.
+ *
+ * Each encoder writes command into cmd (which must have room for CMD_SIZE() bytes)
+ * and returns number of written bytes. Negative device (MAESTRO_COMPACT) selects
+ * Compact protocol, otherwise Pololu protocol with given device number is used.
+ * Compact opcodes are passed as op, Pololu opcodes are derived from them.
+ */
+size_t maestro_enc_set_target(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t target);
+size_t maestro_enc_minissc_set_target(uint8_t* cmd, uint8_t channel, uint8_t target);
+size_t maestro_enc_set_multiple_target(uint8_t* cmd, int32_t device, uint8_t targets_num, uint8_t first_channel, const uint16_t* targets_p);
+size_t maestro_enc_set_speed(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t speed);
+size_t maestro_enc_set_acceleration(uint8_t* cmd, int32_t device, uint8_t channel, uint16_t acceleration);
+size_t maestro_enc_set_pwm(uint8_t* cmd, int32_t device, uint16_t on_time, uint16_t period);
+size_t maestro_enc_get_position(uint8_t* cmd, int32_t device, uint8_t channel);
+size_t maestro_enc_simple(uint8_t* cmd, int32_t device, uint8_t op);
+size_t maestro_enc_restart_script(uint8_t* cmd, int32_t device, uint8_t subroutine_number);
+size_t maestro_enc_restart_script_par(uint8_t* cmd, int32_t device, uint8_t subroutine_number, uint16_t parameter);
+
+/**
+ * Decoder of encoded commands (see mpololu_metrics.c): size of first command
+ * with Pololu header (0 -- unknown or truncated), its command byte and answer
+ * length (0 -- command without answer). Mini SSC commands are unknown.
+ */
+size_t maestro_cmd_size(const uint8_t* cmd, size_t len, uint8_t* command, uint8_t* answer);
+
+/**
+ * Minimal-size set targets planner (see maestro_batch_pololu_set_targets()),
+ * caps -- MAESTRO_CAP_* of device, bit i of masks and targets_p[i] refer
+ * to channel first_channel + i.
+ */
+struct maestro_batch;
+int32_t maestro_batch_set_targets(struct maestro_batch* batch, int32_t device, uint32_t caps, uint8_t first_channel, uint8_t channels_num,
+                                  const uint16_t* targets_p, uint64_t changed, uint64_t known);
+
+
+/** Size of framer buffer for received bytes */
+#define MAESTRO_FRAMER_SIZE 256
+
+/** Longest wait for late bytes during resync */
+#define MAESTRO_QUIET_MAX_US 100000u
+
+/**
+ * RX framer of connection. Bytes are accumulated until answer is complete.
+ * Answer of timed-out query may still arrive and would shift every later
+ * answer, so after timeout (or when more bytes than expected came) stream is
+ * resynchronized before next query: late bytes are read and dropped until all
+ * of them came or line is quiet for quiet window (at least twice the wait of
+ * timed-out query), then input is flushed.
+ */
+struct maestro_framer {
+	uint8_t buf[MAESTRO_FRAMER_SIZE];
+	size_t len;          /** received bytes not consumed yet */
+	size_t stale;        /** bytes of timed-out answers which may still arrive */
+	uint8_t resync;      /** stream must be resynchronized before next query */
+	uint32_t wait_us;    /** how long timed-out query waited, late bytes may take as long */
+	uint64_t rx_bytes;
+	uint64_t short_reads;
+	uint64_t timeouts;
+	uint64_t discarded;
+	uint64_t resyncs;
+};
+
+/**
+ * Transport helpers, none of them allocates memory.
+ * Framer may be NULL: temporary framer is used and input is flushed
+ * right after failed query. Deadline is absolute CLOCK_MONOTONIC time in ns,
+ * 0 -- infinite, query with expired deadline is not sent.
+ */
+int32_t maestro_write_cmd(int32_t fd, const uint8_t* cmd, size_t len);
+int32_t maestro_wait_fd(int32_t fd, short events, uint64_t deadline);
+int32_t maestro_framer_query(int32_t fd, struct maestro_framer* fr, const uint8_t* cmd, size_t len,
+                             uint8_t* answer, size_t ans_len, uint64_t deadline, uint32_t quiet_us);
+int32_t maestro_get_small_answer(int32_t fd, struct maestro_framer* fr, const uint8_t* cmd, size_t len,
+                                 uint64_t deadline, size_t ans_len, uint32_t quiet_us);
+int32_t maestro_get_positions_buf(int32_t fd, struct maestro_framer* fr, int32_t device, uint8_t channels_num,
+                                  uint8_t first_channel, uint16_t* positions_p, int32_t* status_p,
+                                  uint64_t deadline, uint32_t quiet_us, uint8_t* command, uint8_t* answer);
+
+
+/**
+ * Motion model of channel (see mpololu_motion.c).
+ * Positions are in 0.25 us units, velocity in 0.25 us/ms, time in CLOCK_MONOTONIC ns.
+ */
+struct maestro_motion {
+	double position;     /** at t_ns, 0 -- channel is off */
+	double velocity;     /** at t_ns, signed */
+	uint64_t t_ns;
+	uint16_t target;
+	uint16_t speed;
+	uint16_t acceleration;
+};
+
+void maestro_motion_advance(struct maestro_motion* mo, uint64_t now);
+void maestro_motion_set_target(struct maestro_motion* mo, uint16_t target, uint64_t now);
+void maestro_motion_set_speed(struct maestro_motion* mo, uint16_t speed, uint64_t now);
+void maestro_motion_set_acceleration(struct maestro_motion* mo, uint16_t acceleration, uint64_t now);
+void maestro_motion_predict(const struct maestro_motion* mo, uint64_t at, double* position, double* velocity);
+uint64_t maestro_motion_arrival(const struct maestro_motion* mo);
+
+
+/**
+ * Last values successfully written to device
+ */
+struct maestro_shadow {
+	uint8_t enabled;
+	uint8_t valid[256];      /** MAESTRO_SHADOW_* flags */
+	uint16_t target[256];
+	uint16_t speed[256];
+	uint16_t acceleration[256];
+	uint16_t deadband[256];  /** target deadband in 0.25 us units */
+	uint64_t written;
+	uint64_t suppressed;
+};
+
+/**
+ * Persistent controller handle, see mpololu_handle.h.
+ * All buffers are allocated together with handle.
+ */
+/** RTT samples kept for percentiles */
+#define MAESTRO_RTT_WINDOW 64
+
+/** Round trip time estimator of handle */
+struct maestro_rtt {
+	uint32_t us[MAESTRO_RTT_WINDOW];     /** round trip times */
+	uint16_t bytes[MAESTRO_RTT_WINDOW];  /** answer sizes of samples */
+	uint32_t count;       /** samples in window */
+	uint32_t next;        /** slot of next sample */
+	uint32_t byte_ns;     /** cost of answer byte, measured by probe */
+	uint32_t min_us;      /** adaptive timeout bounds, max_us 0 -- adaptive timeout disabled */
+	uint32_t max_us;
+	uint32_t backoff;     /** timeout doubled after each timeout, reset by answer */
+	uint64_t timeouts;
+};
+
+/**
+ * Handle metrics (see mpololu_metrics.h). Only thread using handle writes them,
+ * so counters are bumped by relaxed load and store instead of locked add.
+ */
+struct maestro_metrics_query {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t timeouts;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t latency_us;
+	atomic_uint_fast64_t hist[MAESTRO_METRICS_BUCKETS];
+};
+
+struct maestro_metrics {
+	atomic_uint_fast64_t commands[MAESTRO_METRICS_OPCODES];
+	atomic_uint_fast64_t unknown;
+	atomic_uint_fast64_t writes;
+	atomic_uint_fast64_t write_errors;
+	atomic_uint_fast64_t tx_bytes;
+	atomic_uint_fast64_t rx_bytes;
+	atomic_uint_fast64_t short_reads;
+	atomic_uint_fast64_t discarded;
+	atomic_uint_fast64_t resyncs;
+	struct maestro_metrics_query query[MAESTRO_QUERY_TYPES];
+};
+
+/**
+ * Count written commands (res -- result of write), query outcome
+ * (status 0 -- answered, 1 -- timeout, -1 -- error) and copy framer counters
+ */
+void maestro_metrics_tx(struct maestro_metrics* mt, const uint8_t* cmd, size_t len, int32_t res);
+void maestro_metrics_query(struct maestro_metrics* mt, uint32_t type, uint64_t elapsed_ns, int32_t status);
+void maestro_metrics_framer(struct maestro_metrics* mt, const struct maestro_framer* fr);
+
+struct maestro {
+	int32_t fd;
+	int32_t device;      /** MAESTRO_COMPACT -- Compact protocol */
+	uint8_t channels;
+	uint8_t owns_fd;     /** fd is closed by maestro_handle_close() */
+	uint32_t caps;       /** MAESTRO_CAP_* */
+	struct maestro_shadow shadow;
+
+	/** Motion model, valid for channel when target, speed and acceleration are known */
+	struct maestro_motion motion[256];
+	uint8_t motion_known[256];   /** MAESTRO_SHADOW_* flags */
+	uint64_t resync_period_ns;
+	uint64_t resync_last_ns;
+	uint64_t resyncs;
+	uint32_t resync_max_error;
+	uint32_t resync_last_error;
+
+	struct maestro_rtt rtt;
+	struct maestro_framer framer;
+	uint64_t deadline;   /** batch deadline shared by queries, 0 -- none */
+	struct maestro_metrics metrics;
+
+	uint8_t tx[GET_POSITIONS_CMD_SIZE];
+	uint8_t rx[GET_POSITIONS_ANSWER_SIZE];
+};
+
+/**
+ * Encode targets of channels range through shadow cache of handle without writing
+ * (changed channels within deadband are dropped from *changed), then commit
+ * result of write to metrics (cmd, len -- encoded share of handle), shadow and
+ * motion model. Bit i of masks refers to channel first_channel + i.
+ */
+int32_t maestro_handle_encode_targets(struct maestro* m, struct maestro_batch* batch, uint8_t first_channel, uint8_t targets_num,
+                                      const uint16_t* targets_p, uint64_t* changed, uint64_t known);
+void maestro_handle_commit_targets(struct maestro* m, uint8_t first_channel, uint8_t targets_num,
+                                   const uint16_t* targets_p, uint64_t changed, const uint8_t* cmd, size_t len, int32_t res);
+
+struct maestro_async;
+
+/** Late answers of failed requests are being drained, new queries are held */
+int32_t maestro_async_resyncing(const struct maestro_async* async);
+
+/**
+ * Fixed-rate flusher of target snapshot (see mpololu_flusher.c), shared by
+ * coalescer and shm table. Owner flush runs with lock held: it fills snapshot
+ * and sends it with maestro_flusher_send(). Counters and caps are guarded by lock.
+ */
+#define MAESTRO_FLUSHER_MAX_CHANNELS 64 /** Channels of coalescer and shm table, as many as planner takes */
+
+struct maestro_flusher {
+	int32_t fd;
+	int32_t device;      /** MAESTRO_COMPACT -- Compact protocol */
+	uint8_t channels;
+	uint32_t caps;       /** MAESTRO_CAP_* */
+
+	int32_t (*flush)(void* owner);
+	void* owner;
+
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int thread_started;
+	atomic_int stop;
+	uint64_t period_ns;
+
+	uint16_t snapshot[MAESTRO_FLUSHER_MAX_CHANNELS];
+	uint8_t tx[CMD_SIZE(0, CMD_SET_TARGET_SIZE) * MAESTRO_FLUSHER_MAX_CHANNELS];
+
+	uint64_t flushes;
+	uint64_t sent;
+	uint64_t errors;
+};
+
+void maestro_flusher_init(struct maestro_flusher* f, int32_t fd, int32_t device, uint8_t channels,
+                          int32_t (*flush)(void* owner), void* owner);
+void maestro_flusher_destroy(struct maestro_flusher* f);
+/** Encode snapshot channels (dirty -- n channels to send, known -- may bridge gaps) and write them */
+int32_t maestro_flusher_send(struct maestro_flusher* f, uint64_t dirty, uint64_t known, int32_t n);
+int32_t maestro_flusher_start(struct maestro_flusher* f, uint32_t rate_hz);
+/** Join flush thread (if started) and flush pending targets */
+int32_t maestro_flusher_stop(struct maestro_flusher* f);
+
+
+/** Current CLOCK_MONOTONIC time in ns */
+static inline uint64_t maestro_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Record error of calling thread (see mpololu_error.h) and pass it to log
+ * callback, returns code. MAESTRO_ERR_IO saves errno, so call it right after
+ * failed system call
+ */
+int32_t maestro_fail(int32_t code, const char* what);
+
+/**
+ * Capture hook (see mpololu_capture.h), called after every read and write
+ * of COM-port with its result
+ */
+extern atomic_int maestro_capture_enabled;
+void maestro_capture_record(int32_t fd, uint8_t dir, const uint8_t* data, size_t len);
+
+static inline void maestro_capture(int32_t fd, uint8_t dir, const void* data, ssize_t len)
+{
+	if ((len > 0) && atomic_load_explicit(&maestro_capture_enabled, memory_order_relaxed))
+		maestro_capture_record(fd, dir, (const uint8_t*) data, (size_t) len);
+}
+
+/** Absolute deadline of relative timeout, NULL -- 0 (infinite) */
+static inline uint64_t maestro_deadline(const struct timeval* timeout)
+{
+	if (timeout == NULL)
+		return 0;
+
+	return maestro_now_ns() + (uint64_t) timeout->tv_sec * 1000000000ull + (uint64_t) timeout->tv_usec * 1000ull;
+}
+
+/** Earlier of two deadlines, 0 -- infinite */
+static inline uint64_t maestro_deadline_min(uint64_t a, uint64_t b)
+{
+	if (!a || (b && (b < a)))
+		return b;
+	return a;
+}
+
+#endif /* MPOLOLU_PRIV_H */
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "mpololu_capture.h" /* Capture file format */
+
+double speed = 1.0;
+int32_t replay_fd = -1;
+int wait_host = 1;
+int32_t wait_ms = 5000;
+int list = 0;
+char *link_name = NULL;
+
+static volatile sig_atomic_t stopped = 0;
+
+struct record {
+	struct maestro_capture_record hdr;
+	uint8_t* data;
+};
+
+
+static void on_signal(int sig)
+{
+	stopped = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		if (stopped)
+			break;
+	}
+}
+
+static int32_t load_capture(const char* path, struct record** records_p)
+{
+	struct maestro_capture_header hdr;
+	struct maestro_capture_record rec;
+	struct record* records = NULL;
+	int32_t num = 0, size = 0;
+	int nomem = 0;
+	FILE* fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) ||
+	    memcmp(hdr.magic, MAESTRO_CAPTURE_MAGIC, sizeof(hdr.magic)) ||
+	    (hdr.version != MAESTRO_CAPTURE_VERSION) || (hdr.record_size != sizeof(rec))) {
+		fprintf(stderr, "%s is not a capture file of version %u\n", path, MAESTRO_CAPTURE_VERSION);
+		fclose(fp);
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		struct record* r;
+
+		/** Array is doubled, so long captures are not copied on every record */
+		if (num == size) {
+			size = size ? size * 2 : 1024;
+			r = (struct record*) realloc(records, size * sizeof(*records));
+			if (r == NULL) {
+				nomem = 1;
+				break;
+			}
+			records = r;
+		}
+
+		r = &records[num];
+		r->hdr = rec;
+		r->data = (uint8_t*) malloc(rec.len ? rec.len : 1);
+		if (r->data == NULL) {
+			nomem = 1;
+			break;
+		}
+
+		if (fread(r->data, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "Truncated record %d\n", num);
+			free(r->data);
+			break;
+		}
+		num++;
+	}
+
+	if (nomem) {
+		fprintf(stderr, "Out of memory at record %d\n", num);
+		while (num--) {
+			free(records[num].data);
+		}
+		free(records);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	*records_p = records;
+	return num;
+}
+
+static void list_records(const struct record* records, int32_t num)
+{
+	int32_t i;
+	uint16_t k;
+
+	for (i = 0; i < num; i++) {
+		const struct record* r = &records[i];
+
+		printf("%12.6f fd %d %s %3u:", (double)(r->hdr.ts_ns - records[0].hdr.ts_ns) / 1e9, r->hdr.fd,
+		       (r->hdr.dir == MAESTRO_CAPTURE_TX) ? "TX" : "RX", r->hdr.len);
+		for (k = 0; k < r->hdr.len; k++) {
+			printf(" %02X", r->data[k]);
+		}
+		printf("\n");
+	}
+}
+
+static int open_pty(char* name, size_t size, int* slave)
+{
+	struct termios options;
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((master < 0) || grantpt(master) || unlockpt(master) || ptsname_r(master, name, size)) {
+		perror("pty");
+		return -1;
+	}
+
+	/** Keep slave open, so master does not see hangup between host sessions */
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	if (*slave < 0) {
+		perror(name);
+		close(master);
+		return -1;
+	}
+
+	tcgetattr(*slave, &options);
+	cfmakeraw(&options);
+	tcsetattr(*slave, TCSANOW, &options);
+
+	return master;
+}
+
+/**
+ * @brief Receive bytes host wrote in captured TX record
+ *
+ * @retval number of mismatching bytes, -1 -- host sent nothing within wait_ms
+ */
+static int32_t expect_host(int master, const struct record* r)
+{
+	struct pollfd pfd;
+	uint8_t buf[256];
+	uint16_t done = 0;
+	int32_t diff = 0;
+	ssize_t rd;
+	int i;
+
+	while ((done < r->hdr.len) && !stopped) {
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, wait_ms) <= 0)
+			return done ? diff + (r->hdr.len - done) : -1;
+
+		rd = read(master, buf, (r->hdr.len - done < (int) sizeof(buf)) ? r->hdr.len - done : sizeof(buf));
+		if (rd <= 0) {
+			if ((rd < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < rd; i++) {
+			if (buf[i] != r->data[done + i])
+				diff++;
+		}
+		done += rd;
+	}
+
+	return diff;
+}
+
+static int replay(const struct record* records, int32_t num)
+{
+	uint64_t anchor_ns = 0, anchor_ts = 0, late_max = 0;
+	uint64_t tx_bytes = 0, tx_diff = 0, rx_bytes = 0, missed = 0;
+	char name[64];
+	int master, slave;
+	int32_t i;
+
+	master = open_pty(name, sizeof(name), &slave);
+	if (master < 0)
+		return -1;
+
+	if (link_name) {
+		unlink(link_name);
+		if (symlink(name, link_name)) {
+			perror(link_name);
+			link_name = NULL;
+		}
+	}
+
+	fprintf(stdout, "Replaying fd %d on %s, speed %g%s\n", replay_fd, link_name ? link_name : name,
+	        speed, wait_host ? ", waiting for host" : "");
+	fflush(stdout);
+
+	for (i = 0; (i < num) && !stopped; i++) {
+		const struct record* r = &records[i];
+
+		if (r->hdr.fd != replay_fd)
+			continue;
+
+		/** Answers keep captured delay after the request they follow */
+		if (r->hdr.dir == MAESTRO_CAPTURE_TX) {
+			int32_t diff;
+
+			if (!wait_host) {
+				if (!anchor_ns) {
+					anchor_ns = now_ns();
+					anchor_ts = r->hdr.ts_ns;
+				}
+				continue;
+			}
+
+			diff = expect_host(master, r);
+			if (diff < 0) {
+				fprintf(stderr, "Host sent nothing for record %d within %d ms\n", i, wait_ms);
+				missed++;
+				continue;
+			}
+
+			tx_bytes += r->hdr.len;
+			tx_diff += diff;
+			anchor_ns = now_ns();
+			anchor_ts = r->hdr.ts_ns;
+		} else {
+			uint64_t due, now;
+
+			if (!anchor_ns) {
+				anchor_ns = now_ns();
+				anchor_ts = r->hdr.ts_ns;
+			}
+
+			due = anchor_ns + ((speed > 0) ? (uint64_t)((double)(r->hdr.ts_ns - anchor_ts) / speed) : 0);
+			sleep_until(due);
+
+			if (write(master, r->data, r->hdr.len) != r->hdr.len) {
+				perror("pty write");
+				break;
+			}
+
+			now = now_ns();
+			if (now - due > late_max)
+				late_max = now - due;
+			rx_bytes += r->hdr.len;
+		}
+	}
+
+	fprintf(stdout, "Host %llu bytes (%llu differ, %llu records missed), answers %llu bytes, max lateness %.1f us\n",
+	        (unsigned long long) tx_bytes, (unsigned long long) tx_diff, (unsigned long long) missed,
+	        (unsigned long long) rx_bytes, (double) late_max / 1000.0);
+
+	if (link_name)
+		unlink(link_name);
+
+	close(slave);
+	close(master);
+	return 0;
+}
+
+static void pr_help (char* prog_name)
+{
+	printf("usage: %s [OPTIONS] FILE\n", prog_name);
+	printf("Plays controller side of capture FILE back through pseudo-terminal, use printed device file with mpololu_cmd --dev\n");
+	printf("List of options: \n");
+	printf("\t --speed,s FACTOR\t\t timing factor, 2 -- twice as fast, 0 -- no delays, default 1\n");
+	printf("\t --fd NUM\t\t\t replay records of descriptor NUM, default descriptor of first record\n");
+	printf("\t --no-wait\t\t\t send answers on captured timeline without waiting for host requests\n");
+	printf("\t --wait-ms NUM\t\t\t how long to wait for each host request, default 5000\n");
+	printf("\t --link FILE\t\t\t create symbolic link FILE to pty device\n");
+	printf("\t --list\t\t\t\t print records and exit\n");
+	printf("\t --help,h \t\t\t print this help and exit\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	struct record* records = NULL;
+	int32_t num, i;
+	int32_t c;
+
+	while (1) {
+		int32_t option_index = 0;
+		static struct option long_options[] = {
+			{"speed",    required_argument, 0,  's' },
+			{"fd",       required_argument, 0,  0 },
+			{"no-wait",  no_argument,       0,  0 },
+			{"wait-ms",  required_argument, 0,  0 },
+			{"link",     required_argument, 0,  0 },
+			{"list",     no_argument,       0,  0 },
+			{"help",     no_argument,       0,  'h' },
+			{0,         0,                 0,  0 }
+		};
+
+		c = getopt_long(argc, argv, "s:h",
+		                long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 0:
+			if (!strcmp(long_options[option_index].name, "fd")) {
+				replay_fd = atoi(optarg);
+			} else if (!strcmp(long_options[option_index].name, "no-wait")) {
+				wait_host = 0;
+			} else if (!strcmp(long_options[option_index].name, "wait-ms")) {
+				wait_ms = atoi(optarg);
+			} else if (!strcmp(long_options[option_index].name, "link")) {
+				link_name = optarg;
+			} else if (!strcmp(long_options[option_index].name, "list")) {
+				list = 1;
+			}
+			break;
+		case 'h':
+			pr_help(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			pr_help(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		pr_help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	num = load_capture(argv[optind], &records);
+	if (num < 0)
+		exit(EXIT_FAILURE);
+
+	if (list) {
+		list_records(records, num);
+	} else if (num) {
+		if (replay_fd == -1)
+			replay_fd = records[0].hdr.fd;
+
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+
+		if (replay(records, num))
+			exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num; i++) {
+		free(records[i].data);
+	}
+	free(records);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,425 @@
+/**
+ * @file   mpololu_shm.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Shared-memory target table with fixed-rate flush.
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mpololu.h"
+#include "mpololu_shm.h"
+#include "mpololu_priv.h"
+
+#define SHM_MAGIC "MPOLSHM"  /** First 8 bytes of segment, terminating zero included */
+#define SHM_VERSION 2
+#define SHM_READ_RETRIES 3  /** immediate rereads of table overlapped by pose */
+
+#define SHM_SEQ(slot) ((uint32_t)((slot) >> 32))
+#define SHM_TARGET(slot) ((uint16_t)(slot))
+
+/**
+ * Segment layout, shared by processes of the same library version.
+ * Slot of channel is sequence counter in high 32 bits and target in low 16 bits,
+ * so target and its counter are always read together. Sequence 0 -- never published.
+ */
+struct maestro_shm_table {
+	char magic[8];
+	uint32_t version;
+	uint32_t channels;
+	atomic_uint begun;             /** poses begun, numbers poses */
+	atomic_uint poses;             /** poses completed */
+	atomic_uint_least64_t open;    /** bit (number % 64) of every pose being written */
+	atomic_uint_least64_t slot[MAESTRO_SHM_MAX_CHANNELS];
+};
+
+struct maestro_shm {
+	char* name;
+	uint8_t channels;    /** table size is not taken from shared memory */
+	struct maestro_shm_table* table;
+
+	/** Flush side, guarded by lock of flusher */
+	struct maestro_flusher fl;
+	uint8_t deferred_last;   /** previous flush was postponed */
+	uint64_t waited;         /** open poses flush was already postponed for */
+	uint32_t seq[MAESTRO_SHM_MAX_CHANNELS];  /** sequence counters sent last */
+	uint64_t deferred;
+};
+
+
+static int32_t shm_flush(void* owner)
+{
+	return maestro_shm_flush((struct maestro_shm*) owner);
+}
+
+/** Read table into snapshot, returns poses open while it was read */
+static uint64_t shm_read(struct maestro_shm* shm, uint32_t* seq, int* completed)
+{
+	struct maestro_shm_table* t = shm->table;
+	uint32_t poses = atomic_load(&t->poses);
+	uint64_t open = atomic_load(&t->open);
+	uint32_t ch;
+
+	for (ch = 0; ch < shm->channels; ch++) {
+		uint64_t slot = atomic_load_explicit(&t->slot[ch], memory_order_acquire);
+
+		seq[ch] = SHM_SEQ(slot);
+		shm->fl.snapshot[ch] = SHM_TARGET(slot);
+	}
+
+	open |= atomic_load(&t->open);
+	*completed = atomic_load(&t->poses) != poses;
+
+	return open;
+}
+
+static void shm_store(struct maestro_shm_table* t, uint8_t channel, uint16_t target)
+{
+	uint64_t old = atomic_load_explicit(&t->slot[channel], memory_order_relaxed);
+	uint64_t slot;
+	uint32_t seq;
+
+	/** Counter must change on every store, even when producers race on channel */
+	do {
+		seq = SHM_SEQ(old) + 1;
+		slot = ((uint64_t)(seq ? seq : 1) << 32) | target;
+	} while (!atomic_compare_exchange_weak_explicit(&t->slot[channel], &old, slot,
+	                                                memory_order_release, memory_order_relaxed));
+}
+
+
+/**
+ * @brief Create segment and flusher
+ */
+struct maestro_shm* maestro_shm_create(const char* name, int32_t fd, int32_t device, uint8_t channels)
+{
+	struct maestro_shm* shm;
+	struct maestro_shm_table* t;
+	int sfd;
+	int i;
+
+	if ((channels == 0) || (channels > MAESTRO_SHM_MAX_CHANNELS)) {
+		maestro_fail(MAESTRO_ERR_ARG, "bad number of channels");
+		return NULL;
+	}
+
+	if (name == NULL)
+		name = MAESTRO_SHM_NAME;
+
+	shm = (struct maestro_shm*) calloc(1, sizeof(*shm));
+	if (shm == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	shm->name = strdup(name);
+	if (shm->name == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "strdup()");
+		free(shm);
+		return NULL;
+	}
+
+	/** Fresh segment, producers attached to old one must reattach */
+	shm_unlink(name);
+	sfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (sfd < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "shm_open");
+		free(shm->name);
+		free(shm);
+		return NULL;
+	}
+
+	if (ftruncate(sfd, sizeof(*t)) < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "ftruncate");
+		close(sfd);
+		shm_unlink(name);
+		free(shm->name);
+		free(shm);
+		return NULL;
+	}
+
+	t = (struct maestro_shm_table*) mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+	close(sfd);
+	if (t == MAP_FAILED) {
+		maestro_fail(MAESTRO_ERR_IO, "mmap");
+		shm_unlink(name);
+		free(shm->name);
+		free(shm);
+		return NULL;
+	}
+
+	t->version = SHM_VERSION;
+	t->channels = channels;
+	atomic_init(&t->begun, 0);
+	atomic_init(&t->poses, 0);
+	atomic_init(&t->open, 0);
+	for (i = 0; i < MAESTRO_SHM_MAX_CHANNELS; i++) {
+		atomic_init(&t->slot[i], 0);
+	}
+
+	/** Magic goes last, attach never sees half-initialized table */
+	atomic_thread_fence(memory_order_release);
+	memcpy(t->magic, SHM_MAGIC, sizeof(t->magic));
+
+	shm->channels = channels;
+	shm->table = t;
+	maestro_flusher_init(&shm->fl, fd, device, channels, shm_flush, shm);
+
+	return shm;
+}
+
+/**
+ * @brief Stop flush thread (if started), unmap and remove segment
+ */
+void maestro_shm_destroy(struct maestro_shm* shm)
+{
+	if (shm == NULL)
+		return;
+
+	maestro_shm_stop(shm);
+	munmap(shm->table, sizeof(*shm->table));
+	shm_unlink(shm->name);
+	maestro_flusher_destroy(&shm->fl);
+	free(shm->name);
+	free(shm);
+}
+
+/**
+ * @brief Table of flusher
+ */
+struct maestro_shm_table* maestro_shm_get_table(struct maestro_shm* shm)
+{
+	return shm->table;
+}
+
+/**
+ * @brief Set limits of device
+ */
+void maestro_shm_set_caps(struct maestro_shm* shm, uint32_t caps)
+{
+	pthread_mutex_lock(&shm->fl.lock);
+	shm->fl.caps = caps;
+	pthread_mutex_unlock(&shm->fl.lock);
+}
+
+/**
+ * @brief Send targets of channels changed since previous flush
+ */
+int32_t maestro_shm_flush(struct maestro_shm* shm)
+{
+	uint32_t seq[MAESTRO_SHM_MAX_CHANNELS];
+	uint64_t dirty, known, open;
+	int completed, torn;
+	int32_t res;
+	int32_t n;
+	uint32_t ch;
+	int tries;
+
+	pthread_mutex_lock(&shm->fl.lock);
+
+	/** Pose overlapping the read may be torn, poses are short, so read again */
+	for (tries = 0; ; tries++) {
+		open = shm_read(shm, seq, &completed);
+
+		dirty = known = 0;
+		n = 0;
+		for (ch = 0; ch < shm->channels; ch++) {
+			if (seq[ch])
+				known |= 1ull << ch;
+			if (seq[ch] != shm->seq[ch]) {
+				dirty |= 1ull << ch;
+				n++;
+			}
+		}
+
+		/** Poses already waited for are not waited again, their producer may have died */
+		shm->waited &= open;
+		torn = completed || (open & ~shm->waited);
+		if (!dirty || !torn || (tries == SHM_READ_RETRIES))
+			break;
+	}
+
+	/** Postponed once per pose and never two flushes in a row */
+	if (dirty && torn && !shm->deferred_last) {
+		shm->waited = open;
+		shm->deferred_last = 1;
+		shm->deferred++;
+		pthread_mutex_unlock(&shm->fl.lock);
+		return 0;
+	}
+	shm->deferred_last = 0;
+
+	if (!dirty) {
+		pthread_mutex_unlock(&shm->fl.lock);
+		return 0;
+	}
+
+	res = maestro_flusher_send(&shm->fl, dirty, known, n);
+	if (res < 0) {
+		/** Counters are not advanced, so failed channels are retried */
+		pthread_mutex_unlock(&shm->fl.lock);
+		return res;
+	}
+
+	memcpy(shm->seq, seq, shm->channels * sizeof(seq[0]));
+
+	pthread_mutex_unlock(&shm->fl.lock);
+	return n;
+}
+
+/**
+ * @brief Start thread calling maestro_shm_flush() at fixed rate
+ */
+int32_t maestro_shm_start(struct maestro_shm* shm, uint32_t rate_hz)
+{
+	return maestro_flusher_start(&shm->fl, rate_hz);
+}
+
+/**
+ * @brief Stop flush thread, pending targets are flushed
+ */
+int32_t maestro_shm_stop(struct maestro_shm* shm)
+{
+	return maestro_flusher_stop(&shm->fl);
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_shm_get_stats(struct maestro_shm* shm, struct maestro_shm_stats* stats)
+{
+	pthread_mutex_lock(&shm->fl.lock);
+	stats->flushes = shm->fl.flushes;
+	stats->sent = shm->fl.sent;
+	stats->deferred = shm->deferred;
+	stats->errors = shm->fl.errors;
+	pthread_mutex_unlock(&shm->fl.lock);
+}
+
+/**
+ * @brief Attach to segment created by owner process
+ */
+struct maestro_shm_table* maestro_shm_attach(const char* name)
+{
+	struct maestro_shm_table* t;
+	struct stat st;
+	int sfd;
+
+	if (name == NULL)
+		name = MAESTRO_SHM_NAME;
+
+	sfd = shm_open(name, O_RDWR, 0);
+	if (sfd < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "shm_open");
+		return NULL;
+	}
+
+	if (fstat(sfd, &st) < 0) {
+		maestro_fail(MAESTRO_ERR_IO, "fstat");
+		close(sfd);
+		return NULL;
+	}
+
+	if ((size_t) st.st_size != sizeof(*t)) {
+		maestro_fail(MAESTRO_ERR_PROTOCOL, "shared table size mismatch");
+		close(sfd);
+		return NULL;
+	}
+
+	t = (struct maestro_shm_table*) mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+	close(sfd);
+	if (t == MAP_FAILED) {
+		maestro_fail(MAESTRO_ERR_IO, "mmap");
+		return NULL;
+	}
+
+	if (memcmp(t->magic, SHM_MAGIC, sizeof(t->magic)) || (t->version != SHM_VERSION) ||
+	    (t->channels == 0) || (t->channels > MAESTRO_SHM_MAX_CHANNELS)) {
+		maestro_fail(MAESTRO_ERR_PROTOCOL, "not a shared table of this version");
+		munmap(t, sizeof(*t));
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	return t;
+}
+
+/**
+ * @brief Unmap table attached with maestro_shm_attach()
+ */
+void maestro_shm_detach(struct maestro_shm_table* table)
+{
+	if (table)
+		munmap(table, sizeof(*table));
+}
+
+/**
+ * @brief Number of channels in table
+ */
+uint8_t maestro_shm_channels(const struct maestro_shm_table* table)
+{
+	return (uint8_t) table->channels;
+}
+
+/**
+ * @brief Publish target of channel
+ */
+int32_t maestro_shm_set_target(struct maestro_shm_table* table, uint8_t channel, uint16_t target)
+{
+	if (channel >= table->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	shm_store(table, channel, target);
+	return 0;
+}
+
+/**
+ * @brief Publish pose of channels range
+ */
+int32_t maestro_shm_set_targets(struct maestro_shm_table* table, uint8_t first_channel, uint8_t channels_num,
+                                const uint16_t* targets_p)
+{
+	uint64_t bit;
+	uint8_t i;
+
+	if ((channels_num == 0) || ((uint32_t) first_channel + channels_num > table->channels))
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channels range");
+
+	bit = 1ull << (atomic_fetch_add(&table->begun, 1) % 64);
+
+	/** Pose is counted before its bit is cleared, so flush sees either of them */
+	atomic_fetch_or(&table->open, bit);
+	for (i = 0; i < channels_num; i++) {
+		shm_store(table, first_channel + i, targets_p[i]);
+	}
+	atomic_fetch_add(&table->poses, 1);
+	atomic_fetch_and(&table->open, ~bit);
+
+	return 0;
+}
+
+/**
+ * @brief Last published target of channel
+ */
+int32_t maestro_shm_get_target(const struct maestro_shm_table* table, uint8_t channel)
+{
+	uint64_t slot;
+
+	if (channel >= table->channels)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad channel number");
+
+	slot = atomic_load_explicit(&table->slot[channel], memory_order_acquire);
+
+	/** Never published is not a failure, nothing is recorded */
+	if (!SHM_SEQ(slot))
+		return MAESTRO_ERR_STATE;
+
+	return SHM_TARGET(slot);
+}
@@ -0,0 +1,319 @@
+/**
+ * @file   mpololu_traj.c
+ * @Author kls (gbkletsko@gmail.com)
+ * @date   November, 2012
+ * @brief  Real-time trajectory streaming engine.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mpololu.h"
+#include "mpololu_handle.h"
+#include "mpololu_traj.h"
+#include "mpololu_priv.h"
+
+/** Longest single sleep, so stop request is noticed in time */
+#define TRAJ_SLEEP_SLICE_NS 10000000ull
+
+/** Sleep when queue is empty */
+#define TRAJ_IDLE_NS 1000000ull
+
+struct maestro_traj {
+	struct maestro* m;
+	struct maestro_traj_config cfg;
+	pthread_t thread;
+	int thread_started;
+	atomic_int stop;
+	uint64_t start_ns;
+
+	/** SPSC queue, head is written by engine, tail -- by producer */
+	struct maestro_waypoint* ring;
+	size_t mask;
+	atomic_size_t head;
+	atomic_size_t tail;
+
+	atomic_uint_fast64_t frames;
+	atomic_uint_fast64_t skipped;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t late_max_ns;
+	atomic_uint_fast64_t late_sum_ns;
+	atomic_uint_fast64_t write_max_ns;
+	atomic_uint_fast64_t hist[MAESTRO_TRAJ_HIST_BUCKETS];
+};
+
+
+static void traj_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/** Engine is the only writer of stats, so load and store need not be atomic together */
+static void traj_max(atomic_uint_fast64_t* max, uint64_t val)
+{
+	if (val > atomic_load_explicit(max, memory_order_relaxed))
+		atomic_store_explicit(max, val, memory_order_relaxed);
+}
+
+static void traj_record(struct maestro_traj* tr, uint64_t late_ns, uint64_t write_ns)
+{
+	uint64_t us = late_ns / 1000;
+	int b = 0;
+
+	while ((us != 0) && (b < MAESTRO_TRAJ_HIST_BUCKETS - 1)) {
+		us >>= 1;
+		b++;
+	}
+
+	atomic_fetch_add_explicit(&tr->hist[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&tr->late_sum_ns, late_ns, memory_order_relaxed);
+	traj_max(&tr->late_max_ns, late_ns);
+	traj_max(&tr->write_max_ns, write_ns);
+}
+
+static void* traj_thread(void* arg)
+{
+	struct maestro_traj* tr = (struct maestro_traj*) arg;
+	size_t head = atomic_load_explicit(&tr->head, memory_order_relaxed);
+
+	while (!atomic_load_explicit(&tr->stop, memory_order_relaxed)) {
+		const struct maestro_waypoint* wp;
+		uint64_t deadline, now, late, done;
+		size_t tail = atomic_load_explicit(&tr->tail, memory_order_acquire);
+
+		if (head == tail) {
+			traj_sleep_until(maestro_now_ns() + TRAJ_IDLE_NS);
+			continue;
+		}
+
+		wp = &tr->ring[head & tr->mask];
+		deadline = tr->start_ns + wp->t_ns;
+
+		now = maestro_now_ns();
+		if (now < deadline) {
+			if (deadline - now > TRAJ_SLEEP_SLICE_NS) {
+				traj_sleep_until(now + TRAJ_SLEEP_SLICE_NS);
+				continue;
+			}
+			traj_sleep_until(deadline);
+			now = maestro_now_ns();
+		}
+		late = now - deadline;
+
+		/** Skip stale frame if the next one is already due */
+		if (tr->cfg.skip_late_us && (late > tr->cfg.skip_late_us * 1000ull) && (head + 1 != tail) &&
+		    (tr->start_ns + tr->ring[(head + 1) & tr->mask].t_ns <= now)) {
+			atomic_fetch_add_explicit(&tr->skipped, 1, memory_order_relaxed);
+		} else {
+			if (maestro_set_multiple_target(tr->m, wp->channels_num, wp->first_channel, wp->targets))
+				atomic_fetch_add_explicit(&tr->errors, 1, memory_order_relaxed);
+			done = maestro_now_ns();
+
+			atomic_fetch_add_explicit(&tr->frames, 1, memory_order_relaxed);
+			traj_record(tr, late, done - now);
+		}
+
+		head++;
+		atomic_store_explicit(&tr->head, head, memory_order_release);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief Fill configuration with default values
+ */
+void maestro_traj_config_default(struct maestro_traj_config* cfg)
+{
+	cfg->priority = 0;
+	cfg->cpu = -1;
+	cfg->capacity = 256;
+	cfg->skip_late_us = 0;
+}
+
+/**
+ * @brief Create engine
+ */
+struct maestro_traj* maestro_traj_create(struct maestro* m, const struct maestro_traj_config* cfg)
+{
+	struct maestro_traj* tr;
+	size_t size = 2;
+	int i;
+
+	if (m == NULL) {
+		maestro_fail(MAESTRO_ERR_ARG, "NULL pointer");
+		return NULL;
+	}
+
+	tr = (struct maestro_traj*) calloc(1, sizeof(*tr));
+	if (tr == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		return NULL;
+	}
+
+	if (cfg)
+		tr->cfg = *cfg;
+	else
+		maestro_traj_config_default(&tr->cfg);
+
+	while (size < tr->cfg.capacity) {
+		size <<= 1;
+	}
+
+	tr->ring = (struct maestro_waypoint*) calloc(size, sizeof(*tr->ring));
+	if (tr->ring == NULL) {
+		maestro_fail(MAESTRO_ERR_NOMEM, "calloc()");
+		free(tr);
+		return NULL;
+	}
+
+	tr->m = m;
+	tr->mask = size - 1;
+	atomic_init(&tr->stop, 0);
+	atomic_init(&tr->head, 0);
+	atomic_init(&tr->tail, 0);
+	atomic_init(&tr->frames, 0);
+	atomic_init(&tr->skipped, 0);
+	atomic_init(&tr->errors, 0);
+	atomic_init(&tr->late_max_ns, 0);
+	atomic_init(&tr->late_sum_ns, 0);
+	atomic_init(&tr->write_max_ns, 0);
+	for (i = 0; i < MAESTRO_TRAJ_HIST_BUCKETS; i++) {
+		atomic_init(&tr->hist[i], 0);
+	}
+
+	return tr;
+}
+
+/**
+ * @brief Stop engine (if started) and free it
+ */
+void maestro_traj_destroy(struct maestro_traj* tr)
+{
+	if (tr == NULL)
+		return;
+
+	maestro_traj_stop(tr);
+	free(tr->ring);
+	free(tr);
+}
+
+/**
+ * @brief Queue waypoint
+ */
+int32_t maestro_traj_push(struct maestro_traj* tr, const struct maestro_waypoint* wp)
+{
+	size_t tail = atomic_load_explicit(&tr->tail, memory_order_relaxed);
+
+	if (wp->channels_num > MAESTRO_TRAJ_MAX_CHANNELS)
+		return maestro_fail(MAESTRO_ERR_ARG, "bad waypoint");
+
+	if (tail - atomic_load_explicit(&tr->head, memory_order_acquire) > tr->mask)
+		return maestro_fail(MAESTRO_ERR_FULL, "trajectory queue is full");
+
+	tr->ring[tail & tr->mask] = *wp;
+	atomic_store_explicit(&tr->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+/**
+ * @brief Start engine thread
+ */
+int32_t maestro_traj_start(struct maestro_traj* tr, uint64_t start_ns)
+{
+	pthread_attr_t attr;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int err;
+
+	if (tr->thread_started)
+		return 0;
+
+	pthread_attr_init(&attr);
+
+	if (tr->cfg.priority > 0) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = tr->cfg.priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+
+	if (tr->cfg.cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(tr->cfg.cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	tr->start_ns = start_ns ? start_ns : maestro_now_ns();
+	atomic_store(&tr->stop, 0);
+
+	err = pthread_create(&tr->thread, &attr, traj_thread, tr);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		errno = err;
+		return maestro_fail(MAESTRO_ERR_IO, "failed to start trajectory thread");
+	}
+
+	tr->thread_started = 1;
+	return 0;
+}
+
+/**
+ * @brief Wait until all queued waypoints are sent
+ */
+void maestro_traj_wait(struct maestro_traj* tr)
+{
+	while (tr->thread_started &&
+	       (atomic_load(&tr->head) != atomic_load(&tr->tail))) {
+		traj_sleep_until(maestro_now_ns() + TRAJ_IDLE_NS);
+	}
+}
+
+/**
+ * @brief Stop engine thread, queued waypoints are dropped
+ */
+void maestro_traj_stop(struct maestro_traj* tr)
+{
+	if (!tr->thread_started)
+		return;
+
+	atomic_store(&tr->stop, 1);
+	pthread_join(tr->thread, NULL);
+	tr->thread_started = 0;
+
+	atomic_store(&tr->head, atomic_load(&tr->tail));
+}
+
+/**
+ * @brief Get statistics
+ */
+void maestro_traj_get_stats(struct maestro_traj* tr, struct maestro_traj_stats* stats)
+{
+	int i;
+
+	stats->frames = atomic_load_explicit(&tr->frames, memory_order_relaxed);
+	stats->skipped = atomic_load_explicit(&tr->skipped, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&tr->errors, memory_order_relaxed);
+	stats->late_max_ns = atomic_load_explicit(&tr->late_max_ns, memory_order_relaxed);
+	stats->late_sum_ns = atomic_load_explicit(&tr->late_sum_ns, memory_order_relaxed);
+	stats->write_max_ns = atomic_load_explicit(&tr->write_max_ns, memory_order_relaxed);
+	for (i = 0; i < MAESTRO_TRAJ_HIST_BUCKETS; i++) {
+		stats->hist[i] = atomic_load_explicit(&tr->hist[i], memory_order_relaxed);
+	}
+}